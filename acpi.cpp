@@ -0,0 +1,76 @@
+#include "acpi.h"
+#include "stdlib_hooks.h"
+
+#define ACPI_EBDA_SEGMENT_PTR 0x40E   // BIOS data area word holding the EBDA segment
+#define ACPI_BIOS_AREA_START  0xE0000
+#define ACPI_BIOS_AREA_END    0x100000
+
+static const acpi_rsdp_t* acpi_rsdp_found = nullptr;
+static bool acpi_rsdp_searched = false;
+
+static bool acpi_checksum_ok(const void* data, uint32_t length) {
+    const uint8_t* p = (const uint8_t*)data;
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < length; i++) sum += p[i];
+    return sum == 0;
+}
+
+// The RSDP sits on a 16-byte boundary
+static const acpi_rsdp_t* acpi_scan_rsdp(uintptr_t start, uintptr_t end) {
+    for (uintptr_t addr = start; addr + sizeof(acpi_rsdp_t) <= end; addr += 16) {
+        const acpi_rsdp_t* rsdp = (const acpi_rsdp_t*)addr;
+        if (memcmp(rsdp->signature, "RSD PTR ", 8) != 0) continue;
+        if (!acpi_checksum_ok(rsdp, 20)) continue;
+        if (rsdp->revision >= 2 && !acpi_checksum_ok(rsdp, rsdp->length)) continue;
+        return rsdp;
+    }
+    return nullptr;
+}
+
+const acpi_rsdp_t* acpi_rsdp() {
+    if (acpi_rsdp_searched) return acpi_rsdp_found;
+    acpi_rsdp_searched = true;
+
+    // First KB of the EBDA, then the BIOS read-only area
+    uintptr_t ebda = (uintptr_t)(*(volatile uint16_t*)ACPI_EBDA_SEGMENT_PTR) << 4;
+    if (ebda >= 0x80000 && ebda < 0xA0000) acpi_rsdp_found = acpi_scan_rsdp(ebda, ebda + 1024);
+    if (!acpi_rsdp_found) acpi_rsdp_found = acpi_scan_rsdp(ACPI_BIOS_AREA_START, ACPI_BIOS_AREA_END);
+    return acpi_rsdp_found;
+}
+
+static const acpi_sdt_header_t* acpi_table_at(uint64_t address) {
+    if (address == 0 || address >= 0x100000000ull) return nullptr;
+    const acpi_sdt_header_t* table = (const acpi_sdt_header_t*)(uintptr_t)address;
+    if (table->length < sizeof(acpi_sdt_header_t) || !acpi_checksum_ok(table, table->length)) return nullptr;
+    return table;
+}
+
+const acpi_sdt_header_t* acpi_find_table(const char* signature) {
+    const acpi_rsdp_t* rsdp = acpi_rsdp();
+    if (!rsdp) return nullptr;
+
+    // Prefer the XSDT (64-bit entries); fall back to the RSDT (32-bit entries)
+    const acpi_sdt_header_t* root = nullptr;
+    uint32_t entry_size = 4;
+    if (rsdp->revision >= 2) {
+        root = acpi_table_at(rsdp->xsdt_address);
+        entry_size = 8;
+    }
+    if (!root) {
+        root = acpi_table_at(rsdp->rsdt_address);
+        entry_size = 4;
+    }
+    if (!root) return nullptr;
+
+    const uint8_t* entries = (const uint8_t*)root + sizeof(acpi_sdt_header_t);
+    uint32_t count = (root->length - sizeof(acpi_sdt_header_t)) / entry_size;
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t address;
+        if (entry_size == 8) memcpy(&address, entries + i * 8, 8);  // Entries are only 4-byte aligned
+        else address = *(const uint32_t*)(entries + i * 4);
+
+        const acpi_sdt_header_t* table = acpi_table_at(address);
+        if (table && memcmp(table->signature, signature, 4) == 0) return table;
+    }
+    return nullptr;
+}
@@ -0,0 +1,86 @@
+#ifndef ACPI_H
+#define ACPI_H
+
+#include "types.h"
+
+// ACPI table lookup.
+// The RSDP is found by scanning the EBDA and the BIOS area (0xE0000-0xFFFFF);
+// tables are then reached through the XSDT, or the RSDT on ACPI 1.0 firmware.
+// With no paging every table below 4 GB can be read in place.
+
+typedef struct {
+    char signature[8];         // "RSD PTR "
+    uint8_t checksum;          // First 20 bytes
+    char oem_id[6];
+    uint8_t revision;          // 0 = ACPI 1.0, 2+ = has the XSDT fields
+    uint32_t rsdt_address;
+    uint32_t length;
+    uint64_t xsdt_address;
+    uint8_t extended_checksum; // Whole structure
+    uint8_t reserved[3];
+} __attribute__((packed)) acpi_rsdp_t;
+
+typedef struct {
+    char signature[4];
+    uint32_t length;           // Header included
+    uint8_t revision;
+    uint8_t checksum;          // Whole table sums to zero
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed)) acpi_sdt_header_t;
+
+// MADT ("APIC"): the header, then variable-length entries up to 'length'
+typedef struct {
+    acpi_sdt_header_t header;
+    uint32_t lapic_address;
+    uint32_t flags;            // Bit 0: legacy 8259 PICs present
+} __attribute__((packed)) acpi_madt_t;
+
+#define MADT_LOCAL_APIC          0
+#define MADT_IO_APIC             1
+#define MADT_LAPIC_ADDR_OVERRIDE 5
+
+#define MADT_LAPIC_ENABLED        (1u << 0)
+#define MADT_LAPIC_ONLINE_CAPABLE (1u << 1)  // Disabled now, but may be started
+
+typedef struct {
+    uint8_t type;
+    uint8_t length;
+} __attribute__((packed)) acpi_madt_entry_t;
+
+typedef struct {
+    acpi_madt_entry_t entry;
+    uint8_t processor_id;
+    uint8_t apic_id;
+    uint32_t flags;            // MADT_LAPIC_*
+} __attribute__((packed)) acpi_madt_lapic_t;
+
+typedef struct {
+    acpi_madt_entry_t entry;
+    uint16_t reserved;
+    uint64_t lapic_address;
+} __attribute__((packed)) acpi_madt_lapic_override_t;
+
+// MCFG: the header, 8 reserved bytes, then one entry per PCIe ECAM window
+typedef struct {
+    acpi_sdt_header_t header;
+    uint64_t reserved;
+} __attribute__((packed)) acpi_mcfg_t;
+
+typedef struct {
+    uint64_t base_address;     // Config space of bus 'start_bus'
+    uint16_t segment;
+    uint8_t start_bus;
+    uint8_t end_bus;
+    uint32_t reserved;
+} __attribute__((packed)) acpi_mcfg_entry_t;
+
+// Returns the first table with this 4-character signature whose checksum is
+// good, or nullptr. The RSDP is looked up once and remembered.
+const acpi_sdt_header_t* acpi_find_table(const char* signature);
+const acpi_rsdp_t* acpi_rsdp();
+
+#endif // ACPI_H
@@ -0,0 +1,376 @@
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include "types.h"
+#include "iostream_wrapper.h"
+#include "stdlib_hooks.h"
+#include "identify.h"
+#include "frame.h"
+
+// Sector cache between the filesystem and read_sectors/write_sectors.
+// Blocks are found through a hash on (controller, port, LBA), recycled least recently used
+// first, and written back lazily: a dirty block only reaches the disk when it is
+// evicted or when bcache_sync() runs. The cache starts with BCACHE_BLOCKS static
+// blocks; a miss with every block in use adds BCACHE_GROW_BLOCKS more from the
+// frame allocator instead of evicting, until BCACHE_MAX_BLOCKS are cached.
+
+#define BCACHE_BLOCKS       128   // 128 * 512 = 64KB of static sectors
+#define BCACHE_GROW_BLOCKS  128   // Added at a time: 16 frames
+#define BCACHE_MAX_BLOCKS   8192  // 4MB of cached sectors
+#define BCACHE_HASH_BITS    10
+#define BCACHE_HASH_BUCKETS (1 << BCACHE_HASH_BITS)
+#define BCACHE_NONE         -1
+
+typedef struct {
+    uint64_t lba;
+    uint64_t ahci_base;
+    int port;
+    bool valid;
+    bool dirty;
+    int hash_next;   // Next block in the same hash bucket
+    int lru_prev;    // Towards the most recently used block
+    int lru_next;    // Towards the least recently used block
+} bcache_block_t;
+
+typedef struct {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t evictions;
+    uint32_t writebacks;     // Dirty sectors written to disk
+    uint32_t sync_commands;  // Disk commands issued by bcache_sync
+} bcache_stats_t;
+
+static uint8_t bcache_static_data[BCACHE_BLOCKS][SECTOR_SIZE] __attribute__((aligned(16)));
+static uint8_t* bcache_data[BCACHE_MAX_BLOCKS];  // Sector buffer of each block
+static bcache_block_t bcache_blocks[BCACHE_MAX_BLOCKS];
+static int bcache_block_count = 0;
+static int bcache_sync_order[BCACHE_MAX_BLOCKS];  // bcache_sync()'s sort buffer, too big for a thread stack
+static int bcache_hash_heads[BCACHE_HASH_BUCKETS];
+static int bcache_lru_head = BCACHE_NONE; // Most recently used
+static int bcache_lru_tail = BCACHE_NONE; // Least recently used, next to be recycled
+static bool bcache_ready = false;
+static bcache_stats_t bcache_stats;
+
+static inline uint32_t bcache_hash(uint64_t ahci_base, int port, uint64_t lba) {
+    uint32_t key = (uint32_t)lba ^ (uint32_t)(lba >> 32) ^ ((uint32_t)port << 24) ^ (uint32_t)(ahci_base >> 12);
+    return (key * 2654435761u) >> (32 - BCACHE_HASH_BITS);
+}
+
+static void bcache_lru_unlink(int i) {
+    bcache_block_t* b = &bcache_blocks[i];
+    if (b->lru_prev != BCACHE_NONE) bcache_blocks[b->lru_prev].lru_next = b->lru_next;
+    else bcache_lru_head = b->lru_next;
+    if (b->lru_next != BCACHE_NONE) bcache_blocks[b->lru_next].lru_prev = b->lru_prev;
+    else bcache_lru_tail = b->lru_prev;
+    b->lru_prev = b->lru_next = BCACHE_NONE;
+}
+
+static void bcache_lru_push_front(int i) {
+    bcache_block_t* b = &bcache_blocks[i];
+    b->lru_prev = BCACHE_NONE;
+    b->lru_next = bcache_lru_head;
+    if (bcache_lru_head != BCACHE_NONE) bcache_blocks[bcache_lru_head].lru_prev = i;
+    bcache_lru_head = i;
+    if (bcache_lru_tail == BCACHE_NONE) bcache_lru_tail = i;
+}
+
+static void bcache_lru_push_back(int i) {
+    bcache_block_t* b = &bcache_blocks[i];
+    b->lru_next = BCACHE_NONE;
+    b->lru_prev = bcache_lru_tail;
+    if (bcache_lru_tail != BCACHE_NONE) bcache_blocks[bcache_lru_tail].lru_next = i;
+    bcache_lru_tail = i;
+    if (bcache_lru_head == BCACHE_NONE) bcache_lru_head = i;
+}
+
+static void bcache_hash_remove(int i) {
+    bcache_block_t* b = &bcache_blocks[i];
+    int* link = &bcache_hash_heads[bcache_hash(b->ahci_base, b->port, b->lba)];
+    while (*link != BCACHE_NONE) {
+        if (*link == i) {
+            *link = b->hash_next;
+            break;
+        }
+        link = &bcache_blocks[*link].hash_next;
+    }
+    b->hash_next = BCACHE_NONE;
+}
+
+static void bcache_hash_insert(int i) {
+    bcache_block_t* b = &bcache_blocks[i];
+    uint32_t h = bcache_hash(b->ahci_base, b->port, b->lba);
+    b->hash_next = bcache_hash_heads[h];
+    bcache_hash_heads[h] = i;
+}
+
+// Drop a block without writing it back and make it the next one recycled
+static void bcache_discard(int i) {
+    if (bcache_blocks[i].valid) bcache_hash_remove(i);
+    bcache_blocks[i].valid = false;
+    bcache_blocks[i].dirty = false;
+    bcache_lru_unlink(i);
+    bcache_lru_push_back(i);
+}
+
+// Append 'count' empty blocks over 'data', as the next ones to be recycled
+static void bcache_add_blocks(uint8_t* data, int count) {
+    for (int k = 0; k < count; k++) {
+        int i = bcache_block_count++;
+        bcache_data[i] = data + k * SECTOR_SIZE;
+        bcache_blocks[i].lba = 0;
+        bcache_blocks[i].ahci_base = 0;
+        bcache_blocks[i].port = -1;
+        bcache_blocks[i].valid = false;
+        bcache_blocks[i].dirty = false;
+        bcache_blocks[i].hash_next = BCACHE_NONE;
+        bcache_lru_push_back(i);
+    }
+}
+
+// Returns false once BCACHE_MAX_BLOCKS are cached or no frames are left
+static bool bcache_grow() {
+    if (bcache_block_count + BCACHE_GROW_BLOCKS > BCACHE_MAX_BLOCKS) return false;
+    uintptr_t data = frame_alloc(BCACHE_GROW_BLOCKS * SECTOR_SIZE / FRAME_SIZE);
+    if (data == 0) return false;
+    bcache_add_blocks((uint8_t*)data, BCACHE_GROW_BLOCKS);
+    return true;
+}
+
+static void bcache_setup() {
+    for (int h = 0; h < BCACHE_HASH_BUCKETS; h++) bcache_hash_heads[h] = BCACHE_NONE;
+    bcache_lru_head = bcache_lru_tail = BCACHE_NONE;
+    bcache_block_count = 0;
+    bcache_add_blocks(&bcache_static_data[0][0], BCACHE_BLOCKS);
+    bcache_ready = true;
+}
+
+static inline bool bcache_owned_by(const bcache_block_t* b, uint64_t ahci_base, int port) {
+    return b->port == port && b->ahci_base == ahci_base;
+}
+
+static int bcache_lookup(uint64_t ahci_base, int port, uint64_t lba) {
+    int i = bcache_hash_heads[bcache_hash(ahci_base, port, lba)];
+    while (i != BCACHE_NONE) {
+        if (bcache_blocks[i].lba == lba && bcache_owned_by(&bcache_blocks[i], ahci_base, port)) return i;
+        i = bcache_blocks[i].hash_next;
+    }
+    return BCACHE_NONE;
+}
+
+static int bcache_writeback(int i) {
+    bcache_block_t* b = &bcache_blocks[i];
+    int status = write_sectors(b->ahci_base, b->port, b->lba, 1, bcache_data[i]);
+    if (status < 0) return status;
+    b->dirty = false;
+    bcache_stats.writebacks++;
+    return 0;
+}
+
+// Find the block caching (port, lba), recycling the least recently used one on
+// a miss. If 'fill' is set a missed block is read from disk; otherwise the caller
+// is about to overwrite all of it. Returns the block index or a negative error.
+static int bcache_get_block(uint64_t ahci_base, int port, uint64_t lba, bool fill) {
+    if (!bcache_ready) bcache_setup();
+
+    int i = bcache_lookup(ahci_base, port, lba);
+    if (i != BCACHE_NONE) {
+        bcache_stats.hits++;
+        bcache_lru_unlink(i);
+        bcache_lru_push_front(i);
+        return i;
+    }
+
+    bcache_stats.misses++;
+    if (bcache_blocks[bcache_lru_tail].valid) bcache_grow();  // Free blocks sit at the tail
+    i = bcache_lru_tail;
+    if (bcache_blocks[i].valid) {
+        if (bcache_blocks[i].dirty) {
+            int status = bcache_writeback(i);
+            if (status < 0) return status;
+        }
+        bcache_hash_remove(i);
+        bcache_stats.evictions++;
+    }
+
+    bcache_blocks[i].ahci_base = ahci_base;
+    bcache_blocks[i].port = port;
+    bcache_blocks[i].lba = lba;
+    bcache_blocks[i].valid = true;
+    bcache_blocks[i].dirty = false;
+    bcache_hash_insert(i);
+    bcache_lru_unlink(i);
+    bcache_lru_push_front(i);
+
+    if (fill) {
+        int status = read_sectors(ahci_base, port, lba, 1, bcache_data[i]);
+        if (status < 0) {
+            bcache_discard(i);
+            return status;
+        }
+    }
+    return i;
+}
+
+// Copy one sector through the cache into 'buffer'. Returns 0 on success, negative on error
+int bcache_read(uint64_t ahci_base, int port, uint64_t lba, void* buffer) {
+    int i = bcache_get_block(ahci_base, port, lba, true);
+    if (i < 0) return i;
+    memcpy(buffer, bcache_data[i], SECTOR_SIZE);
+    return 0;
+}
+
+// Replace one sector in the cache; it reaches the disk on eviction or bcache_sync()
+int bcache_write(uint64_t ahci_base, int port, uint64_t lba, const void* buffer) {
+    int i = bcache_get_block(ahci_base, port, lba, false);
+    if (i < 0) return i;
+    memcpy(bcache_data[i], buffer, SECTOR_SIZE);
+    bcache_blocks[i].dirty = true;
+    return 0;
+}
+
+// Move order[root] down the max-heap order[0..n) keyed on block LBA
+static void bcache_sift_down(int* order, int root, int n) {
+    int v = order[root];
+    uint64_t lba = bcache_blocks[v].lba;
+    for (int child = 2 * root + 1; child < n; child = 2 * root + 1) {
+        if (child + 1 < n && bcache_blocks[order[child + 1]].lba > bcache_blocks[order[child]].lba) child++;
+        if (bcache_blocks[order[child]].lba <= lba) break;
+        order[root] = order[child];
+        root = child;
+    }
+    order[root] = v;
+}
+
+// Store the indexes of the dirty blocks of 'port' in 'order' (BCACHE_MAX_BLOCKS
+// entries) in ascending LBA order. Returns how many there are
+int bcache_dirty_blocks(uint64_t ahci_base, int port, int* order) {
+    if (!bcache_ready) return 0;
+    int dirty = 0;
+    for (int i = 0; i < bcache_block_count; i++) {
+        if (bcache_blocks[i].valid && bcache_blocks[i].dirty && bcache_owned_by(&bcache_blocks[i], ahci_base, port)) {
+            order[dirty++] = i;
+        }
+    }
+    // Heapsort by LBA: a grown cache can hold thousands of dirty blocks at a sync
+    for (int root = dirty / 2 - 1; root >= 0; root--) bcache_sift_down(order, root, dirty);
+    for (int end = dirty - 1; end > 0; end--) {
+        int top = order[0];
+        order[0] = order[end];
+        order[end] = top;
+        bcache_sift_down(order, 0, end);
+    }
+    return dirty;
+}
+
+// Write every dirty block of 'port' back in ascending LBA order, merging
+// adjacent sectors into a single scatter/gather command.
+// Returns 0 on success, or the first error (the failed blocks stay dirty)
+int bcache_sync(uint64_t ahci_base, int port) {
+    if (!bcache_ready) return 0;
+
+    int* order = bcache_sync_order;
+    int dirty = bcache_dirty_blocks(ahci_base, port, order);
+
+    int result = 0;
+    int start = 0;
+    while (start < dirty) {
+        ahci_iovec_t iov[MAX_PRDT_ENTRIES];
+        int run = 0;
+        uint64_t first_lba = bcache_blocks[order[start]].lba;
+        while (start + run < dirty && run < MAX_PRDT_ENTRIES &&
+               bcache_blocks[order[start + run]].lba == first_lba + run) {
+            iov[run].base = bcache_data[order[start + run]];
+            iov[run].len = SECTOR_SIZE;
+            run++;
+        }
+
+        int status = write_sectors_v(ahci_base, port, first_lba, iov, run);
+        bcache_stats.sync_commands++;
+        if (status < 0) {
+            if (result == 0) result = status;
+        }
+        else {
+            for (int k = 0; k < run; k++) bcache_blocks[order[start + k]].dirty = false;
+            bcache_stats.writebacks += run;
+        }
+        start += run;
+    }
+    return result;
+}
+
+// A range no longer than the cache is walked LBA by LBA through the hash;
+// a longer one costs less as a scan of every block
+static inline bool bcache_probe_range(uint32_t count) {
+    return count <= (uint32_t)bcache_block_count;
+}
+
+// Write back dirty blocks inside [lba, lba + count) before that range is read
+// directly from disk. Returns 0 on success, negative on error
+int bcache_flush_range(uint64_t ahci_base, int port, uint64_t lba, uint32_t count) {
+    if (!bcache_ready) return 0;
+    if (bcache_probe_range(count)) {
+        for (uint32_t k = 0; k < count; k++) {
+            int i = bcache_lookup(ahci_base, port, lba + k);
+            if (i != BCACHE_NONE && bcache_blocks[i].dirty) {
+                int status = bcache_writeback(i);
+                if (status < 0) return status;
+            }
+        }
+        return 0;
+    }
+    for (int i = 0; i < bcache_block_count; i++) {
+        bcache_block_t* b = &bcache_blocks[i];
+        if (b->valid && b->dirty && bcache_owned_by(b, ahci_base, port) && b->lba >= lba && b->lba < lba + count) {
+            int status = bcache_writeback(i);
+            if (status < 0) return status;
+        }
+    }
+    return 0;
+}
+
+// Forget cached copies of [lba, lba + count) that are about to be overwritten directly on disk
+void bcache_drop_range(uint64_t ahci_base, int port, uint64_t lba, uint32_t count) {
+    if (!bcache_ready) return;
+    if (bcache_probe_range(count)) {
+        for (uint32_t k = 0; k < count; k++) {
+            int i = bcache_lookup(ahci_base, port, lba + k);
+            if (i != BCACHE_NONE) bcache_discard(i);
+        }
+        return;
+    }
+    for (int i = 0; i < bcache_block_count; i++) {
+        bcache_block_t* b = &bcache_blocks[i];
+        if (b->valid && bcache_owned_by(b, ahci_base, port) && b->lba >= lba && b->lba < lba + count) {
+            bcache_discard(i);
+        }
+    }
+}
+
+// Forget everything cached for 'port', dirty blocks included (used by format)
+void bcache_invalidate(uint64_t ahci_base, int port) {
+    if (!bcache_ready) return;
+    for (int i = 0; i < bcache_block_count; i++) {
+        if (bcache_blocks[i].valid && bcache_owned_by(&bcache_blocks[i], ahci_base, port)) bcache_discard(i);
+    }
+}
+
+void bcache_print_stats() {
+    int valid = 0, dirty = 0;
+    for (int i = 0; i < bcache_block_count; i++) {
+        if (bcache_ready && bcache_blocks[i].valid) {
+            valid++;
+            if (bcache_blocks[i].dirty) dirty++;
+        }
+    }
+    uint32_t lookups = bcache_stats.hits + bcache_stats.misses;
+
+    cout << "Block cache: " << valid << "/" << bcache_block_count << " blocks in use (up to " << BCACHE_MAX_BLOCKS
+         << "), " << dirty << " dirty\n";
+    cout << "  Hits: " << bcache_stats.hits << "  Misses: " << bcache_stats.misses;
+    if (lookups > 0) cout << "  Hit rate: " << (bcache_stats.hits * 100 / lookups) << "%";
+    cout << "\n";
+    cout << "  Evictions: " << bcache_stats.evictions << "  Sectors written back: " << bcache_stats.writebacks
+         << "  Sync commands: " << bcache_stats.sync_commands << "\n";
+}
+
+#endif // BLOCK_CACHE_H
@@ -0,0 +1,401 @@
+#ifndef BLOCKDEV_H
+#define BLOCKDEV_H
+
+#include "types.h"
+#include "iostream_wrapper.h"
+#include "stdlib_hooks.h"
+#include "identify.h"
+
+// Block devices.
+// blk_scan() IDENTIFYs the ATA disk behind every implemented port of every AHCI
+// controller and lists it as sdN; a disk is addressed the way the rest of the
+// disk stack expects, by (ahci_base, port).
+// blk_create_stripe() joins disks into a RAID-0 device mdN. It gets a port
+// number from BLK_STRIPE_PORT up, so read_sectors/write_sectors, the block cache,
+// FAT32 and diskbench use it unchanged. Sectors are dealt out to the members in
+// chunks. Within one request a member's chunks are contiguous on that disk, so
+// each member gets as few commands as its PRDT allows, and with NCQ every
+// member's commands are queued before any of them is waited for.
+
+#define BLK_MAX_STRIPES          2
+#define BLK_MAX_DEVICES          (AHCI_MAX_PORTS + BLK_MAX_STRIPES)
+#define BLK_STRIPE_MAX_MEMBERS   4
+#define BLK_STRIPE_DEFAULT_CHUNK 128   // Sectors (64KB)
+#define BLK_STRIPE_MAX_CHUNK     8192  // Sectors (4MB, so a chunk fits one PRDT entry)
+#define SATA_SIG_ATA             0x00000101
+
+typedef struct {
+    char name[8];          // "sd0", "md0"
+    uint64_t ahci_base;    // A stripe carries its first member's controller
+    int port;              // AHCI port, or BLK_STRIPE_PORT + n for a stripe
+    uint64_t sectors;
+    const char* model;     // Disks only
+    int members[BLK_STRIPE_MAX_MEMBERS];  // Stripes: indexes into blk_devices
+    int member_count;
+    uint32_t chunk_sectors;
+} blk_device_t;
+
+static blk_device_t blk_devices[BLK_MAX_DEVICES];
+static int blk_device_count = 0;
+static int blk_disk_count = 0;
+static int blk_stripe_count = 0;
+static int blk_stripe_device[BLK_MAX_STRIPES];  // Stripe n -> index in blk_devices
+static bool blk_scanned = false;
+
+// Find and IDENTIFY every disk. Returns the number of disks found
+int blk_scan() {
+    if (blk_scanned) return blk_disk_count;
+    blk_scanned = true;
+
+    for (int c = 0; c < ahci_controller_count; c++) {
+        uint64_t base = ahci_controllers[c].base;
+        uint32_t implemented = read_mem32(base + AHCI_PI);
+        for (int port = 0; port < 32; port++) {
+            if (!(implemented & (1u << port))) continue;
+            uint64_t port_addr = base + 0x100 + (port * 0x80);
+            if ((read_mem32(port_addr + PORT_SSTS) & 0x0F) != 3) continue;      // No PHY link
+            if (read_mem32(port_addr + PORT_SIG) != SATA_SIG_ATA) continue;     // ATAPI, port multiplier...
+            if (blk_disk_count == AHCI_MAX_PORTS) {
+                cout << "WARNING: more than " << AHCI_MAX_PORTS << " disks, ignoring the rest\n";
+                return blk_disk_count;
+            }
+            if (send_identify_command(base, port, false) < 0) continue;
+
+            ahci_port_t* ap = ahci_port_find(base, port);
+            blk_device_t* dev = &blk_devices[blk_device_count++];
+            memset(dev, 0, sizeof(*dev));
+            snprintf(dev->name, sizeof(dev->name), "sd%d", blk_disk_count++);
+            dev->ahci_base = base;
+            dev->port = port;
+            dev->sectors = ap->sectors;
+            dev->model = ap->model;
+        }
+    }
+    return blk_disk_count;
+}
+
+int blk_count() {
+    return blk_device_count;
+}
+
+const blk_device_t* blk_get(int index) {
+    if (index < 0 || index >= blk_device_count) return nullptr;
+    return &blk_devices[index];
+}
+
+// Index of the device called 'name', or -1
+int blk_find(const char* name) {
+    for (int i = 0; i < blk_device_count; i++) {
+        if (strcmp(blk_devices[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+// Device behind (ahci_base, port), or nullptr
+const blk_device_t* blk_lookup(uint64_t ahci_base, int port) {
+    for (int i = 0; i < blk_device_count; i++) {
+        if (blk_devices[i].port == port && blk_devices[i].ahci_base == ahci_base) return &blk_devices[i];
+    }
+    return nullptr;
+}
+
+// True if writing to one device can change sectors of the other: they are the
+// same device, one is a stripe over the other, or two stripes share a disk
+bool blk_shares_disk(const blk_device_t* a, const blk_device_t* b) {
+    if (a == b) return true;
+    for (int i = 0; i < a->member_count; i++) {
+        if (&blk_devices[a->members[i]] == b) return true;
+        for (int j = 0; j < b->member_count; j++) {
+            if (a->members[i] == b->members[j]) return true;
+        }
+    }
+    for (int j = 0; j < b->member_count; j++) {
+        if (&blk_devices[b->members[j]] == a) return true;
+    }
+    return false;
+}
+
+// Build a RAID-0 device over the given disks. 'chunk_sectors' must be a power of
+// two up to BLK_STRIPE_MAX_CHUNK. Returns the new device's index, -5 if no stripe
+// slot is left, -10 for a bad member count or chunk size, -13 for a bad member
+int blk_create_stripe(const int* members, int member_count, uint32_t chunk_sectors) {
+    if (blk_stripe_count == BLK_MAX_STRIPES) return -5;
+    if (member_count < 2 || member_count > BLK_STRIPE_MAX_MEMBERS) return -10;
+    if (chunk_sectors == 0 || chunk_sectors > BLK_STRIPE_MAX_CHUNK || (chunk_sectors & (chunk_sectors - 1))) return -10;
+
+    // Every member is a distinct disk; the stripe is as big as the smallest one allows
+    uint64_t member_sectors = 0;
+    for (int i = 0; i < member_count; i++) {
+        const blk_device_t* disk = blk_get(members[i]);
+        if (!disk || disk->port >= BLK_STRIPE_PORT) return -13;
+        for (int j = 0; j < i; j++) {
+            if (members[j] == members[i]) return -13;
+        }
+        if (i == 0 || disk->sectors < member_sectors) member_sectors = disk->sectors;
+    }
+    member_sectors -= member_sectors % chunk_sectors;
+    if (member_sectors == 0) return -10;
+
+    int n = blk_stripe_count++;
+    int index = blk_device_count++;
+    blk_device_t* md = &blk_devices[index];
+    memset(md, 0, sizeof(*md));
+    snprintf(md->name, sizeof(md->name), "md%d", n);
+    md->ahci_base = blk_devices[members[0]].ahci_base;
+    md->port = BLK_STRIPE_PORT + n;
+    md->sectors = member_sectors * member_count;
+    md->member_count = member_count;
+    md->chunk_sectors = chunk_sectors;
+    for (int i = 0; i < member_count; i++) md->members[i] = members[i];
+    blk_stripe_device[n] = index;
+    return index;
+}
+
+// Largest request a stripe takes at once: a full-size command on every member,
+// within what one caller's scatter/gather list can describe
+uint32_t blk_stripe_max_sectors(int port) {
+    int n = port - BLK_STRIPE_PORT;
+    if (n < 0 || n >= blk_stripe_count) return MAX_LBA28_SECTORS;
+    const blk_device_t* md = &blk_devices[blk_stripe_device[n]];
+    uint64_t total = 0;
+    for (int i = 0; i < md->member_count; i++) {
+        const blk_device_t* disk = &blk_devices[md->members[i]];
+        total += ahci_max_transfer_sectors(disk->ahci_base, disk->port);
+    }
+    return total > MAX_LBA48_SECTORS ? MAX_LBA48_SECTORS : (uint32_t)total;
+}
+
+// One member's share of a stripe request, built up until it is issued
+typedef struct {
+    const blk_device_t* disk;
+    ahci_iovec_t iov[MAX_PRDT_ENTRIES];
+    int iovcnt;
+    uint64_t lba;
+    uint32_t sectors;
+    uint32_t max_sectors;
+    uint32_t tags;         // NCQ tags in flight, collected at the end
+} blk_stripe_io_t;
+
+// Issue the pending command of one member: queued if the disk has NCQ, otherwise
+// synchronously
+static int blk_stripe_issue(blk_stripe_io_t* io, bool write) {
+    if (io->iovcnt == 0) return 0;
+    const blk_device_t* disk = io->disk;
+    int status = 0;
+
+    if (ncq_queue_depth(disk->ahci_base, disk->port) > 1) {
+        int tag = ncq_submit_v(disk->ahci_base, disk->port, io->lba, io->iov, io->iovcnt, write);
+        while (tag == -5 && status == 0) {
+            // Every tag is busy: collect this request's earlier commands, or wait
+            // for other callers to give one back if this request holds none
+            if (io->tags) {
+                status = ncq_wait_mask(disk->ahci_base, disk->port, io->tags);
+                io->tags = 0;
+            } else {
+                status = ncq_wait_tag(disk->ahci_base, disk->port);
+            }
+            if (status == 0) tag = ncq_submit_v(disk->ahci_base, disk->port, io->lba, io->iov, io->iovcnt, write);
+        }
+        if (status == 0 && tag < 0) status = tag;
+        if (status == 0) io->tags |= 1u << tag;
+    } else {
+        status = write ? write_sectors_v(disk->ahci_base, disk->port, io->lba, io->iov, io->iovcnt)
+                       : read_sectors_v(disk->ahci_base, disk->port, io->lba, io->iov, io->iovcnt);
+    }
+
+    io->lba += io->sectors;
+    io->iovcnt = 0;
+    io->sectors = 0;
+    return status;
+}
+
+// Segments of the caller's list that the next 'bytes' bytes touch, starting at (seg, offset)
+static int blk_iov_slices(const ahci_iovec_t* iov, int iovcnt, int seg, uint32_t offset, uint32_t bytes) {
+    int slices = 0;
+    while (bytes > 0 && seg < iovcnt) {
+        uint32_t take = iov[seg].len - offset;
+        if (take > bytes) take = bytes;
+        bytes -= take;
+        slices++;
+        seg++;
+        offset = 0;
+    }
+    return slices;
+}
+
+// read_sectors_v/write_sectors_v for a stripe's port number
+int blk_stripe_transfer_v(int port, uint64_t lba, const ahci_iovec_t* iov, int iovcnt, bool write) {
+    int n = port - BLK_STRIPE_PORT;
+    if (n < 0 || n >= blk_stripe_count) return -13;
+    const blk_device_t* md = &blk_devices[blk_stripe_device[n]];
+
+    uint32_t count = 0;
+    int prdt_entries = ahci_iov_check(iov, iovcnt, &count);
+    if (prdt_entries < 0) return prdt_entries;
+    if (lba + count > md->sectors) return -10;
+    if (count == 0) return 0;
+
+    blk_stripe_io_t io[BLK_STRIPE_MAX_MEMBERS];
+    for (int m = 0; m < md->member_count; m++) {
+        io[m].disk = &blk_devices[md->members[m]];
+        io[m].iovcnt = 0;
+        io[m].sectors = 0;
+        io[m].tags = 0;
+        io[m].max_sectors = ahci_max_transfer_sectors(io[m].disk->ahci_base, io[m].disk->port);
+    }
+
+    int status = 0;
+    int seg = 0;
+    uint32_t offset = 0;
+    uint64_t pos = lba;
+    uint32_t left = count;
+    while (left > 0 && status == 0) {
+        // Chunk c lives on member c % members, at row c / members of that disk
+        uint64_t chunk = pos / md->chunk_sectors;
+        uint32_t in_chunk = (uint32_t)(pos % md->chunk_sectors);
+        uint32_t piece = md->chunk_sectors - in_chunk;
+        if (piece > left) piece = left;
+        blk_stripe_io_t* mio = &io[chunk % md->member_count];
+        uint64_t member_lba = (chunk / md->member_count) * md->chunk_sectors + in_chunk;
+
+        // Start a new command when the piece does not extend the pending one or
+        // the pending one is full; a chunk bigger than one command carries is
+        // split, its rest going out in the next command
+        if (mio->iovcnt > 0 && (mio->lba + mio->sectors != member_lba || mio->sectors == mio->max_sectors)) {
+            status = blk_stripe_issue(mio, write);
+            if (status < 0) break;
+        }
+        if (piece > mio->max_sectors - mio->sectors) piece = mio->max_sectors - mio->sectors;
+        uint32_t bytes = piece * SECTOR_SIZE;
+        int slices = blk_iov_slices(iov, iovcnt, seg, offset, bytes);
+        if (mio->iovcnt > 0 && mio->iovcnt + slices > MAX_PRDT_ENTRIES) {
+            status = blk_stripe_issue(mio, write);
+            if (status < 0) break;
+        }
+        if (mio->iovcnt == 0) mio->lba = member_lba;
+
+        while (bytes > 0) {
+            uint32_t take = iov[seg].len - offset;
+            if (take > bytes) take = bytes;
+            ahci_iovec_t* last = mio->iovcnt > 0 ? &mio->iov[mio->iovcnt - 1] : nullptr;
+            uint8_t* base = (uint8_t*)iov[seg].base + offset;
+            if (last && (uint8_t*)last->base + last->len == base && last->len + take <= MAX_PRDT_BYTES) {
+                last->len += take;
+            } else {
+                mio->iov[mio->iovcnt].base = base;
+                mio->iov[mio->iovcnt].len = take;
+                mio->iovcnt++;
+            }
+            bytes -= take;
+            offset += take;
+            if (offset == iov[seg].len) {
+                seg++;
+                offset = 0;
+            }
+        }
+        mio->sectors += piece;
+        pos += piece;
+        left -= piece;
+    }
+
+    // Issue what is left, then collect every queued command even after an error,
+    // since the buffers stay in use until the disks are done with them
+    for (int m = 0; m < md->member_count; m++) {
+        if (status == 0) status = blk_stripe_issue(&io[m], write);
+    }
+    for (int m = 0; m < md->member_count; m++) {
+        if (io[m].tags == 0) continue;
+        int wait_status = ncq_wait_mask(io[m].disk->ahci_base, io[m].disk->port, io[m].tags);
+        if (status == 0) status = wait_status;
+    }
+    return status;
+}
+
+// ahci_trim for a stripe. A contiguous stripe range covers one contiguous range
+// on every member: whole chunks in the middle rows, partial ones at the ends
+int blk_stripe_trim(int port, uint64_t lba, uint64_t count) {
+    int n = port - BLK_STRIPE_PORT;
+    if (n < 0 || n >= blk_stripe_count) return -13;
+    const blk_device_t* md = &blk_devices[blk_stripe_device[n]];
+    if (lba + count > md->sectors) return -10;
+    if (count == 0) return 0;
+
+    uint64_t cs = md->chunk_sectors;
+    uint64_t first_chunk = lba / cs, last_chunk = (lba + count - 1) / cs;
+    uint64_t first_row = first_chunk / md->member_count, last_row = last_chunk / md->member_count;
+    int first_member = (int)(first_chunk % md->member_count), last_member = (int)(last_chunk % md->member_count);
+
+    for (int m = 0; m < md->member_count; m++) {
+        uint64_t start = first_row * cs;
+        if (m < first_member) start += cs;
+        else if (m == first_member) start += lba % cs;
+        uint64_t end = last_row * cs;
+        if (m < last_member) end += cs;
+        else if (m == last_member) end += (lba + count - 1) % cs + 1;
+        if (end <= start) continue;
+
+        const blk_device_t* disk = &blk_devices[md->members[m]];
+        int status = ahci_trim(disk->ahci_base, disk->port, start, end - start);
+        if (status < 0) return status;
+    }
+    return 0;
+}
+
+// ahci_flush_cache for a stripe: flush every member
+int blk_stripe_flush(int port) {
+    int n = port - BLK_STRIPE_PORT;
+    if (n < 0 || n >= blk_stripe_count) return -13;
+    const blk_device_t* md = &blk_devices[blk_stripe_device[n]];
+    int status = 0;
+    for (int m = 0; m < md->member_count; m++) {
+        const blk_device_t* disk = &blk_devices[md->members[m]];
+        int member_status = ahci_flush_cache(disk->ahci_base, disk->port);
+        if (status == 0) status = member_status;
+    }
+    return status;
+}
+
+// A stripe takes TRIM if all of its members do
+bool blk_stripe_trim_supported(int port) {
+    int n = port - BLK_STRIPE_PORT;
+    if (n < 0 || n >= blk_stripe_count) return false;
+    const blk_device_t* md = &blk_devices[blk_stripe_device[n]];
+    for (int m = 0; m < md->member_count; m++) {
+        const blk_device_t* disk = &blk_devices[md->members[m]];
+        if (!ahci_trim_supported(disk->ahci_base, disk->port)) return false;
+    }
+    return true;
+}
+
+// Trimmed stripe sectors read as zeroes only if they do on every member
+bool blk_stripe_trim_zeroes(int port) {
+    int n = port - BLK_STRIPE_PORT;
+    if (n < 0 || n >= blk_stripe_count) return false;
+    const blk_device_t* md = &blk_devices[blk_stripe_device[n]];
+    for (int m = 0; m < md->member_count; m++) {
+        const blk_device_t* disk = &blk_devices[md->members[m]];
+        if (!ahci_trim_zeroes(disk->ahci_base, disk->port)) return false;
+    }
+    return true;
+}
+
+void blk_print_list() {
+    if (blk_device_count == 0) {
+        cout << "No disks found.\n";
+        return;
+    }
+    for (int i = 0; i < blk_device_count; i++) {
+        const blk_device_t* dev = &blk_devices[i];
+        uint32_t mib = (uint32_t)(dev->sectors / 2048);
+        if (dev->port < BLK_STRIPE_PORT) {
+            printf("  %-4s  %8u MB  controller 0x%08X port %-2d  NCQ %-2d  %s\n", dev->name, mib,
+                   (uint32_t)dev->ahci_base, dev->port, ncq_queue_depth(dev->ahci_base, dev->port), dev->model);
+        } else {
+            printf("  %-4s  %8u MB  RAID-0, %u KB chunks over", dev->name, mib, dev->chunk_sectors / 2);
+            for (int m = 0; m < dev->member_count; m++) printf(" %s", blk_devices[dev->members[m]].name);
+            printf("\n");
+        }
+    }
+}
+
+#endif // BLOCKDEV_H
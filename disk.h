@@ -177,6 +177,7 @@ int get_device_type(uint8_t port_num);
 #include "pci.h"
 #include "stdlib_hooks.h" // Assumed to provide basic utilities if needed
 #include "identify.h"       // Includes the string R/W functions now
+#include "paging.h"
 
  // AHCI registers offsets (Keep these definitions)
 #define AHCI_CAP        0x00  // Host Capabilities
@@ -207,80 +208,49 @@ int get_device_type(uint8_t port_num);
 
 // Function to print hex value with label (Keep this function)
 void print_hex(const char* label, uint32_t value) {
-    cout << label;
-
-    // Convert to hex
-    char hex_chars[16] = { '0','1','2','3','4','5','6','7','8','9','A','B','C','D','E','F' };
-    char buffer[11]; // Increased size for 0x + 8 digits + null
-
-    buffer[0] = '0';
-    buffer[1] = 'x';
-
-    // Fill from right to left for potentially shorter numbers if desired, but fixed 8 is fine too.
-    for (int i = 0; i < 8; i++) {
-        uint8_t nibble = (value >> (28 - i * 4)) & 0xF;
-        buffer[2 + i] = hex_chars[nibble];
-    }
-    buffer[10] = '\0';
-
-    cout << buffer << "\n";
+    printf("%s0x%08X\n", label, value);
 }
 
 
 
 
-// Debug function to fully examine SATA controller state
+// Find every AHCI controller in the PCI device table, enable bus mastering and
+// add it to ahci_controllers. Returns the first controller's ABAR.
 uint64_t disk_init() {
     cout << "Disk initilisation\n";
     cout << "--------------------\n";
 
-    // Find AHCI controller via PCI
     uint64_t ahci_base = 0;
-    uint16_t bus, dev, func;
-    uint16_t ahci_bus = 0, ahci_dev = 0, ahci_func = 0; // Store location
-
-    for (bus = 0; bus < 256 && !ahci_base; bus++) {
-        for (dev = 0; dev < 32 && !ahci_base; dev++) {
-            for (func = 0; func < 8 && !ahci_base; func++) {
-                // Check if device exists first (Vendor ID != 0xFFFF)
-                uint32_t vendor_device_check = pci_read_config_dword(bus, dev, func, 0x00);
-                if ((vendor_device_check & 0xFFFF) == 0xFFFF) {
-                    continue; // No device here
-                }
-
-                uint32_t class_reg = pci_read_config_dword(bus, dev, func, 0x08);
-                uint8_t class_code = (class_reg >> 24) & 0xFF;
-                uint8_t subclass = (class_reg >> 16) & 0xFF;
-                uint8_t prog_if = (class_reg >> 8) & 0xFF;
-
-                if (class_code == 0x01 && subclass == 0x06 && prog_if == 0x01) {
-                    uint32_t bar5 = pci_read_config_dword(bus, dev, func, 0x24);
-                    // Check if BAR5 is memory mapped and non-zero
-                    if ((bar5 & 0x1) == 0 && (bar5 & ~0xF) != 0) {
-                        ahci_base = bar5 & ~0xF;
-                        ahci_bus = bus;
-                        ahci_dev = dev;
-                        ahci_func = func;
-
-                        cout << "Found AHCI controller at PCI ";
-                        cout << (int)bus << ":" << (int)dev << "." << (int)func << "\n"; // Use dot separator common practice
-
-                        // Get vendor and device ID
-                        uint32_t vendor_device = pci_read_config_dword(bus, dev, func, 0x00);
-                        uint16_t vendor_id = vendor_device & 0xFFFF;
-                        uint16_t device_id = (vendor_device >> 16) & 0xFFFF;
-
-                        // Use print_hex for consistency (need to adapt for 16-bit)
-                        print_hex(" Vendor ID: ", vendor_id); // Assuming print_hex handles width ok
-                        print_hex(" Device ID: ", device_id);
-
-                        cout << "\nPress enter to continue...\n\n";
-                        char input[2]; // Allow for potential newline char
-                        cin >> input; // Read a line to consume potential newline
-                    }
-                }
-            }
+    for (int i = 0; i < pci_count(); i++) {
+        const pci_entry_t* ahci = pci_entry(i);
+        if (ahci->class_code != 0x01 || ahci->subclass != 0x06 || ahci->prog_if != 0x01) continue;
+        // Check if BAR5 is memory mapped and non-zero
+        if ((ahci->bar[5] & 0x1) != 0 || (ahci->bar[5] & ~0xF) == 0) continue;
+
+        uint8_t bus = ahci->bus, dev = ahci->slot, func = ahci->func;
+        uint64_t base = ahci->bar[5] & ~0xF;
+        if (ahci_add_controller(base, ahci->interrupt_line) < 0) {
+            cout << "WARNING: more than " << AHCI_MAX_CONTROLLERS << " AHCI controllers, ignoring the rest\n";
+            break;
         }
+        if (!ahci_base) ahci_base = base;
+        // Register reads must not be cached or merged: ports plus the generic block
+        paging_set_type("AHCI HBA", base, AHCI_PORT_BASE + 32 * AHCI_PORT_SIZE, MEM_TYPE_UC);
+
+        cout << "Found AHCI controller at PCI ";
+        cout << (int)bus << ":" << (int)dev << "." << (int)func << "\n"; // Use dot separator common practice
+
+        print_hex(" Vendor ID: ", ahci->vendor_id);
+        print_hex(" Device ID: ", ahci->device_id);
+
+        // Enable bus mastering and make sure INTx isn't disabled (command bits 2 and 10)
+        uint32_t cmd_status = pci_read_config_dword(bus, dev, func, 0x04);
+        cmd_status = (cmd_status & 0xFFFF) | (1 << 2) | (1 << 1);
+        cmd_status &= ~(1u << 10);
+        pci_write_config_dword(bus, dev, func, 0x04, cmd_status);
+
+        // Interrupt Line register as assigned by the firmware
+        cout << " Interrupt Line: " << (int)ahci->interrupt_line << "\n";
     }
 
     if (!ahci_base) {
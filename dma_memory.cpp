@@ -1,48 +1,648 @@
 #include "dma_memory.h"
 #include "iostream_wrapper.h"
+#include "stdlib_hooks.h"
+#include "interrupts.h"
+#include "timer.h"
+#include "pci.h"
+#include "smp.h"
+#include "thread.h"
+#include "paging.h"
+#include "frame.h"
 
-bool DMAManager::initialize(uint64_t base_address) {
-    initialized = true;
-    active_channels = 0;
-    cout << "DMA Manager initialized at base: 0x";
-    
-    // Convert uint64_t to hex string manually
-    char hex_addr[17];
-    uint64_t addr = base_address;
-    int pos = 15;
-    hex_addr[16] = '\0';
-    
-    do {
-        int digit = addr & 0xF;
-        hex_addr[pos--] = (digit < 10) ? ('0' + digit) : ('A' + digit - 10);
-        addr >>= 4;
-    } while (addr > 0 && pos >= 0);
-    
-    while (pos >= 0) {
-        hex_addr[pos--] = '0';
+#define DMA_WAIT_TIMEOUT_MS 5000 // Without progress before a hardware channel is given up
+
+// --- DMA buffer pool ---
+
+static uint8_t dma_small_region[DMA_SMALL_BUFFERS][DMA_SMALL_BUFFER_SIZE] __attribute__((aligned(DMA_ALIGNMENT)));
+// Inside one large page, so transfers through any block cost a single TLB entry
+static uint8_t dma_buddy_region[DMA_BUDDY_REGION_SIZE] __attribute__((aligned(PAGING_LARGE_PAGE_SIZE)));
+
+#define DMA_BUDDY_BLOCKS (DMA_BUDDY_REGION_SIZE / DMA_BUDDY_MIN_BLOCK)
+#define DMA_NONE -1
+
+// Small buffers: a stack of free indices
+static int16_t dma_small_free[DMA_SMALL_BUFFERS];
+static int dma_small_free_count = 0;
+static bool dma_small_used[DMA_SMALL_BUFFERS];
+
+// Region 0 is the static one; the others come from the frame allocator, aligned
+// to their size so they too sit inside a single large page
+static uint8_t* dma_buddy_regions[DMA_BUDDY_MAX_REGIONS];
+static int dma_buddy_region_count = 0;
+
+// Buddy blocks are named by their first DMA_BUDDY_MIN_BLOCK unit, counted across
+// all regions. A region holds exactly one block of the top order, so a buddy
+// (block ^ size) never lies in another region. A free block sits on the doubly
+// linked list of its order; an allocated one records its order
+static int16_t dma_buddy_head[DMA_BUDDY_MAX_ORDER + 1];
+static int16_t dma_buddy_next[DMA_BUDDY_MAX_REGIONS * DMA_BUDDY_BLOCKS];
+static int16_t dma_buddy_prev[DMA_BUDDY_MAX_REGIONS * DMA_BUDDY_BLOCKS];
+static int8_t dma_buddy_free_order[DMA_BUDDY_MAX_REGIONS * DMA_BUDDY_BLOCKS];  // Order if a free block starts here, else -1
+static int8_t dma_buddy_used_order[DMA_BUDDY_MAX_REGIONS * DMA_BUDDY_BLOCKS];  // Order if an allocated block starts here, else -1
+
+static bool dma_pool_ready = false;
+static uint32_t dma_pool_allocs = 0;
+static uint32_t dma_pool_frees = 0;
+static uint32_t dma_pool_failures = 0;
+
+static void dma_buddy_push(int block, int order) {
+    dma_buddy_free_order[block] = (int8_t)order;
+    dma_buddy_prev[block] = DMA_NONE;
+    dma_buddy_next[block] = dma_buddy_head[order];
+    if (dma_buddy_head[order] != DMA_NONE) dma_buddy_prev[dma_buddy_head[order]] = (int16_t)block;
+    dma_buddy_head[order] = (int16_t)block;
+}
+
+static void dma_buddy_remove(int block) {
+    int order = dma_buddy_free_order[block];
+    if (dma_buddy_prev[block] != DMA_NONE) dma_buddy_next[dma_buddy_prev[block]] = dma_buddy_next[block];
+    else dma_buddy_head[order] = dma_buddy_next[block];
+    if (dma_buddy_next[block] != DMA_NONE) dma_buddy_prev[dma_buddy_next[block]] = dma_buddy_prev[block];
+    dma_buddy_free_order[block] = -1;
+}
+
+static void dma_buddy_add_region(uint8_t* base) {
+    int region = dma_buddy_region_count++;
+    dma_buddy_regions[region] = base;
+    for (int b = 0; b < DMA_BUDDY_BLOCKS; b++) {
+        dma_buddy_free_order[region * DMA_BUDDY_BLOCKS + b] = -1;
+        dma_buddy_used_order[region * DMA_BUDDY_BLOCKS + b] = -1;
     }
-    
-    cout << hex_addr << "\n";
+    dma_buddy_push(region * DMA_BUDDY_BLOCKS, DMA_BUDDY_MAX_ORDER);
+}
+
+// Add a region from the frame allocator. Frames are ordinary RAM and already
+// write-back, so unlike the static pools they need no paging_set_type() entry
+static bool dma_buddy_grow() {
+    if (dma_buddy_region_count == DMA_BUDDY_MAX_REGIONS) return false;
+    const uint32_t frames = DMA_BUDDY_REGION_SIZE / FRAME_SIZE;
+    uintptr_t base = frame_alloc(frames, frames);
+    if (base == 0) return false;
+    dma_buddy_add_region((uint8_t*)base);
     return true;
 }
 
-void* DMAManager::allocate_dma_buffer(size_t size) {
-    static uint8_t dma_heap[64 * 1024]; // 64KB heap
-    static size_t heap_offset = 0;
-    
-    size_t aligned_size = (size + DMA_ALIGNMENT - 1) & ~(DMA_ALIGNMENT - 1);
-    
-    if (heap_offset + aligned_size > sizeof(dma_heap)) {
-        return nullptr;
+static void dma_pool_init() {
+    for (int i = 0; i < DMA_SMALL_BUFFERS; i++) {
+        dma_small_free[i] = (int16_t)(DMA_SMALL_BUFFERS - 1 - i);
+        dma_small_used[i] = false;
     }
-    
-    void* buffer = &dma_heap[heap_offset];
-    heap_offset += aligned_size;
+    dma_small_free_count = DMA_SMALL_BUFFERS;
+
+    for (int o = 0; o <= DMA_BUDDY_MAX_ORDER; o++) dma_buddy_head[o] = DMA_NONE;
+    dma_buddy_region_count = 0;
+    dma_buddy_add_region(dma_buddy_region);
+
+    // Both pools are ordinary RAM and stay write-back
+    paging_set_type("DMA small buffers", (uintptr_t)dma_small_region, sizeof(dma_small_region), MEM_TYPE_WB);
+    paging_set_type("DMA buddy pool", (uintptr_t)dma_buddy_region, sizeof(dma_buddy_region), MEM_TYPE_WB);
+    dma_pool_ready = true;
+}
+
+static inline uint8_t* dma_buddy_address(int block) {
+    return dma_buddy_regions[block / DMA_BUDDY_BLOCKS] + (size_t)(block % DMA_BUDDY_BLOCKS) * DMA_BUDDY_MIN_BLOCK;
+}
+
+static void* dma_buddy_alloc(size_t size) {
+    int order = 0;
+    while (order <= DMA_BUDDY_MAX_ORDER && ((size_t)DMA_BUDDY_MIN_BLOCK << order) < size) order++;
+    if (order > DMA_BUDDY_MAX_ORDER) return nullptr;
+
+    int o = order;
+    while (o <= DMA_BUDDY_MAX_ORDER && dma_buddy_head[o] == DMA_NONE) o++;
+    if (o > DMA_BUDDY_MAX_ORDER) {
+        // Every region is too fragmented or full: grow by one
+        if (!dma_buddy_grow()) return nullptr;
+        o = DMA_BUDDY_MAX_ORDER;
+    }
+
+    int block = dma_buddy_head[o];
+    dma_buddy_remove(block);
+
+    // Split down to the requested order, freeing the upper halves
+    while (o > order) {
+        o--;
+        dma_buddy_push(block + (1 << o), o);
+    }
+    dma_buddy_used_order[block] = (int8_t)order;
+    return dma_buddy_address(block);
+}
+
+static void dma_buddy_free(int block) {
+    int order = dma_buddy_used_order[block];
+    dma_buddy_used_order[block] = -1;
+
+    // Merge with the buddy for as long as it is free and the same size
+    while (order < DMA_BUDDY_MAX_ORDER) {
+        int buddy = block ^ (1 << order);
+        if (dma_buddy_free_order[buddy] != order) break;
+        dma_buddy_remove(buddy);
+        if (buddy < block) block = buddy;
+        order++;
+    }
+    dma_buddy_push(block, order);
+}
+
+void* dma_pool_alloc(size_t size) {
+    if (!dma_pool_ready) dma_pool_init();
+
+    void* buffer = nullptr;
+    if (size <= DMA_SMALL_BUFFER_SIZE && dma_small_free_count > 0) {
+        int index = dma_small_free[--dma_small_free_count];
+        dma_small_used[index] = true;
+        buffer = dma_small_region[index];
+    }
+    else {
+        // Also catches small requests once the small buffers run out
+        buffer = dma_buddy_alloc(size);
+    }
+
+    if (buffer) dma_pool_allocs++;
+    else dma_pool_failures++;
     return buffer;
 }
 
+void dma_pool_free(void* buffer) {
+    uint8_t* p = (uint8_t*)buffer;
+    if (!p || !dma_pool_ready) return;
+
+    uint8_t* small_base = &dma_small_region[0][0];
+    if (p >= small_base && p < small_base + sizeof(dma_small_region)) {
+        int index = (int)((p - small_base) / DMA_SMALL_BUFFER_SIZE);
+        if (!dma_small_used[index]) return; // Double free
+        dma_small_used[index] = false;
+        dma_small_free[dma_small_free_count++] = (int16_t)index;
+        dma_pool_frees++;
+        return;
+    }
+
+    for (int r = 0; r < dma_buddy_region_count; r++) {
+        uint8_t* base = dma_buddy_regions[r];
+        if (p < base || p >= base + DMA_BUDDY_REGION_SIZE) continue;
+        int block = r * DMA_BUDDY_BLOCKS + (int)((p - base) / DMA_BUDDY_MIN_BLOCK);
+        if (dma_buddy_used_order[block] < 0) return; // Double free or interior pointer
+        dma_buddy_free(block);
+        dma_pool_frees++;
+        return;
+    }
+}
+
+// The kernel runs identity mapped, so a pool address is already the bus address
+uint64_t dma_virt_to_phys(const void* buffer) {
+    return (uint64_t)(uintptr_t)buffer;
+}
+
+void dma_pool_print_stats() {
+    if (!dma_pool_ready) dma_pool_init();
+
+    size_t buddy_free = 0;
+    for (int o = 0; o <= DMA_BUDDY_MAX_ORDER; o++) {
+        for (int b = dma_buddy_head[o]; b != DMA_NONE; b = dma_buddy_next[b]) {
+            buddy_free += (size_t)DMA_BUDDY_MIN_BLOCK << o;
+        }
+    }
+
+    cout << "DMA pool: " << dma_small_free_count << "/" << DMA_SMALL_BUFFERS << " small buffers free, "
+         << (uint32_t)(buddy_free / 1024) << "/" << (uint32_t)(dma_buddy_region_count * (DMA_BUDDY_REGION_SIZE / 1024))
+         << " KB of buddy space free in " << dma_buddy_region_count << "/" << DMA_BUDDY_MAX_REGIONS << " regions\n";
+    cout << "  Allocations: " << dma_pool_allocs << "  Frees: " << dma_pool_frees
+         << "  Failures: " << dma_pool_failures << "\n";
+}
+
+void* DMAManager::allocate_dma_buffer(size_t size) {
+    return dma_pool_alloc(size);
+}
+
 void DMAManager::free_dma_buffer(void* buffer) {
-    // Simple implementation - in real kernel, implement proper free
+    dma_pool_free(buffer);
+}
+
+// --- Intel I/OAT (QuickData) copy engine ---
+// Version 2+ channels in ring mode, polled through the completion writeback.
+// Each PCI function carries its own register block; channel i of a block sits
+// at BAR0 + IOAT_CHAN_STRIDE * (i + 1).
+
+#define IOAT_REG_CHANCNT   0x00  // 8-bit
+#define IOAT_REG_XFERCAP   0x01  // 8-bit, log2 of the largest descriptor
+#define IOAT_REG_VER       0x08  // 8-bit, major.minor in nibbles
+#define IOAT_CHAN_STRIDE   0x80
+#define IOAT_CHANCTRL      0x00  // 16-bit
+#define IOAT_DMACOUNT      0x06  // 16-bit, descriptors appended so far
+#define IOAT_CHANSTS       0x08  // 64-bit
+#define IOAT_CHAINADDR     0x10  // 64-bit, first descriptor
+#define IOAT_CHANCMP       0x18  // 64-bit, completion writeback address
+#define IOAT_CHANERR       0x28  // 32-bit, write 1 to clear
+#define IOAT_CHANCMD       0x84  // 8-bit
+#define IOAT_CHANCMD_RESET 0x20
+#define IOAT_CHANCTRL_ERR_ABORT 0x000C  // Write a completion and halt on any error
+#define IOAT_STATUS_MASK   0x7
+#define IOAT_STATUS_HALTED 3
+#define IOAT_DESC_COMPL_WRITE (1u << 3)
+#define IOAT_RING_SIZE     64    // Hardware descriptors per channel (power of two)
+#define IOAT_RESET_MS      100
+
+typedef struct {
+    uint32_t size;
+    uint32_t ctl;        // Bits 24-31 opcode (0 = copy)
+    uint64_t src_addr;
+    uint64_t dst_addr;
+    uint64_t next;
+    uint64_t reserved[4];
+} __attribute__((packed)) ioat_desc_t;
+
+typedef struct {
+    uintptr_t regs;
+    ioat_desc_t* ring;
+    uint64_t ring_phys;
+    volatile uint64_t* completion;
+    uint32_t issued;                 // Descriptors appended (free-running)
+    uint32_t retired;                // Descriptors seen complete
+    uint64_t last_seen;              // Last completion writeback value
+    bool last_piece[IOAT_RING_SIZE]; // Slot ends a ring entry
+} ioat_channel_t;
+
+static ioat_channel_t ioat_channels[DMA_MAX_CHANNELS];
+static int ioat_channel_count = 0;
+static uint32_t ioat_xfercap = 0;
+
+static inline uint8_t mmio_read8(uintptr_t addr) { return *(volatile uint8_t*)addr; }
+static inline uint32_t mmio_read32(uintptr_t addr) { return *(volatile uint32_t*)addr; }
+static inline void mmio_write8(uintptr_t addr, uint8_t v) { *(volatile uint8_t*)addr = v; }
+static inline void mmio_write16(uintptr_t addr, uint16_t v) { *(volatile uint16_t*)addr = v; }
+static inline void mmio_write32(uintptr_t addr, uint32_t v) { *(volatile uint32_t*)addr = v; }
+
+static bool ioat_channel_init(ioat_channel_t* ch, uintptr_t regs) {
+    ch->regs = regs;
+
+    mmio_write8(regs + IOAT_CHANCMD, IOAT_CHANCMD_RESET);
+    uint64_t deadline = deadline_ms(IOAT_RESET_MS);
+    while (mmio_read8(regs + IOAT_CHANCMD) & IOAT_CHANCMD_RESET) {
+        if (deadline_passed(deadline)) return false;
+        asm volatile ("pause");
+    }
+    mmio_write32(regs + IOAT_CHANERR, mmio_read32(regs + IOAT_CHANERR));
+
+    ch->ring = (ioat_desc_t*)dma_pool_alloc(sizeof(ioat_desc_t) * IOAT_RING_SIZE);
+    ch->completion = (volatile uint64_t*)dma_pool_alloc(DMA_ALIGNMENT);
+    if (!ch->ring || !ch->completion) {
+        dma_pool_free(ch->ring);
+        dma_pool_free((void*)ch->completion);
+        return false;
+    }
+    memset(ch->ring, 0, sizeof(ioat_desc_t) * IOAT_RING_SIZE);
+    *ch->completion = 0;
+
+    // Link the descriptors into a circle; the engine follows 'next' forever
+    ch->ring_phys = dma_virt_to_phys(ch->ring);
+    for (int i = 0; i < IOAT_RING_SIZE; i++) {
+        ch->ring[i].next = ch->ring_phys + ((i + 1) % IOAT_RING_SIZE) * sizeof(ioat_desc_t);
+        ch->last_piece[i] = false;
+    }
+    ch->issued = ch->retired = 0;
+    ch->last_seen = 0;
+
+    uint64_t completion_phys = dma_virt_to_phys((const void*)ch->completion);
+    mmio_write32(regs + IOAT_CHANCMP, (uint32_t)completion_phys);
+    mmio_write32(regs + IOAT_CHANCMP + 4, (uint32_t)(completion_phys >> 32));
+    mmio_write16(regs + IOAT_CHANCTRL, IOAT_CHANCTRL_ERR_ABORT);
+    mmio_write32(regs + IOAT_CHAINADDR, (uint32_t)ch->ring_phys);
+    mmio_write32(regs + IOAT_CHAINADDR + 4, (uint32_t)(ch->ring_phys >> 32));
+    return true;
+}
+
+// Find I/OAT functions (Intel, class 08h subclass 80h) in the PCI device table
+// and bring up their channels
+static void ioat_probe() {
+    ioat_channel_count = 0;
+    for (int i = 0; i < pci_count(); i++) {
+        const pci_entry_t* e = pci_entry(i);
+        if (e->vendor_id != 0x8086 || e->class_code != 0x08 || e->subclass != 0x80) continue;
+
+        bool bar64 = ((e->bar[0] >> 1) & 0x3) == 0x2;
+        // Memory BAR reachable without paging
+        if ((e->bar[0] & 1) || (bar64 && e->bar[1] != 0)) continue;
+        uintptr_t base = e->bar[0] & ~0xFu;
+        paging_set_type("I/OAT registers", base, 4096, MEM_TYPE_UC);
+        uint32_t command = pci_read_config_dword(e->bus, e->slot, e->func, 0x04);
+        pci_write_config_dword(e->bus, e->slot, e->func, 0x04, command | 0x6); // Memory space + bus master
+
+        uint8_t version = mmio_read8(base + IOAT_REG_VER);
+        uint8_t xfercap_log = mmio_read8(base + IOAT_REG_XFERCAP) & 0x1F;
+        int count = mmio_read8(base + IOAT_REG_CHANCNT) & 0x1F;
+        if (version < 0x20 || xfercap_log == 0) continue;
+        uint32_t cap = xfercap_log >= 30 ? (1u << 30) : (1u << xfercap_log);
+        if (ioat_xfercap == 0 || cap < ioat_xfercap) ioat_xfercap = cap;
+        for (int c = 0; c < count && ioat_channel_count < DMA_MAX_CHANNELS; c++) {
+            if (ioat_channel_init(&ioat_channels[ioat_channel_count], base + IOAT_CHAN_STRIDE * (c + 1))) {
+                ioat_channel_count++;
+            }
+        }
+    }
+}
+
+// --- Transfer engine ---
+
+static DMAManager* idle_manager = nullptr;
+
+// Runs while the shell waits for input
+static bool dma_idle_hook() {
+    return idle_manager && idle_manager->run_worker();
+}
+
+static bool dma_ranges_overlap(const dma_desc_t* d) {
+    return d->op == DMA_OP_COPY && d->src < d->dst + d->length && d->dst < d->src + d->length;
+}
+
+void DMAManager::post_completion(int channel_id, const dma_ring_entry_t* entry, int status) {
+    if (completion_tail - completion_head == DMA_COMPLETION_RING_SIZE) {
+        completion_head++; // Nobody is polling; drop the oldest
+        completions_dropped++;
+    }
+    dma_completion_t* c = &completions[completion_tail % DMA_COMPLETION_RING_SIZE];
+    c->cookie = entry->desc.cookie;
+    c->channel = channel_id;
+    c->status = status;
+    c->length = entry->desc.length;
+    completion_tail++;
+}
+
+void DMAManager::retire_head(int channel_id, int status) {
+    dma_channel_t* ch = &channels[channel_id];
+    dma_ring_entry_t* entry = &ch->ring[ch->head % DMA_RING_SIZE];
+
+    if (status < 0) {
+        if (ch->batch_status == 0) ch->batch_status = status;
+        ch->error_seq = ch->completed + 1;
+    }
+    else {
+        ch->bytes_moved += entry->desc.length;
+    }
+    if (entry->desc.flags & DMA_FLAG_NOTIFY) {
+        post_completion(channel_id, entry, ch->batch_status);
+        ch->batch_status = 0;
+    }
+
+    ch->completed++;
+    ch->head++;
+    ch->progress = 0;
+    if (ch->issue - ch->head > DMA_RING_SIZE) ch->issue = ch->head; // issue fell behind head
+}
+
+typedef struct {
+    uint8_t* dst;
+    const uint8_t* src;
+    uint8_t pattern;
+} dma_smp_job_t;
+
+static void dma_smp_fill(size_t begin, size_t end, void* arg) {
+    dma_smp_job_t* job = (dma_smp_job_t*)arg;
+    memset(job->dst + begin, job->pattern, end - begin);
+}
+
+static void dma_smp_copy(size_t begin, size_t end, void* arg) {
+    dma_smp_job_t* job = (dma_smp_job_t*)arg;
+    memcpy(job->dst + begin, job->src + begin, end - begin);
+}
+
+// Move up to DMA_CPU_CHUNK bytes per online CPU of the oldest descriptor.
+// Fills and non-overlapping copies are split across the CPUs.
+bool DMAManager::step_cpu(int channel_id) {
+    dma_channel_t* ch = &channels[channel_id];
+    if (ch->head == ch->tail) return false;
+
+    dma_ring_entry_t* entry = &ch->ring[ch->head % DMA_RING_SIZE];
+    const dma_desc_t* d = &entry->desc;
+    size_t chunk = d->length - ch->progress;
+    size_t max_chunk = (size_t)DMA_CPU_CHUNK * smp_cpu_count();
+    if (chunk > max_chunk) chunk = max_chunk;
+
+    dma_smp_job_t job = { (uint8_t*)(uintptr_t)d->dst + ch->progress,
+                          (const uint8_t*)(uintptr_t)d->src + ch->progress, d->pattern };
+    if (d->op == DMA_OP_FILL) {
+        smp_parallel_for(chunk, DMA_SMP_GRAIN, dma_smp_fill, &job);
+    }
+    else if (!dma_ranges_overlap(d)) {
+        smp_parallel_for(chunk, DMA_SMP_GRAIN, dma_smp_copy, &job);
+    }
+    else {
+        if (chunk > DMA_CPU_CHUNK) chunk = DMA_CPU_CHUNK;
+        // With dst above an overlapping src, walk the chunks from the end
+        size_t offset = ch->progress;
+        if (d->dst > d->src) offset = d->length - ch->progress - chunk;
+        memmove((uint8_t*)(uintptr_t)d->dst + offset, (const uint8_t*)(uintptr_t)d->src + offset, chunk);
+    }
+
+    ch->progress += chunk;
+    if (ch->progress == d->length) retire_head(channel_id, 0);
+    return true;
+}
+
+// Reap finished hardware descriptors, run CPU-only work that has reached the
+// head, then hand as many queued copies to the engine as its ring allows
+bool DMAManager::step_hardware(int channel_id) {
+    dma_channel_t* ch = &channels[channel_id];
+    ioat_channel_t* hw = &ioat_channels[ch->hw_channel];
+    bool worked = false;
+
+    uint64_t seen = *hw->completion;
+    if (seen != hw->last_seen && hw->issued != hw->retired) {
+        hw->last_seen = seen;
+        uint64_t addr = seen & ~(uint64_t)0x3F;
+        if (addr >= hw->ring_phys && addr < hw->ring_phys + IOAT_RING_SIZE * sizeof(ioat_desc_t)) {
+            uint32_t slot = (uint32_t)((addr - hw->ring_phys) / sizeof(ioat_desc_t));
+            uint32_t done = ((slot - hw->retired) % IOAT_RING_SIZE) + 1;
+            if (done > hw->issued - hw->retired) done = hw->issued - hw->retired;
+            for (uint32_t i = 0; i < done; i++) {
+                if (hw->last_piece[hw->retired++ % IOAT_RING_SIZE]) retire_head(channel_id, 0);
+            }
+            worked = true;
+        }
+
+        if ((seen & IOAT_STATUS_MASK) == IOAT_STATUS_HALTED) {
+            // Fail whatever the engine still owned and carry on with the CPU
+            cout << "ERROR: I/OAT channel halted, CHANERR=" << mmio_read32(hw->regs + IOAT_CHANERR) << "\n";
+            while (ch->head != ch->tail && ch->ring[ch->head % DMA_RING_SIZE].on_hardware) retire_head(channel_id, -8);
+            ch->backend = DMA_BACKEND_CPU;
+            ch->hw_channel = -1;
+            ch->issue = ch->head;
+            return true;
+        }
+    }
+
+    if (ch->head == ch->issue && ch->head != ch->tail && !ch->ring[ch->head % DMA_RING_SIZE].on_hardware) {
+        const dma_desc_t* d = &ch->ring[ch->head % DMA_RING_SIZE].desc;
+        if (d->op != DMA_OP_COPY || dma_ranges_overlap(d)) return step_cpu(channel_id) || worked;
+    }
+
+    uint32_t appended = 0;
+    while (ch->issue != ch->tail) {
+        dma_ring_entry_t* entry = &ch->ring[ch->issue % DMA_RING_SIZE];
+        const dma_desc_t* d = &entry->desc;
+        if (d->op != DMA_OP_COPY || dma_ranges_overlap(d)) break; // Waits for the CPU at the head
+
+        while (entry->hw_issued < d->length && hw->issued - hw->retired < IOAT_RING_SIZE - 1) {
+            size_t piece = d->length - entry->hw_issued;
+            if (piece > ioat_xfercap) piece = ioat_xfercap;
+            uint32_t slot = hw->issued % IOAT_RING_SIZE;
+            ioat_desc_t* hd = &hw->ring[slot];
+            hd->size = (uint32_t)piece;
+            hd->ctl = IOAT_DESC_COMPL_WRITE;
+            hd->src_addr = d->src + entry->hw_issued;
+            hd->dst_addr = d->dst + entry->hw_issued;
+            entry->hw_issued += piece;
+            hw->last_piece[slot] = entry->hw_issued == d->length;
+            hw->issued++;
+            appended++;
+            entry->on_hardware = true;
+        }
+        if (entry->hw_issued < d->length) break; // Engine ring full
+        ch->issue++;
+    }
+
+    if (appended > 0) {
+        asm volatile ("" : : : "memory");
+        mmio_write16(hw->regs + IOAT_DMACOUNT, (uint16_t)hw->issued);
+        worked = true;
+    }
+    return worked;
+}
+
+int DMAManager::submit(int channel_id, const dma_desc_t* descs, int count) {
+    if (!initialized) return -1;
+    if (channel_id < 0 || channel_id >= DMA_MAX_CHANNELS || !(active_channels & (1 << channel_id))) return -13;
+    if (!descs || count <= 0) return -11;
+
+    dma_channel_t* ch = &channels[channel_id];
+    if ((uint32_t)count > DMA_RING_SIZE - (ch->tail - ch->head)) return -5;
+    for (int i = 0; i < count; i++) {
+        if (descs[i].length == 0 || descs[i].op > DMA_OP_FILL) return -11;
+        if (!verify_memory_range(descs[i].dst, descs[i].length)) return -11;
+        if (descs[i].op == DMA_OP_COPY && !verify_memory_range(descs[i].src, descs[i].length)) return -11;
+    }
+
+    for (int i = 0; i < count; i++) {
+        dma_ring_entry_t* entry = &ch->ring[ch->tail % DMA_RING_SIZE];
+        entry->desc = descs[i];
+        entry->on_hardware = false;
+        entry->hw_issued = 0;
+        ch->tail++;
+    }
+
+    // Start the engine right away; CPU work waits for the worker
+    if (ch->backend == DMA_BACKEND_IOAT) step_hardware(channel_id);
+    return count;
+}
+
+bool DMAManager::run_worker() {
+    if (!initialized) return false;
+    bool worked = false;
+    for (int i = 0; i < DMA_MAX_CHANNELS; i++) {
+        if (channels[i].head == channels[i].tail) continue;
+        if (channels[i].backend == DMA_BACKEND_IOAT) worked |= step_hardware(i);
+        else worked |= step_cpu(i);
+    }
+    return worked;
+}
+
+int DMAManager::pending(int channel_id) {
+    if (channel_id < 0 || channel_id >= DMA_MAX_CHANNELS) return 0;
+    return (int)(channels[channel_id].tail - channels[channel_id].head);
+}
+
+// Run the worker until 'channel_id' has retired its 'target'th descriptor
+bool DMAManager::wait_for(int channel_id, uint32_t target) {
+    dma_channel_t* ch = &channels[channel_id];
+    uint64_t deadline = deadline_ms(DMA_WAIT_TIMEOUT_MS);
+    while ((int32_t)(ch->completed - target) < 0) {
+        bool worked = (ch->backend == DMA_BACKEND_IOAT) ? step_hardware(channel_id) : step_cpu(channel_id);
+        if (worked) {
+            deadline = deadline_ms(DMA_WAIT_TIMEOUT_MS);
+        }
+        else if (deadline_passed(deadline)) {
+            cout << "ERROR: DMA channel " << channel_id << " made no progress, falling back to the CPU\n";
+            while (ch->head != ch->tail && ch->ring[ch->head % DMA_RING_SIZE].on_hardware) retire_head(channel_id, -7);
+            ch->backend = DMA_BACKEND_CPU;
+            ch->hw_channel = -1;
+            ch->issue = ch->head;
+            deadline = deadline_ms(DMA_WAIT_TIMEOUT_MS);
+        }
+        else if (!thread_yield()) {
+            asm volatile ("pause");
+        }
+    }
+    return true;
+}
+
+bool DMAManager::wait_channel_idle(int channel_id) {
+    if (!initialized || channel_id < 0 || channel_id >= DMA_MAX_CHANNELS) return false;
+    return wait_for(channel_id, channels[channel_id].tail - channels[channel_id].head + channels[channel_id].completed);
+}
+
+bool DMAManager::poll_completion(dma_completion_t* out) {
+    if (completion_head == completion_tail) return false;
+    *out = completions[completion_head % DMA_COMPLETION_RING_SIZE];
+    completion_head++;
+    return true;
+}
+
+void DMAManager::report_completions() {
+    dma_completion_t c;
+    while (poll_completion(&c)) {
+        cout << "[dma] #" << c.cookie << " on channel " << c.channel << ": ";
+        if (c.status == 0) cout << (uint32_t)c.length << " bytes done\n";
+        else cout << "failed (" << c.status << ")\n";
+    }
+    if (completions_dropped > 0) {
+        cout << "[dma] " << completions_dropped << " completions dropped\n";
+        completions_dropped = 0;
+    }
+}
+
+// Queue one descriptor on the kernel channel and wait for it
+bool DMAManager::run_sync(const dma_desc_t* desc) {
+    dma_channel_t* ch = &channels[DMA_KERNEL_CHANNEL];
+    int status;
+    while ((status = submit(DMA_KERNEL_CHANNEL, desc, 1)) == -5) {
+        if (!run_worker()) asm volatile ("pause"); // Ring full of background work
+    }
+    if (status < 0) return false;
+
+    uint32_t target = ch->completed + (ch->tail - ch->head);
+    wait_for(DMA_KERNEL_CHANNEL, target);
+    return ch->error_seq != target;
+}
+
+bool DMAManager::initialize(uint64_t base_address) {
+    initialized = true;
+    active_channels = 1 << DMA_KERNEL_CHANNEL;
+    completion_head = completion_tail = 0;
+    completions_dropped = 0;
+    next_cookie = 1;
+
+    ioat_probe();
+    for (int i = 0; i < DMA_MAX_CHANNELS; i++) {
+        dma_channel_t* ch = &channels[i];
+        ch->head = ch->issue = ch->tail = 0;
+        ch->progress = 0;
+        ch->batch_status = 0;
+        ch->completed = 0;
+        ch->error_seq = 0;
+        ch->bytes_moved = 0;
+        ch->has_staged = false;
+        ch->backend = i < ioat_channel_count ? DMA_BACKEND_IOAT : DMA_BACKEND_CPU;
+        ch->hw_channel = i < ioat_channel_count ? i : -1;
+    }
+    idle_manager = this;
+    input_set_idle_hook(dma_idle_hook);
+
+    printf("DMA Manager initialized at base: 0x%016llX\n", (unsigned long long)base_address);
+    if (ioat_channel_count > 0) {
+        cout << "I/OAT copy engine: " << ioat_channel_count << " channel(s), " << ioat_xfercap / 1024 << " KB per descriptor\n";
+    }
+    else {
+        cout << "No copy engine found, transfers run on the CPU worker\n";
+    }
+    return true;
 }
 
 int DMAManager::allocate_channel() {
@@ -56,37 +656,44 @@ int DMAManager::allocate_channel() {
 }
 
 void DMAManager::free_channel(int channel_id) {
-    if (channel_id >= 0 && channel_id < DMA_MAX_CHANNELS) {
+    if (channel_id >= 0 && channel_id < DMA_MAX_CHANNELS && channel_id != DMA_KERNEL_CHANNEL) {
+        if (pending(channel_id) > 0) wait_channel_idle(channel_id);
+        channels[channel_id].has_staged = false;
         active_channels &= ~(1 << channel_id);
     }
 }
 
 bool DMAManager::setup_transfer(int channel_id, uint64_t src, uint64_t dst, size_t length) {
-    cout << "Setup DMA transfer on channel " << channel_id << "\n";
+    if (!initialized || channel_id < 0 || channel_id >= DMA_MAX_CHANNELS) return false;
+    dma_desc_t* d = &channels[channel_id].staged;
+    d->op = DMA_OP_COPY;
+    d->flags = 0;
+    d->pattern = 0;
+    d->src = src;
+    d->dst = dst;
+    d->length = length;
+    d->cookie = new_cookie();
+    channels[channel_id].has_staged = true;
     return true;
 }
 
 bool DMAManager::start_transfer(int channel_id) {
-    cout << "Started DMA transfer on channel " << channel_id << "\n";
+    if (!initialized || channel_id < 0 || channel_id >= DMA_MAX_CHANNELS || !channels[channel_id].has_staged) return false;
+    if (submit(channel_id, &channels[channel_id].staged, 1) < 0) return false;
+    channels[channel_id].has_staged = false;
     return true;
 }
 
 bool DMAManager::wait_transfer_complete(int channel_id) {
-    cout << "DMA transfer complete on channel " << channel_id << "\n";
-    return true;
+    return wait_channel_idle(channel_id);
 }
 
 bool DMAManager::read_memory_dma(uint64_t address, void* buffer, size_t size) {
     if (!initialized) return false;
+    if (size == 0) return true;
     
-    // Direct memory read (replace with actual DMA when hardware ready)
-    uint8_t* src = (uint8_t*)address;
-    uint8_t* dst = (uint8_t*)buffer;
-    
-    for (size_t i = 0; i < size; i++) {
-        dst[i] = src[i];
-    }
-    return true;
+    dma_desc_t d = { DMA_OP_COPY, 0, 0, address, dma_virt_to_phys(buffer), size, new_cookie() };
+    return run_sync(&d);
 }
 
 bool DMAManager::write_memory_dma(uint64_t address, const void* data, size_t size) {
@@ -100,19 +707,14 @@ bool DMAManager::write_memory_dma(uint64_t address, const void* data, size_t siz
         return false;
     }
     
-    // Direct memory write (replace with actual DMA when hardware ready)
-    const uint8_t* src = (const uint8_t*)data;
-    uint8_t* dst = (uint8_t*)address;
-    
-    for (size_t i = 0; i < size; i++) {
-        dst[i] = src[i];
-    }
+    dma_desc_t d = { DMA_OP_COPY, 0, 0, dma_virt_to_phys(data), address, size, new_cookie() };
+    if (size > 0 && !run_sync(&d)) return false;
     
     cout << "DMA write completed: " << (int)size << " bytes\n";
     return true;
 }
 
-bool DMAManager::pattern_fill(uint64_t address, uint8_t pattern, size_t length) {
+bool DMAManager::pattern_fill(uint64_t address, uint8_t pattern, size_t length, bool async) {
     if (!initialized) return false;
     
     cout << "DMA pattern fill: 0x";
@@ -121,72 +723,44 @@ bool DMAManager::pattern_fill(uint64_t address, uint8_t pattern, size_t length)
     hex_pattern[1] = (pattern & 0xF) < 10 ? ('0' + (pattern & 0xF)) : ('A' + (pattern & 0xF) - 10);
     hex_pattern[2] = '\0';
     cout << hex_pattern << " for " << (int)length << " bytes\n";
-    
-    // Use chunked approach for large fills
-    void* buffer = allocate_dma_buffer(length < 1024 ? length : 1024);
-    if (!buffer) return false;
-    
-    uint8_t* fill_data = (uint8_t*)buffer;
-    size_t buffer_size = length < 1024 ? length : 1024;
-    
-    // Fill buffer with pattern
-    for (size_t i = 0; i < buffer_size; i++) {
-        fill_data[i] = pattern;
-    }
-    
-    // Write in chunks
-    size_t remaining = length;
-    uint64_t current_addr = address;
-    
-    while (remaining > 0) {
-        size_t chunk_size = remaining < buffer_size ? remaining : buffer_size;
-        
-        if (!write_memory_dma(current_addr, buffer, chunk_size)) {
-            free_dma_buffer(buffer);
+    if (length == 0) return true;
+    
+    dma_desc_t d = { DMA_OP_FILL, 0, pattern, 0, address, length, new_cookie() };
+    if (async) {
+        d.flags = DMA_FLAG_NOTIFY;
+        int status = submit(DMA_KERNEL_CHANNEL, &d, 1);
+        if (status < 0) {
+            cout << "ERROR: Could not queue fill (" << status << ")\n";
             return false;
         }
-        
-        remaining -= chunk_size;
-        current_addr += chunk_size;
+        cout << "Fill queued as #" << d.cookie << "\n";
+        return true;
     }
     
-    free_dma_buffer(buffer);
+    if (!run_sync(&d)) return false;
     cout << "Pattern fill completed\n";
     return true;
 }
 
-bool DMAManager::memory_copy(uint64_t src, uint64_t dst, size_t length) {
+bool DMAManager::memory_copy(uint64_t src, uint64_t dst, size_t length, bool async) {
     if (!initialized) return false;
     
     cout << "DMA memory copy: " << (int)length << " bytes\n";
-    
-    const size_t chunk_size = 1024;
-    void* temp_buffer = allocate_dma_buffer(chunk_size);
-    if (!temp_buffer) return false;
-    
-    size_t remaining = length;
-    uint64_t current_src = src;
-    uint64_t current_dst = dst;
-    
-    while (remaining > 0) {
-        size_t copy_size = remaining < chunk_size ? remaining : chunk_size;
-        
-        if (!read_memory_dma(current_src, temp_buffer, copy_size)) {
-            free_dma_buffer(temp_buffer);
-            return false;
-        }
-        
-        if (!write_memory_dma(current_dst, temp_buffer, copy_size)) {
-            free_dma_buffer(temp_buffer);
+    if (length == 0) return true;
+    
+    dma_desc_t d = { DMA_OP_COPY, 0, 0, src, dst, length, new_cookie() };
+    if (async) {
+        d.flags = DMA_FLAG_NOTIFY;
+        int status = submit(DMA_KERNEL_CHANNEL, &d, 1);
+        if (status < 0) {
+            cout << "ERROR: Could not queue copy (" << status << ")\n";
             return false;
         }
-        
-        remaining -= copy_size;
-        current_src += copy_size;
-        current_dst += copy_size;
+        cout << "Copy queued as #" << d.cookie << "\n";
+        return true;
     }
     
-    free_dma_buffer(temp_buffer);
+    if (!run_sync(&d)) return false;
     cout << "Memory copy completed successfully\n";
     return true;
 }
@@ -209,8 +783,14 @@ void DMAManager::show_channel_status() {
         } else {
             cout << "FREE";
         }
+        if (initialized) {
+            dma_channel_t* ch = &channels[i];
+            cout << (ch->backend == DMA_BACKEND_IOAT ? "  I/OAT" : "  CPU") << "  pending " << pending(i)
+                 << "  done " << ch->completed << "  " << (uint32_t)(ch->bytes_moved / 1024) << " KB";
+        }
         cout << "\n";
     }
+    dma_pool_print_stats();
 }
 
 bool DMAManager::verify_memory_range(uint64_t address, size_t size) {
@@ -227,66 +807,29 @@ bool DMAManager::verify_memory_range(uint64_t address, size_t size) {
 }
 
 void DMAManager::dump_memory_region(uint64_t start_addr, size_t length) {
-    cout << "Memory Dump - Address: 0x";
-    
-    // Convert uint64_t to hex string manually
-    char hex_addr[17];
-    uint64_t addr = start_addr;
-    int pos = 15;
-    hex_addr[16] = '\0';
-    
-    do {
-        int digit = addr & 0xF;
-        hex_addr[pos--] = (digit < 10) ? ('0' + digit) : ('A' + digit - 10);
-        addr >>= 4;
-    } while (addr > 0 && pos >= 0);
-    
-    while (pos >= 0) {
-        hex_addr[pos--] = '0';
-    }
-    
-    cout << hex_addr << " Length: " << (int)length << " bytes\n";
+    printf("Memory Dump - Address: 0x%016llX Length: %d bytes\n", (unsigned long long)start_addr, (int)length);
     
     uint8_t* mem_addr = (uint8_t*)start_addr;
     
+    // Build each line in a buffer and write it out once
+    char line[96];
     for (size_t i = 0; i < length; i += 16) {
-        // Print address for this line
-        uint64_t line_addr = start_addr + i;
-        char line_hex[17];
-        uint64_t temp_addr = line_addr;
-        int temp_pos = 15;
-        line_hex[16] = '\0';
-        
-        do {
-            int digit = temp_addr & 0xF;
-            line_hex[temp_pos--] = (digit < 10) ? ('0' + digit) : ('A' + digit - 10);
-            temp_addr >>= 4;
-        } while (temp_addr > 0 && temp_pos >= 0);
-        
-        while (temp_pos >= 0) {
-            line_hex[temp_pos--] = '0';
-        }
-        
-        cout << line_hex << ": ";
+        size_t count = length - i < 16 ? length - i : 16;
+        int n = snprintf(line, sizeof(line), "%016llX: ", (unsigned long long)(start_addr + i));
         
         // Hex dump
-        for (size_t j = 0; j < 16 && (i + j) < length; j++) {
-            uint8_t byte = mem_addr[i + j];
-            char hex_byte[3];
-            hex_byte[0] = (byte >> 4) < 10 ? ('0' + (byte >> 4)) : ('A' + (byte >> 4) - 10);
-            hex_byte[1] = (byte & 0xF) < 10 ? ('0' + (byte & 0xF)) : ('A' + (byte & 0xF) - 10);
-            hex_byte[2] = '\0';
-            cout << hex_byte << " ";
+        for (size_t j = 0; j < count; j++) {
+            n += snprintf(line + n, sizeof(line) - n, "%02X ", mem_addr[i + j]);
         }
-        
-        cout << " | ";
+        n += snprintf(line + n, sizeof(line) - n, " | ");
         
         // ASCII representation
-        for (size_t j = 0; j < 16 && (i + j) < length; j++) {
+        for (size_t j = 0; j < count; j++) {
             char c = mem_addr[i + j];
-            cout << (c >= 32 && c <= 126 ? c : '.');
+            line[n++] = (c >= 32 && c <= 126) ? c : '.';
         }
-        cout << "\n";
+        line[n++] = '\n';
+        cout.write(line, n);
     }
 }
 
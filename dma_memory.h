@@ -6,13 +6,104 @@
 #define DMA_BUFFER_SIZE 4096
 #define DMA_ALIGNMENT 64
 
+// DMA buffer pool. Requests up to DMA_SMALL_BUFFER_SIZE come from a free list of
+// fixed-size, cache-line aligned buffers; larger ones from a buddy allocator over
+// a contiguous region, so each block is physically contiguous and aligned to its
+// own size (at least DMA_BUDDY_MIN_BLOCK). Blocks go back to the pool on free.
+// When no block is left the buddy allocator adds another region from the frame
+// allocator, up to DMA_BUDDY_MAX_REGIONS.
+#define DMA_SMALL_BUFFER_SIZE 512
+#define DMA_SMALL_BUFFERS     128                  // 64KB of small buffers
+#define DMA_BUDDY_MIN_BLOCK   4096
+#define DMA_BUDDY_MAX_ORDER   7                    // Largest block: 4KB << 7 = 512KB
+#define DMA_BUDDY_REGION_SIZE (DMA_BUDDY_MIN_BLOCK << DMA_BUDDY_MAX_ORDER)
+#define DMA_BUDDY_MAX_REGIONS 64                   // 32MB of buddy space; block numbers fit in int16_t
+
+void* dma_pool_alloc(size_t size);
+void dma_pool_free(void* buffer);
+uint64_t dma_virt_to_phys(const void* buffer);  // Bus address to program into a PRDT
+void dma_pool_print_stats();
+
+// Asynchronous transfer engine. Each channel owns a ring of descriptors that run
+// in order, either on a PCI copy engine (Intel I/OAT, found by a PCI scan) or on
+// the CPU worker. The worker moves DMA_CPU_CHUNK bytes per step while the shell
+// waits for input, so a queued copy does not block the prompt. Descriptors
+// flagged DMA_FLAG_NOTIFY post a dma_completion_t to a shared completion ring.
+#define DMA_RING_SIZE            16      // Descriptors queued per channel (power of two)
+#define DMA_COMPLETION_RING_SIZE 32
+#define DMA_CPU_CHUNK            65536   // Bytes the CPU worker moves per step, per online CPU
+#define DMA_SMP_GRAIN            16384   // Smallest piece of a step handed to another CPU
+#define DMA_ASYNC_THRESHOLD      65536   // Shell copies/fills at least this big run in the background
+#define DMA_KERNEL_CHANNEL       0       // Reserved for memory_copy/pattern_fill and friends
+
+#define DMA_OP_COPY 0
+#define DMA_OP_FILL 1
+
+#define DMA_FLAG_NOTIFY 0x01  // Post a completion when this descriptor finishes
+
+#define DMA_BACKEND_CPU  0
+#define DMA_BACKEND_IOAT 1
+
+typedef struct {
+    uint8_t op;        // DMA_OP_*
+    uint8_t flags;     // DMA_FLAG_*
+    uint8_t pattern;   // Fill byte for DMA_OP_FILL
+    uint64_t src;
+    uint64_t dst;
+    size_t length;
+    uint32_t cookie;   // Caller tag, returned in the completion
+} dma_desc_t;
+
+typedef struct {
+    uint32_t cookie;
+    int channel;
+    int status;        // 0 on success, negative on error
+    size_t length;
+} dma_completion_t;
+
+typedef struct {
+    dma_desc_t desc;
+    bool on_hardware;      // At least partly handed to the copy engine
+    size_t hw_issued;      // Bytes handed over so far (split at the engine's transfer cap)
+} dma_ring_entry_t;
+
+typedef struct {
+    dma_ring_entry_t ring[DMA_RING_SIZE];
+    uint32_t head;         // Oldest unfinished descriptor (free-running)
+    uint32_t issue;        // Next descriptor to hand to the copy engine
+    uint32_t tail;         // Next free slot
+    size_t progress;       // Bytes of ring[head] done by the CPU worker
+    int batch_status;      // First error since the last notify
+    uint32_t completed;    // Descriptors finished since init
+    uint32_t error_seq;    // Value 'completed' reached with the last failed descriptor
+    uint64_t bytes_moved;
+    uint8_t backend;       // DMA_BACKEND_*
+    int hw_channel;        // Copy engine channel, or -1
+    dma_desc_t staged;     // setup_transfer() -> start_transfer()
+    bool has_staged;
+} dma_channel_t;
+
 class DMAManager {
 private:
     bool initialized;
     uint32_t active_channels;
-    
+    dma_channel_t channels[DMA_MAX_CHANNELS];
+    dma_completion_t completions[DMA_COMPLETION_RING_SIZE];
+    uint32_t completion_head;
+    uint32_t completion_tail;
+    uint32_t completions_dropped;
+    uint32_t next_cookie;
+
+    void post_completion(int channel_id, const dma_ring_entry_t* entry, int status);
+    void retire_head(int channel_id, int status);
+    bool step_cpu(int channel_id);
+    bool step_hardware(int channel_id);
+    bool wait_for(int channel_id, uint32_t target);
+    bool run_sync(const dma_desc_t* desc);
+
 public:
-    DMAManager() : initialized(false), active_channels(0) {}
+    DMAManager() : initialized(false), active_channels(0), completion_head(0), completion_tail(0),
+                   completions_dropped(0), next_cookie(1) {}
     
     // Core DMA functions - DECLARE EACH METHOD ONLY ONCE
     bool initialize(uint64_t base_address);
@@ -21,6 +112,18 @@ public:
     bool setup_transfer(int channel_id, uint64_t src, uint64_t dst, size_t length);
     bool start_transfer(int channel_id);
     bool wait_transfer_complete(int channel_id);
+
+    // Asynchronous engine
+    // Queue 'count' descriptors on a channel as one batch. Returns the number
+    // queued, or negative:
+    // -1 not initialized, -5 ring full, -11 bad descriptor, -13 bad channel
+    int submit(int channel_id, const dma_desc_t* descs, int count);
+    bool poll_completion(dma_completion_t* out);
+    bool run_worker();                       // One step on every channel; true if work was done
+    bool wait_channel_idle(int channel_id);  // Runs the worker until the channel drains
+    int pending(int channel_id);
+    uint32_t new_cookie() { return next_cookie++; }
+    void report_completions();               // Print and drain the completion ring
     
     // Memory management
     void* allocate_dma_buffer(size_t size);
@@ -32,9 +135,10 @@ public:
     void dump_memory_region(uint64_t start_addr, size_t length);
     
     // Advanced operations - ADD THESE MISSING METHODS
-    bool pattern_fill(uint64_t address, uint8_t pattern, size_t length);
-    bool memory_copy(uint64_t src, uint64_t dst, size_t length);
+    // With 'async' set these queue on the kernel channel and return at once;
+    // the result shows up through poll_completion()/report_completions()
+    bool pattern_fill(uint64_t address, uint8_t pattern, size_t length, bool async = false);
+    bool memory_copy(uint64_t src, uint64_t dst, size_t length, bool async = false);
     void show_channel_status();
     bool verify_memory_range(uint64_t address, size_t size);
 };
-
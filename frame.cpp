@@ -0,0 +1,216 @@
+#include "frame.h"
+#include "iostream_wrapper.h"
+#include "stdlib_hooks.h"
+
+// Set up by linker.ld around everything the bootloader loaded, .bss included
+extern "C" uint8_t kernel_start[];
+extern "C" uint8_t kernel_end[];
+
+#define FRAME_WORDS (FRAME_COUNT / 32)
+#define FRAME_NONE  0xFFFFFFFFu
+
+// One bit per frame, set while the frame is in use or not RAM at all
+static uint32_t frame_bitmap[FRAME_WORDS];
+static uint32_t frame_lowest = 0;      // First frame that was ever free
+static uint32_t frame_highest = 0;     // One past the last frame that was ever free
+static uint32_t frame_hint = 0;        // Where the next search starts
+static uint32_t frame_total = 0;
+static uint32_t frame_available = 0;
+static bool frame_initialized = false;
+
+static multiboot_mmap_entry_t frame_map[FRAME_MAP_ENTRIES];
+static int frame_map_count = 0;
+static bool frame_map_from_bootloader = false;  // Else mem_upper stood in for it
+
+static inline bool frame_used(uint32_t f) {
+    return (frame_bitmap[f >> 5] >> (f & 31)) & 1;
+}
+
+static inline uint32_t frame_align_up(uint32_t f, uint32_t align) {
+    return (f + align - 1) & ~(align - 1);
+}
+
+// Mark [first, first + count) free (used = false) or in use, keeping the counters right
+static void frame_mark(uint32_t first, uint32_t count, bool used) {
+    for (uint32_t f = first; f < first + count; f++) {
+        uint32_t bit = 1u << (f & 31);
+        bool was_used = (frame_bitmap[f >> 5] & bit) != 0;
+        if (was_used == used) continue;
+        if (used) {
+            frame_bitmap[f >> 5] |= bit;
+            frame_available--;
+        }
+        else {
+            frame_bitmap[f >> 5] &= ~bit;
+            frame_available++;
+        }
+    }
+}
+
+// Frames wholly inside [base, base + length), clipped to 4 GB
+static bool frame_range(uint64_t base, uint64_t length, uint32_t* first, uint32_t* count) {
+    uint64_t start = (base + FRAME_SIZE - 1) / FRAME_SIZE;
+    uint64_t end = (base + length) / FRAME_SIZE;
+    if (end > FRAME_COUNT) end = FRAME_COUNT;
+    if (start >= end) return false;
+    *first = (uint32_t)start;
+    *count = (uint32_t)(end - start);
+    return true;
+}
+
+static void frame_add_region(uint64_t base, uint64_t length, uint32_t type) {
+    if (frame_map_count < FRAME_MAP_ENTRIES) {
+        multiboot_mmap_entry_t* e = &frame_map[frame_map_count++];
+        e->size = sizeof(*e) - sizeof(e->size);
+        e->addr = base;
+        e->len = length;
+        e->type = type;
+    }
+    uint32_t first, count;
+    if (type != MULTIBOOT_MEMORY_AVAILABLE || !frame_range(base, length, &first, &count)) return;
+    frame_mark(first, count, false);
+}
+
+// Take frames that overlap [base, base + length) back out of the free set
+static void frame_reserve(uint64_t base, uint64_t length) {
+    uint64_t start = base / FRAME_SIZE;
+    uint64_t end = (base + length + FRAME_SIZE - 1) / FRAME_SIZE;
+    if (end > FRAME_COUNT) end = FRAME_COUNT;
+    if (start < end) frame_mark((uint32_t)start, (uint32_t)(end - start), true);
+}
+
+uint32_t frame_init(uint32_t magic, const multiboot_info_t* info) {
+    for (uint32_t w = 0; w < FRAME_WORDS; w++) frame_bitmap[w] = 0xFFFFFFFFu;
+    frame_available = 0;
+    frame_map_count = 0;
+    if (magic != MULTIBOOT_BOOTLOADER_MAGIC || info == nullptr) return 0;
+
+    if (info->flags & MULTIBOOT_INFO_MEM_MAP) {
+        // Entries are variable length: 'size' does not count itself
+        uintptr_t p = info->mmap_addr;
+        uintptr_t end = p + info->mmap_length;
+        while (p + sizeof(multiboot_mmap_entry_t) <= end) {
+            const multiboot_mmap_entry_t* e = (const multiboot_mmap_entry_t*)p;
+            frame_add_region(e->addr, e->len, e->type);
+            p += e->size + sizeof(e->size);
+        }
+        frame_map_from_bootloader = true;
+    }
+    else if (info->flags & MULTIBOOT_INFO_MEMORY) {
+        frame_add_region(0, (uint64_t)info->mem_lower * 1024, MULTIBOOT_MEMORY_AVAILABLE);
+        frame_add_region(FRAME_LOW_LIMIT, (uint64_t)info->mem_upper * 1024, MULTIBOOT_MEMORY_AVAILABLE);
+    }
+    else {
+        return 0;
+    }
+
+    frame_reserve(0, FRAME_LOW_LIMIT);
+    frame_reserve((uintptr_t)kernel_start, (uintptr_t)(kernel_end - kernel_start));
+
+    frame_lowest = FRAME_COUNT;
+    frame_highest = 0;
+    for (uint32_t f = 0; f < FRAME_COUNT; f++) {
+        if (frame_used(f)) continue;
+        if (frame_lowest == FRAME_COUNT) frame_lowest = f;
+        frame_highest = f + 1;
+    }
+    frame_hint = frame_lowest;
+    frame_total = frame_available;
+    frame_initialized = frame_available > 0;
+    return frame_available;
+}
+
+bool frame_ready() {
+    return frame_initialized;
+}
+
+uint32_t frame_free_count() {
+    return frame_available;
+}
+
+// First frame in use within [first, first + count), or FRAME_NONE.
+// Words with no frame in use are checked 32 frames at a time
+static uint32_t frame_first_used(uint32_t first, uint32_t count) {
+    uint32_t f = first;
+    uint32_t end = first + count;
+    while (f < end) {
+        if ((f & 31) == 0 && end - f >= 32) {
+            uint32_t word = frame_bitmap[f >> 5];
+            if (word == 0) {
+                f += 32;
+                continue;
+            }
+            return f + __builtin_ctz(word);
+        }
+        if (frame_used(f)) return f;
+        f++;
+    }
+    return FRAME_NONE;
+}
+
+// Search [from, limit) for the run; returns its first frame or FRAME_NONE
+static uint32_t frame_search(uint32_t from, uint32_t limit, uint32_t count, uint32_t align) {
+    uint32_t f = frame_align_up(from, align);
+    while (f < limit && limit - f >= count) {
+        if (frame_bitmap[f >> 5] == 0xFFFFFFFFu) {
+            f = frame_align_up((f | 31) + 1, align);  // Whole word taken
+            continue;
+        }
+        uint32_t used = frame_first_used(f, count);
+        if (used == FRAME_NONE) return f;
+        f = frame_align_up(used + 1, align);
+    }
+    return FRAME_NONE;
+}
+
+// Next fit from the last allocation, wrapping around once
+uintptr_t frame_alloc(uint32_t count, uint32_t align) {
+    if (!frame_initialized || count == 0 || count > frame_available) return 0;
+    if (align == 0 || (align & (align - 1)) != 0) return 0;
+
+    uint32_t f = frame_search(frame_hint, frame_highest, count, align);
+    if (f == FRAME_NONE) {
+        uint32_t wrap = frame_hint + count < frame_highest ? frame_hint + count : frame_highest;
+        f = frame_search(frame_lowest, wrap, count, align);
+    }
+    if (f == FRAME_NONE) return 0;
+
+    frame_mark(f, count, true);
+    frame_hint = f + count;
+    return (uintptr_t)f * FRAME_SIZE;
+}
+
+void frame_free(uintptr_t address, uint32_t count) {
+    if (!frame_initialized || address % FRAME_SIZE != 0) return;
+    uint32_t first = (uint32_t)(address / FRAME_SIZE);
+    if (first < frame_lowest || first + count > frame_highest) return;
+    frame_mark(first, count, false);
+    if (first < frame_hint) frame_hint = first;
+}
+
+static const char* frame_type_name(uint32_t type) {
+    switch (type) {
+        case MULTIBOOT_MEMORY_AVAILABLE: return "available";
+        case 3: return "ACPI reclaimable";
+        case 4: return "ACPI NVS";
+        case 5: return "bad RAM";
+        default: return "reserved";
+    }
+}
+
+void frame_print_info() {
+    if (!frame_initialized) {
+        cout << "Frame allocator: no memory map from the bootloader; heaps and caches use static space only\n";
+        return;
+    }
+    cout << "Memory map (" << (frame_map_from_bootloader ? "from the bootloader" : "from mem_lower/mem_upper") << "):\n";
+    for (int i = 0; i < frame_map_count; i++) {
+        const multiboot_mmap_entry_t* e = &frame_map[i];
+        printf("  0x%09llX - 0x%09llX  %8u KB  %s\n", (unsigned long long)e->addr,
+               (unsigned long long)(e->addr + e->len - 1), (uint32_t)(e->len / 1024), frame_type_name(e->type));
+    }
+    printf("Kernel image: 0x%08X - 0x%08X (%u KB)\n", (uint32_t)(uintptr_t)kernel_start,
+           (uint32_t)(uintptr_t)kernel_end - 1, (uint32_t)((kernel_end - kernel_start) / 1024));
+    cout << "Frames: " << frame_available << "/" << frame_total << " free ("
+         << (frame_available / 256) << "/" << (frame_total / 256) << " MB)\n";
+}
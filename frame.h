@@ -0,0 +1,59 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include "types.h"
+
+// Physical frame allocator.
+// frame_init() reads the memory map the bootloader passes in (boot.S asks for it
+// with MEMINFO) and tracks every 4 KB frame below 4 GB in a bitmap. Only RAM the
+// map calls available is handed out, never the first megabyte and never the
+// kernel image between the linker symbols kernel_start and kernel_end. The
+// kernel runs identity mapped, so a frame's physical address is also a pointer
+// to it. The heap, the DMA pools and the block cache grow from here once their
+// static space runs out.
+
+#define FRAME_SIZE        4096
+#define FRAME_COUNT       (1u << 20)  // Frames below 4 GB
+#define FRAME_LOW_LIMIT   0x100000    // BIOS data, the AP trampoline and option ROMs live below this
+#define FRAME_MAP_ENTRIES 32          // Memory map entries kept for frame_print_info()
+
+#define MULTIBOOT_BOOTLOADER_MAGIC 0x2BADB002  // In EAX when the bootloader jumps to _start
+#define MULTIBOOT_INFO_MEMORY      (1u << 0)   // mem_lower/mem_upper are valid
+#define MULTIBOOT_INFO_MEM_MAP     (1u << 6)   // mmap_addr/mmap_length are valid
+#define MULTIBOOT_MEMORY_AVAILABLE 1
+
+// The start of the information structure the bootloader leaves in EBX
+typedef struct {
+    uint32_t flags;
+    uint32_t mem_lower;    // KB of RAM from 0
+    uint32_t mem_upper;    // KB of RAM from 1 MB up to the first hole
+    uint32_t boot_device;
+    uint32_t cmdline;
+    uint32_t mods_count;
+    uint32_t mods_addr;
+    uint32_t syms[4];
+    uint32_t mmap_length;  // Bytes of memory map at mmap_addr
+    uint32_t mmap_addr;
+} __attribute__((packed)) multiboot_info_t;
+
+typedef struct {
+    uint32_t size;         // Bytes in the rest of this entry
+    uint64_t addr;
+    uint64_t len;
+    uint32_t type;         // MULTIBOOT_MEMORY_AVAILABLE, or reserved/ACPI/bad RAM
+} __attribute__((packed)) multiboot_mmap_entry_t;
+
+// Build the bitmap from the bootloader's map. The information structure is only
+// read here, so it may be overwritten by allocations afterwards.
+// Returns the number of frames available, 0 if 'magic' is wrong or no map was passed
+uint32_t frame_init(uint32_t magic, const multiboot_info_t* info);
+bool frame_ready();
+
+// 'count' contiguous frames starting on a multiple of 'align' frames (a power of two).
+// Returns the physical address of the first one, or 0 if no such run is free
+uintptr_t frame_alloc(uint32_t count, uint32_t align = 1);
+void frame_free(uintptr_t address, uint32_t count);
+uint32_t frame_free_count();
+void frame_print_info();
+
+#endif // FRAME_H
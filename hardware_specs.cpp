@@ -3,6 +3,10 @@
 #include "terminal_io.h"
 #include "iostream_wrapper.h"
 #include "interrupts.h"
+#include "hardware_specs.h"
+#include "stdlib_hooks.h"
+#include "timer.h"
+#include "frame.h"
  
  /* Define constants for MSR access */
  #define IA32_EFER           0xC0000080  // Extended Feature Enable Register
@@ -24,6 +28,11 @@ char input[1];
      return ((uint64_t)high << 32) | low;
  }
  
+ /* MSR write function */
+ void wrmsr(uint32_t msr, uint64_t value) {
+     __asm__ volatile ("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+ }
+ 
  /* CPUID function */
  void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx) {
      __asm__ volatile ("cpuid"
@@ -38,6 +47,59 @@ char input[1];
                       : "a"(leaf), "c"(subleaf));
  }
  
+ /* Enable x87, SSE and, where XSAVE allows it, AVX register state so vector
+    code can run. Returns the CPU_FEATURE_* flags that are now usable. */
+ uint32_t cpu_simd_enable() {
+     uint32_t eax, ebx, ecx, edx;
+     uint32_t features = 0;
+     
+     cpuid(0, &eax, &ebx, &ecx, &edx);
+     uint32_t max_leaf = eax;
+     
+     cpuid(1, &eax, &ebx, &ecx, &edx);
+     uint32_t ecx1 = ecx, edx1 = edx;
+     if (!(edx1 & (1 << 0))) return 0; // No FPU
+     
+     // CR0: clear EM and TS, set MP and NE
+     uint32_t cr0;
+     __asm__ volatile ("mov %%cr0, %0" : "=r"(cr0));
+     cr0 &= ~((1u << 2) | (1u << 3));
+     cr0 |= (1u << 1) | (1u << 5);
+     __asm__ volatile ("mov %0, %%cr0" : : "r"(cr0));
+     __asm__ volatile ("fninit");
+     
+     // CR4: OSFXSR and OSXMMEXCPT, needs FXSR, SSE and SSE2
+     uint32_t cr4;
+     __asm__ volatile ("mov %%cr4, %0" : "=r"(cr4));
+     if ((edx1 & (1 << 24)) && (edx1 & (1 << 25)) && (edx1 & (1 << 26))) {
+         cr4 |= (1u << 9) | (1u << 10);
+         __asm__ volatile ("mov %0, %%cr4" : : "r"(cr4));
+         features |= CPU_FEATURE_SSE2;
+     }
+     
+     uint32_t ebx7 = 0;
+     if (max_leaf >= 7) {
+         cpuid_ext(7, 0, &eax, &ebx, &ecx, &edx);
+         ebx7 = ebx;
+     }
+     
+     // AVX: CR4.OSXSAVE, then enable x87 | SSE | AVX state in XCR0
+     if ((features & CPU_FEATURE_SSE2) && (ecx1 & (1 << 26)) && (ecx1 & (1 << 28))) {
+         cr4 |= (1u << 18);
+         __asm__ volatile ("mov %0, %%cr4" : : "r"(cr4));
+         uint32_t xcr0_lo, xcr0_hi;
+         __asm__ volatile ("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+         xcr0_lo |= 0x7;
+         __asm__ volatile ("xsetbv" : : "a"(xcr0_lo), "d"(xcr0_hi), "c"(0));
+         features |= CPU_FEATURE_AVX;
+         if (ebx7 & (1 << 5)) features |= CPU_FEATURE_AVX2;
+     }
+     
+     if (ebx7 & (1 << 9)) features |= CPU_FEATURE_ERMS;
+     
+     return features;
+ }
+ 
  /* CPU information */
  void cmd_cpu() {
      uint32_t eax, ebx, ecx, edx;
@@ -408,4 +470,275 @@ char input[1];
      cmd_features();
      cout << "\n";
      cmd_pstates();
+ }
+ 
+ /* Memory benchmark
+    Bandwidth of every copy/fill kernel in stdlib_hooks, load-to-use latency by
+    pointer chasing through working sets that step across the cache sizes, and
+    the cost of one uncached MMIO read from the AHCI BAR. Everything runs in an
+    arena taken from the frame allocator for the length of the run, halved until
+    it fits; without frames it falls back to a smaller heap block. */
+ #define MEMBENCH_ARENA_SIZE  (16u << 20)  // Largest working set measured
+ #define MEMBENCH_ARENA_MIN   (64u << 10)
+ #define MEMBENCH_RUN_NS      10000000ull  // Each bandwidth run repeats for at least 10 ms
+ #define MEMBENCH_RUNS        3            // Best run is reported
+ #define MEMBENCH_CHASE_LOADS (1u << 20)
+ #define MEMBENCH_MMIO_READS  1000
+ #define AHCI_VS_OFFSET       0x10         // HBA version register, reads have no side effects
+ 
+ static uint8_t* membench_arena;
+ static size_t membench_arena_size;
+ static bool membench_arena_frames;  // From frame_alloc, else from the heap
+ static volatile uintptr_t membench_sink;  // Keeps the measured loads from being optimised away
+ static char* membench_report;
+ static size_t membench_report_size;
+ static size_t membench_report_len;
+ 
+ /* Print a line and append it to the report buffer, if there is one */
+ static void membench_out(const char* format, ...) {
+     char line[160];
+     va_list args;
+     va_start(args, format);
+     vsnprintf(line, sizeof(line), format, args);
+     va_end(args);
+     printf("%s", line);
+     
+     size_t len = strlen(line);
+     if (membench_report && membench_report_len + len <= membench_report_size) {
+         memcpy(membench_report + membench_report_len, line, len);
+         membench_report_len += len;
+     }
+ }
+ 
+ /* L1 data, L2 and L3 sizes in KB and the line size, from the leaves cmd_cache
+    reads, with the deterministic cache parameters (leaf 4) filling in anything
+    those leave at zero, as Intel CPUs do */
+ static void cache_sizes(uint32_t* l1d_kb, uint32_t* l2_kb, uint32_t* l3_kb, uint32_t* line) {
+     uint32_t eax, ebx, ecx, edx;
+     *l1d_kb = *l2_kb = *l3_kb = 0;
+     *line = 0;
+     
+     cpuid(0x80000000, &eax, &ebx, &ecx, &edx);
+     if (eax >= 0x80000006) {
+         cpuid(0x80000005, &eax, &ebx, &ecx, &edx);
+         *l1d_kb = (ecx >> 24) & 0xFF;
+         *line = ecx & 0xFF;
+         cpuid(0x80000006, &eax, &ebx, &ecx, &edx);
+         *l2_kb = (ecx >> 16) & 0xFFFF;
+         *l3_kb = ((edx >> 18) & 0x3FFF) * 512;
+         if (!*line) *line = ecx & 0xFF;
+     }
+     
+     cpuid(0, &eax, &ebx, &ecx, &edx);
+     if (eax >= 4) {
+         for (uint32_t i = 0; i < 16; i++) {
+             cpuid_ext(4, i, &eax, &ebx, &ecx, &edx);
+             uint32_t type = eax & 0x1F;
+             if (type == 0) break;
+             if (type == 2) continue;  // Instruction cache
+             uint32_t level = (eax >> 5) & 0x7;
+             uint32_t line_size = (ebx & 0xFFF) + 1;
+             uint32_t kb = (((ebx >> 22) & 0x3FF) + 1) * (((ebx >> 12) & 0x3FF) + 1) * line_size * (ecx + 1) / 1024;
+             if (level == 1 && !*l1d_kb) *l1d_kb = kb;
+             if (level == 2 && !*l2_kb) *l2_kb = kb;
+             if (level == 3 && !*l3_kb) *l3_kb = kb;
+             if (!*line) *line = line_size;
+         }
+     }
+     
+     // Typical values, if CPUID reports nothing (some hypervisors)
+     if (!*l1d_kb) *l1d_kb = 32;
+     if (!*l2_kb) *l2_kb = 256;
+     if (!*line) *line = 64;
+ }
+ 
+ /* Best of MEMBENCH_RUNS, in MB/s of bytes copied or filled */
+ static uint32_t membench_bandwidth(const mem_kernel* k, bool copy, uint8_t* dest, const uint8_t* src, size_t bytes) {
+     uint64_t best = 0;
+     for (int run = 0; run < MEMBENCH_RUNS; run++) {
+         uint64_t done = 0;
+         uint64_t start = now_ns();
+         uint64_t elapsed;
+         do {
+             if (copy) k->copy(dest, src, bytes);
+             else k->fill(dest, 0x5A, bytes);
+             done += bytes;
+             elapsed = now_ns() - start;
+         } while (elapsed < MEMBENCH_RUN_NS);
+         uint64_t rate = done * 1000 / elapsed;
+         if (rate > best) best = rate;
+     }
+     return (uint32_t)best;
+ }
+ 
+ /* Link the first word of every 'stride' bytes in the first 'bytes' of the arena
+    into one random cycle (Sattolo's shuffle), so each load depends on the last
+    and no prefetcher can guess the next line */
+ static void membench_chase_build(size_t bytes, uint32_t stride) {
+     uint32_t lines = bytes / stride;
+     for (uint32_t i = 0; i < lines; i++) *(uint32_t*)(membench_arena + i * stride) = i;
+     
+     uint32_t rng = 0x9E3779B9;
+     for (uint32_t i = lines - 1; i > 0; i--) {
+         rng ^= rng << 13;
+         rng ^= rng >> 17;
+         rng ^= rng << 5;
+         uint32_t j = rng % i;
+         uint32_t* a = (uint32_t*)(membench_arena + i * stride);
+         uint32_t* b = (uint32_t*)(membench_arena + j * stride);
+         uint32_t t = *a;
+         *a = *b;
+         *b = t;
+     }
+     
+     // Line i holds the index of its successor; turn the indices into pointers
+     for (uint32_t i = 0; i < lines; i++) {
+         uint32_t next = *(uint32_t*)(membench_arena + i * stride);
+         *(uintptr_t*)(membench_arena + i * stride) = (uintptr_t)(membench_arena + next * stride);
+     }
+ }
+ 
+ /* Take the largest arena that can be had. Returns false if not even
+    MEMBENCH_ARENA_MIN is free */
+ static bool membench_arena_get() {
+     for (size_t size = MEMBENCH_ARENA_SIZE; size >= MEMBENCH_ARENA_MIN; size /= 2) {
+         uintptr_t base = frame_alloc(size / FRAME_SIZE);
+         if (base) {
+             membench_arena = (uint8_t*)base;
+             membench_arena_size = size;
+             membench_arena_frames = true;
+             return true;
+         }
+     }
+     for (size_t size = MEMBENCH_ARENA_SIZE; size >= MEMBENCH_ARENA_MIN; size /= 2) {
+         membench_arena = (uint8_t*)aligned_malloc(4096, size);
+         if (membench_arena) {
+             membench_arena_size = size;
+             membench_arena_frames = false;
+             return true;
+         }
+     }
+     return false;
+ }
+ 
+ static void membench_arena_put() {
+     if (membench_arena_frames) frame_free((uintptr_t)membench_arena, membench_arena_size / FRAME_SIZE);
+     else free(membench_arena);
+     membench_arena = nullptr;
+     membench_arena_size = 0;
+ }
+ 
+ /* Average nanoseconds per dependent load, times 10, best of MEMBENCH_RUNS */
+ static uint32_t membench_chase(uint32_t lines) {
+     void** p = (void**)membench_arena;
+     for (uint32_t i = 0; i < lines; i++) p = (void**)*p;  // Warm up
+     
+     uint64_t best = ~0ull;
+     for (int run = 0; run < MEMBENCH_RUNS; run++) {
+         uint64_t start = now_ns();
+         for (uint32_t i = 0; i < MEMBENCH_CHASE_LOADS; i++) p = (void**)*p;
+         uint64_t elapsed = now_ns() - start;
+         if (elapsed < best) best = elapsed;
+     }
+     membench_sink = (uintptr_t)p;
+     return (uint32_t)(best * 10 / MEMBENCH_CHASE_LOADS);
+ }
+ 
+ /* Print nanoseconds (times 10) and the matching TSC cycles per operation */
+ static void membench_out_latency(uint32_t ns_x10) {
+     uint32_t khz = clock_tsc_khz();
+     membench_out("%6u.%u ns", ns_x10 / 10, ns_x10 % 10);
+     if (khz) {
+         uint32_t cycles_x10 = (uint32_t)((uint64_t)ns_x10 * khz / 1000000);
+         membench_out("  %6u.%u cycles", cycles_x10 / 10, cycles_x10 % 10);
+     }
+ }
+ 
+ /* Run the benchmarks, printing the results as tables. A copy of the text goes
+    into 'report' (not NUL-terminated) when one is given; returns its length. */
+ size_t cmd_membench(uint64_t ahci_base, char* report, size_t report_size) {
+     membench_report = report;
+     membench_report_size = report_size;
+     membench_report_len = 0;
+     
+     if (!membench_arena_get()) {
+         membench_out("ERROR: no memory for the benchmark arena\n");
+         membench_report = nullptr;
+         return membench_report_len;
+     }
+     
+     uint32_t l1d_kb, l2_kb, l3_kb, line;
+     cache_sizes(&l1d_kb, &l2_kb, &l3_kb, &line);
+     if (line < sizeof(uintptr_t)) line = 64;
+     
+     membench_out("Memory benchmark\n");
+     membench_out("  L1d %u KB, L2 %u KB, L3 %u KB, %u byte lines, TSC %u kHz\n",
+                  l1d_kb, l2_kb, l3_kb, line, clock_tsc_khz());
+     
+     // Bandwidth: once with both buffers inside L2, once spread over the arena
+     size_t cached = (size_t)l2_kb * 1024 / 4;
+     size_t large = membench_arena_size / 2;
+     if (cached > large) cached = large;
+     uint8_t* src = membench_arena;
+     memset(membench_arena, 0xA5, membench_arena_size);
+     
+     membench_out("\nBandwidth, MB/s (* = used by memcpy/memset)\n");
+     membench_out("  %-12s  copy %4uK  fill %4uK  copy %4uM  fill %4uM\n", "kernel",
+                  (uint32_t)(cached / 1024), (uint32_t)(cached / 1024),
+                  (uint32_t)(large >> 20), (uint32_t)(large >> 20));
+     const mem_kernel* kernels;
+     int count = mem_ops_kernels(&kernels);
+     for (int i = 0; i < count; i++) {
+         const mem_kernel* k = &kernels[i];
+         membench_out("  %-10s %c  %10u  %10u  %10u  %10u\n", k->name, k->active ? '*' : ' ',
+                      membench_bandwidth(k, true, src + cached, src, cached),
+                      membench_bandwidth(k, false, src, src, cached),
+                      membench_bandwidth(k, true, src + large, src, large),
+                      membench_bandwidth(k, false, src, src, large));
+     }
+     
+     // Latency: working sets doubling from 4 KB through each cache level into memory
+     size_t chase_max = membench_arena_size;
+     if (l3_kb && (size_t)l3_kb * 4096 < chase_max) chase_max = (size_t)l3_kb * 4096;
+     else if (!l3_kb && (size_t)l2_kb * 4096 < chase_max) chase_max = (size_t)l2_kb * 4096;
+     
+     membench_out("\nLoad latency, random pointer chase over one %u byte line per load\n", line);
+     membench_out("  %10s  %-5s\n", "working set", "level");
+     for (size_t bytes = 4096; bytes <= chase_max; bytes *= 2) {
+         uint32_t kb = bytes / 1024;
+         const char* level = kb <= l1d_kb ? "L1" : kb <= l2_kb ? "L2" : (l3_kb && kb <= l3_kb) ? "L3" : "RAM";
+         membench_chase_build(bytes, line);
+         if (kb < 1024) membench_out("  %9uK  %-5s", kb, level);
+         else membench_out("  %9uM  %-5s", kb / 1024, level);
+         membench_out_latency(membench_chase(bytes / line));
+         membench_out("\n");
+     }
+     if (chase_max == membench_arena_size && l3_kb && (size_t)l3_kb * 1024 >= membench_arena_size / 2) {
+         membench_out("  (working sets stop at %u KB: the RAM figure may still be partly L3)\n",
+                      (uint32_t)(membench_arena_size >> 10));
+     }
+     
+     // MMIO: each read crosses to the device and back, nothing is cached
+     membench_out("\nUncached MMIO read (AHCI BAR, VS register)\n");
+     if (ahci_base == (uint64_t)-1 || ahci_base >= 0x100000000ull) {
+         membench_out("  No AHCI controller below 4 GB, skipped\n");
+     } else {
+         volatile uint32_t* reg = (volatile uint32_t*)(uintptr_t)(ahci_base + AHCI_VS_OFFSET);
+         uint64_t best = ~0ull;
+         uint32_t value = 0;
+         for (int run = 0; run < MEMBENCH_RUNS; run++) {
+             uint64_t start = now_ns();
+             for (int i = 0; i < MEMBENCH_MMIO_READS; i++) value += *reg;
+             uint64_t elapsed = now_ns() - start;
+             if (elapsed < best) best = elapsed;
+         }
+         membench_sink = value;
+         membench_out("  %-17s", "per read");
+         membench_out_latency((uint32_t)(best * 10 / MEMBENCH_MMIO_READS));
+         membench_out("\n");
+     }
+     
+     membench_arena_put();
+     membench_report = nullptr;
+     return membench_report_len;
  }
\ No newline at end of file
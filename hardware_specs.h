@@ -1,8 +1,22 @@
 
+#include <stdint.h>
+#include <stddef.h>
+
+// Usable SIMD features reported by cpu_simd_enable()
+#define CPU_FEATURE_SSE2 (1u << 0)
+#define CPU_FEATURE_AVX  (1u << 1)
+#define CPU_FEATURE_AVX2 (1u << 2)
+#define CPU_FEATURE_ERMS (1u << 3) // Enhanced rep movsb/stosb
+
+uint64_t rdmsr(uint32_t msr);
+void wrmsr(uint32_t msr, uint64_t value);
+void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx);
+uint32_t cpu_simd_enable();
 void cmd_cpu();
 void cmd_memory();
 void cmd_cache();
 void cmd_topology();
 void cmd_features();
 void cmd_pstates();
-void cmd_full();
\ No newline at end of file
+void cmd_full();
+size_t cmd_membench(uint64_t ahci_base, char* report, size_t report_size);  // Returns the report length
\ No newline at end of file
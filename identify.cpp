@@ -8,6 +8,7 @@
 #include "pci.h"
 #include "stdlib_hooks.h"
 #include "sata.h"
+#include "timer.h"
 
  // Make sure we have access to all the AHCI register definitions
  // These should match the definitions in your main code
@@ -127,13 +128,8 @@ inline uint32_t read_mem32(uint64_t addr) {
 
 // Custom memory allocation for aligned memory
 void* aligned_alloc_custom(size_t alignment, size_t size) {
-    // Simple implementation - should be replaced with a proper allocator
-    void* ptr = malloc(size + alignment);
-    if (!ptr) return nullptr;
-
-    uintptr_t addr = (uintptr_t)ptr;
-    uintptr_t aligned = (addr + alignment - 1) & ~(alignment - 1);
-    return (void*)aligned;
+    // The heap hands out aligned blocks directly; release them with free()
+    return aligned_malloc(alignment, size);
 }
 
 // Function to check if a port is idle and ready to accept commands
@@ -164,16 +160,14 @@ bool start_cmd_engine(uint64_t port_addr) {
         *((volatile uint32_t*)(port_addr + PORT_CMD)) = cmd;
     }
 
-    // Wait for command engine to start
-    for (int i = 0; i < 1000; i++) {
-        if (read_mem32(port_addr + PORT_CMD) & 1) {
-            return true;
-        }
-        // Small delay
-        for (volatile int j = 0; j < 1000000; j++);
+    // Wait for command engine to start (AHCI allows 500 ms)
+    uint64_t deadline = deadline_ms(500);
+    while (!(read_mem32(port_addr + PORT_CMD) & 1)) {
+        if (deadline_passed(deadline)) return false;
+        asm volatile ("pause");
     }
 
-    return false;
+    return true;
 }
 
 // Function to stop command engine
@@ -186,14 +180,12 @@ bool stop_cmd_engine(uint64_t port_addr) {
         *((volatile uint32_t*)(port_addr + PORT_CMD)) = cmd;
     }
 
-    // Wait for command engine to stop
-    for (int i = 0; i < 1000; i++) {
-        if (!(read_mem32(port_addr + PORT_CMD) & (1 << 15))) {
-            return true;
-        }
-        // Small delay
-        for (volatile int j = 0; j < 1000000; j++);
+    // Wait for command engine to stop (PxCMD.CR clears within 500 ms)
+    uint64_t deadline = deadline_ms(500);
+    while (read_mem32(port_addr + PORT_CMD) & (1 << 15)) {
+        if (deadline_passed(deadline)) return false;
+        asm volatile ("pause");
     }
 
-    return false;
+    return true;
 }
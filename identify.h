@@ -16,6 +16,13 @@
 
 #include "iostream_wrapper.h" // Assumed to provide a 'cout' like object
 
+#include "interrupts.h" // timer_ticks, irq_install_handler
+#include "timer.h" // now_ns, deadlines
+#include "perf.h" // PERF_SCOPE
+#include "thread.h" // thread_yield while a command is in flight
+
+#include "dma_memory.h" // dma_pool_alloc, dma_virt_to_phys
+
 
 
  // Port registers offsets - duplicate from main file to avoid dependency issues
@@ -123,6 +130,10 @@ inline void write_mem32(uint64_t addr, uint32_t value) {
 #define ATA_CMD_WRITE_DMA_EXT    0x35    // WRITE DMA EXT (LBA48)
 #define ATA_CMD_FLUSH_CACHE      0xE7    // FLUSH CACHE
 #define ATA_CMD_FLUSH_CACHE_EXT  0xEA    // FLUSH CACHE EXT
+#define ATA_CMD_READ_FPDMA_QUEUED  0x60  // READ FPDMA QUEUED (NCQ)
+#define ATA_CMD_WRITE_FPDMA_QUEUED 0x61  // WRITE FPDMA QUEUED (NCQ)
+#define ATA_CMD_DATA_SET_MANAGEMENT 0x06 // DATA SET MANAGEMENT (feature 01h = TRIM)
+#define ATA_DSM_TRIM               0x01
 
 
 
@@ -297,57 +308,265 @@ typedef struct {
 // DEBUG: Ensure alignment requirements are met.
 
 #define SECTOR_SIZE 512
-#define MAX_PRDT_ENTRIES 8 // Allow for potentially fragmented buffers later (though not used yet)
-#define MAX_TRANSFER_SECTORS 128 // Limit transfer size for simplicity (128*512 = 64KB)
-
-// Command list (array of Command Headers) must be 1KB aligned. Max 32 slots.
-static uint8_t cmd_list_buffer[32 * sizeof(hba_cmd_header_t)] __attribute__((aligned(1024)));
-
-// Received FIS buffer must be 256-byte aligned.
-static uint8_t fis_buffer[256] __attribute__((aligned(256)));
+#define MAX_PRDT_ENTRIES 64 // Scatter/gather entries per command table (read_sectors_v/write_sectors_v)
+#define MAX_PRDT_BYTES (4u * 1024 * 1024) // One PRDT entry moves at most 4MB (22-bit 0-based dbc)
+#define MAX_LBA28_SECTORS 256    // READ/WRITE DMA: a count of 0 means 256
+#define MAX_LBA48_SECTORS 65536  // READ/WRITE DMA EXT and FPDMA QUEUED: a count of 0 means 65536
+
+// One scatter/gather segment for read_sectors_v/write_sectors_v.
+// base must be word aligned and len even; the segments together must cover
+// whole sectors. Segments larger than 4MB are split across PRDT entries.
+typedef struct {
+    void* base;
+    uint32_t len;
+} ahci_iovec_t;
 
-// Command Table buffer must be 128-byte aligned.
+// Command Table buffers must be 128-byte aligned.
 // Size needs to accommodate CFIS(64) + ACMD(16) + Resvd(48) + N * PRDT(16)
+// One table per command slot so several commands can be in flight at once (NCQ).
 #define CMD_TABLE_STATIC_SIZE (64 + 16 + 48)
 #define CMD_TABLE_TOTAL_SIZE (CMD_TABLE_STATIC_SIZE + MAX_PRDT_ENTRIES * sizeof(hba_prdt_entry_t))
-static uint8_t cmd_table_buffer[CMD_TABLE_TOTAL_SIZE] __attribute__((aligned(128)));
 
-// Data buffer must be 2-byte aligned (word aligned). Used for IDENTIFY and simple string I/O.
-static uint8_t data_buffer[MAX_TRANSFER_SECTORS * SECTOR_SIZE] __attribute__((aligned(2)));
+// NCQ bookkeeping of one port.
+// Updated from ahci_irq_handler() as well, so task code changes it with interrupts off.
+struct ncq_port_state {
+    volatile uint32_t outstanding; // Tags issued to the device and not yet reaped
+    volatile uint32_t completed;   // Tags that finished successfully, not yet collected by a waiter
+    volatile uint32_t failed;      // Tags that finished with an error, not yet collected by a waiter
+};
 
+// Optional per-tag completion callbacks, run from ncq_reap() (interrupt context when
+// the AHCI IRQ is routed). A tag with a callback is collected by it, not by ncq_wait().
+typedef void (*ahci_completion_cb_t)(int tag, int status, void* ctx);
 
-// Global flag indicating LBA48 support - should be set after IDENTIFY
-static bool lba48_available = false;
+// --- Per-port state ---
+// Every port in use has its own command list, received FIS area and command
+// tables, so commands on different ports and controllers can be in flight at
+// the same time. The entry is claimed the first time (ahci_base, port) is used.
+#define AHCI_MAX_PORTS 8  // Ports in use, over all controllers
 
+typedef struct {
+    // Command list (array of Command Headers) must be 1KB aligned. Max 32 slots.
+    uint8_t cmd_list[32 * sizeof(hba_cmd_header_t)] __attribute__((aligned(1024)));
+    // Received FIS buffer must be 256-byte aligned.
+    uint8_t fis[256] __attribute__((aligned(256)));
+    uint8_t cmd_table[32][CMD_TABLE_TOTAL_SIZE] __attribute__((aligned(128)));
+} ahci_port_mem_t;
 
-// Wait for a bit to clear in the specified register
-
-// DEBUG: This is a busy-wait loop. In a real system, use a proper timer or sleep mechanism.
+typedef struct {
+    uint64_t ahci_base;
+    int port;
+    bool identified;         // IDENTIFY succeeded and the fields below are valid
+    bool lba48;              // IDENTIFY word 83 bit 10
+    bool ncq;                // Word 76 bit 8
+    int ncq_depth;           // Word 75 (0-based) + 1
+    uint64_t sectors;        // Words 100-103, or 60-61 without LBA48
+    bool trim;               // Word 169 bit 0
+    bool trim_zeroes;        // Word 69 bits 14 and 5: trimmed sectors read back as zeroes
+    uint16_t dsm_max_blocks; // Word 105: 512-byte blocks of ranges per DSM command
+    uint32_t flushes;        // FLUSH CACHE commands completed
+    char model[41];
+    ncq_port_state ncq_state;
+    ahci_completion_cb_t ncq_callbacks[32];
+    void* ncq_callback_ctx[32];
+    ahci_port_mem_t* mem;
+} ahci_port_t;
+
+static ahci_port_mem_t ahci_port_mem[AHCI_MAX_PORTS];
+static ahci_port_t ahci_ports[AHCI_MAX_PORTS];
+static int ahci_port_count = 0;
+
+// State of (ahci_base, port), or nullptr if send_identify_command() has not set it up
+ahci_port_t* ahci_port_find(uint64_t ahci_base, int port) {
+    for (int i = 0; i < ahci_port_count; i++) {
+        if (ahci_ports[i].port == port && ahci_ports[i].ahci_base == ahci_base) return &ahci_ports[i];
+    }
+    return nullptr;
+}
 
-//        The inner loop count (100000) is arbitrary and CPU-speed dependent.
+// State of (ahci_base, port), taking a free slot the first time the port is
+// initialised. Returns nullptr once AHCI_MAX_PORTS other ports are in use
+static ahci_port_t* ahci_port_create(uint64_t ahci_base, int port) {
+    ahci_port_t* ap = ahci_port_find(ahci_base, port);
+    if (ap) return ap;
+    if (ahci_port_count == AHCI_MAX_PORTS) return nullptr;
+
+    ap = &ahci_ports[ahci_port_count];
+    memset(ap, 0, sizeof(*ap));
+    ap->ahci_base = ahci_base;
+    ap->port = port;
+    ap->ncq_depth = 1;
+    ap->mem = &ahci_port_mem[ahci_port_count];
+    ahci_port_count++;
+    return ap;
+}
 
-//        Timeout value might need adjustment based on hardware.
+static inline uint64_t ahci_port_addr(const ahci_port_t* ap) {
+    return ap->ahci_base + 0x100 + (ap->port * 0x80);
+}
 
-int wait_for_clear(uint64_t reg_addr, uint32_t mask, int timeout_ms) {
+// Striped devices (blockdev.h) use port numbers from BLK_STRIPE_PORT up; reads
+// and writes to them are split over their member disks there
+#define BLK_STRIPE_PORT 32
+int blk_stripe_transfer_v(int port, uint64_t lba, const ahci_iovec_t* iov, int iovcnt, bool write);
+uint32_t blk_stripe_max_sectors(int port);
+int blk_stripe_trim(int port, uint64_t lba, uint64_t count);
+bool blk_stripe_trim_zeroes(int port);
+bool blk_stripe_trim_supported(int port);
+int blk_stripe_flush(int port);
+
+// Largest sector count a single read/write command can carry on this device
+uint32_t ahci_max_transfer_sectors(uint64_t ahci_base, int port) {
+    if (port >= BLK_STRIPE_PORT) return blk_stripe_max_sectors(port);
+    ahci_port_t* ap = ahci_port_find(ahci_base, port);
+    return ap && ap->lba48 ? MAX_LBA48_SECTORS : MAX_LBA28_SECTORS;
+}
 
-    // DEBUG: Consider adding a check for timeout_ms <= 0
 
-    for (int i = 0; i < timeout_ms * 10; i++) { // Arbitrary multiplier for delay loop
+// Validate a scatter/gather list. Stores the number of sectors it covers in
+// *sectors and returns the number of PRDT entries needed, or a negative error.
+int ahci_iov_check(const ahci_iovec_t* iov, int iovcnt, uint32_t* sectors) {
+    if (!iov || iovcnt <= 0) return -11;
 
-        if ((read_mem32(reg_addr) & mask) == 0) {
+    uint32_t total_bytes = 0;
+    int entries = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (!iov[i].base) return -11;
+        if (((uint64_t)iov[i].base & 1) || (iov[i].len & 1)) return -11; // PRDT needs word alignment
+        if (iov[i].len > MAX_LBA48_SECTORS * SECTOR_SIZE - total_bytes) return -10;
+        total_bytes += iov[i].len;
+        entries += (iov[i].len + MAX_PRDT_BYTES - 1) / MAX_PRDT_BYTES;
+    }
+    if (total_bytes % SECTOR_SIZE != 0) return -11;
+    if (entries > MAX_PRDT_ENTRIES) return -10;
 
-            return 0;  // Success
+    *sectors = total_bytes / SECTOR_SIZE;
+    return entries;
+}
 
+// Fill the PRDT of a command table from a list already accepted by ahci_iov_check().
+// Returns the number of entries written.
+int ahci_fill_prdt(hba_cmd_tbl_t* cmd_table, const ahci_iovec_t* iov, int iovcnt) {
+    int n = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        uint64_t addr = (uint64_t)iov[i].base;
+        uint32_t left = iov[i].len;
+        while (left > 0) {
+            uint32_t chunk = (left > MAX_PRDT_BYTES) ? MAX_PRDT_BYTES : left;
+            cmd_table->prdt[n].dba = addr;
+            cmd_table->prdt[n].reserved0 = 0;
+            cmd_table->prdt[n].dbc = chunk - 1; // 0-based count
+            cmd_table->prdt[n].reserved1 = 0;
+            cmd_table->prdt[n].i = 0;
+            addr += chunk;
+            left -= chunk;
+            n++;
         }
+    }
+    if (n > 0) cmd_table->prdt[n - 1].i = 1; // Interrupt once the last segment is done
+    return n;
+}
 
-        // Simple delay - replace with platform-specific delay/yield if possible
 
-        for (volatile int j = 0; j < 100000; j++);
+// --- Interrupt-driven completion state ---
+// Once ahci_enable_interrupts() has routed the controller's PCI interrupt through
+// the PIC, waits sleep with hlt and are woken by ahci_irq_handler() instead of
+// spinning on MMIO reads. Timeouts are deadlines on now_ns().
 
+#define AHCI_GHC            0x04       // Global Host Control
+#define AHCI_IS             0x08       // Interrupt Status (one bit per port)
+#define AHCI_GHC_IE         (1u << 1)  // Global interrupt enable
+
+#define HBA_PORT_IE_DHRE    (1u << 0)  // Device to Host Register FIS received
+#define HBA_PORT_IE_PSE     (1u << 1)  // PIO Setup FIS received
+#define HBA_PORT_IE_DSE     (1u << 2)  // DMA Setup FIS received
+#define HBA_PORT_IE_SDBE    (1u << 3)  // Set Device Bits FIS received (NCQ completion)
+#define HBA_PORT_IE_TFEE    (1u << 30) // Task File Error
+#define HBA_PORT_IE_DEFAULT (HBA_PORT_IE_DHRE | HBA_PORT_IE_PSE | HBA_PORT_IE_DSE | \
+                             HBA_PORT_IE_SDBE | HBA_PORT_IE_TFEE)
+
+#define AHCI_PI             0x0C       // Ports Implemented
+
+// Controllers found by disk_init()
+#define AHCI_MAX_CONTROLLERS 4
+
+typedef struct {
+    uint64_t base;             // ABAR
+    uint8_t irq;               // PCI interrupt line (0xFF = unknown)
+    bool irq_routed;           // ahci_enable_interrupts() succeeded
+} ahci_controller_t;
+
+static ahci_controller_t ahci_controllers[AHCI_MAX_CONTROLLERS];
+static int ahci_controller_count = 0;
+
+// Add a controller; returns its index, or -5 if the table is full
+int ahci_add_controller(uint64_t base, uint8_t irq) {
+    if (ahci_controller_count == AHCI_MAX_CONTROLLERS) return -5;
+    ahci_controllers[ahci_controller_count].base = base;
+    ahci_controllers[ahci_controller_count].irq = irq;
+    ahci_controllers[ahci_controller_count].irq_routed = false;
+    return ahci_controller_count++;
+}
+
+static volatile bool ahci_irq_enabled = false;  // Every controller has its interrupt routed
+static volatile uint32_t ahci_irq_count = 0;
+
+// Condition polled by ahci_wait_until(); must be cheap and safe with interrupts off
+typedef bool (*ahci_wait_cond_t)(uint64_t arg0, uint32_t arg1);
+
+// Wait until cond() holds or timeout_ms elapses. Returns 0 on success, -1 on timeout.
+// With the AHCI interrupt routed the CPU sleeps in hlt between checks; the check is
+// done with interrupts off and "sti; hlt" re-enables them atomically, so a completion
+// that fires between the check and the hlt still wakes us.
+int ahci_wait_until(ahci_wait_cond_t cond, uint64_t arg0, uint32_t arg1, int timeout_ms) {
+    if (timeout_ms <= 0) timeout_ms = 1;
+    uint64_t deadline = deadline_ms(timeout_ms);
+
+    if (ahci_irq_enabled && interrupts_enabled()) {
+        while (true) {
+            asm volatile ("cli");
+            if (cond(arg0, arg1)) {
+                asm volatile ("sti");
+                return 0;
+            }
+            if (deadline_passed(deadline)) {
+                asm volatile ("sti");
+                return -1;
+            }
+            // Other threads run while the command is in flight; with none, sleep until the interrupt
+            if (thread_others_ready()) {
+                asm volatile ("sti");
+                thread_yield();
+                continue;
+            }
+            asm volatile ("sti\n hlt");
+        }
     }
 
-    return -1;  // Timeout
+    // Polling fallback (no interrupt line, or called with interrupts disabled)
+    while (!cond(arg0, arg1)) {
+        if (deadline_passed(deadline)) return -1;
+        if (!interrupts_enabled() || !thread_yield()) asm volatile ("pause");
+    }
+    return 0;
+}
 
+static bool reg_bits_clear(uint64_t reg_addr, uint32_t mask) {
+    return (read_mem32(reg_addr) & mask) == 0;
+}
+
+static bool reg_bits_set(uint64_t reg_addr, uint32_t mask) {
+    return (read_mem32(reg_addr) & mask) == mask;
+}
+
+// Wait for a bit to clear in the specified register
+int wait_for_clear(uint64_t reg_addr, uint32_t mask, int timeout_ms) {
+    return ahci_wait_until(reg_bits_clear, reg_addr, mask, timeout_ms);
+}
+
+// Wait for all bits of 'mask' to be set in the specified register
+int wait_for_set(uint64_t reg_addr, uint32_t mask, int timeout_ms) {
+    return ahci_wait_until(reg_bits_set, reg_addr, mask, timeout_ms);
 }
 
 
@@ -373,7 +592,7 @@ int issue_ahci_command(uint64_t port_addr, int slot) {
     // Wait for the port to be idle (not busy - TFD.BSY=0, TFD.DRQ=0)
     // BSY (bit 7), DRQ (bit 3)
     if (wait_for_clear(port_addr + PORT_TFD, (1 << 7) | (1 << 3), 1000) < 0) { // Timeout 1 second
-        cout << "ERROR: Port is busy before command issue (TFD=0x" << read_mem32(port_addr + PORT_TFD) << "). Cannot send command.\n";
+        printf("ERROR: Port is busy before command issue (TFD=0x%08x). Cannot send command.\n", read_mem32(port_addr + PORT_TFD));
         // DEBUG: Might need a port reset here.
         return -6;
     }
@@ -387,6 +606,7 @@ int issue_ahci_command(uint64_t port_addr, int slot) {
 // Generic function to wait for command completion and check status
 // Returns 0 on success, negative on error
 int wait_for_ahci_completion(uint64_t port_addr, int slot, hba_cmd_header_t* cmd_header, uint32_t expected_bytes) {
+    PERF_SCOPE(PERF_AHCI_WAIT);
     // Wait for command completion by polling PORT_CI bit for the slot to clear
     // Timeout needs to be generous (e.g., 5 seconds for read/write/identify)
     if (wait_for_clear(port_addr + PORT_CI, (1 << slot), 5000) < 0) { // Timeout 5 seconds
@@ -400,22 +620,22 @@ int wait_for_ahci_completion(uint64_t port_addr, int slot, hba_cmd_header_t* cmd
     // ERR (bit 0) or DF (bit 5) indicate an error.
     uint32_t tfd = read_mem32(port_addr + PORT_TFD);
     if (tfd & ((1 << 0) | (1 << 5))) { // Check ERR or DF bits
-        cout << "ERROR: Command failed. TFD status: ";
-        // Print status bits (based on ATA spec)
-        if (tfd & 0x80) cout << "BSY "; // Busy
-        if (tfd & 0x40) cout << "DRDY "; // Device Ready
-        if (tfd & 0x20) cout << "DF ";  // Device Fault
-        if (tfd & 0x10) cout << "DSC "; // Device Seek Complete (Obsolete)
-        if (tfd & 0x08) cout << "DRQ "; // Data Request
-        if (tfd & 0x04) cout << "CORR "; // Corrected Data (Obsolete)
-        if (tfd & 0x02) cout << "IDX "; // Index (Obsolete)
-        if (tfd & 0x01) cout << "ERR "; // Error
-        cout << "(Raw TFD: 0x" << tfd << ")\n";
+        // Print status bits (based on ATA spec) as one line
+        printf("ERROR: Command failed. TFD status: %s%s%s%s%s%s%s%s(Raw TFD: 0x%08x)\n",
+               (tfd & 0x80) ? "BSY " : "",   // Busy
+               (tfd & 0x40) ? "DRDY " : "",  // Device Ready
+               (tfd & 0x20) ? "DF " : "",    // Device Fault
+               (tfd & 0x10) ? "DSC " : "",   // Device Seek Complete (Obsolete)
+               (tfd & 0x08) ? "DRQ " : "",   // Data Request
+               (tfd & 0x04) ? "CORR " : "",  // Corrected Data (Obsolete)
+               (tfd & 0x02) ? "IDX " : "",   // Index (Obsolete)
+               (tfd & 0x01) ? "ERR " : "",   // Error
+               tfd);
 
         // Check SError register for more details if ERR bit is set
         if (tfd & 0x01) {
             uint32_t serr_val = read_mem32(port_addr + PORT_SERR);
-            cout << " SError: 0x" << serr_val << "\n";
+            printf(" SError: 0x%08x\n", serr_val);
             // Decode SERR bits here based on AHCI spec 3.3.11 if needed
             // Write 1s to clear SERR bits
             write_mem32(port_addr + PORT_SERR, serr_val);
@@ -447,7 +667,7 @@ int prepare_port_for_command(uint64_t port_addr, int port) {
     if (!(port_cmd & HBA_PORT_CMD_FRE)) {
         cout << "WARNING: Port " << port << " FIS Receive (FRE) is not enabled. Attempting to enable.\n";
         write_mem32(port_addr + PORT_CMD, port_cmd | HBA_PORT_CMD_FRE);
-        for (volatile int j = 0; j < 10000; j++); // Short delay
+        wait_for_set(port_addr + PORT_CMD, HBA_PORT_CMD_FRE, 500);
         port_cmd = read_mem32(port_addr + PORT_CMD); // Re-read
         if (!(port_cmd & HBA_PORT_CMD_FRE)) {
             cout << "ERROR: Failed to enable FIS Receive (FRE) on port " << port << "\n";
@@ -459,7 +679,7 @@ int prepare_port_for_command(uint64_t port_addr, int port) {
     if (!(port_cmd & HBA_PORT_CMD_ST)) {
         cout << "WARNING: Port " << port << " Start (ST) is not set. Attempting to start.\n";
         write_mem32(port_addr + PORT_CMD, port_cmd | HBA_PORT_CMD_ST);
-        for (volatile int j = 0; j < 10000; j++); // Short delay
+        wait_for_set(port_addr + PORT_CMD, HBA_PORT_CMD_ST, 500);
         port_cmd = read_mem32(port_addr + PORT_CMD); // Re-read
         if (!(port_cmd & HBA_PORT_CMD_ST)) {
             cout << "ERROR: Failed to start port " << port << " (ST bit)\n";
@@ -494,6 +714,386 @@ int prepare_port_for_command(uint64_t port_addr, int port) {
     return 0; // Port is ready
 }
 
+// --- Native Command Queuing (NCQ) ---
+// READ/WRITE FPDMA QUEUED commands let the device hold up to 32 requests at once
+// and complete them in any order. The command slot number doubles as the NCQ tag,
+// and every slot has its own command table, so tags never share a PRDT.
+// A tag is marked in PORT_SACT before it is issued through PORT_CI. The device
+// clears the SACT bit again (Set Device Bits FIS) once the command has finished.
+
+#define AHCI_CAP            0x00       // Host Capabilities
+#define AHCI_CAP_SNCQ       (1u << 30) // Supports Native Command Queuing
+#define AHCI_CAP_NCS_SHIFT  8          // Number of Command Slots (0-based), bits 12:8
+#define AHCI_CAP_NCS_MASK   0x1F
+#define HBA_PORT_IS_TFES    (1u << 30) // Task File Error Status
+
+// Record finished tags and hand them either to their callback or to a waiter
+static void ncq_finish_tags(ahci_port_t* ap, uint32_t done, uint32_t failed) {
+    ap->ncq_state.outstanding &= ~done;
+    for (int tag = 0; tag < 32; tag++) {
+        uint32_t bit = 1u << tag;
+        if (!(done & bit)) continue;
+
+        ahci_completion_cb_t cb = ap->ncq_callbacks[tag];
+        if (cb) {
+            ap->ncq_callbacks[tag] = nullptr;
+            cb(tag, (failed & bit) ? -8 : 0, ap->ncq_callback_ctx[tag]);
+        } else if (failed & bit) {
+            ap->ncq_state.failed |= bit;
+        } else {
+            ap->ncq_state.completed |= bit;
+        }
+    }
+}
+
+// Number of command slots implemented by the HBA (CAP.NCS + 1)
+int ahci_command_slots(uint64_t ahci_base) {
+    uint32_t cap = read_mem32(ahci_base + AHCI_CAP);
+    return (int)((cap >> AHCI_CAP_NCS_SHIFT) & AHCI_CAP_NCS_MASK) + 1;
+}
+
+// Number of NCQ commands that may be in flight at once on 'port', or 1 if NCQ cannot
+// be used. Limited by both the HBA (CAP.SNCQ, CAP.NCS) and the device (IDENTIFY word 75).
+int ncq_queue_depth(uint64_t ahci_base, int port) {
+    if (port >= BLK_STRIPE_PORT) return 1;
+    ahci_port_t* ap = ahci_port_find(ahci_base, port);
+    uint32_t cap = read_mem32(ahci_base + AHCI_CAP);
+    if (!ap || !ap->ncq || !ap->lba48 || !(cap & AHCI_CAP_SNCQ)) {
+        return 1;
+    }
+    int depth = ahci_command_slots(ahci_base);
+    if (depth > ap->ncq_depth) depth = ap->ncq_depth;
+    return depth;
+}
+
+// Stop and restart the command engine after an NCQ error.
+// Clearing PORT_CMD.ST makes the HBA drop everything in PORT_SACT and PORT_CI.
+// DEBUG: A full recovery would also read NCQ Command Error log page 10h.
+void ncq_recover_port(uint64_t port_addr) {
+    write_mem32(port_addr + PORT_CMD, read_mem32(port_addr + PORT_CMD) & ~HBA_PORT_CMD_ST);
+    if (wait_for_clear(port_addr + PORT_CMD, HBA_PORT_CMD_CR, 500) < 0) {
+        cout << "WARNING: Command engine did not stop during NCQ recovery.\n";
+    }
+    write_mem32(port_addr + PORT_SERR, read_mem32(port_addr + PORT_SERR));
+    write_mem32(port_addr + PORT_IS, 0xFFFFFFFF);
+    write_mem32(port_addr + PORT_CMD, read_mem32(port_addr + PORT_CMD) | HBA_PORT_CMD_ST);
+}
+
+// Point the HBA at this port's command list and received FIS area
+static void ahci_port_set_bases(const ahci_port_t* ap) {
+    uint64_t port_addr = ahci_port_addr(ap);
+    uint64_t cmd_list_phys = (uint64_t)ap->mem->cmd_list;
+    uint64_t fis_buffer_phys = (uint64_t)ap->mem->fis;
+    write_mem32(port_addr + PORT_CLB, (uint32_t)cmd_list_phys);
+    write_mem32(port_addr + PORT_CLBU, (uint32_t)(cmd_list_phys >> 32));
+    write_mem32(port_addr + PORT_FB, (uint32_t)fis_buffer_phys);
+    write_mem32(port_addr + PORT_FBU, (uint32_t)(fis_buffer_phys >> 32));
+}
+
+// Submit a READ/WRITE FPDMA QUEUED command and return without waiting for it.
+// The transfer is scattered over (or gathered from) the segments in 'iov'; the
+// list itself is copied into the PRDT and need not outlive the call.
+// If 'cb' is given it is called once the command finishes; otherwise collect the
+// result with ncq_wait(). Returns the tag (0-31) on success, -5 if every usable
+// tag is busy, other negatives on error.
+int ncq_submit_v(uint64_t ahci_base, int port, uint64_t lba, const ahci_iovec_t* iov, int iovcnt, bool write,
+                 ahci_completion_cb_t cb = nullptr, void* ctx = nullptr) {
+    PERF_SCOPE(PERF_NCQ_SUBMIT);
+    if (port >= BLK_STRIPE_PORT) return -13;
+    ahci_port_t* ap = ahci_port_find(ahci_base, port);
+    if (!ap) return -1;
+    uint64_t port_addr = ahci_port_addr(ap);
+
+    uint32_t count = 0;
+    int prdt_entries = ahci_iov_check(iov, iovcnt, &count);
+    if (prdt_entries < 0) return prdt_entries;
+    if (count == 0) return -10;
+
+    // Port setup only happens while the queue is idle; it clears PORT_IS
+    if (ap->ncq_state.outstanding == 0) {
+        int prep_status = prepare_port_for_command(port_addr, port);
+        if (prep_status < 0) {
+            return prep_status;
+        }
+        ahci_port_set_bases(ap);
+    }
+
+    // A tag stays reserved until its waiter has collected the result
+    int depth = ncq_queue_depth(ahci_base, port);
+    uint32_t flags = irq_save();
+    uint32_t busy = read_mem32(port_addr + PORT_CI) | read_mem32(port_addr + PORT_SACT) |
+                    ap->ncq_state.outstanding | ap->ncq_state.completed | ap->ncq_state.failed;
+    int tag = -1;
+    for (int i = 0; i < depth; i++) {
+        if (!((busy >> i) & 1)) {
+            tag = i;
+            break;
+        }
+    }
+    if (tag < 0) {
+        irq_restore(flags);
+        return -5;
+    }
+
+    hba_cmd_header_t* cmd_header = (hba_cmd_header_t*)(ap->mem->cmd_list + (tag * sizeof(hba_cmd_header_t)));
+    hba_cmd_tbl_t* cmd_table = (hba_cmd_tbl_t*)ap->mem->cmd_table[tag];
+    fis_reg_h2d_t* cmdfis = (fis_reg_h2d_t*)cmd_table->cfis;
+
+    uint8_t* hdr_ptr = (uint8_t*)cmd_header;
+    for (int i = 0; i < sizeof(hba_cmd_header_t); i++) hdr_ptr[i] = 0;
+    uint8_t* tbl_ptr = (uint8_t*)cmd_table;
+    for (int i = 0; i < CMD_TABLE_STATIC_SIZE; i++) tbl_ptr[i] = 0;
+
+    // Configure command header
+    cmd_header->cfl = sizeof(fis_reg_h2d_t) / sizeof(uint32_t); // 5 DWORDs
+    cmd_header->w = write ? 1 : 0;
+    cmd_header->prdtl = (uint16_t)ahci_fill_prdt(cmd_table, iov, iovcnt);
+    cmd_header->ctba = (uint64_t)ap->mem->cmd_table[tag];
+
+    // Configure command FIS - FPDMA QUEUED moves the sector count into the
+    // feature registers (0 means 65536) and carries the tag in bits 7:3 of the
+    // count register
+    cmdfis->fis_type = FIS_TYPE_REG_H2D;
+    cmdfis->c = 1;
+    cmdfis->command = write ? ATA_CMD_WRITE_FPDMA_QUEUED : ATA_CMD_READ_FPDMA_QUEUED;
+    cmdfis->featurel = (uint8_t)(count & 0xFF);
+    cmdfis->featureh = (uint8_t)((count >> 8) & 0xFF);
+    cmdfis->countl = (uint8_t)(tag << 3);
+    cmdfis->counth = 0;
+    cmdfis->device = (1 << 6); // LBA mode
+    cmdfis->lba0 = (uint8_t)(lba & 0xFF);
+    cmdfis->lba1 = (uint8_t)((lba >> 8) & 0xFF);
+    cmdfis->lba2 = (uint8_t)((lba >> 16) & 0xFF);
+    cmdfis->lba3 = (uint8_t)((lba >> 24) & 0xFF);
+    cmdfis->lba4 = (uint8_t)((lba >> 32) & 0xFF);
+    cmdfis->lba5 = (uint8_t)((lba >> 40) & 0xFF);
+    cmdfis->control = 0;
+
+    // SACT must be set before CI for a queued command
+    ap->ncq_callbacks[tag] = cb;
+    ap->ncq_callback_ctx[tag] = ctx;
+    ap->ncq_state.outstanding |= (1u << tag);
+    write_mem32(port_addr + PORT_SACT, (1u << tag));
+    write_mem32(port_addr + PORT_CI, (1u << tag));
+    irq_restore(flags);
+
+    return tag;
+}
+
+// Single-buffer form of ncq_submit_v()
+int ncq_submit(uint64_t ahci_base, int port, uint64_t lba, uint16_t count, void* buffer, bool write,
+               ahci_completion_cb_t cb = nullptr, void* ctx = nullptr) {
+    ahci_iovec_t iov = { buffer, (uint32_t)count * SECTOR_SIZE };
+    return ncq_submit_v(ahci_base, port, lba, &iov, 1, write, cb, ctx);
+}
+
+// Move finished NCQ commands of one port from outstanding to completed/failed.
+// Returns a bitmap of the tags that finished during this call.
+// Called from ahci_irq_handler(); task code must call it with interrupts disabled.
+static uint32_t ncq_reap_port(ahci_port_t* ap) {
+    uint64_t port_addr = ahci_port_addr(ap);
+    if (ap->ncq_state.outstanding == 0) return 0;
+
+    // Acknowledge before sampling SACT so a completion racing with us raises a new interrupt
+    uint32_t is = read_mem32(port_addr + PORT_IS);
+    write_mem32(port_addr + PORT_IS, is);
+
+    if (is & HBA_PORT_IS_TFES) {
+        // An NCQ error aborts every command still queued on the port
+        printf("ERROR: NCQ command failed on port %d. TFD=0x%08x SACT=0x%08x\n", ap->port,
+               read_mem32(port_addr + PORT_TFD), read_mem32(port_addr + PORT_SACT));
+        uint32_t aborted = ap->ncq_state.outstanding;
+        ncq_recover_port(port_addr);
+        ncq_finish_tags(ap, aborted, aborted);
+        return aborted;
+    }
+
+    uint32_t active = read_mem32(port_addr + PORT_SACT) | read_mem32(port_addr + PORT_CI);
+    uint32_t done = ap->ncq_state.outstanding & ~active;
+    if (done) {
+        ncq_finish_tags(ap, done, 0);
+    }
+    return done;
+}
+
+uint32_t ncq_reap(uint64_t ahci_base, int port) {
+    if (port >= BLK_STRIPE_PORT) return 0;
+    ahci_port_t* ap = ahci_port_find(ahci_base, port);
+    return ap ? ncq_reap_port(ap) : 0;
+}
+
+// ahci_wait_until() condition: reap, then check whether every tag in 'mask' is done.
+// 'arg' is the ahci_port_t being waited on.
+static bool ncq_mask_idle(uint64_t arg, uint32_t mask) {
+    ahci_port_t* ap = (ahci_port_t*)(uintptr_t)arg;
+    ncq_reap_port(ap);
+    return (ap->ncq_state.outstanding & mask) == 0;
+}
+
+// Wait until every tag in 'mask' has finished and collect the results.
+// Returns 0 if all of them succeeded, negative if any failed or timed out.
+int ncq_wait_mask(uint64_t ahci_base, int port, uint32_t mask) {
+    PERF_SCOPE(PERF_NCQ_WAIT);
+    if (port >= BLK_STRIPE_PORT) return 0;
+    ahci_port_t* ap = ahci_port_find(ahci_base, port);
+    if (!ap) return -1;
+    uint64_t port_addr = ahci_port_addr(ap);
+
+    // Same budget as wait_for_ahci_completion (5 seconds)
+    int status = 0;
+    if (ahci_wait_until(ncq_mask_idle, (uintptr_t)ap, mask, 5000) < 0) {
+        printf("ERROR: NCQ commands timed out on port %d (SACT=0x%08x).\n", port, read_mem32(port_addr + PORT_SACT));
+        uint32_t flags = irq_save();
+        uint32_t stuck = ap->ncq_state.outstanding;
+        ncq_recover_port(port_addr);
+        ncq_finish_tags(ap, stuck, stuck);
+        irq_restore(flags);
+        status = -7;
+    }
+
+    uint32_t flags = irq_save();
+    if (status == 0 && (ap->ncq_state.failed & mask)) status = -8;
+    ap->ncq_state.completed &= ~mask;
+    ap->ncq_state.failed &= ~mask;
+    irq_restore(flags);
+    return status;
+}
+
+// Wait for a single tag returned by ncq_submit()
+int ncq_wait(uint64_t ahci_base, int port, int tag) {
+    if (tag < 0 || tag > 31) return -13;
+    return ncq_wait_mask(ahci_base, port, (1u << tag));
+}
+
+// Wait until nothing is queued on the port. Results stay available to their waiters.
+// Non-queued commands (IDENTIFY, READ DMA EXT, FLUSH) must not be mixed with NCQ ones.
+int ncq_drain(uint64_t ahci_base, int port) {
+    if (port >= BLK_STRIPE_PORT) return 0;
+    ahci_port_t* ap = ahci_port_find(ahci_base, port);
+    if (!ap || ap->ncq_state.outstanding == 0) return 0;
+    return ahci_wait_until(ncq_mask_idle, (uintptr_t)ap, 0xFFFFFFFF, 5000) < 0 ? -7 : 0;
+}
+
+// ahci_wait_until() condition: reap, then check whether one of the first 'depth'
+// tags is free for ncq_submit_v(). 'arg' is the ahci_port_t being waited on.
+static bool ncq_tag_free(uint64_t arg, uint32_t depth) {
+    ahci_port_t* ap = (ahci_port_t*)(uintptr_t)arg;
+    ncq_reap_port(ap);
+    uint64_t port_addr = ahci_port_addr(ap);
+    uint32_t busy = read_mem32(port_addr + PORT_CI) | read_mem32(port_addr + PORT_SACT) |
+                    ap->ncq_state.outstanding | ap->ncq_state.completed | ap->ncq_state.failed;
+    uint32_t usable = depth >= 32 ? 0xFFFFFFFF : (1u << depth) - 1;
+    return (busy & usable) != usable;
+}
+
+// Wait until ncq_submit_v() can get a tag again after it returned -5 with none of
+// the caller's own commands left to collect. Returns 0, or -7 on timeout
+int ncq_wait_tag(uint64_t ahci_base, int port) {
+    if (port >= BLK_STRIPE_PORT) return 0;
+    ahci_port_t* ap = ahci_port_find(ahci_base, port);
+    if (!ap) return -1;
+    int depth = ncq_queue_depth(ahci_base, port);
+    return ahci_wait_until(ncq_tag_free, (uintptr_t)ap, (uint32_t)depth, 5000) < 0 ? -7 : 0;
+}
+
+// AHCI interrupt service routine (registered with irq_install_handler)
+// Walks every controller with a routed interrupt, acknowledges the ports that
+// raised it and reaps their finished NCQ tags; the non-queued path only needs
+// the wakeup, its waiter re-checks PORT_CI itself.
+void ahci_irq_handler() {
+    for (int c = 0; c < ahci_controller_count; c++) {
+        ahci_controller_t* ctrl = &ahci_controllers[c];
+        if (!ctrl->irq_routed) continue;
+        uint32_t hba_is = read_mem32(ctrl->base + AHCI_IS);
+        if (hba_is == 0) continue; // Shared line, not this controller
+        ahci_irq_count++;
+
+        for (int port = 0; port < 32; port++) {
+            if (!(hba_is & (1u << port))) continue;
+            ahci_port_t* ap = nullptr;
+            for (int i = 0; i < ahci_port_count; i++) {
+                if (ahci_ports[i].port == port && ahci_ports[i].ahci_base == ctrl->base) ap = &ahci_ports[i];
+            }
+            if (ap && ap->ncq_state.outstanding) {
+                ncq_reap_port(ap); // Acknowledges PORT_IS itself
+            } else {
+                uint64_t port_addr = ctrl->base + 0x100 + (port * 0x80);
+                write_mem32(port_addr + PORT_IS, read_mem32(port_addr + PORT_IS));
+            }
+        }
+
+        // HBA-level status is cleared after the port level (AHCI 1.3 section 10.7.2)
+        write_mem32(ctrl->base + AHCI_IS, hba_is);
+    }
+}
+
+// Route the controller's legacy PCI interrupt (INTx, config offset 0x3C) to
+// ahci_irq_handler and enable completion interrupts on every implemented port.
+// MSI would need a local APIC; the kernel only programs the 8259 PIC.
+// Waits sleep on the interrupt once every controller has one routed.
+// Returns 0 on success, negative if the IRQ line is unusable (polling stays in effect).
+int ahci_enable_interrupts(uint64_t ahci_base, uint8_t irq) {
+    ahci_controller_t* ctrl = nullptr;
+    for (int c = 0; c < ahci_controller_count; c++) {
+        if (ahci_controllers[c].base == ahci_base) ctrl = &ahci_controllers[c];
+    }
+    if (!ctrl) return -1;
+    if (irq < 3 || irq > 15) {
+        cout << "AHCI: no usable interrupt line (" << (int)irq << "), using polled completion\n";
+        return -1;
+    }
+
+    // Start from a clean slate so a stale status bit doesn't hold the line asserted
+    uint32_t implemented = read_mem32(ahci_base + AHCI_PI);
+    for (int port = 0; port < 32; port++) {
+        if (!(implemented & (1u << port))) continue;
+        uint64_t port_addr = ahci_base + 0x100 + (port * 0x80);
+        write_mem32(port_addr + PORT_IS, 0xFFFFFFFF);
+        write_mem32(port_addr + PORT_IE, HBA_PORT_IE_DEFAULT);
+    }
+    write_mem32(ahci_base + AHCI_IS, 0xFFFFFFFF);
+
+    // One handler serves every controller, whichever line it arrives on
+    irq_install_handler(irq, ahci_irq_handler);
+    ctrl->irq_routed = true;
+    write_mem32(ahci_base + AHCI_GHC, read_mem32(ahci_base + AHCI_GHC) | AHCI_GHC_IE);
+
+    bool all_routed = true;
+    for (int c = 0; c < ahci_controller_count; c++) {
+        if (!ahci_controllers[c].irq_routed) all_routed = false;
+    }
+    ahci_irq_enabled = all_routed;
+
+    cout << "AHCI: completion interrupts enabled on IRQ " << (int)irq << "\n";
+    return 0;
+}
+
+// Record what read/write commands need from IDENTIFY data: LBA48, NCQ and its
+// queue depth, capacity and the model string
+void ahci_parse_identify(ahci_port_t* ap, const uint16_t* data) {
+    ap->lba48 = data[83] & (1 << 10);
+    ap->ncq = (data[76] != 0xFFFF) && (data[76] & (1 << 8));
+    ap->ncq_depth = ap->ncq ? (data[75] & 0x1F) + 1 : 1;
+    if (ap->lba48) {
+        ap->sectors = (uint64_t)data[100] | ((uint64_t)data[101] << 16) |
+                      ((uint64_t)data[102] << 32) | ((uint64_t)data[103] << 48);
+    } else {
+        ap->sectors = (uint64_t)data[60] | ((uint64_t)data[61] << 16);
+    }
+    ap->trim = ap->lba48 && (data[169] & (1 << 0));
+    ap->trim_zeroes = ap->trim && (data[69] & (1 << 14)) && (data[69] & (1 << 5));
+    ap->dsm_max_blocks = (data[105] == 0 || data[105] == 0xFFFF) ? 1 : data[105];
+
+    // Byte-swapped within each word, padded with spaces
+    for (int i = 0; i < 20; i++) {
+        ap->model[i * 2] = (char)(data[27 + i] >> 8);
+        ap->model[i * 2 + 1] = (char)(data[27 + i] & 0xFF);
+    }
+    ap->model[40] = '\0';
+    for (int i = 39; i >= 0 && ap->model[i] == ' '; i--) ap->model[i] = '\0';
+    ap->identified = true;
+}
+
 // Function to display IDENTIFY data in a readable format
 
 // DEBUG: Assumes iostream_wrapper can handle basic types and C-style strings.
@@ -578,9 +1178,16 @@ void display_identify_data(uint16_t* data) {
 
     // Command Set/Feature Support Words (Word 82, 83, 84, etc.)
 
-    lba48_available = (data[83] & (1 << 10)); // Set global flag
+    bool lba48_available = (data[83] & (1 << 10));
     cout << "Supports LBA48:" << (lba48_available ? "Yes" : "No") << "\n";
 
+    // Serial ATA Capabilities (Word 76 bit 8) and Queue Depth (Word 75, 0-based)
+    bool ncq_available = (data[76] != 0xFFFF) && (data[76] & (1 << 8));
+    int ncq_device_depth = ncq_available ? (data[75] & 0x1F) + 1 : 1;
+    cout << "Supports NCQ:  " << (ncq_available ? "Yes" : "No");
+    if (ncq_available) cout << " (queue depth " << ncq_device_depth << ")";
+    cout << "\n";
+
 
 
     if (lba48_available) {
@@ -599,29 +1206,7 @@ void display_identify_data(uint16_t* data) {
 
 
 
-        // DEBUG: The iostream_wrapper limitation workaround.
-
-        //        This might still overflow 'unsigned int' if max_lba48 >= 2^64.
-
-        //        A proper 64-bit print function is better if available.
-
-        unsigned int lba_high = (unsigned int)(max_lba48 >> 32);
-
-        unsigned int lba_low = (unsigned int)(max_lba48 & 0xFFFFFFFF);
-
-
-
-        cout << "LBA48 Max Sectors: ";
-
-        if (lba_high > 0) {
-
-            // NOTE: This assumes iostream_wrapper can print unsigned int.
-
-            cout << lba_high << " * 2^32 + ";
-
-        }
-
-        //cout << lba_low << " (" << (unsigned long long)max_lba48 << " total)\n"; // Try printing uint64_t if possible
+        cout << "LBA48 Max Sectors: " << max_lba48 << "\n";
 
 
 
@@ -751,6 +1336,15 @@ void display_identify_data(uint16_t* data) {
 
     if (data[78] & (1 << 10)) cout << "  - Device Initiated Power Management (DIPM) supported\n";
 
+    // Word 169 (DATA SET MANAGEMENT), word 69 (trim behaviour), word 105 (range blocks)
+    if (data[169] & (1 << 0)) {
+        cout << "  - TRIM supported";
+        if ((data[69] & (1 << 14)) && (data[69] & (1 << 5))) cout << ", trimmed sectors read as zeroes";
+        else if (data[69] & (1 << 14)) cout << ", deterministic read after trim";
+        if (data[105] != 0 && data[105] != 0xFFFF) cout << " (" << data[105] << " range blocks per command)";
+        cout << "\n";
+    }
+
 }
 
 
@@ -759,12 +1353,24 @@ void display_identify_data(uint16_t* data) {
 
 // Returns 0 on success, negative on error
 
-int send_identify_command(uint64_t ahci_base, int port) {
+// IDENTIFY the device on 'port' and record its capabilities for read/write commands.
+// 'verbose' prints the progress and the decoded data.
+int send_identify_command(uint64_t ahci_base, int port, bool verbose = true) {
 
     // DEBUG: Validate port number against HBA capabilities (e.g., read HBA_CAP register)
 
-    uint64_t port_addr = ahci_base + 0x100 + (port * 0x80);
+    if (port >= BLK_STRIPE_PORT) return -13;
+    ahci_port_t* ap = ahci_port_create(ahci_base, port);
+    if (!ap) {
+        cout << "ERROR: More than " << AHCI_MAX_PORTS << " ports in use.\n";
+        return -5;
+    }
+    uint64_t port_addr = ahci_port_addr(ap);
 
+    // IDENTIFY is not a queued command; let any NCQ traffic finish first
+    if (ncq_drain(ahci_base, port) < 0) {
+        return -7;
+    }
 
     int prep_status = prepare_port_for_command(port_addr, port);
     if (prep_status < 0) {
@@ -786,26 +1392,27 @@ int send_identify_command(uint64_t ahci_base, int port) {
 
     //        This code assumes identity mapping or that buffers are already in physical memory.
 
-    uint64_t cmd_list_phys = (uint64_t)cmd_list_buffer; // DEBUG: Replace with actual physical address if different
-    uint64_t fis_buffer_phys = (uint64_t)fis_buffer;   // DEBUG: Replace with actual physical address if different
-    uint64_t cmd_table_phys = (uint64_t)cmd_table_buffer; // DEBUG: Replace with actual physical address if different
-    uint64_t identify_data_phys = (uint64_t)data_buffer; // DEBUG: Using generic data buffer now
+    uint64_t cmd_table_phys = (uint64_t)ap->mem->cmd_table[slot]; // DEBUG: Replace with actual physical address if different
+
+    // IDENTIFY data lands in a pool buffer, returned once the command is done
+    uint8_t* identify_data = (uint8_t*)dma_pool_alloc(SECTOR_SIZE);
+    if (!identify_data) {
+        cout << "ERROR: No DMA buffer available for IDENTIFY.\n";
+        return -11;
+    }
+    uint64_t identify_data_phys = dma_virt_to_phys(identify_data);
 
 
     // --- Program HBA Registers (BEFORE setting up command details) ---
 
     // Set the command list base and FIS base addresses
     // *** THIS IS CRITICAL - DO NOT SKIP ***
-    write_mem32(port_addr + PORT_CLB, (uint32_t)cmd_list_phys);
-    write_mem32(port_addr + PORT_CLBU, (uint32_t)(cmd_list_phys >> 32));
-
-    write_mem32(port_addr + PORT_FB, (uint32_t)fis_buffer_phys);
-    write_mem32(port_addr + PORT_FBU, (uint32_t)(fis_buffer_phys >> 32));
+    ahci_port_set_bases(ap);
 
 
     // Get pointers to the (virtual) buffers for the chosen slot
-    hba_cmd_header_t* cmd_header = (hba_cmd_header_t*)(cmd_list_buffer + (slot * sizeof(hba_cmd_header_t)));
-    hba_cmd_tbl_t* cmd_table = (hba_cmd_tbl_t*)cmd_table_buffer; // Using the single static cmd table buffer
+    hba_cmd_header_t* cmd_header = (hba_cmd_header_t*)(ap->mem->cmd_list + (slot * sizeof(hba_cmd_header_t)));
+    hba_cmd_tbl_t* cmd_table = (hba_cmd_tbl_t*)ap->mem->cmd_table[slot]; // Command table owned by this slot
     fis_reg_h2d_t* cmdfis = (fis_reg_h2d_t*)cmd_table->cfis;
 
     // Clear buffers (important!)
@@ -820,8 +1427,7 @@ int send_identify_command(uint64_t ahci_base, int port) {
     for (int i = 0; i < CMD_TABLE_STATIC_SIZE + 1 * sizeof(hba_prdt_entry_t); i++) tbl_ptr[i] = 0;
 
     // Clear the data buffer before the read
-    uint8_t* data_ptr = (uint8_t*)data_buffer;
-    for (int i = 0; i < SECTOR_SIZE; i++) data_ptr[i] = 0;
+    for (int i = 0; i < SECTOR_SIZE; i++) identify_data[i] = 0;
 
 
     // Configure the command header (for the chosen slot)
@@ -859,23 +1465,29 @@ int send_identify_command(uint64_t ahci_base, int port) {
 
 
     // --- Issue Command and Wait ---
-    cout << "Issuing IDENTIFY command on slot " << slot << "...\n";
+    if (verbose) cout << "Issuing IDENTIFY command on slot " << slot << "...\n";
     int issue_status = issue_ahci_command(port_addr, slot);
     if (issue_status < 0) {
+        dma_pool_free(identify_data);
         return issue_status; // Propagate error
     }
 
 
-    cout << "Command issued, waiting for completion...\n";
+    if (verbose) cout << "Command issued, waiting for completion...\n";
     int complete_status = wait_for_ahci_completion(port_addr, slot, cmd_header, SECTOR_SIZE);
     if (complete_status < 0) {
+        dma_pool_free(identify_data);
         return complete_status; // Propagate error
     }
 
 
     // --- Process Results ---
-    cout << "\nIDENTIFY command completed successfully.\n";
-    display_identify_data((uint16_t*)data_buffer); // Cast the byte buffer to word pointer
+    ahci_parse_identify(ap, (uint16_t*)identify_data);
+    if (verbose) {
+        cout << "\nIDENTIFY command completed successfully.\n";
+        display_identify_data((uint16_t*)identify_data); // Cast the byte buffer to word pointer
+    }
+    dma_pool_free(identify_data);
 
 
     return 0; // Success
@@ -883,41 +1495,62 @@ int send_identify_command(uint64_t ahci_base, int port) {
 }
 
 
-// Function to read sectors from disk
-// ahci_base: Base address of AHCI controller MMIO space
-// port: Port number (0-31)
-// lba: Starting Logical Block Address (64-bit)
-// count: Number of sectors to read (max depends on MAX_TRANSFER_SECTORS)
-// buffer: Pointer to a DMA-accessible buffer to store the data (must be large enough: count * SECTOR_SIZE)
-// Returns 0 on success, negative on error
-int read_sectors(uint64_t ahci_base, int port, uint64_t lba, uint16_t count, void* buffer) {
-    uint64_t port_addr = ahci_base + 0x100 + (port * 0x80);
+// Common body of read_sectors_v/write_sectors_v: one READ/WRITE DMA command (or
+// FPDMA QUEUED when NCQ is usable) whose PRDT covers every segment in 'iov'.
+static int ahci_transfer_v(uint64_t ahci_base, int port, uint64_t lba, const ahci_iovec_t* iov, int iovcnt, bool write) {
+    if (port >= BLK_STRIPE_PORT) return blk_stripe_transfer_v(port, lba, iov, iovcnt, write);
+    ahci_port_t* ap = ahci_port_find(ahci_base, port);
+    if (!ap) return -1;
+    uint64_t port_addr = ahci_port_addr(ap);
+    const char* op = write ? "Write" : "Read";
     uint8_t command = 0;
     bool use_lba48 = false;
 
     // Basic validation
-    if (count == 0) return 0; // Nothing to do
-    if (count > MAX_TRANSFER_SECTORS) {
-        cout << "ERROR: Read count " << count << " exceeds maximum " << MAX_TRANSFER_SECTORS << "\n";
-        return -10;
-    }
-    if (!buffer) {
-        cout << "ERROR: Read buffer is null.\n";
+    uint32_t count = 0;
+    int prdt_entries = ahci_iov_check(iov, iovcnt, &count);
+    if (prdt_entries == -11) {
+        cout << "ERROR: " << op << " buffer list is null, misaligned or not a whole number of sectors.\n";
         return -11;
     }
+    if (prdt_entries < 0 || count > ahci_max_transfer_sectors(ahci_base, port)) {
+        cout << "ERROR: " << op << " exceeds maximum of " << ahci_max_transfer_sectors(ahci_base, port)
+             << " sectors in " << MAX_PRDT_ENTRIES << " segments\n";
+        return -10;
+    }
+    if (count == 0) return 0; // Nothing to do
+
     // Check LBA range and select command
     if (lba + count > (1ULL << 28)) { // Check if LBA48 is required
-        if (!lba48_available) {
+        if (!ap->lba48) {
             //cout << "ERROR: LBA address " << (unsigned long long)lba << " requires LBA48, but it's not supported by the device.\n";
             return -12;
         }
-        command = ATA_CMD_READ_DMA_EXT;
         use_lba48 = true;
     }
     else {
         // Can use LBA28 or LBA48 if available
-        command = lba48_available ? ATA_CMD_READ_DMA_EXT : ATA_CMD_READ_DMA;
-        use_lba48 = lba48_available;
+        use_lba48 = ap->lba48;
+    }
+    if (write) {
+        command = use_lba48 ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_WRITE_DMA;
+    }
+    else {
+        command = use_lba48 ? ATA_CMD_READ_DMA_EXT : ATA_CMD_READ_DMA;
+    }
+
+    // Queue the command with NCQ when both the HBA and the device support it
+    if (ncq_queue_depth(ahci_base, port) > 1) {
+        int tag = ncq_submit_v(ahci_base, port, lba, iov, iovcnt, write);
+        if (tag == -5) {
+            // Every tag is held by asynchronous submitters; wait for the queue to empty
+            if (ncq_drain(ahci_base, port) < 0) return -7;
+            tag = ncq_submit_v(ahci_base, port, lba, iov, iovcnt, write);
+        }
+        if (tag < 0) {
+            return tag;
+        }
+        return ncq_wait(ahci_base, port, tag);
     }
 
     // Prepare port (checks presence, enables FRE/ST, clears errors)
@@ -929,46 +1562,33 @@ int read_sectors(uint64_t ahci_base, int port, uint64_t lba, uint16_t count, voi
     // Find an empty command slot
     int slot = find_free_command_slot(port_addr);
     if (slot < 0) {
-        cout << "ERROR: No free command slot found for read on port " << port << ".\n";
+        cout << "ERROR: No free command slot found for " << (write ? "write" : "read") << " on port " << port << ".\n";
         return -5;
     }
 
     // --- Setup Command Structures ---
-    uint64_t cmd_list_phys = (uint64_t)cmd_list_buffer;
-    uint64_t fis_buffer_phys = (uint64_t)fis_buffer;
-    uint64_t cmd_table_phys = (uint64_t)cmd_table_buffer;
-    uint64_t data_buffer_phys = (uint64_t)buffer; // Use the provided buffer
+    uint64_t cmd_table_phys = (uint64_t)ap->mem->cmd_table[slot];
 
     // Set base addresses (might be redundant if IDENTIFY was just called, but good practice)
-    write_mem32(port_addr + PORT_CLB, (uint32_t)cmd_list_phys);
-    write_mem32(port_addr + PORT_CLBU, (uint32_t)(cmd_list_phys >> 32));
-    write_mem32(port_addr + PORT_FB, (uint32_t)fis_buffer_phys);
-    write_mem32(port_addr + PORT_FBU, (uint32_t)(fis_buffer_phys >> 32));
+    ahci_port_set_bases(ap);
 
 
-    hba_cmd_header_t* cmd_header = (hba_cmd_header_t*)(cmd_list_buffer + (slot * sizeof(hba_cmd_header_t)));
-    hba_cmd_tbl_t* cmd_table = (hba_cmd_tbl_t*)cmd_table_buffer;
+    hba_cmd_header_t* cmd_header = (hba_cmd_header_t*)(ap->mem->cmd_list + (slot * sizeof(hba_cmd_header_t)));
+    hba_cmd_tbl_t* cmd_table = (hba_cmd_tbl_t*)ap->mem->cmd_table[slot];
     fis_reg_h2d_t* cmdfis = (fis_reg_h2d_t*)cmd_table->cfis;
 
-    // Clear command header and command table area
+    // Clear command header and the CFIS area; ahci_fill_prdt writes every PRDT field it uses
     uint8_t* hdr_ptr = (uint8_t*)cmd_header;
     for (int i = 0; i < sizeof(hba_cmd_header_t); i++) hdr_ptr[i] = 0;
     uint8_t* tbl_ptr = (uint8_t*)cmd_table;
-    // Clear enough for CFIS and 1 PRDT entry (assuming single PRDT entry for simplicity)
-    for (int i = 0; i < CMD_TABLE_STATIC_SIZE + 1 * sizeof(hba_prdt_entry_t); i++) tbl_ptr[i] = 0;
+    for (int i = 0; i < CMD_TABLE_STATIC_SIZE; i++) tbl_ptr[i] = 0;
 
     // Configure command header
     cmd_header->cfl = sizeof(fis_reg_h2d_t) / sizeof(uint32_t); // 5 DWORDs
-    cmd_header->w = 0;   // Direction of DATA transfer is READ (Device to Host)
-    cmd_header->prdtl = 1; // Using 1 PRDT entry
+    cmd_header->w = write ? 1 : 0; // Direction of DATA transfer (1: Host to Device)
+    cmd_header->prdtl = (uint16_t)ahci_fill_prdt(cmd_table, iov, iovcnt);
     cmd_header->ctba = cmd_table_phys;
 
-    // Configure PRDT entry
-    uint32_t byte_count = count * SECTOR_SIZE;
-    cmd_table->prdt[0].dba = data_buffer_phys;
-    cmd_table->prdt[0].dbc = byte_count - 1; // 0-based count
-    cmd_table->prdt[0].i = 1; // Interrupt on completion
-
     // Configure command FIS
     cmdfis->fis_type = FIS_TYPE_REG_H2D;
     cmdfis->c = 1; // Command
@@ -990,162 +1610,221 @@ int read_sectors(uint64_t ahci_base, int port, uint64_t lba, uint16_t count, voi
         cmdfis->lba5 = 0;
     }
 
+    // A count of 0 encodes the maximum (256 for LBA28, 65536 for LBA48)
     cmdfis->countl = (uint8_t)(count & 0xFF);
-    cmdfis->counth = (uint8_t)((count >> 8) & 0xFF);
+    cmdfis->counth = use_lba48 ? (uint8_t)((count >> 8) & 0xFF) : 0;
 
     cmdfis->featurel = 0;
     cmdfis->featureh = 0;
     cmdfis->control = 0;
 
     // --- Issue Command and Wait ---
-   // cout << "Issuing Read DMA command on slot " << slot << " (LBA=" << (unsigned long long)lba << ", Count=" << count << ")...\n";
     int issue_status = issue_ahci_command(port_addr, slot);
     if (issue_status < 0) {
         return issue_status;
     }
 
-    int complete_status = wait_for_ahci_completion(port_addr, slot, cmd_header, byte_count);
+    int complete_status = wait_for_ahci_completion(port_addr, slot, cmd_header, count * SECTOR_SIZE);
     if (complete_status < 0) {
         return complete_status;
     }
 
-    //cout << "Read command completed successfully.\n";
+    // Optional: Issue FLUSH CACHE command after writing for data persistence
+    // This is highly recommended if the device has a volatile write cache.
+    // Example: send_flush_cache_command(ahci_base, port);
+
     return 0; // Success
 }
 
+// Function to read sectors from disk into a scatter list
+// ahci_base: Base address of AHCI controller MMIO space
+// port: Port number (0-31)
+// lba: Starting Logical Block Address (64-bit)
+// iov/iovcnt: Segments receiving consecutive sectors (up to MAX_PRDT_ENTRIES PRDT
+//             entries and ahci_max_transfer_sectors(ahci_base, port) sectors in total)
+// Returns 0 on success, negative on error
+int read_sectors_v(uint64_t ahci_base, int port, uint64_t lba, const ahci_iovec_t* iov, int iovcnt) {
+    PERF_SCOPE(PERF_AHCI_READ);
+    return ahci_transfer_v(ahci_base, port, lba, iov, iovcnt, false);
+}
+
+// Function to write sectors to disk from a gather list
+// Same arguments as read_sectors_v; the segments are written back-to-back starting at lba
+// Returns 0 on success, negative on error
+int write_sectors_v(uint64_t ahci_base, int port, uint64_t lba, const ahci_iovec_t* iov, int iovcnt) {
+    PERF_SCOPE(PERF_AHCI_WRITE);
+    return ahci_transfer_v(ahci_base, port, lba, iov, iovcnt, true);
+}
+
+// Function to read sectors from disk
+// ahci_base: Base address of AHCI controller MMIO space
+// port: Port number (0-31)
+// lba: Starting Logical Block Address (64-bit)
+// count: Number of sectors to read (max ahci_max_transfer_sectors(ahci_base, port))
+// buffer: Pointer to a DMA-accessible buffer to store the data (must be large enough: count * SECTOR_SIZE)
+// Returns 0 on success, negative on error
+int read_sectors(uint64_t ahci_base, int port, uint64_t lba, uint16_t count, void* buffer) {
+    if (count == 0) return 0; // Nothing to do
+    ahci_iovec_t iov = { buffer, (uint32_t)count * SECTOR_SIZE };
+    return read_sectors_v(ahci_base, port, lba, &iov, 1);
+}
+
 
 // Function to write sectors to disk
 // ahci_base: Base address of AHCI controller MMIO space
 // port: Port number (0-31)
 // lba: Starting Logical Block Address (64-bit)
-// count: Number of sectors to write (max depends on MAX_TRANSFER_SECTORS)
+// count: Number of sectors to write (max ahci_max_transfer_sectors(ahci_base, port))
 // buffer: Pointer to a DMA-accessible buffer containing the data (must be count * SECTOR_SIZE bytes)
 // Returns 0 on success, negative on error
 int write_sectors(uint64_t ahci_base, int port, uint64_t lba, uint16_t count, void* buffer) {
-    uint64_t port_addr = ahci_base + 0x100 + (port * 0x80);
-    uint8_t command = 0;
-    bool use_lba48 = false;
-
-    // Basic validation
     if (count == 0) return 0; // Nothing to do
-    if (count > MAX_TRANSFER_SECTORS) {
-        cout << "ERROR: Write count " << count << " exceeds maximum " << MAX_TRANSFER_SECTORS << "\n";
-        return -10;
-    }
-    if (!buffer) {
-        cout << "ERROR: Write buffer is null.\n";
-        return -11;
-    }
-    // Check LBA range and select command
-    if (lba + count > (1ULL << 28)) { // Check if LBA48 is required
-        if (!lba48_available) {
-            //cout << "ERROR: LBA address " << (unsigned long long)lba << " requires LBA48, but it's not supported by the device.\n";
-            return -12;
-        }
-        command = ATA_CMD_WRITE_DMA_EXT;
-        use_lba48 = true;
-    }
-    else {
-        // Can use LBA28 or LBA48 if available
-        command = lba48_available ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_WRITE_DMA;
-        use_lba48 = lba48_available;
-    }
-
-    // Prepare port
-    int prep_status = prepare_port_for_command(port_addr, port);
-    if (prep_status < 0) {
-        return prep_status;
-    }
+    ahci_iovec_t iov = { buffer, (uint32_t)count * SECTOR_SIZE };
+    return write_sectors_v(ahci_base, port, lba, &iov, 1);
+}
 
-    // Find an empty command slot
-    int slot = find_free_command_slot(port_addr);
-    if (slot < 0) {
-        cout << "ERROR: No free command slot found for write on port " << port << ".\n";
-        return -5;
-    }
+// DATA SET MANAGEMENT payload: 512-byte blocks of 64 ranges, each a 48-bit LBA
+// with a 16-bit sector count in the top bits
+#define DSM_RANGES_PER_BLOCK  64
+#define DSM_RANGE_MAX_SECTORS 0xFFFF
+#define DSM_MAX_BLOCKS        8   // Per command we send (4KB of ranges, ~16M sectors)
+
+// True when the device accepts TRIM
+bool ahci_trim_supported(uint64_t ahci_base, int port) {
+    if (port >= BLK_STRIPE_PORT) return blk_stripe_trim_supported(port);
+    ahci_port_t* ap = ahci_port_find(ahci_base, port);
+    return ap && ap->trim;
+}
 
-    // --- Setup Command Structures ---
-    uint64_t cmd_list_phys = (uint64_t)cmd_list_buffer;
-    uint64_t fis_buffer_phys = (uint64_t)fis_buffer;
-    uint64_t cmd_table_phys = (uint64_t)cmd_table_buffer;
-    uint64_t data_buffer_phys = (uint64_t)buffer;
+// True when trimmed sectors are guaranteed to read back as zeroes, so a TRIM
+// can stand in for writing zeroes
+bool ahci_trim_zeroes(uint64_t ahci_base, int port) {
+    if (port >= BLK_STRIPE_PORT) return blk_stripe_trim_zeroes(port);
+    ahci_port_t* ap = ahci_port_find(ahci_base, port);
+    return ap && ap->trim_zeroes;
+}
 
-    // Set base addresses
-    write_mem32(port_addr + PORT_CLB, (uint32_t)cmd_list_phys);
-    write_mem32(port_addr + PORT_CLBU, (uint32_t)(cmd_list_phys >> 32));
-    write_mem32(port_addr + PORT_FB, (uint32_t)fis_buffer_phys);
-    write_mem32(port_addr + PORT_FBU, (uint32_t)(fis_buffer_phys >> 32));
+// Run one non-queued command with no LBA (DSM, FLUSH CACHE) and at most one
+// data-out buffer, and wait for it. The port must be idle and prepared
+static int ahci_nonqueued_command(ahci_port_t* ap, uint8_t command, uint8_t feature, uint16_t count,
+                                  const void* data, uint32_t bytes) {
+    uint64_t port_addr = ahci_port_addr(ap);
+    int slot = find_free_command_slot(port_addr);
+    if (slot < 0) return -5;
 
-    hba_cmd_header_t* cmd_header = (hba_cmd_header_t*)(cmd_list_buffer + (slot * sizeof(hba_cmd_header_t)));
-    hba_cmd_tbl_t* cmd_table = (hba_cmd_tbl_t*)cmd_table_buffer;
+    hba_cmd_header_t* cmd_header = (hba_cmd_header_t*)(ap->mem->cmd_list + (slot * sizeof(hba_cmd_header_t)));
+    hba_cmd_tbl_t* cmd_table = (hba_cmd_tbl_t*)ap->mem->cmd_table[slot];
     fis_reg_h2d_t* cmdfis = (fis_reg_h2d_t*)cmd_table->cfis;
+    memset(cmd_header, 0, sizeof(hba_cmd_header_t));
+    memset(cmd_table, 0, CMD_TABLE_STATIC_SIZE + sizeof(hba_prdt_entry_t));
+
+    cmd_header->cfl = sizeof(fis_reg_h2d_t) / sizeof(uint32_t);
+    cmd_header->ctba = (uint64_t)ap->mem->cmd_table[slot];
+    if (data) {
+        cmd_header->w = 1; // Host to device
+        cmd_header->prdtl = 1;
+        cmd_table->prdt[0].dba = dma_virt_to_phys(data);
+        cmd_table->prdt[0].dbc = bytes - 1;
+        cmd_table->prdt[0].i = 1;
+    }
 
-    // Clear command header and command table area
-    uint8_t* hdr_ptr = (uint8_t*)cmd_header;
-    for (int i = 0; i < sizeof(hba_cmd_header_t); i++) hdr_ptr[i] = 0;
-    uint8_t* tbl_ptr = (uint8_t*)cmd_table;
-    for (int i = 0; i < CMD_TABLE_STATIC_SIZE + 1 * sizeof(hba_prdt_entry_t); i++) tbl_ptr[i] = 0;
-
-
-    // Configure command header
-    cmd_header->cfl = sizeof(fis_reg_h2d_t) / sizeof(uint32_t); // 5 DWORDs
-    cmd_header->w = 1;   // Direction of DATA transfer is WRITE (Host to Device)
-    cmd_header->prdtl = 1; // Using 1 PRDT entry
-    cmd_header->ctba = cmd_table_phys;
-
-    // Configure PRDT entry
-    uint32_t byte_count = count * SECTOR_SIZE;
-    cmd_table->prdt[0].dba = data_buffer_phys;
-    cmd_table->prdt[0].dbc = byte_count - 1; // 0-based count
-    cmd_table->prdt[0].i = 1; // Interrupt on completion
-
-    // Configure command FIS
     cmdfis->fis_type = FIS_TYPE_REG_H2D;
-    cmdfis->c = 1; // Command
+    cmdfis->c = 1;
     cmdfis->command = command;
+    cmdfis->featurel = feature;
+    cmdfis->device = (1 << 6);
+    cmdfis->countl = (uint8_t)(count & 0xFF);
+    cmdfis->counth = (uint8_t)(count >> 8);
 
-    cmdfis->lba0 = (uint8_t)(lba & 0xFF);
-    cmdfis->lba1 = (uint8_t)((lba >> 8) & 0xFF);
-    cmdfis->lba2 = (uint8_t)((lba >> 16) & 0xFF);
-    if (use_lba48) {
-        cmdfis->device = (1 << 6); // LBA mode
-        cmdfis->lba3 = (uint8_t)((lba >> 24) & 0xFF);
-        cmdfis->lba4 = (uint8_t)((lba >> 32) & 0xFF);
-        cmdfis->lba5 = (uint8_t)((lba >> 40) & 0xFF);
+    int status = issue_ahci_command(port_addr, slot);
+    if (status < 0) return status;
+    return wait_for_ahci_completion(port_addr, slot, cmd_header, data ? bytes : 0);
+}
+
+typedef struct {
+    uint64_t lba;
+    uint64_t count;
+} ahci_trim_range_t;
+
+// Tell the device that the given sector ranges no longer hold data, packing as
+// many as fit into each DSM command. Cached copies are the caller's to drop.
+// Returns 0 on success, -13 if the device has no TRIM, negative on error
+int ahci_trim_v(uint64_t ahci_base, int port, const ahci_trim_range_t* list, int list_count) {
+    if (port >= BLK_STRIPE_PORT) {
+        for (int i = 0; i < list_count; i++) {
+            int status = blk_stripe_trim(port, list[i].lba, list[i].count);
+            if (status < 0) return status;
+        }
+        return 0;
     }
-    else {
-        cmdfis->device = (1 << 6) | ((uint8_t)((lba >> 24) & 0x0F)); // LBA mode + LBA high nibble
-        cmdfis->lba3 = 0;
-        cmdfis->lba4 = 0;
-        cmdfis->lba5 = 0;
+    ahci_port_t* ap = ahci_port_find(ahci_base, port);
+    if (!ap || !ap->trim) return -13;
+    if (list_count <= 0) return 0;
+
+    // DSM TRIM is a non-queued command here
+    if (ncq_drain(ahci_base, port) < 0) return -7;
+    int prep_status = prepare_port_for_command(ahci_port_addr(ap), port);
+    if (prep_status < 0) return prep_status;
+    ahci_port_set_bases(ap);
+
+    int max_blocks = ap->dsm_max_blocks < DSM_MAX_BLOCKS ? ap->dsm_max_blocks : DSM_MAX_BLOCKS;
+    uint64_t* ranges = (uint64_t*)dma_pool_alloc(max_blocks * SECTOR_SIZE);
+    if (!ranges) {
+        cout << "ERROR: No DMA buffer available for TRIM.\n";
+        return -11;
     }
 
-    cmdfis->countl = (uint8_t)(count & 0xFF);
-    cmdfis->counth = (uint8_t)((count >> 8) & 0xFF);
-
-    cmdfis->featurel = 0;
-    cmdfis->featureh = 0;
-    cmdfis->control = 0;
+    int status = 0;
+    int item = 0;
+    uint64_t lba = list[0].lba, count = list[0].count;
+    while (status == 0) {
+        // Fill as many ranges as the device takes in one command
+        int n = 0;
+        while (n < max_blocks * DSM_RANGES_PER_BLOCK) {
+            if (count == 0) {
+                if (item + 1 >= list_count) break;
+                item++;
+                lba = list[item].lba;
+                count = list[item].count;
+                continue;
+            }
+            uint64_t len = count > DSM_RANGE_MAX_SECTORS ? DSM_RANGE_MAX_SECTORS : count;
+            ranges[n++] = (lba & 0xFFFFFFFFFFFFull) | (len << 48);
+            lba += len;
+            count -= len;
+        }
+        if (n == 0) break;
+        int blocks = (n + DSM_RANGES_PER_BLOCK - 1) / DSM_RANGES_PER_BLOCK;
+        while (n < blocks * DSM_RANGES_PER_BLOCK) ranges[n++] = 0;
 
-    // --- Issue Command and Wait ---
-    //cout << "Issuing Write DMA command on slot " << slot << " (LBA=" << (unsigned long long)lba << ", Count=" << count << ")...\n";
-    int issue_status = issue_ahci_command(port_addr, slot);
-    if (issue_status < 0) {
-        return issue_status;
+        status = ahci_nonqueued_command(ap, ATA_CMD_DATA_SET_MANAGEMENT, ATA_DSM_TRIM, (uint16_t)blocks,
+                                        ranges, blocks * SECTOR_SIZE);
     }
 
-    int complete_status = wait_for_ahci_completion(port_addr, slot, cmd_header, byte_count);
-    if (complete_status < 0) {
-        return complete_status;
-    }
+    dma_pool_free(ranges);
+    return status;
+}
 
-    // Optional: Issue FLUSH CACHE command after writing for data persistence
-    // This is highly recommended if the device has a volatile write cache.
-    // Implementation similar to read/write but with different command code and PRDTL=0.
-    // Example: send_flush_cache_command(ahci_base, port);
+// ahci_trim_v for a single range
+int ahci_trim(uint64_t ahci_base, int port, uint64_t lba, uint64_t count) {
+    if (port >= BLK_STRIPE_PORT) return blk_stripe_trim(port, lba, count);
+    ahci_trim_range_t range = { lba, count };
+    return ahci_trim_v(ahci_base, port, &range, 1);
+}
 
-    //cout << "Write command completed successfully.\n";
-    return 0; // Success
+// Write barrier: wait until everything the device acknowledged is on stable
+// media (FLUSH CACHE EXT, or FLUSH CACHE without LBA48). Returns 0 on success
+int ahci_flush_cache(uint64_t ahci_base, int port) {
+    if (port >= BLK_STRIPE_PORT) return blk_stripe_flush(port);
+    ahci_port_t* ap = ahci_port_find(ahci_base, port);
+    if (!ap) return -1;
+    if (ncq_drain(ahci_base, port) < 0) return -7;
+    int prep_status = prepare_port_for_command(ahci_port_addr(ap), port);
+    if (prep_status < 0) return prep_status;
+    ahci_port_set_bases(ap);
+    int status = ahci_nonqueued_command(ap, ap->lba48 ? ATA_CMD_FLUSH_CACHE_EXT : ATA_CMD_FLUSH_CACHE, 0, 0, nullptr, 0);
+    if (status == 0) ap->flushes++;
+    return status;
 }
 
 
@@ -1197,16 +1876,20 @@ int write_string_to_sector(uint64_t ahci_base, int port, uint64_t lba, const cha
         return -21;
     }
 
-    // Use the shared static data buffer for this simple case
+    uint8_t* sector = (uint8_t*)dma_pool_alloc(SECTOR_SIZE);
+    if (!sector) {
+        cout << "ERROR: No DMA buffer available.\n";
+        return -11;
+    }
+
     // Clear the buffer first to ensure only the string and null terminator are written
-    clear_buffer(data_buffer, SECTOR_SIZE);
-    simple_strcpy((char*)data_buffer, str); // Copy string including null term
+    clear_buffer(sector, SECTOR_SIZE);
+    simple_strcpy((char*)sector, str); // Copy string including null term
 
     cout << "Writing string \"" << str << "\" to LBA " << (unsigned int)lba << "...\n";
-    int result = write_sectors(ahci_base, port, lba, 1, data_buffer); // Write 1 sector
+    int result = write_sectors(ahci_base, port, lba, 1, sector); // Write 1 sector
 
-    // Clear the buffer after use (optional, for security/cleanup)
-    clear_buffer(data_buffer, SECTOR_SIZE);
+    dma_pool_free(sector);
 
     return result;
 }
@@ -1224,17 +1907,23 @@ int read_string_from_sector(uint64_t ahci_base, int port, uint64_t lba, char* ou
     // Ensure buffer is initially empty / null terminated
     out_buffer[0] = '\0';
 
-    // Use the shared static data buffer to read the sector
-    clear_buffer(data_buffer, SECTOR_SIZE);
+    uint8_t* sector = (uint8_t*)dma_pool_alloc(SECTOR_SIZE);
+    if (!sector) {
+        cout << "ERROR: No DMA buffer available.\n";
+        return -11;
+    }
+
+    clear_buffer(sector, SECTOR_SIZE);
     cout << "Reading string from LBA " << (unsigned int)lba << "...\n";
-    int result = read_sectors(ahci_base, port, lba, 1, data_buffer); // Read 1 sector
+    int result = read_sectors(ahci_base, port, lba, 1, sector); // Read 1 sector
     if (result < 0) {
         //cout << "ERROR: Failed to read sector " << (unsigned long long)lba << ".\n";
+        dma_pool_free(sector);
         return result; // Propagate read error
     }
 
     // Find the null terminator within the sector data
-    char* sector_string = (char*)data_buffer;
+    char* sector_string = (char*)sector;
     size_t string_len = 0;
     bool found_null = false;
     for (string_len = 0; string_len < SECTOR_SIZE; ++string_len) {
@@ -1263,8 +1952,7 @@ int read_string_from_sector(uint64_t ahci_base, int port, uint64_t lba, char* ou
     }
     out_buffer[copy_len] = '\0'; // Ensure null termination
 
-    // Clear the temporary buffer (optional)
-    clear_buffer(data_buffer, SECTOR_SIZE);
+    dma_pool_free(sector);
 
     //cout << "String read: \"" << out_buffer << "\"\n";
     return truncated; // Return 0 on success, 1 if truncated
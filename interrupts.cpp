@@ -1,6 +1,8 @@
 #include "interrupts.h"
 #include "terminal_hooks.h"
 #include "iostream_wrapper.h"
+#include "timer.h"
+#include "thread.h"
 
 // IDT and GDT structures
 struct idt_entry idt[256];
@@ -8,6 +10,12 @@ struct idt_ptr idtp;
 struct gdt_entry gdt[3];
 struct gdt_ptr gdtp;
 
+// Timer tick counter, incremented by timer_handler
+volatile uint32_t timer_ticks = 0;
+
+// Handlers registered through irq_install_handler
+static irq_handler_t irq_handlers[16] = { 0 };
+
 // Keyboard scancode tables
 const char scancode_to_ascii[128] = {
     0, 0, '1', '2', '3', '4', '5', '6', '7', '8', '9', '0', '-', '=', '\b',
@@ -27,85 +35,58 @@ const char extended_scancode_table[128] = {
     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
 };
 
-/* Keyboard interrupt handler */
+// Scancodes waiting for the line reader. keyboard_handler is the only writer of
+// kbd_head and the consumer the only writer of kbd_tail, so neither side locks.
+// Both counters run freely; the slot is the counter masked to the ring size.
+static volatile uint8_t kbd_ring[KBD_RING_SIZE];
+static volatile uint32_t kbd_head = 0;
+static volatile uint32_t kbd_tail = 0;
+
+/* Keyboard interrupt handler: queue the scancode, nothing else */
 extern "C" void keyboard_handler() {
-    /* Read scancode from keyboard data port */
     uint8_t scancode = inb(0x60);
 
-    /* Check for extended key code (0xE0) */
-    if (scancode == 0xE0) {
-        extended_key = true;
-        /* Send EOI to PIC */
-        outb(0x20, 0x20);
-        return;
-    }
-
-    /* Handle key release (bit 7 set) */
-    if (scancode & 0x80) {
-        /* Reset extended key flag if it was set */
-        extended_key = false;
-        /* Send EOI to PIC */
-        outb(0x20, 0x20);
-        return;
-    }
-
-    // Handle special keys for extended keyboard sequences
-    if (extended_key) {
-        switch (scancode) {
-            case SCANCODE_UP: // Up arrow
-                // Access the global cin object and use history navigation
-                //cin.navigateHistory(true);
-                break;
-                
-            case SCANCODE_DOWN: // Down arrow
-                // Access the global cin object and use history navigation
-                //cin.navigateHistory(false);
-                break;
-        }
-        
-        // Reset extended key flag
-        extended_key = false;
-        
-        /* Send EOI to PIC */
-        outb(0x20, 0x20);
-        return;
-    }
-
-    /* Normal input handling */
-    char key = scancode_to_ascii[scancode];
-    if (key != 0) {
-        if (key == '\n') {
-            // Enter key - process command
-            terminal_putchar(key);
-            input_buffer[input_length] = '\0';
-
-            // Notify TerminalInput about the command
-            cin.setInputReady(input_buffer);
-
-            // Reset for next command
-            input_length = 0;
-        } else if (key == '\b') {
-            // Backspace - delete last character
-            if (input_length > 0) {
-                terminal_putchar(key);
-                input_length--;
-            }
-        } else if (input_length < MAX_COMMAND_LENGTH - 1) {
-            // Regular character - add to buffer and display
-            input_buffer[input_length++] = key;
-            terminal_putchar(key);
-        }
+    uint32_t head = kbd_head;
+    if (head - kbd_tail < KBD_RING_SIZE) {
+        kbd_ring[head & (KBD_RING_SIZE - 1)] = scancode;
+        asm volatile ("" : : : "memory"); // Store the byte before publishing it
+        kbd_head = head + 1;
     }
+    // A full ring drops the key
 
     /* Send EOI to PIC */
     outb(0x20, 0x20);
 }
 
+bool keyboard_pop_scancode(uint8_t* scancode) {
+    uint32_t tail = kbd_tail;
+    if (tail == kbd_head) return false;
+    *scancode = kbd_ring[tail & (KBD_RING_SIZE - 1)];
+    asm volatile ("" : : : "memory"); // Read the byte before handing the slot back
+    kbd_tail = tail + 1;
+    return true;
+}
+
+bool keyboard_pending() {
+    return kbd_tail != kbd_head;
+}
+
 /* Timer interrupt handler */
 extern "C" void timer_handler() {
+    timer_ticks++;
+
     // Blink cursor
     update_cursor_state();
 
+    // Push buffered console output to the screen
+    terminal_flush_from_timer();
+
+    // Run scheduled callbacks that are due
+    timer_wheel_tick();
+
+    // Charge the tick to the running thread; flag it once its slice is used up
+    thread_tick();
+
     // Send EOI to PIC
     outb(0x20, 0x20);
 }
@@ -175,6 +156,7 @@ asm(
     ".global keyboard_handler_wrapper\n"
     "keyboard_handler_wrapper:\n"
     "    pusha\n"            // Save registers
+    "    cld\n"              // The ABI expects DF clear; the interrupted code may have set it
     "    call keyboard_handler\n" // Call our C++ handler
     "    popa\n"             // Restore registers
     "    iret\n"             // Return from interrupt
@@ -186,11 +168,86 @@ asm(
     ".global timer_handler_wrapper\n"
     "timer_handler_wrapper:\n"
     "    pusha\n"            // Save registers
+    "    cld\n"              // The ABI expects DF clear; the interrupted code may have set it
     "    call timer_handler\n" // Call our C++ handler
     "    popa\n"             // Restore registers
     "    iret\n"             // Return from interrupt
 );
 
+/* Generic IRQ entry points for lines 2-15; each pushes its IRQ number */
+#define IRQ_STUB(n) \
+    extern "C" void irq##n##_handler_wrapper(); \
+    asm( \
+        ".global irq" #n "_handler_wrapper\n" \
+        "irq" #n "_handler_wrapper:\n" \
+        "    pusha\n" \
+        "    cld\n" \
+        "    push $" #n "\n" \
+        "    call irq_dispatch\n" \
+        "    add $4, %esp\n" \
+        "    popa\n" \
+        "    iret\n" \
+    );
+
+IRQ_STUB(2)  IRQ_STUB(3)  IRQ_STUB(4)  IRQ_STUB(5)
+IRQ_STUB(6)  IRQ_STUB(7)  IRQ_STUB(8)  IRQ_STUB(9)
+IRQ_STUB(10) IRQ_STUB(11) IRQ_STUB(12) IRQ_STUB(13)
+IRQ_STUB(14) IRQ_STUB(15)
+
+static void (*const irq_stub_table[16])() = {
+    0, 0, irq2_handler_wrapper, irq3_handler_wrapper,
+    irq4_handler_wrapper, irq5_handler_wrapper, irq6_handler_wrapper, irq7_handler_wrapper,
+    irq8_handler_wrapper, irq9_handler_wrapper, irq10_handler_wrapper, irq11_handler_wrapper,
+    irq12_handler_wrapper, irq13_handler_wrapper, irq14_handler_wrapper, irq15_handler_wrapper
+};
+
+/* Common IRQ dispatcher: run the registered handler, then acknowledge the PIC(s) */
+extern "C" void irq_dispatch(uint32_t irq) {
+    if (irq < 16 && irq_handlers[irq]) {
+        irq_handlers[irq]();
+    }
+
+    /* Slave PIC needs its own EOI for IRQ 8-15 */
+    if (irq >= 8) {
+        outb(0xA0, 0x20);
+    }
+    outb(0x20, 0x20);
+}
+
+/* Unmask an IRQ line at the PIC (and the cascade line for slave IRQs) */
+void irq_unmask(uint8_t irq) {
+    if (irq < 8) {
+        outb(0x21, inb(0x21) & ~(1 << irq));
+    } else {
+        outb(0xA1, inb(0xA1) & ~(1 << (irq - 8)));
+        outb(0x21, inb(0x21) & ~(1 << 2));
+    }
+}
+
+/* Mask an IRQ line at the PIC */
+void irq_mask(uint8_t irq) {
+    if (irq < 8) {
+        outb(0x21, inb(0x21) | (1 << irq));
+    } else {
+        outb(0xA1, inb(0xA1) | (1 << (irq - 8)));
+    }
+}
+
+/* Register a handler for IRQ 2-15 and point its IDT gate at the matching stub */
+void irq_install_handler(uint8_t irq, irq_handler_t handler) {
+    if (irq < 2 || irq > 15) {
+        return;
+    }
+
+    uint32_t flags = irq_save();
+    irq_handlers[irq] = handler;
+
+    uint8_t vector = (irq < 8) ? (0x20 + irq) : (0x28 + (irq - 8));
+    idt_set_gate(vector, reinterpret_cast<uint32_t>(irq_stub_table[irq]), 0x08, 0x8E);
+    irq_unmask(irq);
+    irq_restore(flags);
+}
+
 /* Initialize PIC */
 void init_pic() {
     /* ICW1: Start initialization sequence */
@@ -217,7 +274,7 @@ void init_pic() {
 
 /* Initialize PIT (Programmable Interval Timer) for cursor blinking */
 void init_pit() {
-    uint32_t divisor = 1193180 / 100; // 100 Hz timer frequency
+    uint32_t divisor = PIT_FREQUENCY_HZ / TIMER_TICK_HZ; // 100 Hz timer frequency
 
     // Set command byte: channel 0, access mode lobyte/hibyte, mode 3 (square wave)
     outb(0x43, 0x36);
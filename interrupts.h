@@ -22,12 +22,48 @@ void idt_load();
 void idt_set_gate(uint8_t num, uint32_t base, uint16_t sel, uint8_t flags);
 void gdt_set_gate(int num, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran);
 
+// Scancodes queued by keyboard_handler, oldest first. The ISR only stores the
+// byte; decoding, echo and line editing happen in the reader (cin).
+#define KBD_RING_SIZE 256  // Power of two
+bool keyboard_pop_scancode(uint8_t* scancode);  // False when the ring is empty
+bool keyboard_pending();
+
+// Timer ticks since init_pit (PIT runs at 100 Hz, so one tick is 10 ms)
+extern volatile uint32_t timer_ticks;
+
+// Route a hardware IRQ line (2-15) to a handler and unmask it at the PIC.
+// The handler runs in interrupt context; EOI is sent by the dispatcher.
+typedef void (*irq_handler_t)();
+void irq_install_handler(uint8_t irq, irq_handler_t handler);
+void irq_unmask(uint8_t irq);
+void irq_mask(uint8_t irq);
+
+// Interrupt flag helpers for short critical sections shared with ISRs
+static inline uint32_t irq_save() {
+    uint32_t flags;
+    asm volatile ("pushf\n pop %0\n cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint32_t flags) {
+    if (flags & (1 << 9)) {
+        asm volatile ("sti" : : : "memory");
+    }
+}
+
+static inline bool interrupts_enabled() {
+    uint32_t flags;
+    asm volatile ("pushf\n pop %0" : "=r"(flags));
+    return (flags & (1 << 9)) != 0;
+}
+
 // Interrupt handler declarations
 extern "C" {
     void keyboard_handler_wrapper();
     void timer_handler_wrapper();
     void keyboard_handler();
     void timer_handler();
+    void irq_dispatch(uint32_t irq);
 }
 
 #endif // INTERRUPTS_H
\ No newline at end of file
@@ -1,10 +1,19 @@
 #include "iostream_wrapper.h"
 #include "stdlib_hooks.h"
+#include "interrupts.h"
+#include "perf.h"
+#include "thread.h"
 
 // Global instances
 TerminalOutput cout;
 TerminalInput cin;
 
+static input_idle_hook_t input_idle_hook = nullptr;
+
+void input_set_idle_hook(input_idle_hook_t hook) {
+    input_idle_hook = hook;
+}
+
 // Add this implementation for the new operator
 TerminalOutput& TerminalOutput::operator<<(TerminalOutput& (*manip)(TerminalOutput&)) {
     return manip(*this);
@@ -29,100 +38,92 @@ TerminalOutput& TerminalOutput::dec() {
     return *this;
 }
 
+uint16_t* TerminalOutput::scrollback_line(size_t line) {
+    return &scrollback_buffer[((scrollback_head + line) % SCROLLBACK_BUFFER_HEIGHT) * VGA_WIDTH];
+}
+
 void TerminalOutput::scroll_screen_internal() {
-    // First, save the top line that's about to be scrolled off to scrollback buffer
+    // Save the top line that's about to be scrolled off; once the ring is full
+    // the oldest line is overwritten in place
     if (scrollback_lines < SCROLLBACK_BUFFER_HEIGHT) {
-        // We have room in scrollback buffer, so save the first line
-        for (size_t x = 0; x < VGA_WIDTH; x++) {
-            scrollback_buffer[scrollback_lines * VGA_WIDTH + x] = terminal_buffer[x];
-        }
         scrollback_lines++;
     } else {
-        // Scrollback buffer is full, so shift everything up one line
-        for (size_t y = 0; y < SCROLLBACK_BUFFER_HEIGHT - 1; y++) {
-            for (size_t x = 0; x < VGA_WIDTH; x++) {
-                scrollback_buffer[y * VGA_WIDTH + x] = scrollback_buffer[(y + 1) * VGA_WIDTH + x];
-            }
-        }
-        
-        // Now save the current top line to the last scrollback line
-        for (size_t x = 0; x < VGA_WIDTH; x++) {
-            scrollback_buffer[(SCROLLBACK_BUFFER_HEIGHT - 1) * VGA_WIDTH + x] = terminal_buffer[x];
-        }
-    }
-    
-    // Move all rows up one line
-    for (size_t y = 0; y < VGA_HEIGHT - 1; y++) {
-        for (size_t x = 0; x < VGA_WIDTH; x++) {
-            const size_t dest_index = y * VGA_WIDTH + x;
-            const size_t src_index = (y + 1) * VGA_WIDTH + x;
-            terminal_buffer[dest_index] = terminal_buffer[src_index];
-        }
+        scrollback_head = (scrollback_head + 1) % SCROLLBACK_BUFFER_HEIGHT;
     }
+    memcpy(scrollback_line(scrollback_lines - 1), terminal_buffer, VGA_WIDTH * sizeof(uint16_t));
     
-    // Clear the last row
-    for (size_t x = 0; x < VGA_WIDTH; x++) {
-        const size_t index = (VGA_HEIGHT - 1) * VGA_WIDTH + x;
-        terminal_buffer[index] = make_vgaentry(' ', terminal_color);
-    }
+    scroll_screen();
 }
 
 void TerminalOutput::put_entry_at(char c, uint8_t color, size_t x, size_t y) {
     const size_t index = y * VGA_WIDTH + x;
     terminal_buffer[index] = make_vgaentry(c, color);
+    terminal_mark_dirty(x, x, y);
+}
+
+void TerminalOutput::new_line() {
+    terminal_column = 0;
+    if (++terminal_row == VGA_HEIGHT) {
+        // We've reached the bottom of the screen, need to scroll
+        scroll_screen_internal();
+        terminal_row = VGA_HEIGHT - 1; // Stay at the last row
+    }
 }
 
 void TerminalOutput::put_char(char c) {
-    if (c == '\n') {
-        // Handle newline character
-        terminal_column = 0;
-        if (++terminal_row == VGA_HEIGHT) {
-            // We've reached the bottom of the screen, need to scroll
-            scroll_screen_internal();
-            terminal_row = VGA_HEIGHT - 1; // Stay at the last row
-        }
-    } else if (c == '\b') {
-        // Handle backspace character
-        if (terminal_column > 0) {
-            // Move cursor back one position
-            terminal_column--;
-            // Clear the character at the cursor position
-            put_entry_at(' ', terminal_color, terminal_column, terminal_row);
-        } else if (terminal_row > 0) {
-            // If at the beginning of a line and not the first line,
-            // move to the end of the previous line
-            terminal_row--;
-            terminal_column = VGA_WIDTH - 1;
-            // Clear the character at the cursor position
-            put_entry_at(' ', terminal_color, terminal_column, terminal_row);
-        }
-    } else if (c == '\r') {
-        // Handle carriage return (move to beginning of line)
-        terminal_column = 0;
-    } else if (c == '\t') {
-        // Handle tab (move to next 8-character boundary)
-        size_t tab_size = 8;
-        terminal_column = (terminal_column + tab_size) & ~(tab_size - 1);
-        if (terminal_column >= VGA_WIDTH) {
-            terminal_column = 0;
-            if (++terminal_row == VGA_HEIGHT) {
-                scroll_screen_internal();
-                terminal_row = VGA_HEIGHT - 1;
+    write(&c, 1);
+}
+
+void TerminalOutput::write(const char* data, size_t len) {
+    PERF_SCOPE(PERF_CONSOLE_WRITE);
+    console_busy++;
+    bool newline = false;
+    size_t i = 0;
+    while (i < len) {
+        char c = data[i];
+        if (c == '\n') {
+            new_line();
+            newline = true;
+            i++;
+        } else if (c == '\b') {
+            // Step back and blank the cell, wrapping to the end of the previous line
+            if (terminal_column > 0) {
+                terminal_column--;
+                put_entry_at(' ', terminal_color, terminal_column, terminal_row);
+            } else if (terminal_row > 0) {
+                terminal_row--;
+                terminal_column = VGA_WIDTH - 1;
+                put_entry_at(' ', terminal_color, terminal_column, terminal_row);
             }
-        }
-    } else {
-        put_entry_at(c, terminal_color, terminal_column, terminal_row);
-        if (++terminal_column == VGA_WIDTH) {
+            i++;
+        } else if (c == '\r') {
             terminal_column = 0;
-            if (++terminal_row == VGA_HEIGHT) {
-                scroll_screen_internal();
-                terminal_row = VGA_HEIGHT - 1;
+            i++;
+        } else if (c == '\t') {
+            // Move to the next 8-character boundary
+            terminal_column = (terminal_column + 8) & ~(size_t)7;
+            if (terminal_column >= VGA_WIDTH) new_line();
+            i++;
+        } else {
+            // Store the printable run that fits on this row, then mark it dirty once
+            uint16_t* row = &terminal_buffer[terminal_row * VGA_WIDTH];
+            size_t x = terminal_column;
+            while (i < len && x < VGA_WIDTH) {
+                c = data[i];
+                if (c == '\n' || c == '\b' || c == '\r' || c == '\t') break;
+                row[x++] = make_vgaentry(c, terminal_color);
+                i++;
             }
+            terminal_mark_dirty(terminal_column, x - 1, terminal_row);
+            terminal_column = x;
+            if (terminal_column == VGA_WIDTH) new_line();
         }
     }
 
     // Update the hardware cursor position
     update_hardware_cursor(terminal_column, terminal_row);
+    console_busy--;
+    if (newline) terminal_flush_newline();
 }
 
 bool TerminalOutput::show_scrollback_page(int page) {
@@ -136,45 +137,44 @@ bool TerminalOutput::show_scrollback_page(int page) {
         start_line = 0;
     }
     
-    // Backup current screen if this is the first scrollback operation
-    static bool first_scrollback = true;
-    static uint16_t screen_backup[SCREEN_BACKUP_SIZE];
-    if (first_scrollback) {
-        for (size_t y = 0; y < VGA_HEIGHT; y++) {
-            for (size_t x = 0; x < VGA_WIDTH; x++) {
-                screen_backup[y * VGA_WIDTH + x] = terminal_buffer[y * VGA_WIDTH + x];
-            }
-        }
-        first_scrollback = false;
+    // Back up the live screen the first time a page is shown
+    if (!viewing_scrollback) {
+        memcpy(screen_backup, terminal_buffer, sizeof(screen_backup));
+        viewing_scrollback = true;
     }
     
-    // Copy scrollback buffer to screen
+    // Copy scrollback lines to the screen, topping up from the live screen
     for (size_t y = 0; y < VGA_HEIGHT; y++) {
-        for (size_t x = 0; x < VGA_WIDTH; x++) {
-            if (start_line + y < scrollback_lines) {
-                terminal_buffer[y * VGA_WIDTH + x] = scrollback_buffer[(start_line + y) * VGA_WIDTH + x];
+        uint16_t* row = &terminal_buffer[y * VGA_WIDTH];
+        if (start_line + y < scrollback_lines) {
+            memcpy(row, scrollback_line(start_line + y), VGA_WIDTH * sizeof(uint16_t));
+        } else {
+            int backup_line = y - (scrollback_lines - start_line);
+            if (backup_line >= 0 && backup_line < VGA_HEIGHT) {
+                memcpy(row, &screen_backup[backup_line * VGA_WIDTH], VGA_WIDTH * sizeof(uint16_t));
             } else {
-                // If we run out of scrollback lines, use the backup screen
-                int backup_line = y - (scrollback_lines - start_line);
-                if (backup_line >= 0 && backup_line < VGA_HEIGHT) {
-                    terminal_buffer[y * VGA_WIDTH + x] = screen_backup[backup_line * VGA_WIDTH + x];
-                } else {
-                    // Fill with blanks if we somehow run out of data
-                    terminal_buffer[y * VGA_WIDTH + x] = make_vgaentry(' ', terminal_color);
-                }
+                // Fill with blanks if we somehow run out of data
+                for (size_t x = 0; x < VGA_WIDTH; x++) row[x] = make_vgaentry(' ', terminal_color);
             }
         }
     }
     
     // Update hardware cursor (place at bottom left during scrollback)
     update_hardware_cursor(0, VGA_HEIGHT - 1);
+    terminal_mark_screen_dirty();
+    terminal_flush();
     return true;
 }
 
 void TerminalOutput::restore_screen() {
-    // Redraw the current screen (the system should continue from where it left off)
-    // This is essentially just a refresh, since the actual terminal_buffer hasn't changed
+    // Put the live screen back and continue from where it left off
+    if (viewing_scrollback) {
+        memcpy(terminal_buffer, screen_backup, sizeof(screen_backup));
+        viewing_scrollback = false;
+        terminal_mark_screen_dirty();
+    }
     update_hardware_cursor(terminal_column, terminal_row);
+    terminal_flush();
 }
 
 int TerminalOutput::get_scrollback_pages() {
@@ -182,10 +182,7 @@ int TerminalOutput::get_scrollback_pages() {
 }
 
 TerminalOutput& TerminalOutput::operator<<(const char* str) {
-    size_t len = strlen(str);
-    for (size_t i = 0; i < len; i++) {
-        put_char(str[i]);
-    }
+    write(str, strlen(str));
     return *this;
 }
 
@@ -194,130 +191,192 @@ TerminalOutput& TerminalOutput::operator<<(char c) {
     return *this;
 }
 
-TerminalOutput& TerminalOutput::operator<<(int num) {
-    char buffer[20];
+// Numbers print as decimal, or as 0x-prefixed lowercase hex after std::hex
+void TerminalOutput::put_number(uint64_t num, bool negative) {
+    char buffer[FORMAT_NUMBER_MAX + 2];
+    int len;
     if (use_hex_format) {
-        sprintf(buffer, "0x%x", num);
+        buffer[0] = '0';
+        buffer[1] = 'x';
+        len = 2 + format_unsigned(buffer + 2, num, 16, false);
+    } else if (negative) {
+        buffer[0] = '-';
+        len = 1 + format_unsigned(buffer + 1, num, 10, false);
     } else {
-        sprintf(buffer, "%d", num);
+        len = format_unsigned(buffer, num, 10, false);
     }
-    *this << buffer;
+    write(buffer, len);
+}
+
+TerminalOutput& TerminalOutput::operator<<(int num) {
+    // Hex shows the two's complement bits, as "%x" always has
+    if (use_hex_format) put_number((unsigned int)num, false);
+    else put_number(num < 0 ? 0u - (unsigned int)num : (unsigned int)num, num < 0);
     return *this;
 }
 
 TerminalOutput& TerminalOutput::operator<<(unsigned int num) {
-    char buffer[20];
-    if (use_hex_format) {
-        sprintf(buffer, "0x%x", num);
-    } else {
-        sprintf(buffer, "%u", num);
-    }
-    *this << buffer;
+    put_number(num, false);
+    return *this;
+}
+
+TerminalOutput& TerminalOutput::operator<<(long num) {
+    return *this << (int)num;  // long is 32 bits on this target
+}
+
+TerminalOutput& TerminalOutput::operator<<(unsigned long num) {
+    return *this << (unsigned int)num;
+}
+
+TerminalOutput& TerminalOutput::operator<<(long long num) {
+    if (use_hex_format) put_number((unsigned long long)num, false);
+    else put_number(num < 0 ? 0ull - (unsigned long long)num : (unsigned long long)num, num < 0);
+    return *this;
+}
+
+TerminalOutput& TerminalOutput::operator<<(unsigned long long num) {
+    put_number(num, false);
     return *this;
 }
 
 TerminalOutput& TerminalOutput::operator<<(void* ptr) {
-    char buffer[20];
-    sprintf(buffer, "0x%x", reinterpret_cast<unsigned int>(ptr));
-    *this << buffer;
+    char buffer[FORMAT_NUMBER_MAX + 2] = { '0', 'x' };
+    int len = 2 + format_unsigned(buffer + 2, reinterpret_cast<uintptr_t>(ptr), 16, false);
+    write(buffer, len);
     return *this;
 }
 
 // Implementation of TerminalInput methods
-TerminalInput::TerminalInput() : input_ready(false) {
+TerminalInput::TerminalInput() {
     // Initialize history
     for (int i = 0; i < HISTORY_SIZE; i++) {
         memset(command_history[i], 0, MAX_COMMAND_LENGTH);
     }
 }
 
-void TerminalInput::setInputReady(const char* buffer) {
-    strcpy(input_buffer, buffer);
-    
-    // Add command to history if not empty
-    if (strlen(buffer) > 0) {
-        // Shift history entries down
-        for (int i = HISTORY_SIZE - 1; i > 0; i--) {
-            strcpy(command_history[i], command_history[i-1]);
-        }
-        
-        // Add new command at the top
-        strcpy(command_history[0], buffer);
-        
-        // Update history count if needed
-        if (history_count < HISTORY_SIZE) {
-            history_count++;
-        }
+void TerminalInput::history_push() {
+    history_depth = 0;
+    if (line_length == 0) return;
+    strcpy(command_history[history_next], line);
+    history_next = (history_next + 1) % HISTORY_SIZE;
+    if (history_count < HISTORY_SIZE) {
+        history_count++;
     }
-    
-    history_index = -1;  // Reset history navigation
-    input_ready = true;
 }
 
 void TerminalInput::navigateHistory(bool up) {
     if (up) {  // Up key
-        if (history_index < history_count - 1) {
-            history_index++;
-            // Update command buffer with history item
-            strcpy(input_buffer, command_history[history_index]);
-            input_length = strlen(input_buffer);
-            
-            // Clear current input line and display the history item
-            clearInputLine();
-            terminal_writestring(input_buffer);
-        }
-    } else {  // Down key
-        if (history_index > -1) {
-            history_index--;
-            
-            // Clear current input line
-            clearInputLine();
-            
-            if (history_index == -1) {
-                // Return to empty input
-                input_buffer[0] = '\0';
-                input_length = 0;
-            } else {
-                // Show previous history item
-                strcpy(input_buffer, command_history[history_index]);
-                input_length = strlen(input_buffer);
-                terminal_writestring(input_buffer);
-            }
-        }
+        if (history_depth < history_count) history_depth++;
+        else return;
+    } else {   // Down key
+        if (history_depth > 0) history_depth--;
+        else return;
+    }
+    
+    if (history_depth == 0) {
+        replace_line("");  // Back to an empty new line
+    } else {
+        replace_line(command_history[(history_next - history_depth + HISTORY_SIZE) % HISTORY_SIZE]);
     }
 }
 
 void TerminalInput::clearInputLine() {
-    size_t current_col = terminal_column;
-    while (current_col > 0) {
-        terminal_putchar('\b');
-        current_col--;
+    // Back over what was echoed, leaving the prompt alone
+    char erase[MAX_COMMAND_LENGTH];
+    memset(erase, '\b', line_length);
+    cout.write(erase, line_length);
+    line_length = 0;
+}
+
+void TerminalInput::replace_line(const char* text) {
+    clearInputLine();
+    strncpy(line, text, MAX_COMMAND_LENGTH - 1);
+    line[MAX_COMMAND_LENGTH - 1] = '\0';
+    line_length = strlen(line);
+    cout.write(line, line_length);
+}
+
+bool TerminalInput::handle_scancode(uint8_t scancode) {
+    if (scancode == 0xE0) {
+        extended_key = true;
+        return false;
     }
     
-    // Clear the entire line
-    for (size_t i = 0; i < VGA_WIDTH; i++) {
-        terminal_putentryat(' ', terminal_color, i, terminal_row);
+    // Key release (bit 7 set)
+    if (scancode & 0x80) {
+        extended_key = false;
+        return false;
     }
     
-    // Reset cursor to beginning of line
-    terminal_column = 0;
-    update_hardware_cursor(terminal_column, terminal_row);
+    char key;
+    if (extended_key) {
+        extended_key = false;
+        if (scancode == SCANCODE_UP || scancode == SCANCODE_DOWN) {
+            navigateHistory(scancode == SCANCODE_UP);
+            return false;
+        }
+        key = extended_scancode_table[scancode];  // Keypad Enter
+    } else {
+        key = scancode_to_ascii[scancode];
+    }
+    
+    if (key == '\n') {
+        // Enter key - line complete
+        cout << key;
+        line[line_length] = '\0';
+        return true;
+    } else if (key == '\b') {
+        // Backspace - delete last character
+        if (line_length > 0) {
+            cout << key;
+            line_length--;
+        }
+    } else if (key != 0 && line_length < MAX_COMMAND_LENGTH - 1) {
+        // Regular character - add to line and echo
+        line[line_length++] = key;
+        cout << key;
+    }
+    return false;
+}
+
+bool TerminalInput::try_read_line(char* str) {
+    uint8_t scancode;
+    bool echoed = false;
+    while (keyboard_pop_scancode(&scancode)) {
+        echoed = true;
+        if (handle_scancode(scancode)) {
+            strcpy(str, line);
+            history_push();
+            line_length = 0;
+            terminal_flush();
+            return true;
+        }
+    }
+    if (echoed) terminal_flush();  // Show typed keys right away
+    return false;
 }
 
 TerminalInput& TerminalInput::operator>>(char* str) {
-    input_ready = false;
-    memset(input_buffer, 0, sizeof(input_buffer));
-    
-    // Reset input buffer
-    input_length = 0;
-    
-    // Wait for input to be ready (set by keyboard interrupt)
-    while (!input_ready) {
-        asm volatile ("hlt"); // Wait for input
+    // The keyboard belongs to the shell; background jobs read empty lines
+    if (thread_current_id() != 0) {
+        str[0] = '\0';
+        return *this;
+    }
+
+    // Show everything printed so far, then edit a line from the queued keys
+    terminal_flush();
+    while (!try_read_line(str)) {
+        if (input_idle_hook && input_idle_hook()) continue;
+        if (thread_yield()) continue;  // Background jobs run while the user types
+        // Sleep only if no key slipped in after the check: sti holds interrupts
+        // off until hlt has started, so the wakeup can't be missed
+        asm volatile ("cli");
+        if (keyboard_pending()) {
+            asm volatile ("sti");
+            continue;
+        }
+        asm volatile ("sti\n hlt");
     }
-    
-    // Copy input to provided string
-    strcpy(str, input_buffer);
     return *this;
 }
 
@@ -330,6 +389,12 @@ namespace std {
     TerminalOutput& dec(TerminalOutput& out) {
         return out.dec();
     }
+    
+    TerminalOutput& endl(TerminalOutput& out) {
+        out << '\n';
+        terminal_flush();
+        return out;
+    }
 }
 
 void init_terminal_io() {
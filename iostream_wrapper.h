@@ -17,22 +17,30 @@ class TerminalOutput;
 namespace std {
     TerminalOutput& hex(TerminalOutput& out);
     TerminalOutput& dec(TerminalOutput& out);
+    TerminalOutput& endl(TerminalOutput& out);  // Newline, then flush the console
 }
 
 // TerminalOutput class for output operations
 class TerminalOutput {
 private:
-    // Scrollback buffer
+    // Scrollback buffer, a ring of lines: line i (0 = oldest) lives in slot
+    // (scrollback_head + i) % SCROLLBACK_BUFFER_HEIGHT
     uint16_t scrollback_buffer[SCROLLBACK_BUFFER_HEIGHT * VGA_WIDTH];
+    size_t scrollback_head = 0;
     size_t scrollback_lines = 0;
+    uint16_t screen_backup[SCREEN_BACKUP_SIZE];  // Live screen while a scrollback page is shown
+    bool viewing_scrollback = false;
    
     // Flag for hex mode
     bool use_hex_format;
    
     // Internal methods
     void scroll_screen_internal();
+    uint16_t* scrollback_line(size_t line);
     void put_entry_at(char c, uint8_t color, size_t x, size_t y);
+    void new_line();
     void put_char(char c);
+    void put_number(uint64_t num, bool negative);
 public:
     TerminalOutput();
    
@@ -50,32 +58,47 @@ public:
     TerminalOutput& operator<<(char c);
     TerminalOutput& operator<<(int num);
     TerminalOutput& operator<<(unsigned int num);
+    TerminalOutput& operator<<(long num);
+    TerminalOutput& operator<<(unsigned long num);
+    TerminalOutput& operator<<(long long num);
+    TerminalOutput& operator<<(unsigned long long num);
     TerminalOutput& operator<<(void* ptr);
     
+    // Write 'len' characters with a single cursor update and flush check
+    void write(const char* data, size_t len);
+    
     // Add support for manipulators
     TerminalOutput& operator<<(TerminalOutput& (*manip)(TerminalOutput&));
 };
 
-// TerminalInput class for input operations
+// TerminalInput class for input operations.
+// Keys arrive as raw scancodes from the keyboard ring (interrupts.h); decoding,
+// echo, line editing and history all happen here, outside interrupt context.
 class TerminalInput {
 private:
-    char input_buffer[MAX_COMMAND_LENGTH];
-    bool input_ready;
-    size_t input_length = 0;
+    char line[MAX_COMMAND_LENGTH];  // Line being edited
+    size_t line_length = 0;
+    bool extended_key = false;      // Previous scancode was the 0xE0 prefix
    
-    // Command history
+    // Command history, a ring: the newest entry is in slot history_next - 1
     char command_history[HISTORY_SIZE][MAX_COMMAND_LENGTH];
+    int history_next = 0;
     int history_count = 0;
-    int history_index = -1;
+    int history_depth = 0;          // Entries walked back with Up, 0 = new line
+    
+    bool handle_scancode(uint8_t scancode);  // True once Enter completes the line
+    void history_push();
+    void replace_line(const char* text);
 public:
     TerminalInput();
    
-    // Input handling
-    void setInputReady(const char* buffer);
+    // Process queued keys without blocking. Returns true and copies the line
+    // into 'str' (MAX_COMMAND_LENGTH bytes) once Enter has been pressed
+    bool try_read_line(char* str);
     void navigateHistory(bool up);
     void clearInputLine();
    
-    // Input operator
+    // Input operator, waits for a complete line
     TerminalInput& operator>>(char* str);
 };
 // Global instances
@@ -83,4 +106,9 @@ extern TerminalOutput cout;
 extern TerminalInput cin;
 // Initialization function
 void init_terminal_io();
+
+// Run while cin waits for a line. Returns true if it did some work, in which case
+// the wait polls again instead of halting until the next interrupt.
+typedef bool (*input_idle_hook_t)();
+void input_set_idle_hook(input_idle_hook_t hook);
 #endif // IOSTREAM_WRAPPER_H
\ No newline at end of file
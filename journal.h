@@ -0,0 +1,341 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "types.h"
+#include "iostream_wrapper.h"
+#include "stdlib_hooks.h"
+#include "identify.h"
+#include "block_cache.h"
+
+// Metadata journal.
+// A transaction is a set of sector images with their home locations.
+// journal_commit() writes it to the log as one contiguous record - header
+// sectors with a tag per image, the images, then a commit sector carrying a
+// CRC32 of the whole record - and issues FLUSH CACHE. Only then may the caller
+// write the sectors home (the checkpoint), finishing with
+// journal_checkpoint_done(), which flushes the home writes and then erases the
+// record. Sectors may reach home outside a commit afterwards (cache evictions),
+// so a checkpointed record must never be replayed over them. The log holds at
+// most one record, the last one committed and not yet checkpointed:
+// journal_replay() copies it home if its CRC matches, then erases it too.
+//
+// Layout from 'start': superblock, then the record.
+
+#define JOURNAL_MAGIC           0x4C4E524A  // "JRNL", superblock
+#define JOURNAL_RECORD_MAGIC    0x44524352  // "RCRD", record header
+#define JOURNAL_COMMIT_MAGIC    0x544D4F43  // "COMT", commit sector
+#define JOURNAL_VERSION         1
+#define JOURNAL_DEFAULT_SECTORS 1024        // 512KB, superblock included
+#define JOURNAL_MAX_BLOCKS      320         // Sector images per transaction
+#define JOURNAL_HEADER_SECTORS  ((16 + JOURNAL_MAX_BLOCKS * 16 + SECTOR_SIZE - 1) / SECTOR_SIZE)
+#define JOURNAL_IO_SECTORS      128         // Replay reads the log 64KB at a time
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t sectors;        // Log size, superblock included
+    uint32_t seq;            // Sequence number of the next record at format time
+} journal_super_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t count;          // Sector images in the record
+    uint32_t header_sectors;
+} journal_record_head_t;
+
+// Image i goes to lba + k * stride for k < copies (FAT mirrors)
+typedef struct {
+    uint64_t lba;
+    uint32_t stride;
+    uint32_t copies;
+} journal_tag_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t count;
+    uint32_t crc;            // CRC32 of the header sectors and the images
+} journal_commit_t;
+
+typedef struct {
+    uint32_t commits;
+    uint32_t blocks_logged;
+    uint32_t overflows;      // Transactions too big for the log
+    uint32_t replayed;       // Sectors copied home at mount
+} journal_stats_t;
+
+static uint8_t journal_header[JOURNAL_HEADER_SECTORS * SECTOR_SIZE] __attribute__((aligned(16)));
+static uint8_t journal_commit_sector[SECTOR_SIZE] __attribute__((aligned(16)));
+static const uint8_t* journal_data[JOURNAL_MAX_BLOCKS];
+static journal_stats_t journal_stats;
+
+static struct {
+    bool active;
+    uint64_t ahci_base;
+    int port;
+    uint64_t start;
+    uint32_t sectors;
+    uint32_t seq;
+    int count;               // Images in the open transaction
+} journal;
+
+static inline journal_record_head_t* journal_head() {
+    return (journal_record_head_t*)journal_header;
+}
+
+static inline journal_tag_t* journal_tags() {
+    return (journal_tag_t*)(journal_header + sizeof(journal_record_head_t));
+}
+
+static uint32_t journal_crc_table[256];
+static bool journal_crc_ready = false;
+
+static uint32_t journal_crc32(uint32_t crc, const uint8_t* data, uint32_t len) {
+    if (!journal_crc_ready) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            journal_crc_table[i] = c;
+        }
+        journal_crc_ready = true;
+    }
+    crc = ~crc;
+    for (uint32_t i = 0; i < len; i++) crc = journal_crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+static inline uint32_t journal_header_sectors(int count) {
+    return (sizeof(journal_record_head_t) + count * sizeof(journal_tag_t) + SECTOR_SIZE - 1) / SECTOR_SIZE;
+}
+
+// Most images a record fits in this log
+static inline int journal_capacity() {
+    int fit = (int)journal.sectors - 2 - (int)journal_header_sectors(JOURNAL_MAX_BLOCKS);
+    return fit < JOURNAL_MAX_BLOCKS ? fit : JOURNAL_MAX_BLOCKS;
+}
+
+bool journal_active() {
+    return journal.active;
+}
+
+// Write an empty log of 'sectors' at 'start'. Returns 0 on success
+int journal_format(uint64_t ahci_base, int port, uint64_t start, uint32_t sectors) {
+    memset(journal_header, 0, SECTOR_SIZE * 2);
+    journal_super_t* sb = (journal_super_t*)journal_header;
+    sb->magic = JOURNAL_MAGIC;
+    sb->version = JOURNAL_VERSION;
+    sb->sectors = sectors;
+    sb->seq = 1;
+    bcache_drop_range(ahci_base, port, start, 2);
+    return write_sectors(ahci_base, port, start, 2, journal_header);  // Superblock and an empty record
+}
+
+// Use the log at 'start', at most 'limit' sectors long. Returns 0 if a valid
+// superblock is there, -13 otherwise
+int journal_open(uint64_t ahci_base, int port, uint64_t start, uint32_t limit) {
+    journal.active = false;
+    if (read_sectors(ahci_base, port, start, 1, journal_header) != 0) return -8;
+    journal_super_t* sb = (journal_super_t*)journal_header;
+    if (sb->magic != JOURNAL_MAGIC || sb->version != JOURNAL_VERSION || sb->sectors > limit) return -13;
+
+    journal.ahci_base = ahci_base;
+    journal.port = port;
+    journal.start = start;
+    journal.sectors = sb->sectors;
+    journal.seq = sb->seq;
+    journal.count = 0;
+    if (journal_capacity() < 1) return -13;
+    memset(&journal_stats, 0, sizeof(journal_stats));
+    journal.active = true;
+    return 0;
+}
+
+void journal_close() {
+    journal.active = false;
+}
+
+// Start collecting a transaction
+void journal_begin() {
+    journal.count = 0;
+}
+
+// Add the image of one sector. 'data' must stay unchanged until the checkpoint.
+// Returns 0, or -10 once the transaction holds as much as the log can take
+int journal_add(uint64_t lba, uint32_t stride, uint32_t copies, const void* data) {
+    if (journal.count >= journal_capacity()) return -10;
+    journal_tag_t* tag = &journal_tags()[journal.count];
+    tag->lba = lba;
+    tag->stride = stride;
+    tag->copies = copies;
+    journal_data[journal.count++] = (const uint8_t*)data;
+    return 0;
+}
+
+// Write the open transaction to the log and make it durable. Nothing is
+// written for an empty transaction. Returns 0 on success
+int journal_commit() {
+    if (!journal.active) return -1;
+    int count = journal.count;
+    if (count == 0) return 0;
+
+    uint32_t header_sectors = journal_header_sectors(count);
+    journal_record_head_t* head = journal_head();
+    head->magic = JOURNAL_RECORD_MAGIC;
+    head->seq = journal.seq;
+    head->count = count;
+    head->header_sectors = header_sectors;
+    uint32_t used = sizeof(journal_record_head_t) + count * sizeof(journal_tag_t);
+    memset(journal_header + used, 0, header_sectors * SECTOR_SIZE - used);
+
+    uint32_t crc = journal_crc32(0, journal_header, header_sectors * SECTOR_SIZE);
+    for (int i = 0; i < count; i++) crc = journal_crc32(crc, journal_data[i], SECTOR_SIZE);
+    memset(journal_commit_sector, 0, SECTOR_SIZE);
+    journal_commit_t* commit = (journal_commit_t*)journal_commit_sector;
+    commit->magic = JOURNAL_COMMIT_MAGIC;
+    commit->seq = journal.seq;
+    commit->count = count;
+    commit->crc = crc;
+
+    // The record is one run of sectors: gather it into as few commands as the
+    // PRDT and the transfer limit allow, merging images that sit back to back
+    uint32_t max_sectors = ahci_max_transfer_sectors(journal.ahci_base, journal.port);
+    uint64_t lba = journal.start + 1;
+    ahci_iovec_t iov[MAX_PRDT_ENTRIES];
+    int iovcnt = 0;
+    uint32_t sectors = 0;
+    for (int i = -1; i <= count; i++) {
+        const uint8_t* base = (i < 0) ? journal_header : (i == count) ? journal_commit_sector : journal_data[i];
+        uint32_t n = (i < 0) ? header_sectors : 1;
+        bool merge = iovcnt > 0 && (const uint8_t*)iov[iovcnt - 1].base + iov[iovcnt - 1].len == base &&
+                     iov[iovcnt - 1].len + n * SECTOR_SIZE <= MAX_PRDT_BYTES;
+        if ((!merge && iovcnt == MAX_PRDT_ENTRIES) || sectors + n > max_sectors) {
+            if (write_sectors_v(journal.ahci_base, journal.port, lba, iov, iovcnt) != 0) return -8;
+            lba += sectors;
+            iovcnt = 0;
+            sectors = 0;
+            merge = false;
+        }
+        if (merge) {
+            iov[iovcnt - 1].len += n * SECTOR_SIZE;
+        } else {
+            iov[iovcnt].base = (void*)base;
+            iov[iovcnt].len = n * SECTOR_SIZE;
+            iovcnt++;
+        }
+        sectors += n;
+    }
+    if (write_sectors_v(journal.ahci_base, journal.port, lba, iov, iovcnt) != 0) return -8;
+
+    // Barrier: the record is on stable media before any of it is written home
+    int status = ahci_flush_cache(journal.ahci_base, journal.port);
+    if (status < 0) return status;
+    journal.seq++;
+    journal_stats.commits++;
+    journal_stats.blocks_logged += count;
+    return 0;
+}
+
+// Erase the record header and make that durable before anything else is
+// written home, so the record is never replayed over newer sectors
+static int journal_invalidate() {
+    memset(journal_header, 0, SECTOR_SIZE);
+    if (write_sectors(journal.ahci_base, journal.port, journal.start + 1, 1, journal_header) != 0) return -8;
+    return ahci_flush_cache(journal.ahci_base, journal.port);
+}
+
+// The committed sectors have been written home: make them durable, then
+// retire the record. Returns 0 on success
+int journal_checkpoint_done() {
+    journal.count = 0;
+    int status = ahci_flush_cache(journal.ahci_base, journal.port);
+    if (status < 0) return status;
+    return journal_invalidate();
+}
+
+// The transaction could not be logged and is about to be written in place.
+// The old record must not be replayed over that, so the log is emptied first
+int journal_overflow() {
+    journal.count = 0;
+    journal_stats.overflows++;
+    return journal_invalidate();
+}
+
+// Copy the logged record home if it is complete. Returns the number of
+// sectors replayed (0 for an empty or torn log), negative on error
+int journal_replay() {
+    if (!journal.active) return -1;
+    uint64_t base = journal.ahci_base;
+    int port = journal.port;
+
+    if (read_sectors(base, port, journal.start + 1, 1, journal_header) != 0) return -8;
+    journal_record_head_t* head = journal_head();
+    if (head->magic != JOURNAL_RECORD_MAGIC) return 0;
+    int count = (int)head->count;
+    uint32_t header_sectors = head->header_sectors;
+    if (count <= 0 || count > journal_capacity() || header_sectors != journal_header_sectors(count)) return 0;
+    uint32_t seq = head->seq;
+    if (header_sectors > 1 &&
+        read_sectors(base, port, journal.start + 2, (uint16_t)(header_sectors - 1), journal_header + SECTOR_SIZE) != 0) {
+        return -8;
+    }
+
+    uint8_t* buffer = (uint8_t*)dma_pool_alloc(JOURNAL_IO_SECTORS * SECTOR_SIZE);
+    if (!buffer) return -11;
+    uint64_t data_lba = journal.start + 1 + header_sectors;
+
+    // First pass: the record counts only if its commit sector matches
+    int status = 0;
+    uint32_t crc = journal_crc32(0, journal_header, header_sectors * SECTOR_SIZE);
+    for (int done = 0; done < count && status == 0; done += JOURNAL_IO_SECTORS) {
+        int n = (count - done < JOURNAL_IO_SECTORS) ? count - done : JOURNAL_IO_SECTORS;
+        if (read_sectors(base, port, data_lba + done, (uint16_t)n, buffer) != 0) status = -8;
+        else crc = journal_crc32(crc, buffer, n * SECTOR_SIZE);
+    }
+    if (status == 0 && read_sectors(base, port, data_lba + count, 1, journal_commit_sector) != 0) status = -8;
+    journal_commit_t* commit = (journal_commit_t*)journal_commit_sector;
+    if (status < 0 || commit->magic != JOURNAL_COMMIT_MAGIC || commit->seq != seq ||
+        commit->count != (uint32_t)count || commit->crc != crc) {
+        dma_pool_free(buffer);
+        return status;
+    }
+
+    // Second pass: write every image to each of its home locations
+    const journal_tag_t* tags = journal_tags();
+    for (int done = 0; done < count && status == 0; done += JOURNAL_IO_SECTORS) {
+        int n = (count - done < JOURNAL_IO_SECTORS) ? count - done : JOURNAL_IO_SECTORS;
+        if (read_sectors(base, port, data_lba + done, (uint16_t)n, buffer) != 0) {
+            status = -8;
+            break;
+        }
+        for (int i = 0; i < n && status == 0; i++) {
+            const journal_tag_t* tag = &tags[done + i];
+            for (uint32_t k = 0; k < tag->copies && status == 0; k++) {
+                uint64_t home = tag->lba + (uint64_t)k * tag->stride;
+                bcache_drop_range(base, port, home, 1);
+                if (write_sectors(base, port, home, 1, buffer + i * SECTOR_SIZE) != 0) status = -8;
+            }
+        }
+    }
+    dma_pool_free(buffer);
+    if (status == 0) status = ahci_flush_cache(base, port);
+    if (status == 0) status = journal_invalidate();
+    if (status < 0) return status;
+
+    if (seq >= journal.seq) journal.seq = seq + 1;
+    journal_stats.replayed += count;
+    return count;
+}
+
+void journal_print_stats() {
+    if (!journal.active) {
+        cout << "Journal: none on this volume\n";
+        return;
+    }
+    cout << "Journal: " << journal.sectors << " sectors at LBA " << (uint32_t)journal.start << ", next record "
+         << journal.seq << "\n";
+    cout << "  Commits: " << journal_stats.commits << "  Sectors logged: " << journal_stats.blocks_logged
+         << "  Too big to log: " << journal_stats.overflows << "  Replayed at mount: " << journal_stats.replayed << "\n";
+}
+
+#endif // JOURNAL_H
@@ -1,6 +1,8 @@
 #ifndef KERNEL_H
 #define KERNEL_H
 
+#include "frame.h"
+
 // External declarations for commands
 void cmd_help();
 void cmd_hello();
@@ -11,7 +13,7 @@ void print_prog2();
 // Main command prompt function
 void command_prompt();
 
-// Kernel entry point
-extern "C" void kernel_main();
+// Kernel entry point, called from boot.S with the bootloader's EAX and EBX
+extern "C" void kernel_main(uint32_t multiboot_magic, const multiboot_info_t* multiboot_info);
 
 #endif // KERNEL_H
@@ -0,0 +1,284 @@
+#include "paging.h"
+#include "hardware_specs.h"
+#include "interrupts.h"
+#include "iostream_wrapper.h"
+#include "stdlib_hooks.h"
+
+#define PTE_PRESENT  (1u << 0)
+#define PTE_WRITE    (1u << 1)
+#define PTE_PWT      (1u << 3)
+#define PTE_PCD      (1u << 4)
+#define PDE_LARGE    (1u << 7)  // PS: a 4 MB page instead of a page table
+#define PTE_CACHE    (PTE_PWT | PTE_PCD)
+
+#define CR0_PG  (1u << 31)
+#define CR4_PSE (1u << 4)
+
+#define MSR_MTRR_CAP      0xFE
+#define MSR_MTRR_PHYSBASE 0x200  // + 2 * n
+#define MSR_MTRR_PHYSMASK 0x201  // + 2 * n
+#define MSR_MTRR_FIX64K   0x250
+#define MSR_MTRR_FIX16K   0x258
+#define MSR_MTRR_FIX4K    0x268
+#define MSR_PAT           0x277
+#define MSR_MTRR_DEF_TYPE 0x2FF
+
+#define MTRR_VALID        (1u << 11)
+#define MTRR_ENABLE       (1u << 11)
+#define MTRR_FIXED_ENABLE (1u << 10)
+#define MTRR_CAP_FIXED    (1u << 8)
+
+// PAT entries 0-3, repeated in 4-7: WB, WC, UC-, UC. A page's PWT bit selects
+// the odd entries and PCD the upper pair, so UC- and UC keep their reset
+// meaning and only the PWT = 1, PCD = 0 case changes from WT to WC.
+#define PAGING_PAT_VALUE 0x0007010600070106ull
+
+static uint32_t paging_directory[1024] __attribute__((aligned(PAGING_PAGE_SIZE)));
+static uint32_t paging_tables[PAGING_SPLIT_TABLES][1024] __attribute__((aligned(PAGING_PAGE_SIZE)));
+static int paging_tables_used = 0;
+
+static paging_region_t paging_regions[PAGING_MAX_REGIONS];
+static int paging_region_count = 0;
+
+static bool paging_on = false;
+static bool paging_has_pat = false;
+static bool paging_has_mtrr = false;
+static bool paging_changed = false;  // An entry changed type since the last flush
+
+volatile uint32_t paging_generation = 0;
+
+static inline void paging_load_cr3() {
+    asm volatile ("mov %0, %%cr3" : : "r"((uint32_t)(uintptr_t)paging_directory) : "memory");
+}
+
+// PWT/PCD bits for a memory type, or -13 if the PAT layout above has no entry for it
+static int paging_type_bits(uint8_t type) {
+    switch (type) {
+        case MEM_TYPE_WB:       return 0;
+        case MEM_TYPE_WC:       return paging_has_pat ? PTE_PWT : 0;  // Without a PAT, PWT means WT
+        case MEM_TYPE_UC_MINUS: return PTE_PCD;
+        case MEM_TYPE_UC:       return PTE_PCD | PTE_PWT;
+        default:                return -13;
+    }
+}
+
+// Replace a 4 MB page by a page table of 4 KB pages with the same type
+static int paging_split(uint32_t pde_index) {
+    if (paging_tables_used == PAGING_SPLIT_TABLES) return -5;
+    uint32_t* table = paging_tables[paging_tables_used++];
+    uint32_t large = paging_directory[pde_index];
+    uint32_t base = pde_index << 22;
+    for (uint32_t i = 0; i < 1024; i++) {
+        table[i] = (base + i * PAGING_PAGE_SIZE) | PTE_PRESENT | PTE_WRITE | (large & PTE_CACHE);
+    }
+    paging_directory[pde_index] = (uint32_t)(uintptr_t)table | PTE_PRESENT | PTE_WRITE;
+    return 0;
+}
+
+static int paging_apply(const paging_region_t* region) {
+    int bits = paging_type_bits(region->type);
+    if (bits < 0) return bits;
+
+    uint64_t addr = region->base & ~(uint64_t)(PAGING_PAGE_SIZE - 1);
+    uint64_t end = region->base + region->size;
+    while (addr < end) {
+        uint32_t pde_index = (uint32_t)(addr >> 22);
+        uint64_t large_start = (uint64_t)pde_index << 22;
+        uint64_t large_end = large_start + PAGING_LARGE_PAGE_SIZE;
+        uint32_t pde = paging_directory[pde_index];
+
+        if (pde & PDE_LARGE) {
+            // Large pages that already have the type, or that the region covers, stay large
+            if ((pde & PTE_CACHE) == (uint32_t)bits) {
+                addr = large_end;
+                continue;
+            }
+            if (addr == large_start && end >= large_end) {
+                paging_directory[pde_index] = (pde & ~PTE_CACHE) | bits;
+                paging_changed = true;
+                addr = large_end;
+                continue;
+            }
+            int status = paging_split(pde_index);
+            if (status < 0) return status;
+        }
+
+        uint32_t* table = (uint32_t*)(uintptr_t)(paging_directory[pde_index] & ~0xFFFu);
+        for (; addr < end && addr < large_end; addr += PAGING_PAGE_SIZE) {
+            uint32_t* pte = &table[(addr >> 12) & 1023];
+            if ((*pte & PTE_CACHE) == (uint32_t)bits) continue;
+            *pte = (*pte & ~PTE_CACHE) | bits;
+            paging_changed = true;
+        }
+    }
+    return 0;
+}
+
+// Changing a memory type needs the old lines and translations gone on every CPU
+static void paging_flush() {
+    if (!paging_changed) return;
+    paging_changed = false;
+    asm volatile ("wbinvd" : : : "memory");
+    paging_load_cr3();
+    __atomic_add_fetch(&paging_generation, 1, __ATOMIC_RELEASE);
+}
+
+bool paging_init() {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    if (!(edx & (1u << 3))) return false;  // PSE
+    paging_has_pat = edx & (1u << 16);
+    paging_has_mtrr = edx & (1u << 12);
+
+    for (uint32_t i = 0; i < 1024; i++) {
+        paging_directory[i] = (i << 22) | PTE_PRESENT | PTE_WRITE | PDE_LARGE;
+    }
+    paging_on = true;
+    paging_cpu_init();
+
+    // Regions registered before paging was on
+    for (int i = 0; i < paging_region_count; i++) {
+        if (paging_apply(&paging_regions[i]) < 0) {
+            printf("ERROR: could not set %s to %s\n", paging_regions[i].name, mem_type_name(paging_regions[i].type));
+        }
+    }
+    paging_flush();
+    return true;
+}
+
+void paging_cpu_init() {
+    if (!paging_on) return;
+    // The PAT must match on every CPU, and be in place before its entries are used
+    if (paging_has_pat) wrmsr(MSR_PAT, PAGING_PAT_VALUE);
+
+    uint32_t cr4, cr0;
+    asm volatile ("mov %%cr4, %0" : "=r"(cr4));
+    asm volatile ("mov %0, %%cr4" : : "r"(cr4 | CR4_PSE));
+    paging_load_cr3();
+    asm volatile ("mov %%cr0, %0" : "=r"(cr0));
+    asm volatile ("mov %0, %%cr0" : : "r"(cr0 | CR0_PG) : "memory");
+}
+
+bool paging_enabled() {
+    return paging_on;
+}
+
+int paging_set_type(const char* name, uint64_t base, uint64_t size, uint8_t type) {
+    if (base + size > 0x100000000ull) return -10;
+    if (paging_type_bits(type) < 0) return -13;
+
+    // Setting a region again replaces it
+    paging_region_t* region = nullptr;
+    for (int i = 0; i < paging_region_count; i++) {
+        if (paging_regions[i].base == base) region = &paging_regions[i];
+    }
+    if (!region) {
+        if (paging_region_count == PAGING_MAX_REGIONS) return -5;
+        region = &paging_regions[paging_region_count++];
+    }
+    region->name = name;
+    region->base = base;
+    region->size = size;
+    region->type = type;
+
+    if (!paging_on) return 0;
+    uint32_t flags = irq_save();
+    int status = paging_apply(region);
+    paging_flush();
+    irq_restore(flags);
+    return status;
+}
+
+uint32_t paging_cpu_sync() {
+    uint32_t generation = __atomic_load_n(&paging_generation, __ATOMIC_ACQUIRE);
+    if (paging_on) {
+        asm volatile ("wbinvd" : : : "memory");
+        paging_load_cr3();
+    }
+    return generation;
+}
+
+int mtrr_type(uint64_t address) {
+    if (!paging_has_mtrr) return -1;
+    uint64_t def = rdmsr(MSR_MTRR_DEF_TYPE);
+    if (!(def & MTRR_ENABLE)) return MEM_TYPE_UC;
+    uint64_t cap = rdmsr(MSR_MTRR_CAP);
+
+    // Below 1 MB the fixed-range MTRRs hold one type byte per 64K, 16K or 4K block
+    if (address < 0x100000 && (def & MTRR_FIXED_ENABLE) && (cap & MTRR_CAP_FIXED)) {
+        uint32_t msr, byte;
+        uint32_t a = (uint32_t)address;
+        if (a < 0x80000) {
+            msr = MSR_MTRR_FIX64K;
+            byte = a >> 16;
+        } else if (a < 0xC0000) {
+            msr = MSR_MTRR_FIX16K + ((a - 0x80000) >> 17);
+            byte = ((a - 0x80000) >> 14) & 7;
+        } else {
+            msr = MSR_MTRR_FIX4K + ((a - 0xC0000) >> 15);
+            byte = ((a - 0xC0000) >> 12) & 7;
+        }
+        return (int)((rdmsr(msr) >> (byte * 8)) & 0xFF);
+    }
+
+    // Overlapping variable ranges: UC wins, and WT beats WB
+    int type = -1;
+    for (uint32_t i = 0; i < (cap & 0xFF); i++) {
+        uint64_t mask = rdmsr(MSR_MTRR_PHYSMASK + 2 * i);
+        if (!(mask & MTRR_VALID)) continue;
+        uint64_t base = rdmsr(MSR_MTRR_PHYSBASE + 2 * i);
+        mask &= ~0xFFFull;
+        if ((address & mask) != (base & mask)) continue;
+
+        int range_type = (int)(base & 0xFF);
+        if (range_type == MEM_TYPE_UC) return MEM_TYPE_UC;
+        if (type == -1) type = range_type;
+        else if (type != range_type && (type == MEM_TYPE_WT || range_type == MEM_TYPE_WT)) type = MEM_TYPE_WT;
+    }
+    return type == -1 ? (int)(def & 0xFF) : type;
+}
+
+const char* mem_type_name(int type) {
+    switch (type) {
+        case MEM_TYPE_UC:       return "UC";
+        case MEM_TYPE_WC:       return "WC";
+        case MEM_TYPE_WT:       return "WT";
+        case MEM_TYPE_WP:       return "WP";
+        case MEM_TYPE_WB:       return "WB";
+        case MEM_TYPE_UC_MINUS: return "UC-";
+        default:                return "?";
+    }
+}
+
+// What the CPU uses when a page's PAT type and the MTRR type disagree
+static int paging_effective_type(int pat_type, int mtrr) {
+    if (mtrr < 0) return pat_type;
+    if (pat_type == MEM_TYPE_WC || pat_type == MEM_TYPE_UC) return pat_type;
+    if (pat_type == MEM_TYPE_UC_MINUS) return mtrr == MEM_TYPE_WC ? MEM_TYPE_WC : MEM_TYPE_UC;
+    return mtrr;  // WB defers to the MTRRs
+}
+
+void paging_print_info() {
+    if (!paging_on) {
+        cout << "Paging is off (no PSE support); memory types come from the MTRRs only\n";
+        return;
+    }
+    cout << "Paging: 4 MB identity pages, " << paging_tables_used << "/" << PAGING_SPLIT_TABLES
+         << " split into 4 KB pages, PAT " << (paging_has_pat ? "programmed" : "not supported") << "\n";
+    if (paging_has_mtrr) {
+        uint64_t def = rdmsr(MSR_MTRR_DEF_TYPE);
+        uint64_t cap = rdmsr(MSR_MTRR_CAP);
+        cout << "MTRRs: " << ((def & MTRR_ENABLE) ? "enabled" : "disabled") << ", default "
+             << mem_type_name((int)(def & 0xFF)) << ", " << (uint32_t)(cap & 0xFF) << " variable ranges, fixed ranges "
+             << ((def & MTRR_FIXED_ENABLE) ? "on" : "off") << "\n";
+    }
+
+    cout << "Regions:\n";
+    for (int i = 0; i < paging_region_count; i++) {
+        const paging_region_t* r = &paging_regions[i];
+        int mtrr = mtrr_type(r->base);
+        printf("  %-18s 0x%08X  %6u KB  PAT %-3s  MTRR %-3s  effective %s\n", r->name, (uint32_t)r->base,
+               (uint32_t)(r->size / 1024), mem_type_name(r->type), mtrr < 0 ? "-" : mem_type_name(mtrr),
+               mem_type_name(paging_effective_type(paging_type_bits(r->type) == 0 ? MEM_TYPE_WB : r->type, mtrr)));
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef PAGING_H
+#define PAGING_H
+
+#include "types.h"
+
+// Paging.
+// paging_init() identity-maps all 4 GB with 4 MB PSE pages and programs the PAT
+// so every page can pick its memory type through its PWT/PCD bits. Regions
+// given to paging_set_type() get their own type; a large page that is only
+// partly covered is split into 4 KB pages from a small pool of page tables.
+// Pages default to WB, which leaves the MTRR type in charge, as with paging off.
+
+#define PAGING_LARGE_PAGE_SIZE 0x400000
+#define PAGING_PAGE_SIZE       4096
+#define PAGING_SPLIT_TABLES    8     // Large pages that can be broken into 4 KB pages
+#define PAGING_MAX_REGIONS     16
+
+// Architectural memory type encodings, as used by the PAT and the MTRRs
+#define MEM_TYPE_UC       0x00  // Strong uncacheable
+#define MEM_TYPE_WC       0x01  // Write-combining
+#define MEM_TYPE_WT       0x04
+#define MEM_TYPE_WP       0x05
+#define MEM_TYPE_WB       0x06
+#define MEM_TYPE_UC_MINUS 0x07  // Uncacheable, but an MTRR WC range wins
+
+typedef struct {
+    const char* name;
+    uint64_t base;
+    uint64_t size;
+    uint8_t type;
+} paging_region_t;
+
+bool paging_init();              // BSP, before smp_init(); false if the CPU has no PSE
+void paging_cpu_init();          // Each AP: same PAT, directory and CR4/CR0 bits as the BSP
+bool paging_enabled();
+
+// Give [base, base + size) the memory type 'type' (MEM_TYPE_WB, WC, UC_MINUS or UC).
+// May be called before paging_init(); the region is applied once paging is on.
+// Returns 0 on success, -5 if no page table is left to split a large page,
+// -10 if the region reaches above 4 GB, -13 for an unsupported type.
+int paging_set_type(const char* name, uint64_t base, uint64_t size, uint8_t type);
+
+// APs reload their TLB and flush caches when this moves (see paging_cpu_sync)
+extern volatile uint32_t paging_generation;
+uint32_t paging_cpu_sync();      // Returns the generation now in effect on this CPU
+
+int mtrr_type(uint64_t address); // MTRR memory type at 'address', -1 if the CPU has no MTRRs
+const char* mem_type_name(int type);
+void paging_print_info();
+
+#endif // PAGING_H
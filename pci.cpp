@@ -1,3 +1,5 @@
+#include "pci.h"
+#include "acpi.h"
 #include "hardware_specs.h"
 #include "interrupts.h"
 #include "iostream_wrapper.h"
@@ -5,13 +7,10 @@
 #include "stdlib_hooks.h"
 #include "terminal_hooks.h"
 #include "terminal_io.h"
+#include "timer.h"
+#include "paging.h"
 #include "types.h"
 
-#define PCI_CONFIG_ADDRESS 0xCF8
-#define PCI_CONFIG_DATA 0xCFC
-#define PCI_COMMAND_REGISTER 0x04
-#define PCI_VENDOR_ID 0x00
-
 // Direct implementation of outl/inl functions
 void direct_outl(uint16_t port, uint32_t value) {
     asm volatile ("outl %0, %1" : : "a"(value), "Nd"(port));
@@ -23,23 +22,23 @@ uint32_t direct_inl(uint16_t port) {
     return ret;
 }
 
-struct pci_device {
-    uint16_t vendor_id;
-    uint16_t device_id;
-    uint16_t command;
-    uint16_t status;
-    uint8_t revision_id;
-    uint8_t prog_if;
-    uint8_t subclass;
-    uint8_t class_code;
-    uint8_t cache_line_size;
-    uint8_t latency_timer;
-    uint8_t header_type;
-    uint8_t bist;
-    uint32_t bar[6];
-};
+// ECAM window for segment 0 from the MCFG table, or nullptr
+static volatile uint8_t* pci_ecam_base = nullptr;
+static uint8_t pci_ecam_start_bus = 0;
+static uint8_t pci_ecam_end_bus = 0;
+
+// Each function has 4KB of config space at base + (bus << 20 | slot << 15 | func << 12)
+static volatile uint32_t* pci_ecam_address(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) {
+    if (!pci_ecam_base || bus < pci_ecam_start_bus || bus > pci_ecam_end_bus) return nullptr;
+    uint32_t where = ((uint32_t)(bus - pci_ecam_start_bus) << 20) | ((uint32_t)slot << 15) |
+                     ((uint32_t)func << 12) | (offset & 0xFC);
+    return (volatile uint32_t*)(pci_ecam_base + where);
+}
 
 uint32_t pci_read_config_dword(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) {
+    volatile uint32_t* ecam = pci_ecam_address(bus, slot, func, offset);
+    if (ecam) return *ecam;
+
     uint32_t address;
     uint32_t lbus = (uint32_t)bus;
     uint32_t lslot = (uint32_t)slot;
@@ -53,6 +52,12 @@ uint32_t pci_read_config_dword(uint8_t bus, uint8_t slot, uint8_t func, uint8_t
 }
 
 void pci_write_config_dword(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t value) {
+    volatile uint32_t* ecam = pci_ecam_address(bus, slot, func, offset);
+    if (ecam) {
+        *ecam = value;
+        return;
+    }
+
     uint32_t address;
     uint32_t lbus = (uint32_t)bus;
     uint32_t lslot = (uint32_t)slot;
@@ -84,45 +89,169 @@ int check_device(uint8_t bus, uint8_t device) {
     return (vendor != 0xFFFF);
 }
 
+// --- Device table ---
+
+static pci_entry_t pci_table[PCI_MAX_FUNCTIONS];
+static int pci_entries = 0;
+static int pci_dropped = 0;                // Functions found after the table filled up
+static int pci_class_head[256];            // First entry per class code
+static int pci_class_tail[256];
+static uint32_t pci_bus_seen[256 / 32];    // Guards against bridges that loop back
+static bool pci_ready = false;
+static uint64_t pci_scan_ns = 0;
+
+static void pci_scan_bus(uint8_t bus);
+
+static void pci_setup_ecam() {
+    const acpi_mcfg_t* mcfg = (const acpi_mcfg_t*)acpi_find_table("MCFG");
+    if (!mcfg) return;
+
+    const acpi_mcfg_entry_t* entry = (const acpi_mcfg_entry_t*)(mcfg + 1);
+    uint32_t count = (mcfg->header.length - sizeof(acpi_mcfg_t)) / sizeof(acpi_mcfg_entry_t);
+    for (uint32_t i = 0; i < count; i++, entry++) {
+        if (entry->segment != 0 || entry->end_bus < entry->start_bus) continue;
+        // Without paging only windows below 4GB can be reached
+        uint64_t size = (uint64_t)(entry->end_bus - entry->start_bus + 1) << 20;
+        if (entry->base_address == 0 || entry->base_address + size > 0x100000000ull) continue;
+        pci_ecam_base = (volatile uint8_t*)(uintptr_t)entry->base_address;
+        pci_ecam_start_bus = entry->start_bus;
+        pci_ecam_end_bus = entry->end_bus;
+        paging_set_type("PCI ECAM", entry->base_address, size, MEM_TYPE_UC);
+        return;
+    }
+}
+
+static void pci_scan_function(uint8_t bus, uint8_t slot, uint8_t func) {
+    uint32_t vendor_device = pci_read_config_dword(bus, slot, func, PCI_VENDOR_ID);
+    uint32_t class_reg = pci_read_config_dword(bus, slot, func, 0x08);
+    uint8_t header_type = (pci_read_config_dword(bus, slot, func, 0x0C) >> 16) & 0x7F;
+    uint8_t class_code = class_reg >> 24;
+    uint8_t subclass = (class_reg >> 16) & 0xFF;
+
+    uint8_t secondary_bus = 0;
+    bool bridge = header_type == 1 && class_code == PCI_CLASS_BRIDGE && subclass == PCI_SUBCLASS_PCI_PCI;
+    if (bridge) secondary_bus = (pci_read_config_dword(bus, slot, func, 0x18) >> 8) & 0xFF;
+
+    if (pci_entries < PCI_MAX_FUNCTIONS) {
+        int index = pci_entries++;
+        pci_entry_t* e = &pci_table[index];
+        e->bus = bus;
+        e->slot = slot;
+        e->func = func;
+        e->header_type = header_type;
+        e->vendor_id = vendor_device & 0xFFFF;
+        e->device_id = vendor_device >> 16;
+        e->class_code = class_code;
+        e->subclass = subclass;
+        e->prog_if = (class_reg >> 8) & 0xFF;
+        e->revision_id = class_reg & 0xFF;
+        e->interrupt_line = pci_read_config_dword(bus, slot, func, 0x3C) & 0xFF;
+        e->secondary_bus = secondary_bus;
+        int bars = header_type == 0 ? 6 : (header_type == 1 ? 2 : 0);
+        for (int i = 0; i < 6; i++) e->bar[i] = i < bars ? pci_read_config_dword(bus, slot, func, 0x10 + i * 4) : 0;
+
+        e->class_next = PCI_NONE;
+        if (pci_class_tail[class_code] != PCI_NONE) pci_table[pci_class_tail[class_code]].class_next = index;
+        else pci_class_head[class_code] = index;
+        pci_class_tail[class_code] = index;
+    } else {
+        pci_dropped++;
+    }
+
+    // A bridge that firmware has not numbered yet reports secondary bus 0
+    if (bridge && secondary_bus != 0) pci_scan_bus(secondary_bus);
+}
+
+static void pci_scan_bus(uint8_t bus) {
+    if (pci_bus_seen[bus / 32] & (1u << (bus % 32))) return;
+    pci_bus_seen[bus / 32] |= 1u << (bus % 32);
+
+    for (uint8_t slot = 0; slot < 32; slot++) {
+        if (!check_device(bus, slot)) continue;
+        pci_scan_function(bus, slot, 0);
+        uint8_t header_type = (pci_read_config_dword(bus, slot, 0, 0x0C) >> 16) & 0xFF;
+        if (!(header_type & 0x80)) continue;
+        for (uint8_t func = 1; func < 8; func++) {
+            uint32_t vendor_device = pci_read_config_dword(bus, slot, func, PCI_VENDOR_ID);
+            if ((vendor_device & 0xFFFF) != 0xFFFF) pci_scan_function(bus, slot, func);
+        }
+    }
+}
+
+void pci_init() {
+    if (pci_ready) return;
+    pci_ready = true;
+    uint64_t start = now_ns();
+
+    pci_entries = 0;
+    pci_dropped = 0;
+    for (int i = 0; i < 256; i++) pci_class_head[i] = pci_class_tail[i] = PCI_NONE;
+    for (int i = 0; i < 256 / 32; i++) pci_bus_seen[i] = 0;
+
+    pci_setup_ecam();
+
+    // Function N of a multi-function host bridge at 00:00 is the host controller for bus N
+    uint8_t header_type = (pci_read_config_dword(0, 0, 0, 0x0C) >> 16) & 0xFF;
+    if (!(header_type & 0x80)) {
+        pci_scan_bus(0);
+    } else {
+        for (uint8_t func = 0; func < 8; func++) {
+            uint32_t vendor_device = pci_read_config_dword(0, 0, func, PCI_VENDOR_ID);
+            if ((vendor_device & 0xFFFF) != 0xFFFF) pci_scan_bus(func);
+        }
+    }
+    pci_scan_ns = now_ns() - start;
+}
+
+int pci_count() {
+    pci_init();
+    return pci_entries;
+}
+
+const pci_entry_t* pci_entry(int index) {
+    pci_init();
+    if (index < 0 || index >= pci_entries) return nullptr;
+    return &pci_table[index];
+}
+
+const pci_entry_t* pci_find_class(uint8_t class_code, uint8_t subclass, uint8_t prog_if) {
+    pci_init();
+    for (int i = pci_class_head[class_code]; i != PCI_NONE; i = pci_table[i].class_next) {
+        if (pci_table[i].subclass == subclass && pci_table[i].prog_if == prog_if) return &pci_table[i];
+    }
+    return nullptr;
+}
+
+bool pci_ecam_active() {
+    pci_init();
+    return pci_ecam_base != nullptr;
+}
+
 void scan_pci() {
-    struct pci_device dev;
-    
-    for (uint16_t bus = 0; bus < 256; bus++) {
-        for (uint8_t device = 0; device < 32; device++) {
-            if (check_device(bus, device)) {
-                uint32_t vendor_device = pci_read_config_dword(bus, device, 0, PCI_VENDOR_ID);
-                dev.vendor_id = (uint16_t)(vendor_device & 0xFFFF);
-                dev.device_id = (uint16_t)(vendor_device >> 16);
-                
-                dev.command = get_pci_command(bus, device, 0);
-                
-                read_pci_bars(bus, device, 0, &dev);
-                
-                cout << "Device found at Bus " << bus << ", Device " << device << "\n";
-                cout << "Vendor ID: " << std::hex << dev.vendor_id << ", Device ID: " << dev.device_id << std::dec << "\n";
-                cout << "Command Register: " << std::hex << dev.command << std::dec << "\n";
-                
-                for (int i = 0; i < 6; i++) {
-                    cout << "BAR" << i << ": " << std::hex << dev.bar[i] << std::dec << "\n";
-                    
-                    if (dev.bar[i] != 0) {
-                        if (dev.bar[i] & 1) {
-                            cout << "  Type: I/O Space\n";
-                            cout << "  I/O Port Base Address: " << std::hex << (dev.bar[i] & 0xFFFFFFFC) << std::dec << "\n";
-                        } else {
-                            cout << "  Type: Memory Space\n";
-                            uint8_t mem_type = (dev.bar[i] >> 1) & 3;
-                            cout << "  Memory Type: " << int(mem_type) << "\n";
-                            cout << "  Memory Base Address: " << std::hex << (dev.bar[i] & 0xFFFFFFF0) << std::dec << "\n";
-                        }
-                    }
-                }
-                cout << "\nPress enter to continue\n\n";
-                char input[1];
-                cin >> input;
-                cout << "\n";
+    pci_init();
+    cout << "PCI devices: " << pci_entries << " functions, config access through "
+         << (pci_ecam_base ? "ECAM" : "ports 0xCF8/0xCFC") << ", scanned in "
+         << (uint32_t)(pci_scan_ns / 1000) << " us\n";
+    if (pci_dropped > 0) cout << "  (" << pci_dropped << " more did not fit in the table)\n";
+
+    for (int i = 0; i < pci_entries; i++) {
+        const pci_entry_t* e = &pci_table[i];
+        printf("  %02X:%02X.%d  %04X:%04X  class %02X.%02X.%02X  irq %d",
+               e->bus, e->slot, e->func, e->vendor_id, e->device_id,
+               e->class_code, e->subclass, e->prog_if, e->interrupt_line);
+        if (e->secondary_bus != 0) printf("  bridge to bus %d", e->secondary_bus);
+        printf("\n");
+
+        for (int b = 0; b < 6; b++) {
+            uint32_t bar = e->bar[b];
+            if (bar == 0) continue;
+            if (bar & 1) {
+                printf("      BAR%d: I/O 0x%X\n", b, bar & 0xFFFFFFFC);
+            } else {
+                bool wide = ((bar >> 1) & 3) == 2;
+                printf("      BAR%d: memory 0x%08X%s\n", b, bar & 0xFFFFFFF0, wide ? " (64-bit)" : "");
+                if (wide) b++;  // The next BAR holds the upper half
             }
         }
     }
 }
-
@@ -24,11 +24,46 @@ struct pci_device {
     uint32_t bar[6];
 };
 
+// Devices found by pci_init(), one entry per function
+#define PCI_MAX_FUNCTIONS 128
+#define PCI_NONE          -1
+
+#define PCI_CLASS_BRIDGE      0x06
+#define PCI_SUBCLASS_PCI_PCI  0x04
+
+typedef struct {
+    uint8_t bus;
+    uint8_t slot;
+    uint8_t func;
+    uint8_t header_type;     // Multi-function bit stripped
+    uint16_t vendor_id;
+    uint16_t device_id;
+    uint8_t class_code;
+    uint8_t subclass;
+    uint8_t prog_if;
+    uint8_t revision_id;
+    uint8_t interrupt_line;
+    uint8_t secondary_bus;   // PCI-to-PCI bridges only
+    uint32_t bar[6];         // Bridges only have the first two
+    int class_next;          // Next entry with the same class code, in scan order
+} pci_entry_t;
+
+// Config space goes through the MCFG ECAM window once pci_init() has found
+// one, and through ports 0xCF8/0xCFC otherwise
 uint32_t pci_read_config_dword(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset);
 void pci_write_config_dword(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t value);
 uint16_t get_pci_command(uint8_t bus, uint8_t slot, uint8_t func);
 void read_pci_bars(uint8_t bus, uint8_t slot, uint8_t func, struct pci_device* dev);
 int check_device(uint8_t bus, uint8_t device);
-void scan_pci();
+void scan_pci();  // Print the device table
+
+// Walk the buses once, starting at the host bridges and following PCI-to-PCI
+// bridges, and fill the device table. Lookups below call it on first use.
+void pci_init();
+int pci_count();
+const pci_entry_t* pci_entry(int index);
+// First function with this class, subclass and programming interface, or nullptr
+const pci_entry_t* pci_find_class(uint8_t class_code, uint8_t subclass, uint8_t prog_if);
+bool pci_ecam_active();
 
-#endif
\ No newline at end of file
+#endif // PCI_BAR_READER_H
\ No newline at end of file
@@ -0,0 +1,81 @@
+#include "perf.h"
+#include "stdlib_hooks.h"
+
+perf_probe_t perf_probes[PERF_PROBE_COUNT];
+bool perf_active = false;
+
+static const char* const perf_probe_names[PERF_PROBE_COUNT] = {
+    "ahci.read",
+    "ahci.write",
+    "ahci.wait",
+    "ncq.submit",
+    "ncq.wait",
+    "fat.read_entry",
+    "fat.write_entry",
+    "fat.alloc_chain",
+    "fat.read_data",
+    "fat.write_data",
+    "fat.dir_load",
+    "heap.alloc",
+    "heap.free",
+    "console.write",
+};
+
+void perf_init() {
+    perf_reset();
+    // rdtsc is only safe, and the numbers only mean something, with a calibrated TSC
+    perf_active = PERF_PROBES && clock_tsc_khz() != 0;
+}
+
+void perf_reset() {
+    memset(perf_probes, 0, sizeof(perf_probes));
+}
+
+// Format a cycle count as time, picking ns/us/ms to keep it short
+static void perf_format_time(char* out, size_t size, uint64_t cycles) {
+    uint64_t ns = cycles * 1000000 / clock_tsc_khz();
+    if (ns < 10000) snprintf(out, size, "%uns", (uint32_t)ns);
+    else if (ns < 10000000) snprintf(out, size, "%uus", (uint32_t)(ns / 1000));
+    else snprintf(out, size, "%ums", (uint32_t)(ns / 1000000));
+}
+
+void perf_print() {
+    if (!PERF_PROBES) {
+        printf("Probes were compiled out (PERF_PROBES=0)\n");
+        return;
+    }
+    if (clock_tsc_khz() == 0) {
+        printf("No calibrated TSC, probes are unavailable\n");
+        return;
+    }
+    printf("Probes %s, %u kHz TSC\n", perf_active ? "enabled" : "disabled", clock_tsc_khz());
+    printf("%-16s %8s %8s %8s %8s\n", "probe", "count", "min", "avg", "max");
+
+    bool any = false;
+    for (int i = 0; i < PERF_PROBE_COUNT; i++) {
+        perf_probe_t* p = &perf_probes[i];
+        if (p->count == 0) continue;
+        any = true;
+        char lo[16], avg[16], hi[16];
+        perf_format_time(lo, sizeof(lo), p->min);
+        perf_format_time(avg, sizeof(avg), p->total / p->count);
+        perf_format_time(hi, sizeof(hi), p->max);
+        printf("%-16s %8u %8s %8s %8s\n", perf_probe_names[i], p->count, lo, avg, hi);
+
+        // Histogram: only the populated buckets, each as "<upper bound:count"
+        printf("   ");
+        int shown = 0;
+        for (int b = 0; b < PERF_BUCKETS; b++) {
+            if (p->buckets[b] == 0) continue;
+            if (shown > 0 && shown % 6 == 0) printf("\n   ");
+            char bound[16];
+            bool last = b == PERF_BUCKETS - 1;
+            perf_format_time(bound, sizeof(bound), last ? 1ull << b : 2ull << b);
+            if (last) printf(" >=%s:%u", bound, p->buckets[b]);
+            else printf(" <%s:%u", bound, p->buckets[b]);
+            shown++;
+        }
+        printf("\n");
+    }
+    if (!any) printf("(no samples)\n");
+}
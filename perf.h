@@ -0,0 +1,81 @@
+#ifndef PERF_H
+#define PERF_H
+
+#include "types.h"
+#include "timer.h"
+
+// Hot-path probes. PERF_SCOPE(id) stamps the TSC when the enclosing block is
+// entered and adds the elapsed cycles to probe 'id' when it is left. Each probe
+// keeps a count, total, min/max and a histogram with one bucket per power of two.
+// Build with -DPERF_PROBES=0 to compile every probe out.
+// Probes are not locked; a probe hit from an interrupt in the middle of another
+// update of the same probe can lose that one sample.
+
+#ifndef PERF_PROBES
+#define PERF_PROBES 1
+#endif
+
+enum perf_probe_id {
+    PERF_AHCI_READ,       // read_sectors_v, command build to completion
+    PERF_AHCI_WRITE,      // write_sectors_v
+    PERF_AHCI_WAIT,       // wait_for_ahci_completion
+    PERF_NCQ_SUBMIT,      // ncq_submit_v
+    PERF_NCQ_WAIT,        // ncq_wait_mask
+    PERF_FAT_READ_ENTRY,  // read_fat_entry
+    PERF_FAT_WRITE_ENTRY, // write_fat_entry
+    PERF_FAT_ALLOC_CHAIN, // allocate_cluster_chain
+    PERF_FAT_READ_DATA,   // read_data_from_clusters
+    PERF_FAT_WRITE_DATA,  // write_data_to_clusters
+    PERF_FAT_DIR_LOAD,    // dir_index_load
+    PERF_HEAP_ALLOC,      // KernelHeap::allocate
+    PERF_HEAP_FREE,       // KernelHeap::deallocate
+    PERF_CONSOLE_WRITE,   // TerminalOutput::write (put_char included)
+    PERF_PROBE_COUNT
+};
+
+#define PERF_BUCKETS 40  // Bucket b counts samples of [2^b, 2^(b+1)) cycles; the last one is open-ended
+
+typedef struct {
+    uint32_t count;
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    uint32_t buckets[PERF_BUCKETS];
+} perf_probe_t;
+
+extern perf_probe_t perf_probes[PERF_PROBE_COUNT];
+extern bool perf_active;  // Off until perf_init() finds a TSC, or after "perf off"
+
+void perf_init();
+void perf_reset();
+void perf_print();
+
+static inline void perf_record(int id, uint64_t cycles) {
+    perf_probe_t* p = &perf_probes[id];
+    p->count++;
+    p->total += cycles;
+    if (cycles < p->min || p->count == 1) p->min = cycles;
+    if (cycles > p->max) p->max = cycles;
+    uint32_t hi = (uint32_t)(cycles >> 32);
+    int bucket = hi ? 32 + (31 - __builtin_clz(hi)) : (cycles ? 31 - __builtin_clz((uint32_t)cycles) : 0);
+    p->buckets[bucket < PERF_BUCKETS ? bucket : PERF_BUCKETS - 1]++;
+}
+
+#if PERF_PROBES
+struct PerfScope {
+    int id;
+    uint64_t start;
+    PerfScope(int probe) : id(probe), start(perf_active ? rdtsc() : 0) {}
+    ~PerfScope() {
+        if (start) perf_record(id, rdtsc() - start);
+    }
+};
+
+#define PERF_CONCAT_(a, b) a##b
+#define PERF_CONCAT(a, b) PERF_CONCAT_(a, b)
+#define PERF_SCOPE(id) PerfScope PERF_CONCAT(perf_scope_, __LINE__)(id)
+#else
+#define PERF_SCOPE(id) do { } while (0)
+#endif
+
+#endif // PERF_H
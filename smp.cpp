@@ -0,0 +1,377 @@
+#include "smp.h"
+#include "acpi.h"
+#include "interrupts.h"
+#include "hardware_specs.h"
+#include "stdlib_hooks.h"
+#include "timer.h"
+#include "paging.h"
+
+// Local APIC registers (byte offsets from the MMIO base)
+#define LAPIC_ID        0x020
+#define LAPIC_SVR       0x0F0
+#define LAPIC_ICR_LOW   0x300
+#define LAPIC_ICR_HIGH  0x310
+#define LAPIC_LVT_LINT0 0x350
+#define LAPIC_LVT_LINT1 0x360
+
+#define LAPIC_SVR_ENABLE      (1u << 8)
+#define LAPIC_SPURIOUS_VECTOR 0xFF
+#define LAPIC_ICR_INIT        0x00004500  // INIT, level assert
+#define LAPIC_ICR_STARTUP     0x00004600  // Start-up IPI; the low byte is the entry page
+#define LAPIC_ICR_PENDING     (1u << 12)  // Delivery status
+#define LAPIC_LVT_EXTINT      0x00000700
+#define LAPIC_LVT_NMI         0x00000400
+
+#define SMP_INIT_DELAY_MS   10
+#define SMP_START_WAIT_MS   100  // After the second start-up IPI
+#define SMP_IPI_TIMEOUT_MS  10
+#define SMP_NO_CPU          0xFF
+
+static volatile uint32_t* lapic = nullptr;
+static smp_cpu_t smp_cpus[SMP_MAX_CPUS];
+static uint8_t smp_stacks[SMP_MAX_CPUS - 1][SMP_STACK_SIZE] __attribute__((aligned(16)));  // One per AP
+static uint8_t smp_cpu_by_apic[256];
+static uint32_t smp_cpu_total = 1;       // Entries in smp_cpus, started or not
+static volatile uint32_t smp_online = 1;
+static volatile uint32_t smp_starting;   // Index of the AP being started
+
+/* Real-mode entry for the APs. It is copied to SMP_TRAMPOLINE_BASE, so every
+   address in it is computed from its offset to smp_trampoline_start. The BSP
+   patches the stack and entry words before each start-up IPI. */
+#define SMP_STR_(x) #x
+#define SMP_STR(x) SMP_STR_(x)
+#define SMP_TRAMPOLINE_ADDR(label) SMP_STR(SMP_TRAMPOLINE_BASE) " + " #label " - smp_trampoline_start"
+
+extern "C" char smp_trampoline_start[], smp_trampoline_end[];
+extern "C" char smp_trampoline_stack[], smp_trampoline_entry[];
+asm(
+    ".pushsection .text\n"
+    ".global smp_trampoline_start\n"
+    ".global smp_trampoline_end\n"
+    ".global smp_trampoline_stack\n"
+    ".global smp_trampoline_entry\n"
+    ".code16\n"
+    "smp_trampoline_start:\n"
+    "    cli\n"
+    "    cld\n"
+    "    movw %cs, %ax\n"
+    "    movw %ax, %ds\n"
+    "    lgdtl smp_trampoline_gdt_ptr - smp_trampoline_start\n"
+    "    movl %cr0, %eax\n"
+    "    orl $1, %eax\n"
+    "    movl %eax, %cr0\n"
+    "    ljmpl $0x08, $(" SMP_TRAMPOLINE_ADDR(smp_trampoline_pm) ")\n"
+    ".code32\n"
+    "smp_trampoline_pm:\n"
+    "    movw $0x10, %ax\n"
+    "    movw %ax, %ds\n"
+    "    movw %ax, %es\n"
+    "    movw %ax, %fs\n"
+    "    movw %ax, %gs\n"
+    "    movw %ax, %ss\n"
+    "    movl (" SMP_TRAMPOLINE_ADDR(smp_trampoline_stack) "), %esp\n"
+    "    call *(" SMP_TRAMPOLINE_ADDR(smp_trampoline_entry) ")\n"
+    "1:  cli\n"
+    "    hlt\n"
+    "    jmp 1b\n"
+    ".align 8\n"
+    "smp_trampoline_gdt:\n"                // Flat code and data with the kernel's selectors
+    "    .quad 0\n"
+    "    .quad 0x00CF9A000000FFFF\n"
+    "    .quad 0x00CF92000000FFFF\n"
+    "smp_trampoline_gdt_ptr:\n"
+    "    .word 23\n"
+    "    .long " SMP_TRAMPOLINE_ADDR(smp_trampoline_gdt) "\n"
+    "smp_trampoline_stack:\n"
+    "    .long 0\n"
+    "smp_trampoline_entry:\n"
+    "    .long 0\n"
+    "smp_trampoline_end:\n"
+    ".popsection\n"
+);
+
+/* Spurious interrupts from the local APIC take no EOI */
+extern "C" void lapic_spurious_wrapper();
+asm(
+    ".global lapic_spurious_wrapper\n"
+    "lapic_spurious_wrapper:\n"
+    "    iret\n"
+);
+
+static inline uint32_t lapic_read(uint32_t reg) {
+    return lapic[reg / 4];
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t value) {
+    lapic[reg / 4] = value;
+}
+
+static void lapic_send_ipi(uint8_t apic_id, uint32_t command) {
+    lapic_write(LAPIC_ICR_HIGH, (uint32_t)apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, command);
+    uint64_t deadline = deadline_ms(SMP_IPI_TIMEOUT_MS);
+    while ((lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING) && !deadline_passed(deadline)) {
+        asm volatile ("pause");
+    }
+}
+
+// --- Work-stealing deque ---
+
+static bool deque_push(smp_deque_t* q, smp_task_t* task) {
+    uint32_t b = q->bottom;
+    uint32_t t = __atomic_load_n(&q->top, __ATOMIC_ACQUIRE);
+    if (b - t >= SMP_DEQUE_SIZE) return false;
+    q->slots[b & (SMP_DEQUE_SIZE - 1)] = task;
+    __atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Owner only: take the newest task
+static smp_task_t* deque_pop(smp_deque_t* q) {
+    uint32_t b = q->bottom - 1;
+    __atomic_store_n(&q->bottom, b, __ATOMIC_SEQ_CST);  // Claim the slot before looking at top
+    uint32_t t = __atomic_load_n(&q->top, __ATOMIC_SEQ_CST);
+    if ((int32_t)(b - t) < 0) {
+        q->bottom = t;  // Was empty
+        return nullptr;
+    }
+    smp_task_t* task = q->slots[b & (SMP_DEQUE_SIZE - 1)];
+    if (b != t) return task;
+
+    // The last task: a thief may be taking it at the same time
+    uint32_t expected = t;
+    if (!__atomic_compare_exchange_n(&q->top, &expected, t + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        task = nullptr;
+    }
+    q->bottom = t + 1;
+    return task;
+}
+
+// Any CPU: take the oldest task
+static smp_task_t* deque_steal(smp_deque_t* q) {
+    uint32_t t = __atomic_load_n(&q->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uint32_t b = __atomic_load_n(&q->bottom, __ATOMIC_ACQUIRE);
+    if ((int32_t)(b - t) <= 0) return nullptr;
+    smp_task_t* task = q->slots[t & (SMP_DEQUE_SIZE - 1)];
+    if (!__atomic_compare_exchange_n(&q->top, &t, t + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return nullptr;  // Lost it to the owner or another thief
+    }
+    return task;
+}
+
+static void smp_run_task(smp_cpu_t* cpu, smp_task_t* task, bool stolen) {
+    task->fn(task->begin, task->end, task->arg);
+    cpu->tasks_run++;
+    if (stolen) cpu->tasks_stolen++;
+    // The task may live on the submitter's stack: nothing touches it after this
+    __atomic_sub_fetch(task->remaining, 1, __ATOMIC_RELEASE);
+}
+
+// This CPU's own deque first, then one pass over everybody else's
+static smp_task_t* smp_find_work(smp_cpu_t* cpu, bool* stolen) {
+    *stolen = false;
+    smp_task_t* task = deque_pop(&cpu->deque);
+    if (task) return task;
+
+    for (uint32_t i = 1; i < smp_cpu_total; i++) {
+        smp_cpu_t* victim = &smp_cpus[(cpu->index + i) % smp_cpu_total];
+        if (!victim->online) continue;
+        task = deque_steal(&victim->deque);
+        if (task) {
+            *stolen = true;
+            return task;
+        }
+    }
+    return nullptr;
+}
+
+// --- Application processors ---
+
+static void smp_ap_loop(smp_cpu_t* cpu) {
+    uint32_t page_generation = paging_generation;
+    while (true) {
+        bool stolen;
+        smp_task_t* task = smp_find_work(cpu, &stolen);
+        if (task) smp_run_task(cpu, task, stolen);
+        else if (page_generation != paging_generation) page_generation = paging_cpu_sync();
+        else asm volatile ("pause");
+    }
+}
+
+// Reached from the trampoline in protected mode, on this AP's own stack
+extern "C" void smp_ap_entry() {
+    smp_cpu_t* cpu = &smp_cpus[smp_starting];
+
+    // The kernel's GDT has the same selectors as the trampoline's
+    asm volatile ("lgdt %0" : : "m"(gdtp));
+    asm volatile (
+        "ljmp $0x08, $1f\n"
+        "1:\n"
+        "mov $0x10, %%ax\n"
+        "mov %%ax, %%ds\n"
+        "mov %%ax, %%es\n"
+        "mov %%ax, %%fs\n"
+        "mov %%ax, %%gs\n"
+        "mov %%ax, %%ss\n"
+        : : : "eax", "memory");
+    asm volatile ("lidt %0" : : "m"(idtp));
+    cpu_simd_enable();  // Per-CPU: CR0, CR4 and XCR0 for the vector copy kernels
+    paging_cpu_init();
+
+    __atomic_store_n(&cpu->online, true, __ATOMIC_RELEASE);
+    smp_ap_loop(cpu);
+}
+
+static bool smp_start_ap(smp_cpu_t* cpu) {
+    uint8_t* trampoline = (uint8_t*)SMP_TRAMPOLINE_BASE;
+    uint32_t stack_top = (uint32_t)(uintptr_t)(smp_stacks[cpu->index - 1] + SMP_STACK_SIZE);
+    uint32_t entry = (uint32_t)(uintptr_t)smp_ap_entry;
+    memcpy(trampoline + (smp_trampoline_stack - smp_trampoline_start), &stack_top, 4);
+    memcpy(trampoline + (smp_trampoline_entry - smp_trampoline_start), &entry, 4);
+    smp_starting = cpu->index;
+    asm volatile ("" : : : "memory");
+
+    // INIT, then up to two start-up IPIs; a CPU that is already running ignores the second
+    lapic_send_ipi(cpu->apic_id, LAPIC_ICR_INIT);
+    sleep_ms(SMP_INIT_DELAY_MS);
+    for (int attempt = 0; attempt < 2 && !cpu->online; attempt++) {
+        lapic_send_ipi(cpu->apic_id, LAPIC_ICR_STARTUP | (SMP_TRAMPOLINE_BASE >> 12));
+        uint64_t deadline = attempt == 0 ? deadline_us(200) : deadline_ms(SMP_START_WAIT_MS);
+        while (!cpu->online && !deadline_passed(deadline)) asm volatile ("pause");
+    }
+    return cpu->online;
+}
+
+// Software-enable the BSP's local APIC, which sending IPIs needs
+static void lapic_enable_bsp() {
+    idt_set_gate(LAPIC_SPURIOUS_VECTOR, (uint32_t)(uintptr_t)lapic_spurious_wrapper, 0x08, 0x8E);
+    uint32_t svr = lapic_read(LAPIC_SVR);
+    if (svr & LAPIC_SVR_ENABLE) return;
+
+    uint32_t flags = irq_save();
+    lapic_write(LAPIC_SVR, (svr & ~0xFFu) | LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+    // Virtual wire mode, so the 8259 keeps reaching this CPU
+    lapic_write(LAPIC_LVT_LINT0, LAPIC_LVT_EXTINT);
+    lapic_write(LAPIC_LVT_LINT1, LAPIC_LVT_NMI);
+    irq_restore(flags);
+}
+
+void smp_init() {
+    for (int i = 0; i < 256; i++) smp_cpu_by_apic[i] = SMP_NO_CPU;
+    smp_cpus[0].index = 0;
+    smp_cpus[0].online = true;
+
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    if (!(edx & (1 << 9))) return;  // No local APIC
+
+    const acpi_madt_t* madt = (const acpi_madt_t*)acpi_find_table("APIC");
+    if (!madt) return;
+
+    uint64_t lapic_address = madt->lapic_address;
+    const uint8_t* p = (const uint8_t*)madt + sizeof(acpi_madt_t);
+    const uint8_t* end = (const uint8_t*)madt + madt->header.length;
+    while (p + sizeof(acpi_madt_entry_t) <= end) {
+        const acpi_madt_entry_t* entry = (const acpi_madt_entry_t*)p;
+        if (entry->length < sizeof(acpi_madt_entry_t)) break;
+        if (entry->type == MADT_LAPIC_ADDR_OVERRIDE) {
+            lapic_address = ((const acpi_madt_lapic_override_t*)entry)->lapic_address;
+        }
+        p += entry->length;
+    }
+    if (lapic_address == 0 || lapic_address >= 0x100000000ull) return;
+    lapic = (volatile uint32_t*)(uintptr_t)lapic_address;
+    paging_set_type("Local APIC", lapic_address, 4096, MEM_TYPE_UC);
+
+    uint8_t bsp_id = lapic_read(LAPIC_ID) >> 24;
+    smp_cpus[0].apic_id = bsp_id;
+    smp_cpu_by_apic[bsp_id] = 0;
+
+    // Enabled processors only; x2APIC entries (IDs above 255) are not supported
+    p = (const uint8_t*)madt + sizeof(acpi_madt_t);
+    while (p + sizeof(acpi_madt_entry_t) <= end && smp_cpu_total < SMP_MAX_CPUS) {
+        const acpi_madt_entry_t* entry = (const acpi_madt_entry_t*)p;
+        if (entry->length < sizeof(acpi_madt_entry_t)) break;
+        if (entry->type == MADT_LOCAL_APIC) {
+            const acpi_madt_lapic_t* cpu = (const acpi_madt_lapic_t*)entry;
+            if ((cpu->flags & MADT_LAPIC_ENABLED) && smp_cpu_by_apic[cpu->apic_id] == SMP_NO_CPU) {
+                smp_cpus[smp_cpu_total].index = smp_cpu_total;
+                smp_cpus[smp_cpu_total].apic_id = cpu->apic_id;
+                smp_cpu_by_apic[cpu->apic_id] = (uint8_t)smp_cpu_total;
+                smp_cpu_total++;
+            }
+        }
+        p += entry->length;
+    }
+    if (smp_cpu_total == 1) return;
+
+    lapic_enable_bsp();
+    memcpy((void*)SMP_TRAMPOLINE_BASE, smp_trampoline_start, smp_trampoline_end - smp_trampoline_start);
+
+    // One at a time: they share the trampoline's stack word
+    for (uint32_t i = 1; i < smp_cpu_total; i++) {
+        if (!smp_start_ap(&smp_cpus[i])) {
+            // A late starter would pick up the next AP's stack, so stop here
+            printf("WARNING: CPU %u (APIC ID %u) did not start, not starting the rest\n", i, smp_cpus[i].apic_id);
+            break;
+        }
+        smp_online++;
+    }
+}
+
+int smp_cpu_count() {
+    return (int)smp_online;
+}
+
+smp_cpu_t* smp_this_cpu() {
+    if (!lapic) return &smp_cpus[0];
+    uint8_t index = smp_cpu_by_apic[lapic_read(LAPIC_ID) >> 24];
+    return index == SMP_NO_CPU ? &smp_cpus[0] : &smp_cpus[index];
+}
+
+void smp_parallel_for(size_t count, size_t grain, smp_range_fn fn, void* arg) {
+    if (count == 0) return;
+    if (grain == 0) grain = 1;
+    if (smp_online <= 1 || count <= grain) {
+        fn(0, count, arg);
+        return;
+    }
+
+    size_t pieces = (count + grain - 1) / grain;
+    if (pieces > SMP_MAX_PIECES) {
+        grain = (count + SMP_MAX_PIECES - 1) / SMP_MAX_PIECES;
+        pieces = (count + grain - 1) / grain;
+    }
+
+    smp_task_t tasks[SMP_MAX_PIECES];
+    volatile uint32_t remaining = pieces;
+    smp_cpu_t* cpu = smp_this_cpu();
+    for (size_t i = 0; i < pieces; i++) {
+        smp_task_t* task = &tasks[i];
+        task->fn = fn;
+        task->arg = arg;
+        task->begin = i * grain;
+        task->end = (i + 1) * grain < count ? (i + 1) * grain : count;
+        task->remaining = &remaining;
+        if (!deque_push(&cpu->deque, task)) smp_run_task(cpu, task, false);  // Deque full
+    }
+
+    // Work alongside the thieves until the last piece is done
+    while (__atomic_load_n(&remaining, __ATOMIC_ACQUIRE) != 0) {
+        bool stolen;
+        smp_task_t* task = smp_find_work(cpu, &stolen);
+        if (task) smp_run_task(cpu, task, stolen);
+        else asm volatile ("pause");
+    }
+}
+
+void smp_print_info() {
+    printf("CPUs: %u online, %u listed in the MADT%s\n", smp_online, smp_cpu_total,
+           lapic ? "" : " (no MADT or local APIC, BSP only)");
+    for (uint32_t i = 0; i < smp_cpu_total; i++) {
+        smp_cpu_t* cpu = &smp_cpus[i];
+        printf("  CPU %-2u APIC ID %-3u %-7s tasks %u, stolen %u\n", i, cpu->apic_id,
+               i == 0 ? "BSP" : cpu->online ? "online" : "offline", cpu->tasks_run, cpu->tasks_stolen);
+    }
+}
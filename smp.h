@@ -0,0 +1,58 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include "types.h"
+
+// Symmetric multiprocessing.
+// smp_init() reads the processor list from the ACPI MADT and starts every
+// application processor (AP) with INIT-SIPI-SIPI through the local APIC. Each
+// CPU gets its own stack and a smp_cpu_t. APs run with interrupts off and only
+// execute work: every CPU owns a work-stealing deque, smp_parallel_for() pushes
+// the pieces of a range onto the caller's deque and idle CPUs steal from the
+// others. Interrupts, the console and the drivers stay on the bootstrap
+// processor (BSP), so work handed to smp_parallel_for() must only touch memory.
+
+#define SMP_MAX_CPUS        64
+#define SMP_STACK_SIZE      16384
+#define SMP_DEQUE_SIZE      256     // Power of two
+#define SMP_MAX_PIECES      64      // smp_parallel_for() splits a range into at most this many tasks
+#define SMP_TRAMPOLINE_BASE 0x8000  // Real-mode entry point for APs: below 1 MB, 4 KB aligned
+
+typedef void (*smp_range_fn)(size_t begin, size_t end, void* arg);
+
+typedef struct {
+    smp_range_fn fn;
+    void* arg;
+    size_t begin;
+    size_t end;
+    volatile uint32_t* remaining;  // Decremented once the piece has run
+} smp_task_t;
+
+// Chase-Lev deque: the owner pushes and pops at 'bottom', thieves take from 'top'.
+// Both counters run freely; the slot is the counter masked to the deque size.
+typedef struct {
+    smp_task_t* volatile slots[SMP_DEQUE_SIZE];
+    volatile uint32_t top __attribute__((aligned(64)));
+    volatile uint32_t bottom __attribute__((aligned(64)));
+} smp_deque_t;
+
+typedef struct {
+    uint32_t index;            // 0 is the BSP
+    uint8_t apic_id;
+    volatile bool online;
+    volatile uint32_t tasks_run;
+    volatile uint32_t tasks_stolen;  // Of tasks_run, the ones taken from another CPU's deque
+    smp_deque_t deque;
+} smp_cpu_t;
+
+void smp_init();              // After clock_init() and mem_ops_init()
+int smp_cpu_count();          // CPUs online, the BSP included
+smp_cpu_t* smp_this_cpu();
+void smp_print_info();
+
+// Run fn(begin, end, arg) over [0, count) in pieces of at least 'grain' items,
+// spread over every online CPU; returns when all of them have finished. Small
+// ranges, and every range before smp_init(), run inline on the caller.
+void smp_parallel_for(size_t count, size_t grain, smp_range_fn fn, void* arg);
+
+#endif // SMP_H
@@ -1,10 +1,20 @@
 #include "stdlib_hooks.h"
 #include <cstdarg>  // For va_list, va_start, va_arg, va_end
 #include "terminal_hooks.h"
+#include "iostream_wrapper.h"
+#include "hardware_specs.h"
+#include "perf.h"
+#include "frame.h"
+#include "interrupts.h"
 
 // Static member initialization for KernelHeap
-uint8_t KernelHeap::heap_space[HEAP_SIZE];
-KernelHeap::MemoryBlock* KernelHeap::free_list = nullptr;
+uint8_t KernelHeap::heap_space[HEAP_SIZE] __attribute__((aligned(4096)));
+KernelHeap::PageInfo KernelHeap::pages[MAX_PAGES];
+KernelHeap::Arena KernelHeap::arenas[MAX_ARENAS];
+int KernelHeap::arena_count = 0;
+int KernelHeap::page_total = 0;
+int KernelHeap::partial_pages[CLASS_COUNT];
+bool KernelHeap::initialized = false;
 
 // Global formatting state
 extern bool use_hex;
@@ -36,87 +46,216 @@ char* strcpy(char* dest, const char* src) {
 }
 
 // Memory operations
-void* memcpy(void* dest, const void* src, size_t n) {
-    unsigned char* d = static_cast<unsigned char*>(dest);
-    const unsigned char* s = static_cast<const unsigned char*>(src);
-    
-    // Check for word-aligned addresses for optimization
-    if (((reinterpret_cast<uintptr_t>(dest) & 0x3) == 0) && 
-        ((reinterpret_cast<uintptr_t>(src) & 0x3) == 0) && 
-        (n >= 4)) {
-        
-        // Copy 4 bytes at a time when possible
-        size_t words = n / 4;
-        uint32_t* d32 = static_cast<uint32_t*>(dest);
-        const uint32_t* s32 = static_cast<const uint32_t*>(src);
-        
-        for (size_t i = 0; i < words; i++) {
-            d32[i] = s32[i];
-        }
-        
-        // Handle remaining bytes
-        for (size_t i = words * 4; i < n; i++) {
-            d[i] = s[i];
-        }
-    } else {
-        // Byte-by-byte copy for unaligned addresses
-        for (size_t i = 0; i < n; i++) {
-            d[i] = s[i];
-        }
+// memcpy, memmove, memset and memcmp run through the kernels below, picked from
+// CPUID by mem_ops_init(). Until that runs the rep movsd/stosd versions are used,
+// which need no FPU state. The SSE2 and AVX2 kernels save and restore every vector
+// register they touch, so an interrupt handler that copies memory in the middle of
+// another copy cannot corrupt it.
+
+#define MEM_VECTOR_THRESHOLD 256 // Below this the register save/restore costs more than it gains
+
+static inline void rep_movsb(void* dest, const void* src, size_t n) {
+    asm volatile ("rep movsb" : "+D"(dest), "+S"(src), "+c"(n) : : "memory");
+}
+
+static inline void rep_movsd(void* dest, const void* src, size_t words) {
+    asm volatile ("rep movsl" : "+D"(dest), "+S"(src), "+c"(words) : : "memory");
+}
+
+static inline void rep_stosb(void* dest, uint8_t v, size_t n) {
+    asm volatile ("rep stosb" : "+D"(dest), "+c"(n) : "a"(v) : "memory");
+}
+
+static inline void rep_stosd(void* dest, uint32_t v, size_t words) {
+    asm volatile ("rep stosl" : "+D"(dest), "+c"(words) : "a"(v) : "memory");
+}
+
+static void copy_movsd(void* dest, const void* src, size_t n) {
+    size_t body = n & ~(size_t)3;
+    rep_movsd(dest, src, n / 4);
+    rep_movsb(static_cast<uint8_t*>(dest) + body, static_cast<const uint8_t*>(src) + body, n & 3);
+}
+
+static void copy_movsb(void* dest, const void* src, size_t n) {
+    rep_movsb(dest, src, n);
+}
+
+static void copy_sse2(void* dest, const void* src, size_t n) {
+    uint8_t* d = static_cast<uint8_t*>(dest);
+    const uint8_t* s = static_cast<const uint8_t*>(src);
+    if (n < MEM_VECTOR_THRESHOLD) {
+        copy_movsd(d, s, n);
+        return;
     }
-    
-    return dest;
+
+    // Align the destination so the stores can use movdqa
+    size_t head = (16 - (reinterpret_cast<uintptr_t>(d) & 15)) & 15;
+    rep_movsb(d, s, head);
+    d += head;
+    s += head;
+    n -= head;
+
+    size_t blocks = n / 64;
+    uint8_t save[64];
+    asm volatile (
+        "movdqu %%xmm0, 0(%[sv])\n\t"
+        "movdqu %%xmm1, 16(%[sv])\n\t"
+        "movdqu %%xmm2, 32(%[sv])\n\t"
+        "movdqu %%xmm3, 48(%[sv])\n\t"
+        "1:\n\t"
+        "movdqu 0(%[s]), %%xmm0\n\t"
+        "movdqu 16(%[s]), %%xmm1\n\t"
+        "movdqu 32(%[s]), %%xmm2\n\t"
+        "movdqu 48(%[s]), %%xmm3\n\t"
+        "movdqa %%xmm0, 0(%[d])\n\t"
+        "movdqa %%xmm1, 16(%[d])\n\t"
+        "movdqa %%xmm2, 32(%[d])\n\t"
+        "movdqa %%xmm3, 48(%[d])\n\t"
+        "add $64, %[s]\n\t"
+        "add $64, %[d]\n\t"
+        "dec %[n]\n\t"
+        "jnz 1b\n\t"
+        "movdqu 0(%[sv]), %%xmm0\n\t"
+        "movdqu 16(%[sv]), %%xmm1\n\t"
+        "movdqu 32(%[sv]), %%xmm2\n\t"
+        "movdqu 48(%[sv]), %%xmm3\n\t"
+        : [d] "+r"(d), [s] "+r"(s), [n] "+r"(blocks)
+        : [sv] "r"(save)
+        : "memory", "cc");
+
+    copy_movsd(d, s, n & 63);
 }
 
-void* memmove(void* dest, const void* src, size_t n) {
-    unsigned char* d = static_cast<unsigned char*>(dest);
-    const unsigned char* s = static_cast<const unsigned char*>(src);
-    
-    // If destination and source overlap, copy backwards
-    if (d > s && d < s + n) {
-        for (size_t i = n; i > 0; i--) {
-            d[i-1] = s[i-1];
-        }
-    } else {
-        // Otherwise, use standard copy
-        for (size_t i = 0; i < n; i++) {
-            d[i] = s[i];
-        }
+static void copy_avx2(void* dest, const void* src, size_t n) {
+    uint8_t* d = static_cast<uint8_t*>(dest);
+    const uint8_t* s = static_cast<const uint8_t*>(src);
+    if (n < MEM_VECTOR_THRESHOLD) {
+        copy_movsd(d, s, n);
+        return;
     }
-    
-    return dest;
+
+    size_t head = (32 - (reinterpret_cast<uintptr_t>(d) & 31)) & 31;
+    rep_movsb(d, s, head);
+    d += head;
+    s += head;
+    n -= head;
+
+    size_t blocks = n / 128;
+    uint8_t save[128];
+    if (blocks > 0) {
+        asm volatile (
+            "vmovdqu %%ymm0, 0(%[sv])\n\t"
+            "vmovdqu %%ymm1, 32(%[sv])\n\t"
+            "vmovdqu %%ymm2, 64(%[sv])\n\t"
+            "vmovdqu %%ymm3, 96(%[sv])\n\t"
+            "1:\n\t"
+            "vmovdqu 0(%[s]), %%ymm0\n\t"
+            "vmovdqu 32(%[s]), %%ymm1\n\t"
+            "vmovdqu 64(%[s]), %%ymm2\n\t"
+            "vmovdqu 96(%[s]), %%ymm3\n\t"
+            "vmovdqa %%ymm0, 0(%[d])\n\t"
+            "vmovdqa %%ymm1, 32(%[d])\n\t"
+            "vmovdqa %%ymm2, 64(%[d])\n\t"
+            "vmovdqa %%ymm3, 96(%[d])\n\t"
+            "add $128, %[s]\n\t"
+            "add $128, %[d]\n\t"
+            "dec %[n]\n\t"
+            "jnz 1b\n\t"
+            "vmovdqu 0(%[sv]), %%ymm0\n\t"
+            "vmovdqu 32(%[sv]), %%ymm1\n\t"
+            "vmovdqu 64(%[sv]), %%ymm2\n\t"
+            "vmovdqu 96(%[sv]), %%ymm3\n\t"
+            : [d] "+r"(d), [s] "+r"(s), [n] "+r"(blocks)
+            : [sv] "r"(save)
+            : "memory", "cc");
+    }
+
+    copy_movsd(d, s, n & 127);
 }
 
-void* memset(void* dest, int val, size_t n) {
-    unsigned char* d = static_cast<unsigned char*>(dest);
-    unsigned char v = static_cast<unsigned char>(val);
-    
-    // Check for word-aligned addresses for optimization
-    if (((reinterpret_cast<uintptr_t>(dest) & 0x3) == 0) && n >= 4) {
-        // Fill 4 bytes at a time when possible
-        size_t words = n / 4;
-        uint32_t v32 = v | (v << 8) | (v << 16) | (v << 24);
-        uint32_t* d32 = static_cast<uint32_t*>(dest);
-        
-        for (size_t i = 0; i < words; i++) {
-            d32[i] = v32;
-        }
-        
-        // Handle remaining bytes
-        for (size_t i = words * 4; i < n; i++) {
-            d[i] = v;
-        }
-    } else {
-        // Byte-by-byte fill for unaligned addresses
-        for (size_t i = 0; i < n; i++) {
-            d[i] = v;
-        }
+static void fill_stosd(void* dest, uint8_t v, size_t n) {
+    size_t body = n & ~(size_t)3;
+    rep_stosd(dest, v * 0x01010101u, n / 4);
+    rep_stosb(static_cast<uint8_t*>(dest) + body, v, n & 3);
+}
+
+static void fill_stosb(void* dest, uint8_t v, size_t n) {
+    rep_stosb(dest, v, n);
+}
+
+static void fill_sse2(void* dest, uint8_t v, size_t n) {
+    uint8_t* d = static_cast<uint8_t*>(dest);
+    if (n < MEM_VECTOR_THRESHOLD) {
+        fill_stosd(d, v, n);
+        return;
     }
-    
-    return dest;
+
+    size_t head = (16 - (reinterpret_cast<uintptr_t>(d) & 15)) & 15;
+    rep_stosb(d, v, head);
+    d += head;
+    n -= head;
+
+    uint8_t pattern[16];
+    for (int i = 0; i < 16; i++) pattern[i] = v;
+    size_t blocks = n / 64;
+    uint8_t save[16];
+    asm volatile (
+        "movdqu %%xmm0, (%[sv])\n\t"
+        "movdqu (%[p]), %%xmm0\n\t"
+        "1:\n\t"
+        "movdqa %%xmm0, 0(%[d])\n\t"
+        "movdqa %%xmm0, 16(%[d])\n\t"
+        "movdqa %%xmm0, 32(%[d])\n\t"
+        "movdqa %%xmm0, 48(%[d])\n\t"
+        "add $64, %[d]\n\t"
+        "dec %[n]\n\t"
+        "jnz 1b\n\t"
+        "movdqu (%[sv]), %%xmm0\n\t"
+        : [d] "+r"(d), [n] "+r"(blocks)
+        : [sv] "r"(save), [p] "r"(pattern)
+        : "memory", "cc");
+
+    fill_stosd(d, v, n & 63);
 }
 
-int memcmp(const void* s1, const void* s2, size_t n) {
+static void fill_avx2(void* dest, uint8_t v, size_t n) {
+    uint8_t* d = static_cast<uint8_t*>(dest);
+    if (n < MEM_VECTOR_THRESHOLD) {
+        fill_stosd(d, v, n);
+        return;
+    }
+
+    size_t head = (32 - (reinterpret_cast<uintptr_t>(d) & 31)) & 31;
+    rep_stosb(d, v, head);
+    d += head;
+    n -= head;
+
+    uint8_t pattern[32];
+    for (int i = 0; i < 32; i++) pattern[i] = v;
+    size_t blocks = n / 128;
+    uint8_t save[32];
+    if (blocks > 0) {
+        asm volatile (
+            "vmovdqu %%ymm0, (%[sv])\n\t"
+            "vmovdqu (%[p]), %%ymm0\n\t"
+            "1:\n\t"
+            "vmovdqa %%ymm0, 0(%[d])\n\t"
+            "vmovdqa %%ymm0, 32(%[d])\n\t"
+            "vmovdqa %%ymm0, 64(%[d])\n\t"
+            "vmovdqa %%ymm0, 96(%[d])\n\t"
+            "add $128, %[d]\n\t"
+            "dec %[n]\n\t"
+            "jnz 1b\n\t"
+            "vmovdqu (%[sv]), %%ymm0\n\t"
+            : [d] "+r"(d), [n] "+r"(blocks)
+            : [sv] "r"(save), [p] "r"(pattern)
+            : "memory", "cc");
+    }
+
+    fill_stosd(d, v, n & 127);
+}
+
+static int compare_scalar(const void* s1, const void* s2, size_t n) {
     const unsigned char* p1 = static_cast<const unsigned char*>(s1);
     const unsigned char* p2 = static_cast<const unsigned char*>(s2);
     
@@ -129,6 +268,181 @@ int memcmp(const void* s1, const void* s2, size_t n) {
     return 0;
 }
 
+// The vector compares skip whole equal blocks, then leave the block holding the
+// first difference (or the tail) to compare_scalar
+static int compare_sse2(const void* s1, const void* s2, size_t n) {
+    const uint8_t* a = static_cast<const uint8_t*>(s1);
+    const uint8_t* b = static_cast<const uint8_t*>(s2);
+    size_t blocks = n / 16;
+    if (n >= 64) {
+        size_t left = blocks;
+        uint32_t mask;
+        uint8_t save[32];
+        asm volatile (
+            "movdqu %%xmm0, 0(%[sv])\n\t"
+            "movdqu %%xmm1, 16(%[sv])\n\t"
+            "1:\n\t"
+            "movdqu (%[a]), %%xmm0\n\t"
+            "movdqu (%[b]), %%xmm1\n\t"
+            "pcmpeqb %%xmm1, %%xmm0\n\t"
+            "pmovmskb %%xmm0, %[m]\n\t"
+            "cmp $0xffff, %[m]\n\t"
+            "jne 2f\n\t"
+            "add $16, %[a]\n\t"
+            "add $16, %[b]\n\t"
+            "dec %[n]\n\t"
+            "jnz 1b\n\t"
+            "2:\n\t"
+            "movdqu 0(%[sv]), %%xmm0\n\t"
+            "movdqu 16(%[sv]), %%xmm1\n\t"
+            : [a] "+r"(a), [b] "+r"(b), [n] "+r"(left), [m] "=&r"(mask)
+            : [sv] "r"(save)
+            : "memory", "cc");
+        n -= (blocks - left) * 16;
+    }
+    return compare_scalar(a, b, n);
+}
+
+static int compare_avx2(const void* s1, const void* s2, size_t n) {
+    const uint8_t* a = static_cast<const uint8_t*>(s1);
+    const uint8_t* b = static_cast<const uint8_t*>(s2);
+    size_t blocks = n / 32;
+    if (n >= 128) {
+        size_t left = blocks;
+        uint32_t mask;
+        uint8_t save[64];
+        asm volatile (
+            "vmovdqu %%ymm0, 0(%[sv])\n\t"
+            "vmovdqu %%ymm1, 32(%[sv])\n\t"
+            "1:\n\t"
+            "vmovdqu (%[a]), %%ymm0\n\t"
+            "vmovdqu (%[b]), %%ymm1\n\t"
+            "vpcmpeqb %%ymm1, %%ymm0, %%ymm0\n\t"
+            "vpmovmskb %%ymm0, %[m]\n\t"
+            "cmp $0xffffffff, %[m]\n\t"
+            "jne 2f\n\t"
+            "add $32, %[a]\n\t"
+            "add $32, %[b]\n\t"
+            "dec %[n]\n\t"
+            "jnz 1b\n\t"
+            "2:\n\t"
+            "vmovdqu 0(%[sv]), %%ymm0\n\t"
+            "vmovdqu 32(%[sv]), %%ymm1\n\t"
+            : [a] "+r"(a), [b] "+r"(b), [n] "+r"(left), [m] "=&r"(mask)
+            : [sv] "r"(save)
+            : "memory", "cc");
+        n -= (blocks - left) * 32;
+    }
+    return compare_scalar(a, b, n);
+}
+
+static void (*copy_kernel)(void*, const void*, size_t) = copy_movsd;
+static void (*fill_kernel)(void*, uint8_t, size_t) = fill_stosd;
+static int (*compare_kernel)(const void*, const void*, size_t) = compare_scalar;
+static const char* copy_kernel_name = "rep movsd";
+static const char* compare_kernel_name = "scalar";
+static uint32_t mem_features = 0;
+
+void mem_ops_init() {
+    uint32_t features = cpu_simd_enable();
+    mem_features = features;
+
+    if (features & CPU_FEATURE_SSE2) {
+        copy_kernel = copy_sse2;
+        fill_kernel = fill_sse2;
+        compare_kernel = compare_sse2;
+        copy_kernel_name = "SSE2";
+        compare_kernel_name = "SSE2";
+    }
+    // Fast strings beat 16-byte SSE2 loops on CPUs that have them, but not 32-byte AVX2 ones
+    if (features & CPU_FEATURE_ERMS) {
+        copy_kernel = copy_movsb;
+        fill_kernel = fill_stosb;
+        copy_kernel_name = "ERMS rep movsb";
+    }
+    if (features & CPU_FEATURE_AVX2) {
+        copy_kernel = copy_avx2;
+        fill_kernel = fill_avx2;
+        compare_kernel = compare_avx2;
+        copy_kernel_name = "AVX2";
+        compare_kernel_name = "AVX2";
+    }
+}
+
+void mem_ops_print() {
+    printf("Memory kernels: copy/fill %s, compare %s\n", copy_kernel_name, compare_kernel_name);
+}
+
+int mem_ops_kernels(const mem_kernel** kernels) {
+    static mem_kernel usable[4];
+    int count = 0;
+    usable[count++] = { "rep movsd", copy_movsd, fill_stosd, false };
+    usable[count++] = { "rep movsb", copy_movsb, fill_stosb, false };
+    if (mem_features & CPU_FEATURE_SSE2) usable[count++] = { "SSE2", copy_sse2, fill_sse2, false };
+    if (mem_features & CPU_FEATURE_AVX2) usable[count++] = { "AVX2", copy_avx2, fill_avx2, false };
+    for (int i = 0; i < count; i++) usable[i].active = usable[i].copy == copy_kernel;
+    *kernels = usable;
+    return count;
+}
+
+void* memcpy(void* dest, const void* src, size_t n) {
+    copy_kernel(dest, src, n);
+    return dest;
+}
+
+void* memmove(void* dest, const void* src, size_t n) {
+    uint8_t* d = static_cast<uint8_t*>(dest);
+    const uint8_t* s = static_cast<const uint8_t*>(src);
+    
+    // Copying forwards is safe unless the destination starts inside the source
+    if (d == s || n == 0) return dest;
+    if (reinterpret_cast<uintptr_t>(d) - reinterpret_cast<uintptr_t>(s) >= n) {
+        copy_kernel(d, s, n);
+        return dest;
+    }
+
+    // Overlapping with dest above src: copy backwards, the odd tail bytes first
+    while (n & 3) {
+        n--;
+        d[n] = s[n];
+    }
+    // No interrupt may run C code while DF is set, so interrupts stay off for
+    // the std/cld window, one 64KB piece at a time to bound their latency
+    void* dw = d + n - 4;
+    const void* sw = s + n - 4;
+    size_t words = n / 4;
+    while (words > 0) {
+        size_t piece = words < 16384 ? words : 16384;
+        words -= piece;
+        uint32_t flags = irq_save();
+        asm volatile ("std\n\trep movsl\n\tcld" : "+D"(dw), "+S"(sw), "+c"(piece) : : "memory");
+        irq_restore(flags);
+    }
+    
+    return dest;
+}
+
+void* memset(void* dest, int val, size_t n) {
+    fill_kernel(dest, static_cast<uint8_t>(val), n);
+    return dest;
+}
+
+int memcmp(const void* s1, const void* s2, size_t n) {
+    return compare_kernel(s1, s2, n);
+}
+
+// Entry points for string.cpp, whose C-linkage memcpy/memset the compiler calls
+// for struct copies and initialisers
+void* kernel_memcpy(void* dest, const void* src, size_t n) {
+    copy_kernel(dest, src, n);
+    return dest;
+}
+
+void* kernel_memset(void* dest, int val, size_t n) {
+    fill_kernel(dest, static_cast<uint8_t>(val), n);
+    return dest;
+}
+
 char* strncpy(char* dest, const char* src, size_t n) {
     char* original_dest = dest;
     size_t i;
@@ -207,509 +521,578 @@ char* strrchr(const char* s, int c) {
     return const_cast<char*>(last);
 }
 
-// Simple kernel-level printf implementation
-int printf(const char* format, ...) {
-    va_list args;
-    va_start(args, format);
-    
-    int chars_written = 0;
-    
-    for (const char* p = format; *p; p++) {
-        if (*p != '%') {
-            terminal_putchar(*p);
-            chars_written++;
-            continue;
+// --- Formatting engine ---
+// printf, sprintf, snprintf and the output streams all go through
+// format_vprint(). Nothing is allocated: output collects in the caller's sink
+// buffer, and numbers are converted two decimal digits per step from a table.
+
+static const char digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+static const char hex_lower[] = "0123456789abcdef";
+static const char hex_upper[] = "0123456789ABCDEF";
+
+// Write the digits of 'value' backwards, ending just before 'end'. Returns the first digit
+static char* format_digits(char* end, uint64_t value, int base, bool upper) {
+    char* p = end;
+    if (base == 16) {
+        const char* digits = upper ? hex_upper : hex_lower;
+        do {
+            *--p = digits[value & 0xF];
+            value >>= 4;
+        } while (value);
+        return p;
+    }
+
+    // Only the top digits of a full 64-bit value need the (slow) 64-bit divide
+    while (value > 0xFFFFFFFFu) {
+        uint32_t low = (uint32_t)(value % 100);
+        value /= 100;
+        p -= 2;
+        p[0] = digit_pairs[low * 2];
+        p[1] = digit_pairs[low * 2 + 1];
+    }
+    uint32_t v = (uint32_t)value;
+    while (v >= 100) {
+        uint32_t low = v % 100;
+        v /= 100;
+        p -= 2;
+        p[0] = digit_pairs[low * 2];
+        p[1] = digit_pairs[low * 2 + 1];
+    }
+    if (v >= 10) {
+        p -= 2;
+        p[0] = digit_pairs[v * 2];
+        p[1] = digit_pairs[v * 2 + 1];
+    } else {
+        *--p = (char)('0' + v);
+    }
+    return p;
+}
+
+int format_unsigned(char* out, uint64_t value, int base, bool upper) {
+    char tmp[FORMAT_NUMBER_MAX];
+    char* end = tmp + sizeof(tmp);
+    char* p = format_digits(end, value, base, upper);
+    int len = (int)(end - p);
+    memcpy(out, p, len);
+    out[len] = '\0';
+    return len;
+}
+
+int format_signed(char* out, int64_t value) {
+    if (value < 0) {
+        out[0] = '-';
+        return 1 + format_unsigned(out + 1, 0 - (uint64_t)value, 10, false);
+    }
+    return format_unsigned(out, (uint64_t)value, 10, false);
+}
+
+void format_sink_init(format_sink* sink, char* buf, size_t size, void (*flush)(format_sink*)) {
+    sink->buf = buf;
+    sink->size = size;
+    sink->len = 0;
+    sink->total = 0;
+    sink->flush = flush;
+}
+
+static void sink_write(format_sink* sink, const char* data, size_t n) {
+    sink->total += n;
+    while (n > 0) {
+        size_t room = sink->size - sink->len;
+        if (room == 0) {
+            if (!sink->flush) return;  // Truncated: keep counting, stop storing
+            sink->flush(sink);
+            room = sink->size;
         }
-        
-        // Handle format specifier
-        switch (*++p) {
-            case 'c': {
-                char c = va_arg(args, int);  // char is promoted to int in varargs
-                terminal_putchar(c);
-                chars_written++;
-                break;
+        size_t chunk = n < room ? n : room;
+        memcpy(sink->buf + sink->len, data, chunk);
+        sink->len += chunk;
+        data += chunk;
+        n -= chunk;
+    }
+}
+
+static void sink_fill(format_sink* sink, char c, int n) {
+    char pad[16];
+    memset(pad, c, sizeof(pad));
+    while (n > 0) {
+        int chunk = n < (int)sizeof(pad) ? n : (int)sizeof(pad);
+        sink_write(sink, pad, chunk);
+        n -= chunk;
+    }
+}
+
+#define FMT_LEFT   0x01  // '-'
+#define FMT_ZERO   0x02  // '0'
+#define FMT_PLUS   0x04  // '+'
+#define FMT_SPACE  0x08  // ' '
+#define FMT_ALT    0x10  // '#'
+
+// Emit a string of 'len' characters space-padded to 'width'
+static void sink_padded(format_sink* sink, const char* s, int len, int flags, int width) {
+    if (!(flags & FMT_LEFT)) sink_fill(sink, ' ', width - len);
+    sink_write(sink, s, len);
+    if (flags & FMT_LEFT) sink_fill(sink, ' ', width - len);
+}
+
+// Emit prefix + zero padding up to 'precision' + digits, padded to 'width'
+static void format_number(format_sink* sink, uint64_t value, bool negative, int base, bool upper,
+                          int flags, int width, int precision) {
+    char tmp[FORMAT_NUMBER_MAX];
+    char* end = tmp + sizeof(tmp);
+    char* digits = end;
+    if (value != 0 || precision != 0) digits = format_digits(end, value, base, upper);
+    int ndigits = (int)(end - digits);
+
+    char prefix[2];
+    int nprefix = 0;
+    if (negative) prefix[nprefix++] = '-';
+    else if (flags & FMT_PLUS) prefix[nprefix++] = '+';
+    else if (flags & FMT_SPACE) prefix[nprefix++] = ' ';
+    if ((flags & FMT_ALT) && base == 16 && value != 0) {
+        prefix[nprefix++] = '0';
+        prefix[nprefix++] = upper ? 'X' : 'x';
+    }
+
+    int zeros = precision > ndigits ? precision - ndigits : 0;
+    int pad = width - nprefix - zeros - ndigits;
+    if (pad < 0) pad = 0;
+    if ((flags & FMT_ZERO) && !(flags & FMT_LEFT) && precision < 0) {
+        zeros += pad;
+        pad = 0;
+    }
+
+    if (!(flags & FMT_LEFT)) sink_fill(sink, ' ', pad);
+    sink_write(sink, prefix, nprefix);
+    sink_fill(sink, '0', zeros);
+    sink_write(sink, digits, ndigits);
+    if (flags & FMT_LEFT) sink_fill(sink, ' ', pad);
+}
+
+int format_vprint(format_sink* sink, const char* format, va_list args) {
+    const char* p = format;
+    while (*p) {
+        // Copy the literal run up to the next conversion in one go
+        const char* run = p;
+        while (*p && *p != '%') p++;
+        if (p != run) sink_write(sink, run, p - run);
+        if (!*p) break;
+        const char* spec = p++;
+
+        int flags = 0;
+        for (;; p++) {
+            if (*p == '-') flags |= FMT_LEFT;
+            else if (*p == '0') flags |= FMT_ZERO;
+            else if (*p == '+') flags |= FMT_PLUS;
+            else if (*p == ' ') flags |= FMT_SPACE;
+            else if (*p == '#') flags |= FMT_ALT;
+            else break;
+        }
+
+        int width = 0;
+        if (*p == '*') {
+            width = va_arg(args, int);
+            if (width < 0) {
+                flags |= FMT_LEFT;
+                width = -width;
             }
-            case 's': {
-                const char* s = va_arg(args, const char*);
-                while (*s) {
-                    terminal_putchar(*s++);
-                    chars_written++;
-                }
-                break;
+            p++;
+        } else {
+            while (*p >= '0' && *p <= '9') width = width * 10 + (*p++ - '0');
+        }
+
+        int precision = -1;
+        if (*p == '.') {
+            p++;
+            precision = 0;
+            if (*p == '*') {
+                precision = va_arg(args, int);
+                p++;
+            } else {
+                while (*p >= '0' && *p <= '9') precision = precision * 10 + (*p++ - '0');
             }
-            case 'd': 
+        }
+
+        int longs = 0;   // Count of 'l' modifiers; 'z' is int-sized on this target
+        int shorts = 0;  // 'h' narrows to short, 'hh' to char
+        while (*p == 'l' || *p == 'h' || *p == 'z') {
+            if (*p == 'l') longs++;
+            else if (*p == 'h') shorts++;
+            p++;
+        }
+
+        switch (*p) {
+            case 'd':
             case 'i': {
-                int num = va_arg(args, int);
-                // Handle negative numbers
-                if (num < 0) {
-                    terminal_putchar('-');
-                    chars_written++;
-                    num = -num;
-                }
-                
-                // Convert to string and print digits
-                char buffer[12];  // Enough for 32-bit int
-                int i = 0;
-                
-                // Handle 0 specially
-                if (num == 0) {
-                    terminal_putchar('0');
-                    chars_written++;
-                } else {
-                    // Convert digits
-                    while (num > 0) {
-                        buffer[i++] = '0' + (num % 10);
-                        num /= 10;
-                    }
-                    
-                    // Print in reverse order
-                    while (--i >= 0) {
-                        terminal_putchar(buffer[i]);
-                        chars_written++;
-                    }
-                }
-                break;
-            }
-            case 'u': {
-                unsigned int num = va_arg(args, unsigned int);
-                char buffer[12];  // Enough for 32-bit unsigned
-                int i = 0;
-                
-                // Handle 0 specially
-                if (num == 0) {
-                    terminal_putchar('0');
-                    chars_written++;
-                } else {
-                    // Convert digits
-                    while (num > 0) {
-                        buffer[i++] = '0' + (num % 10);
-                        num /= 10;
-                    }
-                    
-                    // Print in reverse order
-                    while (--i >= 0) {
-                        terminal_putchar(buffer[i]);
-                        chars_written++;
-                    }
-                }
+                int64_t num = longs >= 2 ? va_arg(args, long long)
+                            : longs == 1 ? va_arg(args, long) : va_arg(args, int);
+                if (shorts == 1) num = (short)num;
+                else if (shorts >= 2) num = (signed char)num;
+                uint64_t magnitude = num < 0 ? 0 - (uint64_t)num : (uint64_t)num;
+                format_number(sink, magnitude, num < 0, 10, false, flags, width, precision);
                 break;
             }
-            case 'x': {
-                unsigned int num = va_arg(args, unsigned int);
-                char buffer[12];  // Enough for 32-bit hex
-                int i = 0;
-                
-                // Handle 0 specially
-                if (num == 0) {
-                    terminal_putchar('0');
-                    chars_written++;
-                } else {
-                    // Convert digits
-                    while (num > 0) {
-                        int digit = num % 16;
-                        buffer[i++] = digit < 10 ? '0' + digit : 'a' + (digit - 10);
-                        num /= 16;
-                    }
-                    
-                    // Print in reverse order
-                    while (--i >= 0) {
-                        terminal_putchar(buffer[i]);
-                        chars_written++;
-                    }
-                }
+            case 'u':
+            case 'x':
+            case 'X': {
+                uint64_t num = longs >= 2 ? va_arg(args, unsigned long long)
+                             : longs == 1 ? va_arg(args, unsigned long) : va_arg(args, unsigned int);
+                if (shorts == 1) num = (unsigned short)num;
+                else if (shorts >= 2) num = (unsigned char)num;
+                int base = *p == 'u' ? 10 : 16;
+                format_number(sink, num, false, base, *p == 'X', flags & ~(FMT_PLUS | FMT_SPACE), width, precision);
                 break;
             }
             case 'p': {
-                terminal_putchar('0');
-                terminal_putchar('x');
-                chars_written += 2;
-                
-                void* ptr = va_arg(args, void*);
-                uintptr_t num = reinterpret_cast<uintptr_t>(ptr);
-                
-                char buffer[12];  // Enough for 32-bit pointer
-                int i = 0;
-                
-                // Handle null pointer
-                if (num == 0) {
-                    terminal_putchar('0');
-                    chars_written++;
-                } else {
-                    // Convert digits
-                    while (num > 0) {
-                        int digit = num % 16;
-                        buffer[i++] = digit < 10 ? '0' + digit : 'a' + (digit - 10);
-                        num /= 16;
-                    }
-                    
-                    // Print in reverse order
-                    while (--i >= 0) {
-                        terminal_putchar(buffer[i]);
-                        chars_written++;
-                    }
-                }
-                break;
-            }
-            case '%': {
-                terminal_putchar('%');
-                chars_written++;
-                break;
-            }
-            default: {
-                // Unknown format specifier, just output it
-                terminal_putchar('%');
-                terminal_putchar(*p);
-                chars_written += 2;
+                // Always "0x" + hex, null pointers included
+                char tmp[FORMAT_NUMBER_MAX + 2] = { '0', 'x' };
+                uintptr_t num = reinterpret_cast<uintptr_t>(va_arg(args, void*));
+                int len = 2 + format_unsigned(tmp + 2, num, 16, false);
+                sink_padded(sink, tmp, len, flags, width);
                 break;
             }
-        }
-    }
-    
-    va_end(args);
-    return chars_written;
-}
-
-int sprintf(char* str, const char* format, ...) {
-    va_list args;
-    va_start(args, format);
-    
-    int chars_written = 0;
-    
-    for (const char* p = format; *p; p++) {
-        if (*p != '%') {
-            str[chars_written++] = *p;
-            continue;
-        }
-        
-        // Handle format specifier
-        switch (*++p) {
             case 'c': {
-                char c = va_arg(args, int);  // char is promoted to int in varargs
-                str[chars_written++] = c;
+                char c = (char)va_arg(args, int);  // char is promoted to int in varargs
+                sink_padded(sink, &c, 1, flags, width);
                 break;
             }
             case 's': {
                 const char* s = va_arg(args, const char*);
-                while (*s) {
-                    str[chars_written++] = *s++;
-                }
-                break;
-            }
-            case 'd': 
-            case 'i': {
-                int num = va_arg(args, int);
-                // Handle negative numbers
-                if (num < 0) {
-                    str[chars_written++] = '-';
-                    num = -num;
-                }
-                
-                // Convert to string and print digits
-                char buffer[12];  // Enough for 32-bit int
-                int i = 0;
-                
-                // Handle 0 specially
-                if (num == 0) {
-                    str[chars_written++] = '0';
-                } else {
-                    // Convert digits
-                    while (num > 0) {
-                        buffer[i++] = '0' + (num % 10);
-                        num /= 10;
-                        }
-                    
-                    // Print in reverse order
-                    while (--i >= 0) {
-                        str[chars_written++] = buffer[i];
-                    }
-                }
+                if (!s) s = "(null)";
+                int len = 0;
+                while ((precision < 0 || len < precision) && s[len]) len++;
+                sink_padded(sink, s, len, flags, width);
                 break;
             }
-            case 'u': {
-                unsigned int num = va_arg(args, unsigned int);
-                char buffer[12];  // Enough for 32-bit unsigned
-                int i = 0;
-                
-                // Handle 0 specially
-                if (num == 0) {
-                    str[chars_written++] = '0';
-                } else {
-                    // Convert digits
-                    while (num > 0) {
-                        buffer[i++] = '0' + (num % 10);
-                        num /= 10;
-                    }
-                    
-                    // Print in reverse order
-                    while (--i >= 0) {
-                        str[chars_written++] = buffer[i];
-                    }
-                }
+            case '%':
+                sink_write(sink, "%", 1);
                 break;
-            }
-            case 'x': {
-                unsigned int num = va_arg(args, unsigned int);
-                char buffer[12];  // Enough for 32-bit hex
-                int i = 0;
-                
-                // Handle 0 specially
-                if (num == 0) {
-                    str[chars_written++] = '0';
-                } else {
-                    // Convert digits
-                    while (num > 0) {
-                        int digit = num % 16;
-                        buffer[i++] = digit < 10 ? '0' + digit : 'a' + (digit - 10);
-                        num /= 16;
-                    }
-                    
-                    // Print in reverse order
-                    while (--i >= 0) {
-                        str[chars_written++] = buffer[i];
-                    }
+            default:
+                // Unknown conversion: print it as written
+                if (!*p) {
+                    sink_write(sink, spec, p - spec);
+                    return (int)sink->total;
                 }
+                sink_write(sink, spec, p + 1 - spec);
                 break;
-            }
-            case 'p': {
-                str[chars_written++] = '0';
-                str[chars_written++] = 'x';
-                
-                void* ptr = va_arg(args, void*);
-                uintptr_t num = reinterpret_cast<uintptr_t>(ptr);
-                
-                char buffer[12];  // Enough for 32-bit pointer
-                int i = 0;
-                
-                // Handle null pointer
-                if (num == 0) {
-                    str[chars_written++] = '0';
-                } else {
-                    // Convert digits
-                    while (num > 0) {
-                        int digit = num % 16;
-                        buffer[i++] = digit < 10 ? '0' + digit : 'a' + (digit - 10);
-                        num /= 16;
-                    }
-                    
-                    // Print in reverse order
-                    while (--i >= 0) {
-                        str[chars_written++] = buffer[i];
-                    }
-                }
-                break;
-            }
-            case '%': {
-                str[chars_written++] = '%';
-                break;
-            }
-            default: {
-                // Unknown format specifier, just output it
-                str[chars_written++] = '%';
-                str[chars_written++] = *p;
-                break;
-            }
         }
+        p++;
     }
-    
-    // Null-terminate the string
-    str[chars_written] = '\0';
-    
+    return (int)sink->total;
+}
+
+// printf output is collected here and handed to the console a chunk at a time
+#define PRINTF_BUFFER_SIZE 256
+
+static void console_sink_flush(format_sink* sink) {
+    cout.write(sink->buf, sink->len);
+    sink->len = 0;
+}
+
+int vprintf(const char* format, va_list args) {
+    char buffer[PRINTF_BUFFER_SIZE];
+    format_sink sink;
+    format_sink_init(&sink, buffer, sizeof(buffer), console_sink_flush);
+    int written = format_vprint(&sink, format, args);
+    if (sink.len > 0) console_sink_flush(&sink);
+    return written;
+}
+
+int printf(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int written = vprintf(format, args);
     va_end(args);
-    return chars_written;
+    return written;
+}
+
+int vsnprintf(char* str, size_t size, const char* format, va_list args) {
+    format_sink sink;
+    format_sink_init(&sink, str, size > 0 ? size - 1 : 0, nullptr);  // Keep room for the NUL
+    int written = format_vprint(&sink, format, args);
+    if (size > 0) str[sink.len] = '\0';
+    return written;  // Length the full output would have had
 }
 
 int snprintf(char* str, size_t size, const char* format, ...) {
     va_list args;
     va_start(args, format);
+    int written = vsnprintf(str, size, format, args);
+    va_end(args);
+    return written;
+}
+
+int sprintf(char* str, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int written = vsnprintf(str, (size_t)-1 / 2, format, args);  // Unbounded, as sprintf has always been
+    va_end(args);
+    return written;
+}
+
+// KernelHeap implementation
+void KernelHeap::init() {
+    for (int c = 0; c < CLASS_COUNT; c++) {
+        partial_pages[c] = NO_PAGE;
+    }
+    arena_count = 0;
+    page_total = 0;
+    add_arena(heap_space, PAGE_COUNT);
+    initialized = true;
+}
+
+// Every page of a new arena starts out free; slab pages are carved on demand
+bool KernelHeap::add_arena(uint8_t* base, size_t page_count) {
+    if (arena_count == MAX_ARENAS || page_total + page_count > MAX_PAGES) return false;
+    Arena& arena = arenas[arena_count++];
+    arena.base = base;
+    arena.first_page = page_total;
+    arena.page_count = (int)page_count;
+    arena.free_pages = (int)page_count;
+    for (size_t i = 0; i < page_count; i++) {
+        PageInfo& info = pages[page_total + i];
+        info.kind = PAGE_FREE;
+        info.in_use = 0;
+        info.run_pages = 0;
+        info.prev = info.next = NO_PAGE;
+        info.free_objects = nullptr;
+    }
+    page_total += (int)page_count;
+    return true;
+}
+
+// Take a new arena of at least 'count' pages, aligned to 'alignment', from the
+// frame allocator. Fails before frame_init() and once MAX_PAGES are in use
+bool KernelHeap::grow(size_t count, size_t alignment) {
+    if (!frame_ready() || arena_count == MAX_ARENAS) return false;
+    size_t want = (count > ARENA_SIZE / PAGE_SIZE) ? count : ARENA_SIZE / PAGE_SIZE;
+    size_t left = MAX_PAGES - page_total;
+    if (want > left) want = left;
+    if (want < count) return false;
     
-    int chars_written = 0;
-    size_t remaining = size > 0 ? size - 1 : 0;  // Leave room for null terminator
-    
-    for (const char* p = format; *p && remaining > 0; p++) {
-        if (*p != '%') {
-            str[chars_written++] = *p;
-            remaining--;
-            continue;
-        }
-        
-        // Handle format specifier (abbreviated implementation)
-        switch (*++p) {
-            case 'c': {
-                if (remaining > 0) {
-                    char c = va_arg(args, int);
-                    str[chars_written++] = c;
-                    remaining--;
-                } else {
-                    va_arg(args, int);  // Consume but don't write
-                }
-                break;
-            }
-            case 's': {
-                const char* s = va_arg(args, const char*);
-                while (*s && remaining > 0) {
-                    str[chars_written++] = *s++;
-                    remaining--;
-                }
-                // Skip remaining characters if no space
-                while (*s) s++;
-                break;
-            }
-            case 'd': 
-            case 'i': {
-                int num = va_arg(args, int);
-                // Handle negative numbers
-                if (num < 0 && remaining > 0) {
-                    str[chars_written++] = '-';
-                    remaining--;
-                    num = -num;
-                }
-                
-                // Convert to string
-                char buffer[12];  // Enough for 32-bit int
-                int i = 0;
-                
-                // Handle 0 specially
-                if (num == 0) {
-                    if (remaining > 0) {
-                        str[chars_written++] = '0';
-                        remaining--;
-                    }
-                } else {
-                    // Convert digits
-                    while (num > 0) {
-                        buffer[i++] = '0' + (num % 10);
-                        num /= 10;
-                    }
-                    
-                    // Print in reverse order
-                    while (--i >= 0 && remaining > 0) {
-                        str[chars_written++] = buffer[i];
-                        remaining--;
-                    }
+    // PAGE_SIZE == FRAME_SIZE, so heap pages and frames line up one to one
+    uintptr_t base = frame_alloc((uint32_t)want, (uint32_t)(alignment / FRAME_SIZE));
+    if (base == 0) return false;
+    return add_arena(reinterpret_cast<uint8_t*>(base), want);
+}
+
+// Arena holding 'p', or -1 if it isn't heap memory. The static arena is checked first
+int KernelHeap::arena_of(const uint8_t* p) {
+    for (int a = 0; a < arena_count; a++) {
+        if (p >= arenas[a].base && p < arenas[a].base + (size_t)arenas[a].page_count * PAGE_SIZE) return a;
+    }
+    return -1;
+}
+
+uint8_t* KernelHeap::page_address(int arena, int page) {
+    return arenas[arena].base + (size_t)(page - arenas[arena].first_page) * PAGE_SIZE;
+}
+
+// Index of the smallest size class holding 'size' bytes
+int KernelHeap::size_class(size_t size) {
+    if (size <= MIN_CLASS_SIZE) return 0;
+    return (32 - __builtin_clz((uint32_t)(size - 1))) - 4; // log2(MIN_CLASS_SIZE) == 4
+}
+
+void KernelHeap::link_partial(int page) {
+    int cls = pages[page].size_class;
+    pages[page].prev = NO_PAGE;
+    pages[page].next = partial_pages[cls];
+    if (partial_pages[cls] != NO_PAGE) pages[partial_pages[cls]].prev = page;
+    partial_pages[cls] = page;
+}
+
+void KernelHeap::unlink_partial(int page) {
+    int cls = pages[page].size_class;
+    if (pages[page].prev != NO_PAGE) pages[pages[page].prev].next = pages[page].next;
+    else partial_pages[cls] = pages[page].next;
+    if (pages[page].next != NO_PAGE) pages[pages[page].next].prev = pages[page].prev;
+    pages[page].prev = pages[page].next = NO_PAGE;
+}
+
+// First run of 'count' free pages whose address is a multiple of 'alignment',
+// growing the heap by an arena if none is free. A run never crosses arenas, and
+// arenas without enough free pages are skipped unscanned.
+// Returns the first page index (with its arena in '*arena') or NO_PAGE
+int KernelHeap::find_page_run(size_t count, size_t alignment, int* arena) {
+    for (int pass = 0; pass < 2; pass++) {
+        for (int a = 0; a < arena_count; a++) {
+            if ((size_t)arenas[a].free_pages < count) continue;
+            size_t run = 0;
+            int first = arenas[a].first_page;
+            for (int i = first; i < first + arenas[a].page_count; i++) {
+                if (pages[i].kind != PAGE_FREE) {
+                    run = 0;
+                    continue;
                 }
-                break;
-            }
-            case 'u':
-            case 'x':
-            case 'p': {
-                // Just consume the argument but don't process to keep example simple
-                va_arg(args, unsigned int);
-                break;
-            }
-            case '%': {
-                if (remaining > 0) {
-                    str[chars_written++] = '%';
-                    remaining--;
+                if (run == 0 && ((uintptr_t)page_address(a, i) & (alignment - 1)) != 0) {
+                    continue;
                 }
-                break;
-            }
-            default: {
-                // Unknown format specifier, just output it if room
-                if (remaining >= 2) {
-                    str[chars_written++] = '%';
-                    str[chars_written++] = *p;
-                    remaining -= 2;
-                } else if (remaining == 1) {
-                    str[chars_written++] = '%';
-                    remaining = 0;
+                if (++run == count) {
+                    *arena = a;
+                    return (int)(i + 1 - count);
                 }
-                break;
             }
         }
+        if (pass == 0 && !grow(count, alignment)) break;
+    }
+    return NO_PAGE;
+}
+
+void* KernelHeap::allocate_small(int cls) {
+    if (partial_pages[cls] == NO_PAGE) {
+        int arena;
+        int page = find_page_run(1, PAGE_SIZE, &arena);
+        if (page == NO_PAGE) return nullptr;
+        
+        // Thread every object of the new slab onto its free list
+        size_t object_size = MIN_CLASS_SIZE << cls;
+        uint8_t* base = page_address(arena, page);
+        FreeObject* head = nullptr;
+        for (size_t offset = PAGE_SIZE; offset >= object_size; ) {
+            offset -= object_size;
+            FreeObject* obj = reinterpret_cast<FreeObject*>(base + offset);
+            obj->next = head;
+            head = obj;
+        }
+        
+        pages[page].kind = PAGE_SLAB;
+        pages[page].size_class = (uint8_t)cls;
+        pages[page].in_use = 0;
+        pages[page].free_objects = head;
+        arenas[arena].free_pages--;
+        link_partial(page);
     }
     
-    // Null-terminate the string
-    str[chars_written < size ? chars_written : size - 1] = '\0';
-    
-    va_end(args);
-    return chars_written;
+    int page = partial_pages[cls];
+    FreeObject* obj = pages[page].free_objects;
+    pages[page].free_objects = obj->next;
+    pages[page].in_use++;
+    if (pages[page].free_objects == nullptr) {
+        unlink_partial(page);  // Full; it rejoins the list on its next free
+    }
+    return obj;
 }
 
-// KernelHeap implementation
-void KernelHeap::init() {
-    // Initialize the heap with a single free block
-    free_list = reinterpret_cast<MemoryBlock*>(heap_space);
-    free_list->size = HEAP_SIZE - sizeof(MemoryBlock);
-    free_list->used = false;
-    free_list->next = nullptr;
+void* KernelHeap::allocate_pages(size_t size, size_t alignment) {
+    size_t count = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (alignment < PAGE_SIZE) alignment = PAGE_SIZE;
+    
+    int arena;
+    int first = find_page_run(count, alignment, &arena);
+    if (first == NO_PAGE) return nullptr;
+    
+    pages[first].kind = PAGE_RUN_HEAD;
+    pages[first].run_pages = (uint16_t)count;
+    for (size_t i = 1; i < count; i++) {
+        pages[first + i].kind = PAGE_RUN_TAIL;
+    }
+    arenas[arena].free_pages -= (int)count;
+    return page_address(arena, first);
 }
 
 void* KernelHeap::allocate(size_t size) {
+    PERF_SCOPE(PERF_HEAP_ALLOC);
     // Initialize heap on first allocation
-    if (free_list == nullptr) {
+    if (!initialized) {
         init();
     }
     
-    // Align size to 4 bytes
-    size = (size + 3) & ~3;
-    
-    // First-fit allocation strategy
-    MemoryBlock* block = free_list;
-    MemoryBlock* prev = nullptr;
-    
-    while (block != nullptr) {
-        if (!block->used && block->size >= size) {
-            // Found a suitable block
-            
-            // Split block if it's big enough to create a new free block
-            if (block->size >= size + sizeof(MemoryBlock) + 4) {
-                MemoryBlock* new_block = reinterpret_cast<MemoryBlock*>(
-                    reinterpret_cast<uint8_t*>(block) + sizeof(MemoryBlock) + size
-                );
-                new_block->size = block->size - size - sizeof(MemoryBlock);
-                new_block->used = false;
-                new_block->next = block->next;
-                
-                block->size = size;
-                block->next = new_block;
-            }
-            
-            block->used = true;
-            
-            // Return pointer to the memory after the block header
-            return reinterpret_cast<uint8_t*>(block) + sizeof(MemoryBlock);
-        }
-        
-        prev = block;
-        block = block->next;
+    if (size <= MAX_CLASS_SIZE) {
+        return allocate_small(size_class(size));
+    }
+    return allocate_pages(size, PAGE_SIZE);
+}
+
+// 'alignment' must be a power of two. Slab objects are aligned to their own
+// size, so small aligned requests just use a large enough class
+void* KernelHeap::allocate_aligned(size_t alignment, size_t size) {
+    if (!initialized) {
+        init();
+    }
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        return nullptr;
     }
     
-    // If we get here, memory allocation failed
-    return nullptr;
+    size_t need = (size > alignment) ? size : alignment;
+    if (need <= MAX_CLASS_SIZE) {
+        return allocate_small(size_class(need));
+    }
+    return allocate_pages(size, alignment);
 }
 
 void KernelHeap::deallocate(void* ptr) {
-    if (ptr == nullptr) {
+    PERF_SCOPE(PERF_HEAP_FREE);
+    uint8_t* p = reinterpret_cast<uint8_t*>(ptr);
+    int arena = (p == nullptr || !initialized) ? -1 : arena_of(p);
+    if (arena < 0) {
         return;
     }
     
-    // Get the block header from the pointer
-    MemoryBlock* block = reinterpret_cast<MemoryBlock*>(
-        reinterpret_cast<uint8_t*>(ptr) - sizeof(MemoryBlock)
-    );
-    
-    // Mark the block as free
-    block->used = false;
+    int page = arenas[arena].first_page + (int)((p - arenas[arena].base) / PAGE_SIZE);
+    PageInfo& info = pages[page];
     
-    // Coalesce with adjacent free blocks
-    // This is a simple implementation - could be optimized
-    MemoryBlock* current = free_list;
-    
-    while (current != nullptr) {
-        if (!current->used) {
-            // Check if the next block is also free and adjacent
-            MemoryBlock* next = current->next;
-            while (next != nullptr && !next->used && 
-                   reinterpret_cast<uint8_t*>(current) + sizeof(MemoryBlock) + current->size == 
-                   reinterpret_cast<uint8_t*>(next)) {
-                // Merge the blocks
-                current->size += sizeof(MemoryBlock) + next->size;
-                current->next = next->next;
-                next = current->next;
-            }
+    if (info.kind == PAGE_SLAB) {
+        bool was_full = (info.free_objects == nullptr);
+        FreeObject* obj = reinterpret_cast<FreeObject*>(p);
+        obj->next = info.free_objects;
+        info.free_objects = obj;
+        info.in_use--;
+        if (was_full) {
+            link_partial(page);
         }
-        current = current->next;
+        
+        // Hand an empty slab back to the page pool, but keep the class's only
+        // partial page so alternating alloc/free doesn't re-carve it each time
+        bool only_partial = (info.prev == NO_PAGE && info.next == NO_PAGE);
+        if (info.in_use == 0 && !only_partial) {
+            unlink_partial(page);
+            info.kind = PAGE_FREE;
+            info.free_objects = nullptr;
+            arenas[arena].free_pages++;
+        }
+    } else if (info.kind == PAGE_RUN_HEAD) {
+        for (size_t i = 0; i < info.run_pages; i++) {
+            pages[page + i].kind = PAGE_FREE;
+        }
+        arenas[arena].free_pages += info.run_pages;
+        info.run_pages = 0;
+    }
+}
+
+// Bytes actually available at 'ptr' (0 if it isn't a live heap block)
+size_t KernelHeap::usable_size(void* ptr) {
+    uint8_t* p = reinterpret_cast<uint8_t*>(ptr);
+    int arena = (p == nullptr || !initialized) ? -1 : arena_of(p);
+    if (arena < 0) {
+        return 0;
+    }
+    
+    const PageInfo& info = pages[arenas[arena].first_page + (p - arenas[arena].base) / PAGE_SIZE];
+    if (info.kind == PAGE_SLAB) return MIN_CLASS_SIZE << info.size_class;
+    if (info.kind == PAGE_RUN_HEAD) return info.run_pages * PAGE_SIZE;
+    return 0;
+}
+
+void KernelHeap::print_stats() {
+    if (!initialized) {
+        init();
     }
+    int free_pages = 0;
+    for (int a = 0; a < arena_count; a++) free_pages += arenas[a].free_pages;
+    cout << "Kernel heap: " << arena_count << " arena" << (arena_count == 1 ? "" : "s") << ", "
+         << (uint32_t)(free_pages * PAGE_SIZE / 1024) << "/" << (uint32_t)(page_total * PAGE_SIZE / 1024)
+         << " KB of pages free, room to grow to " << (uint32_t)(MAX_PAGES * PAGE_SIZE / 1024) << " KB\n";
 }
 
 void* KernelHeap::reallocate(void* ptr, size_t size) {
@@ -724,13 +1107,9 @@ void* KernelHeap::reallocate(void* ptr, size_t size) {
         return nullptr;
     }
     
-    // Get the block header from the pointer
-    MemoryBlock* block = reinterpret_cast<MemoryBlock*>(
-        reinterpret_cast<uint8_t*>(ptr) - sizeof(MemoryBlock)
-    );
-    
     // If the current block size is sufficient, just return the same pointer
-    if (block->size >= size) {
+    size_t old_size = usable_size(ptr);
+    if (old_size >= size) {
         return ptr;
     }
     
@@ -741,7 +1120,7 @@ void* KernelHeap::reallocate(void* ptr, size_t size) {
     }
     
     // Copy the old data to the new block
-    memcpy(new_ptr, ptr, block->size);
+    memcpy(new_ptr, ptr, old_size);
     
     // Free the old block
     deallocate(ptr);
@@ -771,6 +1150,10 @@ void* realloc(void* ptr, size_t size) {
     return KernelHeap::reallocate(ptr, size);
 }
 
+void* aligned_malloc(size_t alignment, size_t size) {
+    return KernelHeap::allocate_aligned(alignment, size);
+}
+
 // C++ operators
 void* operator new(size_t size) {
     return KernelHeap::allocate(size);
@@ -3,12 +3,26 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <cstdarg>
 
 // Memory operations
 void* memcpy(void* dest, const void* src, size_t n);
 void* memmove(void* dest, const void* src, size_t n);
 void* memset(void* str, int c, size_t n);
 int memcmp(const void* s1, const void* s2, size_t n);
+void* kernel_memcpy(void* dest, const void* src, size_t n);  // Same kernels, for string.cpp
+void* kernel_memset(void* dest, int val, size_t n);
+void mem_ops_init();   // Enable FPU/SSE/AVX state and pick kernels from CPUID
+void mem_ops_print();
+
+// The copy/fill kernels this CPU can run, for benchmarking them against each other
+struct mem_kernel {
+    const char* name;
+    void (*copy)(void* dest, const void* src, size_t n);
+    void (*fill)(void* dest, uint8_t v, size_t n);
+    bool active;  // The one memcpy/memset use
+};
+int mem_ops_kernels(const mem_kernel** kernels);  // Returns the count
 
 // String operations
 char* strcpy(char* dest, const char* src);
@@ -22,30 +36,105 @@ char* strchr(const char* s, int c);
 char* strrchr(const char* s, int c);
 bool string_compare(const char* s1, const char* s2);
 
+// Formatting engine behind printf/sprintf/snprintf and the output streams.
+// Understands %d %i %u %x %X %p %c %s %% with the flags "-0+ #", a width and
+// precision (either may be '*'), and the h/hh/l/ll/z length modifiers.
+// Output goes into 'buf'; when it fills up 'flush' drains it, or without a
+// flush callback the rest is counted but dropped (snprintf truncation).
+struct format_sink {
+    char* buf;
+    size_t size;
+    size_t len;    // Characters waiting in buf
+    size_t total;  // Characters produced so far, dropped ones included
+    void (*flush)(format_sink* sink);
+};
+
+#define FORMAT_NUMBER_MAX 24  // Longest 64-bit number in any base we print, plus NUL
+
+void format_sink_init(format_sink* sink, char* buf, size_t size, void (*flush)(format_sink*));
+int format_vprint(format_sink* sink, const char* format, va_list args);  // Returns sink->total
+// NUL-terminated digits of 'value' (base 10 or 16) into 'out'; returns the length
+int format_unsigned(char* out, uint64_t value, int base, bool upper);
+int format_signed(char* out, int64_t value);
+
 // Standard I/O operations
 int printf(const char* format, ...);
+int vprintf(const char* format, va_list args);
 int sprintf(char* str, const char* format, ...);
 int snprintf(char* str, size_t size, const char* format, ...);
+int vsnprintf(char* str, size_t size, const char* format, va_list args);
 
 // Kernel heap management
+// Requests up to MAX_CLASS_SIZE come from slab pages split into power-of-two
+// size classes; larger ones take a run of whole pages. Both paths cost the same
+// regardless of how fragmented the heap has become. Pages live in arenas: the
+// static one serves early boot, and once it is full the heap grows by arenas of
+// at least ARENA_SIZE taken from the frame allocator, up to MAX_PAGES in all.
 class KernelHeap {
 public:
-    static const size_t HEAP_SIZE = 65536;  // 64 KB heap
+    static const size_t HEAP_SIZE = 262144;    // 256 KB static arena
+    static const size_t ARENA_SIZE = 1048576;  // Smallest arena added when the heap grows
+    static const size_t PAGE_SIZE = 4096;
+    static const size_t MIN_CLASS_SIZE = 16;
+    static const size_t MAX_CLASS_SIZE = 2048;
     
     static void init();
     static void* allocate(size_t size);
+    static void* allocate_aligned(size_t alignment, size_t size);
     static void deallocate(void* ptr);
     static void* reallocate(void* ptr, size_t size);
+    static size_t usable_size(void* ptr);
+    static void print_stats();
     
 private:
-    struct MemoryBlock {
-        size_t size;
-        bool used;
-        MemoryBlock* next;
+    static const size_t PAGE_COUNT = HEAP_SIZE / PAGE_SIZE;
+    static const size_t MAX_PAGES = 16384 + PAGE_COUNT;  // 64 MB grown; page numbers fit in int16_t
+    static const int MAX_ARENAS = 64;
+    static const int CLASS_COUNT = 8;  // 16, 32, ..., 2048 bytes
+    static const int NO_PAGE = -1;
+    
+    enum PageKind : uint8_t { PAGE_FREE, PAGE_SLAB, PAGE_RUN_HEAD, PAGE_RUN_TAIL };
+    
+    struct FreeObject {
+        FreeObject* next;
+    };
+    
+    struct PageInfo {
+        PageKind kind;
+        uint8_t size_class;      // Slab pages: index into the size classes
+        uint16_t in_use;         // Slab pages: objects handed out
+        uint16_t run_pages;      // Run heads: length of the run in pages
+        int16_t prev;            // Slab pages: links in the class's partial list
+        int16_t next;
+        FreeObject* free_objects;
+    };
+    
+    // Pages [first_page, first_page + page_count) of 'pages' describe this arena
+    struct Arena {
+        uint8_t* base;
+        int first_page;
+        int page_count;
+        int free_pages;
     };
     
     static uint8_t heap_space[HEAP_SIZE];
-    static MemoryBlock* free_list;
+    static PageInfo pages[MAX_PAGES];
+    static Arena arenas[MAX_ARENAS];
+    static int arena_count;
+    static int page_total;                  // Pages handed to arenas so far
+    static int partial_pages[CLASS_COUNT];  // Slab pages that still have a free object
+    static bool initialized;
+    
+    static int size_class(size_t size);
+    static int arena_of(const uint8_t* p);
+    static uint8_t* page_address(int arena, int page);
+    static bool add_arena(uint8_t* base, size_t page_count);
+    static bool grow(size_t count, size_t alignment);
+    static int find_page_run(size_t count, size_t align_pages, int* arena);
+    static void* allocate_small(int cls);
+    static void* allocate_pages(size_t size, size_t alignment);
+    static void unlink_partial(int page);
+    static void link_partial(int page);
 };
 
 // C and C++ memory management hooks
@@ -53,6 +142,7 @@ void* malloc(size_t size);
 void free(void* ptr);
 void* calloc(size_t num, size_t size);
 void* realloc(void* ptr, size_t size);
+void* aligned_malloc(size_t alignment, size_t size);  // Release with free()
 
 // C++ operators
 void* operator new(size_t size);
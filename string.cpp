@@ -1,22 +1,15 @@
-
 #include <cstddef>
+
+// The compiler emits calls to these for struct copies and initialisers; they
+// share the CPU-dispatched kernels in stdlib_hooks.cpp
+void* kernel_memcpy(void* dest, const void* src, size_t n);
+void* kernel_memset(void* dest, int val, size_t n);
+
 extern "C" void* memcpy(void* dest, const void* src, size_t count) {
-    unsigned char* d = static_cast<unsigned char*>(dest);
-    const unsigned char* s = static_cast<const unsigned char*>(src);
-    for (size_t i = 0; i < count; i++) {
-        d[i] = s[i];
-    }
-    return dest;
+    return kernel_memcpy(dest, src, count);
 }
 
 // Custom implementation of memset function
 extern "C" void* memset(void* dest, int value, size_t count) {
-    unsigned char* d = static_cast<unsigned char*>(dest);
-    unsigned char v = static_cast<unsigned char>(value);
-    
-    for (size_t i = 0; i < count; i++) {
-        d[i] = v;
-    }
-    
-    return dest;
+    return kernel_memset(dest, value, count);
 }
\ No newline at end of file
@@ -1,5 +1,29 @@
 #include "terminal_hooks.h"
 #include "stdlib_hooks.h"
+#include "interrupts.h"
+
+// Colour text memory is a 32KB window holding VGA_TEXT_ROWS rows. The visible
+// screen slides down through it by moving the CRTC start address, so scrolling
+// a line only clears one row; when the window reaches the end of video memory
+// the visible rows are moved back to the top in a single block copy.
+#define VGA_TEXT_MEMORY 0xB8000
+#define VGA_TEXT_ROWS   (32768 / (VGA_WIDTH * 2))  // 204 rows of 80 columns
+
+// Writers draw into a RAM shadow of that video memory and mark the columns they
+// touch. terminal_flush() copies each row's dirty span to 0xB8000 and programs
+// the start address and cursor once, so port writes no longer happen per
+// character. Flushes run at a newline (at most once per timer tick), when input
+// is awaited, on endl, and from the timer interrupt.
+static uint16_t vga_shadow[VGA_TEXT_ROWS * VGA_WIDTH];
+static uint8_t dirty_lo[VGA_TEXT_ROWS];  // Dirty columns of each row; lo > hi means clean
+static uint8_t dirty_hi[VGA_TEXT_ROWS];
+static size_t dirty_first = VGA_TEXT_ROWS;  // Range of rows with anything dirty
+static size_t dirty_last = 0;
+static bool display_start_dirty = false;
+static bool cursor_dirty = false;
+static uint16_t cursor_pos = 0;
+static uint32_t last_flush_tick = 0;
+volatile uint32_t console_busy = 0;
 
 // Terminal state variables
 size_t terminal_row;
@@ -8,12 +32,7 @@ uint8_t terminal_color;
 uint16_t* terminal_buffer;
 bool cursor_visible = true;
 uint32_t cursor_blink_counter = 0;
-
-// Input state variables
-char input_buffer[MAX_COMMAND_LENGTH];
-int input_length = 0;
-bool input_ready = false;
-bool extended_key = false;
+size_t terminal_origin = 0;
 
 uint8_t make_color(enum vga_color fg, enum vga_color bg) {
     return fg | bg << 4;
@@ -25,14 +44,86 @@ uint16_t make_vgaentry(char c, uint8_t color) {
     return c16 | color16 << 8;
 }
 
-void update_hardware_cursor(int x, int y) {
-    uint16_t pos = y * VGA_WIDTH + x;
+// CRTC start address: the row of video memory shown at the top of the screen
+static void set_display_start(size_t row) {
+    uint16_t pos = row * VGA_WIDTH;
+    outb(0x3D4, 0x0C);
+    outb(0x3D5, static_cast<uint8_t>((pos >> 8) & 0xFF));
+    outb(0x3D4, 0x0D);
+    outb(0x3D5, static_cast<uint8_t>(pos & 0xFF));
+}
 
-    // CRT Controller registers: cursor position (low and high bytes)
-    outb(0x3D4, 0x0F);  // Low byte index
-    outb(0x3D5, static_cast<uint8_t>(pos & 0xFF));  // Low byte data
-    outb(0x3D4, 0x0E);  // High byte index
-    outb(0x3D5, static_cast<uint8_t>((pos >> 8) & 0xFF));  // High byte data
+static void set_origin(size_t row) {
+    terminal_origin = row;
+    terminal_buffer = vga_shadow + row * VGA_WIDTH;
+    display_start_dirty = true;
+}
+
+void terminal_mark_dirty(size_t x_first, size_t x_last, size_t y) {
+    size_t row = terminal_origin + y;
+    if (dirty_lo[row] > dirty_hi[row]) {
+        dirty_lo[row] = static_cast<uint8_t>(x_first);
+        dirty_hi[row] = static_cast<uint8_t>(x_last);
+    } else {
+        if (x_first < dirty_lo[row]) dirty_lo[row] = static_cast<uint8_t>(x_first);
+        if (x_last > dirty_hi[row]) dirty_hi[row] = static_cast<uint8_t>(x_last);
+    }
+    if (row < dirty_first) dirty_first = row;
+    if (row > dirty_last) dirty_last = row;
+}
+
+void terminal_mark_screen_dirty() {
+    for (size_t y = 0; y < VGA_HEIGHT; y++) terminal_mark_dirty(0, VGA_WIDTH - 1, y);
+}
+
+void terminal_flush() {
+    uint32_t flags = irq_save();
+    
+    uint16_t* vga = reinterpret_cast<uint16_t*>(VGA_TEXT_MEMORY);
+    for (size_t row = dirty_first; row <= dirty_last && row < VGA_TEXT_ROWS; row++) {
+        if (dirty_lo[row] <= dirty_hi[row]) {
+            size_t offset = row * VGA_WIDTH + dirty_lo[row];
+            memcpy(vga + offset, vga_shadow + offset, (dirty_hi[row] - dirty_lo[row] + 1) * sizeof(uint16_t));
+            dirty_lo[row] = 0xFF;
+            dirty_hi[row] = 0;
+        }
+    }
+    dirty_first = VGA_TEXT_ROWS;
+    dirty_last = 0;
+    
+    if (display_start_dirty) {
+        set_display_start(terminal_origin);
+        display_start_dirty = false;
+    }
+    if (cursor_dirty) {
+        // CRT Controller registers: cursor position (low and high bytes)
+        outb(0x3D4, 0x0F);  // Low byte index
+        outb(0x3D5, static_cast<uint8_t>(cursor_pos & 0xFF));  // Low byte data
+        outb(0x3D4, 0x0E);  // High byte index
+        outb(0x3D5, static_cast<uint8_t>((cursor_pos >> 8) & 0xFF));  // High byte data
+        cursor_dirty = false;
+    }
+    last_flush_tick = timer_ticks;
+    
+    irq_restore(flags);
+}
+
+void terminal_flush_newline() {
+    // An echo from the keyboard handler may land in the middle of another writer
+    if (console_busy != 0) return;
+    // With interrupts off the timer cannot flush, so do it every line
+    if (timer_ticks != last_flush_tick || !interrupts_enabled()) terminal_flush();
+}
+
+void terminal_flush_from_timer() {
+    // A writer may be halfway through marking a row; catch it next tick
+    if (console_busy == 0) terminal_flush();
+}
+
+void update_hardware_cursor(int x, int y) {
+    // The cursor location counts from the start of video memory, not the screen
+    cursor_pos = (terminal_origin + y) * VGA_WIDTH + x;
+    cursor_dirty = true;
 }
 
 void enable_hardware_cursor(uint8_t cursor_start, uint8_t cursor_end) {
@@ -50,12 +141,16 @@ void disable_hardware_cursor() {
 }
 
 void clear_screen() {
+    console_busy++;
+    set_origin(0);
     for (size_t y = 0; y < VGA_HEIGHT; y++) {
         for (size_t x = 0; x < VGA_WIDTH; x++) {
             const size_t index = y * VGA_WIDTH + x;
             terminal_buffer[index] = make_vgaentry(' ', terminal_color);
         }
     }
+    terminal_mark_screen_dirty();
+    console_busy--;
     terminal_row = 0;
     terminal_column = 0;
     update_hardware_cursor(terminal_column, terminal_row);
@@ -65,17 +160,23 @@ void terminal_initialize() {
     terminal_row = 0;
     terminal_column = 0;
     terminal_color = make_color(COLOR_LIGHT_GREY, COLOR_BLACK);
-    terminal_buffer = reinterpret_cast<uint16_t*>(0xB8000);
+    for (size_t row = 0; row < VGA_TEXT_ROWS; row++) {
+        dirty_lo[row] = 0xFF;
+        dirty_hi[row] = 0;
+    }
+    set_origin(0);
     for (size_t y = 0; y < VGA_HEIGHT; y++) {
         for (size_t x = 0; x < VGA_WIDTH; x++) {
             const size_t index = y * VGA_WIDTH + x;
             terminal_buffer[index] = make_vgaentry(' ', terminal_color);
         }
     }
+    terminal_mark_screen_dirty();
 
     // Initialize hardware cursor (start line 14, end line 15 - typical underline cursor)
     enable_hardware_cursor(14, 15);
     update_hardware_cursor(0, 0);
+    terminal_flush();
 }
 
 void terminal_setcolor(uint8_t color) {
@@ -85,26 +186,34 @@ void terminal_setcolor(uint8_t color) {
 void terminal_putentryat(char c, uint8_t color, size_t x, size_t y) {
     const size_t index = y * VGA_WIDTH + x;
     terminal_buffer[index] = make_vgaentry(c, color);
+    terminal_mark_dirty(x, x, y);
 }
 
 void scroll_screen() {
-    // Move all rows up one line (except the first row which will be overwritten)
-    for (size_t y = 0; y < VGA_HEIGHT - 1; y++) {
-        for (size_t x = 0; x < VGA_WIDTH; x++) {
-            const size_t dest_index = y * VGA_WIDTH + x;
-            const size_t src_index = (y + 1) * VGA_WIDTH + x;
-            terminal_buffer[dest_index] = terminal_buffer[src_index];
-        }
+    // The keyboard handler echoes through here too
+    uint32_t flags = irq_save();
+    
+    if (terminal_origin + VGA_HEIGHT < VGA_TEXT_ROWS) {
+        set_origin(terminal_origin + 1);
+    } else {
+        // Out of video memory below the window: rows 1..24 go back to the top
+        memcpy(vga_shadow, terminal_buffer + VGA_WIDTH, (VGA_HEIGHT - 1) * VGA_WIDTH * sizeof(uint16_t));
+        set_origin(0);
+        for (size_t y = 0; y < VGA_HEIGHT - 1; y++) terminal_mark_dirty(0, VGA_WIDTH - 1, y);
     }
     
-    // Clear the last row
+    // Clear the new last row
     for (size_t x = 0; x < VGA_WIDTH; x++) {
         const size_t index = (VGA_HEIGHT - 1) * VGA_WIDTH + x;
         terminal_buffer[index] = make_vgaentry(' ', terminal_color);
     }
+    terminal_mark_dirty(0, VGA_WIDTH - 1, VGA_HEIGHT - 1);
+    
+    irq_restore(flags);
 }
 
 void terminal_putchar(char c) {
+    console_busy++;
     if (c == '\n') {
         // Handle newline character
         terminal_column = 0;
@@ -142,6 +251,8 @@ void terminal_putchar(char c) {
 
     // Update the hardware cursor position
     update_hardware_cursor(terminal_column, terminal_row);
+    console_busy--;
+    if (c == '\n') terminal_flush_newline();
 }
 
 void terminal_writestring(const char* data) {
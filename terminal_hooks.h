@@ -10,12 +10,7 @@ extern uint8_t terminal_color;
 extern uint16_t* terminal_buffer;
 extern bool cursor_visible;
 extern uint32_t cursor_blink_counter;
-
-// Input buffer state
-extern char input_buffer[MAX_COMMAND_LENGTH];
-extern int input_length;
-extern bool input_ready;
-extern bool extended_key;
+extern size_t terminal_origin;  // Video memory row shown at the top of the screen (hardware scroll)
 
 // Terminal functions
 uint8_t make_color(enum vga_color fg, enum vga_color bg);
@@ -32,6 +27,15 @@ void terminal_writestring(const char* data);
 void update_cursor_state();
 void scroll_screen();
 
+// Buffered output: writers mark what they change in terminal_buffer (a RAM
+// shadow), and terminal_flush() pushes it to VGA memory
+extern volatile uint32_t console_busy;  // Non-zero while a writer is mid-update
+void terminal_mark_dirty(size_t x_first, size_t x_last, size_t y);
+void terminal_mark_screen_dirty();
+void terminal_flush();
+void terminal_flush_newline();     // Flush unless already done this tick
+void terminal_flush_from_timer();
+
 // IO port functions
 static inline uint8_t inb(uint16_t port);
 static inline void outb(uint16_t port, uint8_t val);
@@ -1,6 +1,7 @@
 #include "terminal_io.h"
 #include "terminal_hooks.h"
 #include "stdlib_hooks.h"
+#include "iostream_wrapper.h"
 
 // Global terminal I/O object
 TerminalIO kout;
@@ -73,9 +74,7 @@ TerminalIO& dec(TerminalIO& stream) {
 
 // Output operators
 TerminalIO& TerminalIO::operator<<(const char* str) {
-    while (*str) {
-        terminal_putchar(*str++);
-    }
+    terminal_writestring(str);
     return *this;
 }
 
@@ -84,124 +83,43 @@ TerminalIO& TerminalIO::operator<<(char c) {
     return *this;
 }
 
+// Digits go out as one string, in hex (no prefix) or decimal per 'use_hex'
+static void put_number(uint64_t num, bool negative) {
+    char buffer[FORMAT_NUMBER_MAX + 1];
+    int len = 0;
+    if (negative) buffer[len++] = '-';
+    format_unsigned(buffer + len, num, use_hex ? 16 : 10, false);
+    terminal_writestring(buffer);
+}
+
 TerminalIO& TerminalIO::operator<<(int num) {
-    if (use_hex) {
-        // Print in hexadecimal
-        char buffer[12];  // Enough for 32-bit hex
-        int i = 0;
-        
-        // Handle 0 specially
-        if (num == 0) {
-            terminal_putchar('0');
-            return *this;
-        }
-        
-        // Handle negative numbers
-        if (num < 0) {
-            terminal_putchar('-');
-            num = -num;
-        }
-        
-        // Convert digits
-        while (num > 0) {
-            int digit = num % 16;
-            buffer[i++] = digit < 10 ? '0' + digit : 'a' + (digit - 10);
-            num /= 16;
-        }
-        
-        // Print in reverse order
-        while (--i >= 0) {
-            terminal_putchar(buffer[i]);
-        }
-    } else {
-        // Print in decimal
-        char buffer[12];  // Enough for 32-bit int
-        int i = 0;
-        
-        // Handle 0 specially
-        if (num == 0) {
-            terminal_putchar('0');
-            return *this;
-        }
-        
-        // Handle negative numbers
-        if (num < 0) {
-            terminal_putchar('-');
-            num = -num;
-        }
-        
-        // Convert digits
-        while (num > 0) {
-            buffer[i++] = '0' + (num % 10);
-            num /= 10;
-        }
-        
-        // Print in reverse order
-        while (--i >= 0) {
-            terminal_putchar(buffer[i]);
-        }
-    }
-    
+    put_number(num < 0 ? 0u - (unsigned int)num : (unsigned int)num, num < 0);
     return *this;
 }
 
 TerminalIO& TerminalIO::operator<<(unsigned int num) {
-    if (use_hex) {
-        // Print in hexadecimal
-        char buffer[12];  // Enough for 32-bit hex
-        int i = 0;
-        
-        // Handle 0 specially
-        if (num == 0) {
-            terminal_putchar('0');
-            return *this;
-        }
-        
-        // Convert digits
-        while (num > 0) {
-            int digit = num % 16;
-            buffer[i++] = digit < 10 ? '0' + digit : 'a' + (digit - 10);
-            num /= 16;
-        }
-        
-        // Print in reverse order
-        while (--i >= 0) {
-            terminal_putchar(buffer[i]);
-        }
-    } else {
-        // Print in decimal
-        char buffer[12];  // Enough for 32-bit unsigned
-        int i = 0;
-        
-        // Handle 0 specially
-        if (num == 0) {
-            terminal_putchar('0');
-            return *this;
-        }
-        
-        // Convert digits
-        while (num > 0) {
-            buffer[i++] = '0' + (num % 10);
-            num /= 10;
-        }
-        
-        // Print in reverse order
-        while (--i >= 0) {
-            terminal_putchar(buffer[i]);
-        }
-    }
-    
+    put_number(num, false);
     return *this;
 }
 
 TerminalIO& TerminalIO::operator<<(long num) {
-    // Implementation similar to int version, but handles the larger size
-    return operator<<(static_cast<int>(num));  // Simplified for example
+    put_number(num < 0 ? 0ul - (unsigned long)num : (unsigned long)num, num < 0);
+    return *this;
 }
 
 TerminalIO& TerminalIO::operator<<(unsigned long num) {
-    // Implementation similar to unsigned int version, but handles the larger size
-    return operator<<(static_cast<unsigned int>(num));  // Simplified for example
+    put_number(num, false);
+    return *this;
+}
+
+TerminalIO& TerminalIO::operator<<(long long num) {
+    put_number(num < 0 ? 0ull - (unsigned long long)num : (unsigned long long)num, num < 0);
+    return *this;
+}
+
+TerminalIO& TerminalIO::operator<<(unsigned long long num) {
+    put_number(num, false);
+    return *this;
 }
 
 TerminalIO& TerminalIO::operator<<(void* ptr) {
@@ -232,22 +150,12 @@ TerminalIO& TerminalIO::operator<<(ManipulatorFunc func) {
 
 // Keyboard input function
 TerminalIO& TerminalIO::operator>>(char* str) {
-    // Reset the input ready flag
-    input_ready = false;
-    
     // Display prompt to indicate input is expected
     *this << "> ";
     
-    // Wait for the keyboard handler to set input_ready flag
-    // This will be set when the user presses Enter
-    while (!input_ready) {
-        // Use hlt instruction to wait efficiently for interrupts
-        asm volatile ("hlt");
-    }
-    
-    // Copy the input buffer to the provided string
-    strcpy(str, input_buffer);
+    // Same line reader as cin, so both share the keyboard ring and history
+    cin >> str;
     
     // Return this object for chaining
     return *this;
-}
\ No newline at end of file
+}
@@ -18,6 +18,8 @@ public:
     TerminalIO& operator<<(unsigned int num);
     TerminalIO& operator<<(long num);
     TerminalIO& operator<<(unsigned long num);
+    TerminalIO& operator<<(long long num);
+    TerminalIO& operator<<(unsigned long long num);
     TerminalIO& operator<<(void* ptr);
     TerminalIO& operator<<(ManipulatorFunc func);
     
@@ -0,0 +1,177 @@
+#include "thread.h"
+#include "interrupts.h"
+#include "stdlib_hooks.h"
+#include "timer.h"
+
+static thread_t threads[THREAD_MAX];
+static uint8_t thread_stacks[THREAD_MAX - 1][THREAD_STACK_SIZE] __attribute__((aligned(16)));  // Not for thread 0
+static int thread_current = 0;
+static uint32_t thread_slice_start = 0;
+volatile bool thread_resched = false;
+
+// Save the callee-saved registers and EFLAGS on this stack, store the stack
+// pointer in *save_esp, and resume the thread whose stack is 'next_esp'
+extern "C" void thread_switch(uint32_t* save_esp, uint32_t next_esp);
+asm(
+    ".global thread_switch\n"
+    "thread_switch:\n"
+    "    movl 4(%esp), %eax\n"
+    "    movl 8(%esp), %edx\n"
+    "    pushl %ebp\n"
+    "    pushl %ebx\n"
+    "    pushl %esi\n"
+    "    pushl %edi\n"
+    "    pushfl\n"
+    "    movl %esp, (%eax)\n"
+    "    movl %edx, %esp\n"
+    "    popfl\n"
+    "    popl %edi\n"
+    "    popl %esi\n"
+    "    popl %ebx\n"
+    "    popl %ebp\n"
+    "    ret\n"
+);
+
+static void thread_init() {
+    if (threads[0].state != THREAD_FREE) return;
+    threads[0].state = THREAD_RUNNING;
+    strncpy(threads[0].name, "shell", THREAD_NAME_LENGTH - 1);
+}
+
+static bool thread_runnable(thread_t* t) {
+    if (t->state == THREAD_SLEEPING && deadline_passed(t->wake_ns)) t->state = THREAD_READY;
+    return t->state == THREAD_READY;
+}
+
+// A new thread's first switch returns here
+static void thread_bootstrap() {
+    thread_t* self = &threads[thread_current];
+    asm volatile ("sti");
+    self->entry(self->arg);
+
+    // Nothing switches back to a finished thread; wait here until another one can run
+    self->state = THREAD_DONE;
+    while (true) {
+        if (!thread_yield()) asm volatile ("sti\n hlt");
+    }
+}
+
+int thread_spawn(const char* name, thread_entry_t entry, void* arg) {
+    thread_init();
+    for (int id = 1; id < THREAD_MAX; id++) {
+        thread_t* t = &threads[id];
+        if (t->state != THREAD_FREE) continue;
+
+        // The frame thread_switch pops: EFLAGS, edi, esi, ebx, ebp, return address
+        uint32_t* sp = (uint32_t*)(thread_stacks[id - 1] + THREAD_STACK_SIZE);
+        *--sp = 0;                                   // Keeps the stack 16-byte aligned at entry
+        *--sp = (uint32_t)(uintptr_t)thread_bootstrap;
+        for (int i = 0; i < 4; i++) *--sp = 0;
+        *--sp = 0x002;                               // Interrupts off until thread_bootstrap
+        t->esp = (uint32_t)(uintptr_t)sp;
+
+        t->entry = entry;
+        t->arg = arg;
+        t->ticks = 0;
+        t->switches = 0;
+        strncpy(t->name, name, THREAD_NAME_LENGTH - 1);
+        t->name[THREAD_NAME_LENGTH - 1] = '\0';
+        t->state = THREAD_READY;
+        return id;
+    }
+    return -5;
+}
+
+bool thread_others_ready() {
+    for (int i = 1; i < THREAD_MAX; i++) {
+        if (thread_runnable(&threads[(thread_current + i) % THREAD_MAX])) return true;
+    }
+    return false;
+}
+
+bool thread_yield() {
+    thread_init();
+    thread_resched = false;
+
+    int prev = thread_current;
+    int next = -1;
+    for (int i = 1; i < THREAD_MAX; i++) {
+        int id = (prev + i) % THREAD_MAX;
+        if (thread_runnable(&threads[id])) {
+            next = id;
+            break;
+        }
+    }
+    if (next < 0) return false;
+
+    uint32_t flags = irq_save();
+    if (threads[prev].state == THREAD_RUNNING) threads[prev].state = THREAD_READY;
+    threads[next].state = THREAD_RUNNING;
+    threads[next].switches++;
+    thread_current = next;
+    thread_slice_start = timer_ticks;
+    thread_switch(&threads[prev].esp, threads[next].esp);
+
+    // Running again. A thread that finished can't free its own slot; do it here
+    for (int id = 1; id < THREAD_MAX; id++) {
+        if (id != thread_current && threads[id].state == THREAD_DONE) threads[id].state = THREAD_FREE;
+    }
+    irq_restore(flags);
+    return true;
+}
+
+void thread_sleep_ms(uint32_t ms) {
+    thread_t* self = &threads[thread_current];
+    uint64_t wake = deadline_ms(ms);
+    while (!deadline_passed(wake)) {
+        self->state = THREAD_SLEEPING;
+        self->wake_ns = wake;
+        if (!thread_yield()) {
+            // Nobody else to run: wait for the next tick
+            self->state = THREAD_RUNNING;
+            asm volatile ("sti\n hlt");
+        }
+    }
+    self->state = THREAD_RUNNING;
+}
+
+int thread_current_id() {
+    return thread_current;
+}
+
+const char* thread_name(int id) {
+    if (id < 0 || id >= THREAD_MAX) return "";
+    return threads[id].name;
+}
+
+void thread_tick() {
+    threads[thread_current].ticks++;
+    if (timer_ticks - thread_slice_start >= THREAD_SLICE_TICKS) thread_resched = true;
+}
+
+bool thread_mutex_try_lock(thread_mutex_t* m) {
+    if (m->owner != -1) return false;
+    m->owner = thread_current;
+    return true;
+}
+
+void thread_mutex_lock(thread_mutex_t* m) {
+    while (!thread_mutex_try_lock(m)) {
+        if (!thread_yield()) asm volatile ("pause");  // Only an interrupt path could release it
+    }
+}
+
+void thread_mutex_unlock(thread_mutex_t* m) {
+    if (m->owner == thread_current) m->owner = -1;
+}
+
+void thread_print_list() {
+    static const char* const state_names[] = { "free", "ready", "running", "sleeping", "done" };
+    thread_init();
+    printf("  ID  STATE     TICKS  SWITCHES  NAME\n");
+    for (int id = 0; id < THREAD_MAX; id++) {
+        thread_t* t = &threads[id];
+        if (t->state == THREAD_FREE) continue;
+        printf("  %2d  %-8s %6u  %8u  %s\n", id, state_names[t->state], t->ticks, t->switches, t->name);
+    }
+}
@@ -0,0 +1,69 @@
+#ifndef THREAD_H
+#define THREAD_H
+
+#include "types.h"
+
+// Cooperative kernel threads.
+// Thread 0 is the boot thread that runs the shell; thread_spawn() adds threads
+// with their own stack. Switches only happen when a thread calls thread_yield()
+// (directly, or through a wait such as ahci_wait_until, a DMA wait or
+// thread_sleep_ms), so code between two such calls needs no locking against
+// other threads. timer_handler wakes sleeping threads and flags a thread that
+// has run for a full slice; long CPU loops call thread_preempt_point() to give
+// way when that flag is set. Threads run on the BSP only.
+
+#define THREAD_MAX         8
+#define THREAD_STACK_SIZE  16384
+#define THREAD_SLICE_TICKS 2      // 20 ms at TIMER_TICK_HZ
+#define THREAD_NAME_LENGTH 32
+
+enum thread_state {
+    THREAD_FREE,
+    THREAD_READY,
+    THREAD_RUNNING,
+    THREAD_SLEEPING,
+    THREAD_DONE,      // Finished; the slot is reclaimed by the next switch
+};
+
+typedef void (*thread_entry_t)(void* arg);
+
+typedef struct {
+    uint32_t esp;             // Saved stack pointer while switched out
+    enum thread_state state;
+    thread_entry_t entry;
+    void* arg;
+    uint64_t wake_ns;         // THREAD_SLEEPING: now_ns() value to wake at
+    uint32_t ticks;           // Timer ticks spent running
+    uint32_t switches;
+    char name[THREAD_NAME_LENGTH];
+} thread_t;
+
+// Start 'entry(arg)' in a new thread. Returns its id, or -5 if every slot is in use
+int thread_spawn(const char* name, thread_entry_t entry, void* arg);
+bool thread_yield();                 // Run the next ready thread; false if there was none
+bool thread_others_ready();          // Whether thread_yield() would switch
+void thread_sleep_ms(uint32_t ms);
+int thread_current_id();
+const char* thread_name(int id);
+void thread_tick();                  // Called by timer_handler
+void thread_print_list();
+
+extern volatile bool thread_resched;  // Set by thread_tick() when the slice is used up
+
+static inline void thread_preempt_point() {
+    if (thread_resched) thread_yield();
+}
+
+// Mutex for code that yields while holding shared state (a disk command
+// in flight, say). Not recursive.
+typedef struct {
+    volatile int owner;       // Thread id, or -1
+} thread_mutex_t;
+
+#define THREAD_MUTEX_INIT { -1 }
+
+bool thread_mutex_try_lock(thread_mutex_t* m);
+void thread_mutex_lock(thread_mutex_t* m);
+void thread_mutex_unlock(thread_mutex_t* m);
+
+#endif // THREAD_H
@@ -0,0 +1,169 @@
+#include "timer.h"
+#include "interrupts.h"
+#include "terminal_hooks.h"
+#include "hardware_specs.h"
+#include "stdlib_hooks.h"
+#include "thread.h"
+
+// TSC to nanoseconds: ns = cycles * tsc_ns_q24 >> 24
+static uint32_t tsc_khz = 0;
+static uint32_t tsc_ns_q24 = 0;
+static uint64_t tsc_base = 0;
+
+#define CALIBRATE_PIT_COUNT 11932  // 10 ms of PIT input clock
+#define CALIBRATE_RUNS      5
+#define CALIBRATE_MAX_POLLS 10000000
+
+// Count TSC cycles while PIT channel 2 counts down 'count' input clocks.
+// Returns 0 if the channel never reached terminal count.
+static uint64_t pit_measure_cycles(uint16_t count) {
+    uint8_t port61 = inb(0x61);
+    outb(0x61, port61 & ~0x03);           // Gate low, speaker off
+    outb(0x43, 0xB0);                     // Channel 2, lobyte/hibyte, mode 0
+    outb(0x42, count & 0xFF);
+    outb(0x42, count >> 8);
+    outb(0x61, (port61 & ~0x02) | 0x01);  // Gate high: the countdown starts
+
+    uint64_t start = rdtsc();
+    uint32_t polls = 0;
+    while (!(inb(0x61) & 0x20)) {         // OUT2 goes high at terminal count
+        if (++polls == CALIBRATE_MAX_POLLS) {
+            outb(0x61, port61);
+            return 0;
+        }
+    }
+    uint64_t cycles = rdtsc() - start;
+    outb(0x61, port61);
+    return cycles;
+}
+
+void clock_init() {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    if (!(edx & (1 << 4))) return;  // No TSC: now_ns() counts PIT ticks
+
+    // Keep the shortest run; an interrupt or SMI can only make one longer
+    uint64_t best = 0;
+    uint32_t flags = irq_save();
+    for (int i = 0; i < CALIBRATE_RUNS; i++) {
+        uint64_t cycles = pit_measure_cycles(CALIBRATE_PIT_COUNT);
+        if (cycles != 0 && (best == 0 || cycles < best)) best = cycles;
+    }
+    irq_restore(flags);
+    if (best == 0) return;
+
+    uint64_t khz = best * PIT_FREQUENCY_HZ / CALIBRATE_PIT_COUNT / 1000;
+    if (khz == 0 || khz > 0xFFFFFFFFu) return;
+    tsc_khz = (uint32_t)khz;
+    tsc_ns_q24 = (uint32_t)((1000000ull << 24) / tsc_khz);
+
+    // Carry on from the tick clock so now_ns() never steps backwards
+    uint64_t elapsed = (uint64_t)timer_ticks * TIMER_TICK_NS;
+    tsc_base = rdtsc() - elapsed * tsc_khz / 1000000;
+}
+
+uint64_t now_ns() {
+    if (tsc_khz == 0) return (uint64_t)timer_ticks * TIMER_TICK_NS;
+    uint64_t cycles = rdtsc() - tsc_base;
+    // 64 x 32 bit multiply in two halves so it doesn't overflow
+    uint64_t low = ((uint64_t)(uint32_t)cycles * tsc_ns_q24) >> 24;
+    uint64_t high = ((cycles >> 32) * tsc_ns_q24) << 8;
+    return low + high;
+}
+
+uint32_t clock_tsc_khz() {
+    return tsc_khz;
+}
+
+void clock_print_info() {
+    if (tsc_khz != 0) {
+        printf("Clock: TSC at %u.%03u MHz, calibrated against the PIT\n", tsc_khz / 1000, tsc_khz % 1000);
+    } else {
+        printf("Clock: no usable TSC, using the %u Hz PIT tick\n", TIMER_TICK_HZ);
+    }
+}
+
+// Waits longer than a tick let other threads run meanwhile; shorter ones, and
+// any wait with interrupts off, spin on the clock
+static void sleep_until(uint64_t deadline, uint64_t wait_ns) {
+    bool yield = wait_ns > TIMER_TICK_NS && interrupts_enabled();
+    while (!deadline_passed(deadline)) {
+        if (!yield || !thread_yield()) asm volatile ("pause");
+    }
+}
+
+void sleep_us(uint32_t us) {
+    sleep_until(deadline_us(us), (uint64_t)us * 1000);
+}
+
+void sleep_ms(uint32_t ms) {
+    sleep_until(deadline_ms(ms), (uint64_t)ms * 1000000);
+}
+
+// --- Timer wheel ---
+// Slot i holds the events whose expiry tick is congruent to i; events more than
+// one revolution away stay in their slot until their tick comes round.
+
+static timer_event_t* timer_wheel[TIMER_WHEEL_SLOTS];
+
+static void wheel_insert(timer_event_t* ev) {
+    timer_event_t** slot = &timer_wheel[ev->expires & (TIMER_WHEEL_SLOTS - 1)];
+    ev->prev = nullptr;
+    ev->next = *slot;
+    if (*slot) (*slot)->prev = ev;
+    *slot = ev;
+    ev->armed = true;
+}
+
+static void wheel_remove(timer_event_t* ev) {
+    if (ev->prev) ev->prev->next = ev->next;
+    else timer_wheel[ev->expires & (TIMER_WHEEL_SLOTS - 1)] = ev->next;
+    if (ev->next) ev->next->prev = ev->prev;
+    ev->next = ev->prev = nullptr;
+    ev->armed = false;
+}
+
+static uint32_t ms_to_ticks(uint32_t ms) {
+    uint32_t ticks = (ms + (1000 / TIMER_TICK_HZ) - 1) / (1000 / TIMER_TICK_HZ);
+    return ticks > 0 ? ticks : 1;
+}
+
+void timer_schedule(timer_event_t* ev, uint32_t delay_ms, uint32_t period_ms, timer_callback_t callback, void* arg) {
+    uint32_t flags = irq_save();
+    if (ev->armed) wheel_remove(ev);
+    ev->callback = callback;
+    ev->arg = arg;
+    ev->period_ticks = period_ms ? ms_to_ticks(period_ms) : 0;
+    ev->expires = timer_ticks + ms_to_ticks(delay_ms);
+    wheel_insert(ev);
+    irq_restore(flags);
+}
+
+bool timer_cancel(timer_event_t* ev) {
+    uint32_t flags = irq_save();
+    bool was_armed = ev->armed;
+    if (was_armed) wheel_remove(ev);
+    irq_restore(flags);
+    return was_armed;
+}
+
+void timer_wheel_tick() {
+    uint32_t now = timer_ticks;
+    timer_event_t** slot = &timer_wheel[now & (TIMER_WHEEL_SLOTS - 1)];
+
+    // Fire one due event at a time: a callback may schedule or cancel any
+    // event, so the slot is rescanned from the head after each one
+    while (true) {
+        timer_event_t* ev = *slot;
+        while (ev && (int32_t)(now - ev->expires) < 0) ev = ev->next;
+        if (!ev) break;
+
+        wheel_remove(ev);
+        if (ev->period_ticks) {
+            ev->expires += ev->period_ticks;
+            if ((int32_t)(now - ev->expires) >= 0) ev->expires = now + 1;  // Fell behind: don't burst
+            wheel_insert(ev);
+        }
+        ev->callback(ev->arg);
+    }
+}
@@ -0,0 +1,62 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include "types.h"
+
+// Time subsystem.
+// now_ns() is a monotonic clock read from the TSC, whose rate clock_init()
+// measures against PIT channel 2 at boot. Without a TSC it falls back to the
+// 100 Hz PIT tick. Driver waits use deadlines on this clock instead of
+// counted spin loops, so they take the same real time on every host.
+
+#define PIT_FREQUENCY_HZ 1193182
+#define TIMER_TICK_HZ    100          // init_pit() rate, timer_ticks advances at this rate
+#define TIMER_TICK_NS    (1000000000ull / TIMER_TICK_HZ)
+
+static inline uint64_t rdtsc() {
+    uint32_t lo, hi;
+    asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+void clock_init();                    // Calibrate the TSC; call once interrupts are set up
+uint64_t now_ns();
+uint32_t clock_tsc_khz();             // Measured TSC rate, 0 when the PIT tick is used
+void clock_print_info();
+
+// Wait at least the given time; waits over a tick run other threads meanwhile
+void sleep_us(uint32_t us);
+void sleep_ms(uint32_t ms);
+
+// A deadline is an absolute now_ns() value
+static inline uint64_t deadline_us(uint64_t us) { return now_ns() + us * 1000; }
+static inline uint64_t deadline_ms(uint64_t ms) { return now_ns() + ms * 1000000; }
+static inline bool deadline_passed(uint64_t deadline) { return (int64_t)(now_ns() - deadline) >= 0; }
+
+// --- Timer wheel ---
+// Callbacks scheduled here run from timer_handler, in interrupt context, on the
+// first tick at or after their expiry. Events are owned by the caller and must
+// stay valid until they fire or are cancelled. A periodic event is re-armed
+// before its callback runs, so the callback may cancel it.
+
+#define TIMER_WHEEL_SLOTS 256  // Power of two; one slot per tick
+
+typedef void (*timer_callback_t)(void* arg);
+
+typedef struct timer_event {
+    timer_callback_t callback;
+    void* arg;
+    uint32_t expires;          // timer_ticks value to fire at
+    uint32_t period_ticks;     // 0 = one-shot
+    bool armed;
+    struct timer_event* next;  // Links in the wheel slot
+    struct timer_event* prev;
+} timer_event_t;
+
+// Fire 'callback(arg)' after 'delay_ms' and then every 'period_ms' (0 = once).
+// Rescheduling an armed event moves it.
+void timer_schedule(timer_event_t* ev, uint32_t delay_ms, uint32_t period_ms, timer_callback_t callback, void* arg);
+bool timer_cancel(timer_event_t* ev);  // False if it was not armed
+void timer_wheel_tick();               // Called by timer_handler after timer_ticks++
+
+#endif // TIMER_H